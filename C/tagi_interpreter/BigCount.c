@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <assert.h>
+
+#include <err.h>
+
+#include <stdio.h>
+
+#include "BigCount.h"
+#include "Util.h"
+
+#define BIGCOUNT_LIMB_BITS      32
+
+static
+STATUS
+BigCountReserve(
+    BigCount **Count,
+    uint32_t Capacity
+    )
+{
+    STATUS status = ENV_OK;
+    BigCount *count = *Count;
+    uint32_t capacity;
+
+    if (count != NULL && count->Capacity >= Capacity)
+    {
+        goto Bail;
+    }
+
+    //
+    // Grow geometrically. Anything that needs this is likely doubling.
+    //
+    capacity = MAX(Capacity, count != NULL ? count->Capacity * 2 : 4);
+
+    count = realloc(count, sizeof(*count) + capacity * sizeof(count->Limbs[0]));
+    if (count == NULL)
+    {
+        TagWarnx("realloc BigCount (%u limbs)", capacity);
+        BAIL(status = ENV_OOM);
+    }
+
+    if (*Count == NULL)
+    {
+        count->Size = 0;
+    }
+    count->Capacity = capacity;
+    *Count = count;
+
+Bail:
+    return status;
+}
+
+static
+inline
+void
+BigCountTrim(
+    BigCount *Count
+    )
+{
+    while (Count->Size > 0 && Count->Limbs[Count->Size - 1] == 0)
+    {
+        --Count->Size;
+    }
+}
+
+STATUS
+BigCountFromU64(
+    BigCount **Count,
+    uint64_t Value
+    )
+{
+    STATUS status = ENV_OK;
+
+    assert(Count != NULL);
+
+    *Count = NULL;
+
+    CHECK(status = BigCountReserve(Count, 2));
+
+    (*Count)->Limbs[0] = (uint32_t) Value;
+    (*Count)->Limbs[1] = (uint32_t) (Value >> BIGCOUNT_LIMB_BITS);
+    (*Count)->Size = 2;
+    BigCountTrim(*Count);
+
+Bail:
+    return status;
+}
+
+STATUS
+BigCountCopy(
+    BigCount **Copy,
+    const BigCount *Count
+    )
+{
+    STATUS status = ENV_OK;
+
+    *Copy = NULL;
+
+    CHECK(status = BigCountReserve(Copy, MAX(Count->Size, 2)));
+
+    memcpy((*Copy)->Limbs, Count->Limbs, Count->Size * sizeof(Count->Limbs[0]));
+    (*Copy)->Size = Count->Size;
+
+Bail:
+    return status;
+}
+
+void
+BigCountFree(
+    BigCount *Count
+    )
+{
+    free(Count);
+}
+
+STATUS
+BigCountAddU64(
+    BigCount **Count,
+    uint64_t Value
+    )
+{
+    STATUS status = ENV_OK;
+    BigCount *count;
+    uint64_t carry;
+    uint32_t i;
+
+    CHECK(status = BigCountReserve(Count, MAX((*Count)->Size, 2) + 1));
+    count = *Count;
+
+    for (i = count->Size; i < count->Capacity; ++i)
+    {
+        count->Limbs[i] = 0;
+    }
+
+    carry = Value;
+    for (i = 0; carry != 0; ++i)
+    {
+        uint64_t sum = (uint64_t) count->Limbs[i] + (uint32_t) carry;
+
+        count->Limbs[i] = (uint32_t) sum;
+        carry = (carry >> BIGCOUNT_LIMB_BITS) + (sum >> BIGCOUNT_LIMB_BITS);
+    }
+
+    count->Size = MAX(count->Size, i);
+    BigCountTrim(count);
+
+Bail:
+    return status;
+}
+
+STATUS
+BigCountAdd(
+    BigCount **Count,
+    const BigCount *Addend
+    )
+{
+    STATUS status = ENV_OK;
+    BigCount *count;
+    uint64_t carry, sum;
+    uint32_t i, size;
+
+    size = MAX((*Count)->Size, Addend->Size) + 1;
+
+    CHECK(status = BigCountReserve(Count, size));
+    count = *Count;
+
+    for (i = count->Size; i < size; ++i)
+    {
+        count->Limbs[i] = 0;
+    }
+
+    carry = 0;
+    for (i = 0; i < size; ++i)
+    {
+        sum = (uint64_t) count->Limbs[i] +
+              (i < Addend->Size ? Addend->Limbs[i] : 0) +
+              carry;
+
+        count->Limbs[i] = (uint32_t) sum;
+        carry = sum >> BIGCOUNT_LIMB_BITS;
+    }
+    assert(carry == 0);
+
+    count->Size = size;
+    BigCountTrim(count);
+
+Bail:
+    return status;
+}
+
+void
+BigCountSubU64(
+    BigCount *Count,
+    uint64_t Value
+    )
+{
+    uint64_t borrow, limb;
+    uint32_t i;
+
+    borrow = Value;
+    for (i = 0; borrow != 0; ++i)
+    {
+        assert(i < Count->Size);
+
+        limb = Count->Limbs[i];
+        if (limb >= (uint32_t) borrow)
+        {
+            Count->Limbs[i] = (uint32_t) (limb - (uint32_t) borrow);
+            borrow >>= BIGCOUNT_LIMB_BITS;
+        }
+        else
+        {
+            Count->Limbs[i] = (uint32_t) ((limb | (1ULL << BIGCOUNT_LIMB_BITS)) - (uint32_t) borrow);
+            borrow = (borrow >> BIGCOUNT_LIMB_BITS) + 1;
+        }
+    }
+    BigCountTrim(Count);
+}
+
+STATUS
+BigCountMulU32(
+    BigCount **Count,
+    uint32_t Factor
+    )
+{
+    STATUS status = ENV_OK;
+    BigCount *count;
+    uint64_t carry, product;
+    uint32_t i;
+
+    CHECK(status = BigCountReserve(Count, (*Count)->Size + 1));
+    count = *Count;
+
+    carry = 0;
+    for (i = 0; i < count->Size; ++i)
+    {
+        product = (uint64_t) count->Limbs[i] * Factor + carry;
+
+        count->Limbs[i] = (uint32_t) product;
+        carry = product >> BIGCOUNT_LIMB_BITS;
+    }
+
+    if (carry != 0)
+    {
+        count->Limbs[count->Size++] = (uint32_t) carry;
+    }
+    BigCountTrim(count);
+
+Bail:
+    return status;
+}
+
+uint32_t
+BigCountDivU32(
+    BigCount *Count,
+    uint32_t Divisor
+    )
+{
+    uint64_t remainder = 0, dividend;
+    uint32_t i;
+
+    assert(Divisor != 0);
+
+    for (i = Count->Size; i-- > 0;)
+    {
+        dividend = (remainder << BIGCOUNT_LIMB_BITS) | Count->Limbs[i];
+
+        Count->Limbs[i] = (uint32_t) (dividend / Divisor);
+        remainder = dividend % Divisor;
+    }
+    BigCountTrim(Count);
+
+    return (uint32_t) remainder;
+}
+
+uint32_t
+BigCountModU32(
+    const BigCount *Count,
+    uint32_t Divisor
+    )
+{
+    uint64_t remainder = 0;
+    uint32_t i;
+
+    assert(Divisor != 0);
+
+    for (i = Count->Size; i-- > 0;)
+    {
+        remainder = ((remainder << BIGCOUNT_LIMB_BITS) | Count->Limbs[i]) % Divisor;
+    }
+
+    return (uint32_t) remainder;
+}
+
+bool
+BigCountToU64(
+    const BigCount *Count,
+    uint64_t *Value
+    )
+{
+    if (Count->Size > 2)
+    {
+        return false;
+    }
+
+    *Value = 0;
+    if (Count->Size > 0)
+    {
+        *Value = Count->Limbs[0];
+    }
+    if (Count->Size > 1)
+    {
+        *Value |= (uint64_t) Count->Limbs[1] << BIGCOUNT_LIMB_BITS;
+    }
+
+    return true;
+}
+
+uint64_t
+BigCountBits(
+    const BigCount *Count
+    )
+{
+    uint64_t bits;
+    uint32_t top;
+
+    if (Count->Size == 0)
+    {
+        return 0;
+    }
+
+    bits = (uint64_t) (Count->Size - 1) * BIGCOUNT_LIMB_BITS;
+    for (top = Count->Limbs[Count->Size - 1]; top != 0; top >>= 1)
+    {
+        ++bits;
+    }
+
+    return bits;
+}
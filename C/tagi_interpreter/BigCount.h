@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Util.h"
+
+//
+// A minimal unsigned arbitrary precision integer for run counts that no longer
+// fit in 64 bits. Only what the queue needs is here: adding, multiplying and
+// dividing by machine words and converting back when the value is small again.
+//
+// Functions that can grow the number take a BigCount ** as they may have to
+// move it.
+//
+typedef struct _BigCount
+{
+    uint32_t Size;          // Limbs in use. The top one is never 0.
+    uint32_t Capacity;
+    uint32_t Limbs[];       // Least significant first.
+} BigCount;
+
+STATUS
+BigCountFromU64(
+    BigCount **Count,
+    uint64_t Value
+    );
+
+STATUS
+BigCountCopy(
+    BigCount **Copy,
+    const BigCount *Count
+    );
+
+void
+BigCountFree(
+    BigCount *Count
+    );
+
+STATUS
+BigCountAddU64(
+    BigCount **Count,
+    uint64_t Value
+    );
+
+STATUS
+BigCountAdd(
+    BigCount **Count,
+    const BigCount *Addend
+    );
+
+//
+// Count must be at least Value.
+//
+void
+BigCountSubU64(
+    BigCount *Count,
+    uint64_t Value
+    );
+
+STATUS
+BigCountMulU32(
+    BigCount **Count,
+    uint32_t Factor
+    );
+
+//
+// Divides in place and returns the remainder.
+//
+uint32_t
+BigCountDivU32(
+    BigCount *Count,
+    uint32_t Divisor
+    );
+
+uint32_t
+BigCountModU32(
+    const BigCount *Count,
+    uint32_t Divisor
+    );
+
+//
+// False if the value doesn't fit.
+//
+bool
+BigCountToU64(
+    const BigCount *Count,
+    uint64_t *Value
+    );
+
+uint64_t
+BigCountBits(
+    const BigCount *Count
+    );
@@ -0,0 +1,940 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#include <assert.h>
+
+#include <err.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ChunkQueue.h"
+#include "Util.h"
+#include "TagProbe.h"
+
+//
+// Every spilled block is written as its element count followed by the
+// elements themselves.
+//
+typedef uint64_t ChunkQueueRecordHeader;
+
+static
+inline
+uint64_t
+ChunkQueueNow(
+    void
+    )
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+static
+inline
+uint64_t
+ChunkQueueBlockSize(
+    const ChunkQueue *Queue
+    )
+{
+    return Queue->HugePages ? CHUNKQ_HUGE_BLOCK_SIZE : CHUNKQ_BLOCK_SIZE;
+}
+
+STATUS
+ChunkQueueInitialize(
+    ChunkQueue *Queue,
+    uint32_t ElementSize
+    )
+{
+    STATUS status = ENV_OK;
+
+    assert(Queue != NULL);
+
+    memset(Queue, 0, sizeof(*Queue));
+
+    Queue->SpillFd = -1;
+
+    if (ElementSize == 0 ||
+        ElementSize > CHUNKQ_BLOCK_SIZE - sizeof(ChunkQueueBlock))
+    {
+        TagWarnx("Bad element size (%u)", ElementSize);
+        BAIL(status = ENV_BADARG);
+    }
+
+    Queue->ElementSize = ElementSize;
+
+Bail:
+    return status;
+}
+
+static
+void
+ChunkQueueFreeBlock(
+    ChunkQueueBlock *Block
+    )
+{
+    if (Block->Mapped)
+    {
+        (void) munmap(Block, Block->Size);
+    }
+    else
+    {
+        free(Block);
+    }
+}
+
+void
+ChunkQueueTeardown(
+    ChunkQueue *Queue
+    )
+{
+    ChunkQueueBlock *block, *next;
+
+    for (block = Queue->First; block != NULL; block = next)
+    {
+        next = block->Next;
+        ChunkQueueFreeBlock(block);
+    }
+
+    for (block = Queue->Free; block != NULL; block = next)
+    {
+        next = block->Next;
+        ChunkQueueFreeBlock(block);
+    }
+
+    if (Queue->Scratch != NULL)
+    {
+        ChunkQueueFreeBlock(Queue->Scratch);
+    }
+
+    if (Queue->Spilling)
+    {
+        (void) close(Queue->SpillFd);
+    }
+
+    Queue->First = NULL;
+    Queue->Last = NULL;
+    Queue->Free = NULL;
+    Queue->FreeCount = 0;
+    Queue->Count = 0;
+    Queue->BlocksInMemory = 0;
+    Queue->Scratch = NULL;
+    Queue->Seam = NULL;
+    Queue->Spilled = 0;
+    Queue->Spilling = false;
+    Queue->Pinned = false;
+    Queue->SpillFd = -1;
+}
+
+//
+// Hands out a block of Size bytes from the free list or, failing that, a new
+// one.
+//
+static
+STATUS
+ChunkQueueGetBlock(
+    ChunkQueue *Queue,
+    uint64_t Size,
+    ChunkQueueBlock **Block
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *block = NULL, **link;
+    void *mapping;
+
+    for (link = &Queue->Free; *link != NULL; link = &(*link)->Next)
+    {
+        if ((*link)->Size == Size)
+        {
+            block = *link;
+            *link = block->Next;
+            --Queue->FreeCount;
+            goto Done;
+        }
+    }
+
+    if (Size == CHUNKQ_HUGE_BLOCK_SIZE)
+    {
+        mapping = mmap(NULL,
+                       Size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                       -1,
+                       0);
+        if (mapping == MAP_FAILED)
+        {
+            //
+            // No huge pages reserved. Ask for transparent ones instead.
+            //
+            mapping = mmap(NULL,
+                           Size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+            if (mapping == MAP_FAILED)
+            {
+                TagWarn("mmap block (%lu)", Size);
+                BAIL(status = ENV_OOM);
+            }
+
+            (void) madvise(mapping, Size, MADV_HUGEPAGE);
+        }
+
+        block = (ChunkQueueBlock *) mapping;
+        block->Mapped = true;
+    }
+    else
+    {
+        block = malloc(Size);
+        if (block == NULL)
+        {
+            TagWarnx("malloc block (%lu)", Size);
+            BAIL(status = ENV_OOM);
+        }
+
+        block->Mapped = false;
+    }
+
+    block->Size = Size;
+    ++Queue->BlocksAllocated;
+
+    TagProbe2(block_alloc, Size, Queue->BlocksAllocated);
+    TagTraceEvent(TagEvent_BlockAlloc, 0, Size, Queue->BlocksAllocated);
+
+Done:
+    //
+    // Blocks read back from the spill file may have been cut short.
+    //
+    block->Capacity = (block->Size - sizeof(*block)) / Queue->ElementSize;
+    block->Next = NULL;
+    *Block = block;
+
+Bail:
+    return status;
+}
+
+//
+// Takes back a drained block, keeping a few of them for later.
+//
+static
+void
+ChunkQueuePutBlock(
+    ChunkQueue *Queue,
+    ChunkQueueBlock *Block
+    )
+{
+    if (Queue->FreeCount < CHUNKQ_MAX_FREE_BLOCKS)
+    {
+        Block->Next = Queue->Free;
+        Queue->Free = Block;
+        ++Queue->FreeCount;
+    }
+    else
+    {
+        ++Queue->BlocksReleased;
+
+        TagProbe2(block_free, Block->Size, Queue->BlocksReleased);
+        TagTraceEvent(TagEvent_BlockFree, 0, Block->Size, Queue->BlocksReleased);
+
+        ChunkQueueFreeBlock(Block);
+    }
+}
+
+STATUS
+ChunkQueueSpill(
+    ChunkQueue *Queue,
+    const char *Directory,
+    uint64_t MemoryLimit
+    )
+{
+    STATUS status = ENV_OK;
+    char path[PATH_MAX];
+    int fd = -1;
+
+    assert(Queue != NULL);
+    assert(Directory != NULL);
+
+    if (Queue->Spilling)
+    {
+        TagWarnx("Already spilling");
+        BAIL(status = ENV_BADARG);
+    }
+
+    if (snprintf(path, sizeof(path), "%s/tagi-spill-XXXXXX", Directory) >= (int) sizeof(path))
+    {
+        TagWarnx("Spill directory name too long");
+        BAIL(status = ENV_LENTOOBIG);
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+        TagWarn("mkstemp (%s)", path);
+        BAIL(status = CHUNKQ_IO);
+    }
+
+    //
+    // Nobody else needs to see the file and this way it goes away with us
+    // however we exit.
+    //
+    (void) unlink(path);
+
+    Queue->Spilling = true;
+    Queue->SpillFd = fd;
+    fd = -1;
+
+    //
+    // The head window and the block being pushed onto always stay in memory
+    // whatever the limit.
+    //
+    Queue->MaxBlocks = MAX(CHUNKQ_SPILL_HEAD_BLOCKS + 2,
+                           MemoryLimit / ChunkQueueBlockSize(Queue));
+
+Bail:
+    if (fd >= 0)
+    {
+        (void) close(fd);
+    }
+
+    return status;
+}
+
+static
+STATUS
+ChunkQueueWriteAt(
+    ChunkQueue *Queue,
+    const void *Buffer,
+    uint64_t Size,
+    uint64_t Offset
+    )
+{
+    STATUS status = ENV_OK;
+    const uint8_t *buffer = (const uint8_t *) Buffer;
+    ssize_t written;
+
+    while (Size > 0)
+    {
+        written = pwrite(Queue->SpillFd, buffer, Size, (off_t) Offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            TagWarn("pwrite (%lu at %lu)", Size, Offset);
+            BAIL(status = CHUNKQ_IO);
+        }
+
+        buffer += written;
+        Size -= (uint64_t) written;
+        Offset += (uint64_t) written;
+    }
+
+Bail:
+    return status;
+}
+
+static
+STATUS
+ChunkQueueReadAt(
+    ChunkQueue *Queue,
+    void *Buffer,
+    uint64_t Size,
+    uint64_t Offset
+    )
+{
+    STATUS status = ENV_OK;
+    uint8_t *buffer = (uint8_t *) Buffer;
+    ssize_t got;
+
+    while (Size > 0)
+    {
+        got = pread(Queue->SpillFd, buffer, Size, (off_t) Offset);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            TagWarn("pread (%lu at %lu)", Size, Offset);
+            BAIL(status = CHUNKQ_IO);
+        }
+
+        buffer += got;
+        Size -= (uint64_t) got;
+        Offset += (uint64_t) got;
+    }
+
+Bail:
+    return status;
+}
+
+//
+// Appends a full block to the spill file.
+//
+static
+STATUS
+ChunkQueueWriteBlock(
+    ChunkQueue *Queue,
+    ChunkQueueBlock *Block
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueRecordHeader header = Block->Capacity;
+    uint64_t bytes = Block->Capacity * Queue->ElementSize;
+    uint64_t start = ChunkQueueNow();
+
+    CHECK(status = ChunkQueueWriteAt(Queue, &header, sizeof(header), Queue->WriteOffset));
+    CHECK(status = ChunkQueueWriteAt(Queue, Block->Data, bytes, Queue->WriteOffset + sizeof(header)));
+
+    Queue->WriteOffset += sizeof(header) + bytes;
+
+    ++Queue->SpillWrites;
+    Queue->SpillBytesWritten += sizeof(header) + bytes;
+    Queue->SpillPeakBytes = MAX(Queue->SpillPeakBytes, Queue->WriteOffset - Queue->ReadOffset);
+
+Bail:
+    Queue->SpillWriteNs += ChunkQueueNow() - start;
+
+    return status;
+}
+
+//
+// Reads the spilled block at Offset into *Block or, if that's NULL, into a
+// block of our own. Next receives the offset of the block after it.
+//
+static
+STATUS
+ChunkQueueReadBlock(
+    ChunkQueue *Queue,
+    uint64_t Offset,
+    ChunkQueueBlock **Block,
+    uint64_t *Next
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *block = *Block;
+    ChunkQueueRecordHeader header;
+    uint64_t bytes, start = ChunkQueueNow();
+
+    CHECK(status = ChunkQueueReadAt(Queue, &header, sizeof(header), Offset));
+
+    bytes = header * Queue->ElementSize;
+
+    if (block == NULL)
+    {
+        CHECK(status = ChunkQueueGetBlock(
+                            Queue,
+                            sizeof(*block) + bytes <= CHUNKQ_BLOCK_SIZE ?
+                                CHUNKQ_BLOCK_SIZE : CHUNKQ_HUGE_BLOCK_SIZE,
+                            &block));
+    }
+
+    if (header == 0 || sizeof(*block) + bytes > block->Size)
+    {
+        TagWarnx("Bad spilled block at %lu (%lu elements)", Offset, header);
+        BAIL(status = CHUNKQ_IO);
+    }
+
+    CHECK(status = ChunkQueueReadAt(Queue, block->Data, bytes, Offset + sizeof(header)));
+
+    block->Capacity = header;
+    *Next = Offset + sizeof(header) + bytes;
+
+    Queue->SpillBytesRead += sizeof(header) + bytes;
+
+Bail:
+    if (FAILED(status) && block != NULL && *Block == NULL)
+    {
+        ChunkQueuePutBlock(Queue, block);
+    }
+    else
+    {
+        *Block = block;
+    }
+
+    Queue->SpillReadNs += ChunkQueueNow() - start;
+
+    return status;
+}
+
+//
+// Brings the oldest spilled block back into memory at the end of the head
+// window.
+//
+static
+STATUS
+ChunkQueueLoad(
+    ChunkQueue *Queue
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *block = NULL;
+    uint64_t next;
+
+    assert(Queue->Seam != NULL);
+    assert(Queue->Spilled > 0);
+
+    CHECK(status = ChunkQueueReadBlock(Queue, Queue->ReadOffset, &block, &next));
+
+    //
+    // Nothing reads that far back again so the disk space can go, unless
+    // someone pinned the file.
+    //
+    if (!Queue->Pinned)
+    {
+        (void) fallocate(Queue->SpillFd,
+                         FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t) Queue->ReadOffset,
+                         (off_t) (next - Queue->ReadOffset));
+    }
+
+    block->Next = Queue->Seam->Next;
+    Queue->Seam->Next = block;
+    Queue->Seam = block;
+    ++Queue->HeadBlocks;
+    ++Queue->BlocksInMemory;
+
+    ++Queue->SpillReads;
+    --Queue->Spilled;
+
+    if (Queue->Spilled == 0 && !Queue->Pinned)
+    {
+        //
+        // The queue is all in memory again so the file can start over.
+        //
+        Queue->Seam = NULL;
+        Queue->HeadBlocks = 0;
+        Queue->ReadOffset = 0;
+        Queue->WriteOffset = 0;
+
+        (void) ftruncate(Queue->SpillFd, 0);
+    }
+    else if (Queue->Spilled == 0)
+    {
+        //
+        // Or it will once it's unpinned. Until then new blocks go after the
+        // old ones.
+        //
+        Queue->Seam = NULL;
+        Queue->HeadBlocks = 0;
+        Queue->ReadOffset = next;
+    }
+    else
+    {
+        //
+        // Let the kernel fetch the next few while the head is being popped.
+        //
+        (void) posix_fadvise(Queue->SpillFd,
+                             (off_t) next,
+                             (off_t) (CHUNKQ_SPILL_HEAD_BLOCKS * (next - Queue->ReadOffset)),
+                             POSIX_FADV_WILLNEED);
+
+        Queue->ReadOffset = next;
+    }
+
+Bail:
+    return status;
+}
+
+//
+// Spills blocks from behind the head window until we're back under
+// MaxBlocks or there's nothing left that can go.
+//
+static
+STATUS
+ChunkQueueMakeRoom(
+    ChunkQueue *Queue
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *seam, *block;
+    uint64_t headBlocks;
+
+    while (Queue->BlocksInMemory >= Queue->MaxBlocks)
+    {
+        seam = Queue->Seam;
+        headBlocks = Queue->HeadBlocks;
+
+        if (seam == NULL)
+        {
+            for (seam = Queue->First, headBlocks = 1;
+                 headBlocks < CHUNKQ_SPILL_HEAD_BLOCKS && seam != Queue->Last;
+                 seam = seam->Next, ++headBlocks)
+            {
+            }
+        }
+
+        //
+        // Last is still being pushed onto so it stays.
+        //
+        if (seam == Queue->Last || seam->Next == Queue->Last)
+        {
+            break;
+        }
+
+        block = seam->Next;
+
+        CHECK(status = ChunkQueueWriteBlock(Queue, block));
+
+        seam->Next = block->Next;
+        Queue->Seam = seam;
+        Queue->HeadBlocks = headBlocks;
+        --Queue->BlocksInMemory;
+        ++Queue->Spilled;
+
+        ChunkQueuePutBlock(Queue, block);
+    }
+
+Bail:
+    return status;
+}
+
+STATUS
+ChunkQueuePush(
+    ChunkQueue *Queue,
+    const void *Elements,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    const uint8_t *elements = (const uint8_t *) Elements;
+    ChunkQueueBlock *block;
+    uint64_t room, take;
+
+    assert(Queue != NULL);
+    assert(Elements != NULL || Count == 0);
+
+    while (Count > 0)
+    {
+        if (Queue->Last == NULL || Queue->LastIndex == Queue->Last->Capacity)
+        {
+            if (Queue->Spilling)
+            {
+                CHECK(status = ChunkQueueMakeRoom(Queue));
+            }
+
+            CHECK(status = ChunkQueueGetBlock(Queue, ChunkQueueBlockSize(Queue), &block));
+
+            if (Queue->Last == NULL)
+            {
+                Queue->First = block;
+                Queue->FirstIndex = 0;
+            }
+            else
+            {
+                Queue->Last->Next = block;
+            }
+
+            Queue->Last = block;
+            Queue->LastIndex = 0;
+            ++Queue->BlocksInMemory;
+        }
+
+        room = Queue->Last->Capacity - Queue->LastIndex;
+        take = MIN(room, Count);
+
+        memcpy(&Queue->Last->Data[Queue->LastIndex * Queue->ElementSize],
+               elements,
+               take * Queue->ElementSize);
+
+        Queue->LastIndex += take;
+        Queue->Count += take;
+        elements += take * Queue->ElementSize;
+        Count -= take;
+    }
+
+Bail:
+    return status;
+}
+
+//
+// Sets up the block that walks read spilled blocks into, if it isn't already.
+//
+static
+STATUS
+ChunkQueueGetScratch(
+    ChunkQueue *Queue
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *scratch;
+
+    if (Queue->Scratch != NULL)
+    {
+        goto Bail;
+    }
+
+    scratch = malloc(CHUNKQ_HUGE_BLOCK_SIZE);
+    if (scratch == NULL)
+    {
+        TagWarnx("malloc Scratch (%llu)", CHUNKQ_HUGE_BLOCK_SIZE);
+        BAIL(status = ENV_OOM);
+    }
+
+    scratch->Next = NULL;
+    scratch->Size = CHUNKQ_HUGE_BLOCK_SIZE;
+    scratch->Mapped = false;
+    Queue->Scratch = scratch;
+
+Bail:
+    return status;
+}
+
+STATUS
+ChunkQueuePin(
+    ChunkQueue *Queue
+    )
+{
+    STATUS status = ENV_OK;
+
+    if (Queue->Spilled > 0)
+    {
+        CHECK(status = ChunkQueueGetScratch(Queue));
+    }
+
+    Queue->Pinned = Queue->Spilling;
+
+Bail:
+    return status;
+}
+
+void
+ChunkQueueUnpin(
+    ChunkQueue *Queue
+    )
+{
+    if (!Queue->Pinned)
+    {
+        return;
+    }
+
+    Queue->Pinned = false;
+
+    if (Queue->Spilled == 0)
+    {
+        Queue->ReadOffset = 0;
+        Queue->WriteOffset = 0;
+
+        (void) ftruncate(Queue->SpillFd, 0);
+    }
+    else
+    {
+        //
+        // Everything loaded back while we were pinned.
+        //
+        (void) fallocate(Queue->SpillFd,
+                         FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         0,
+                         (off_t) Queue->ReadOffset);
+    }
+}
+
+STATUS
+ChunkQueueAdvance(
+    ChunkQueue *Queue,
+    ChunkQueueCursor *Cursor
+    )
+{
+    STATUS status = ENV_OK;
+
+    if (Cursor->Block == Queue->Seam)
+    {
+        Cursor->Spilled = Queue->Spilled;
+        Cursor->Offset = Queue->ReadOffset;
+    }
+
+    if (Cursor->Spilled > 0)
+    {
+        CHECK(status = ChunkQueueGetScratch(Queue));
+
+        CHECK(status = ChunkQueueReadBlock(Queue, Cursor->Offset, &Queue->Scratch, &Cursor->Offset));
+
+        ++Queue->SpillPeeks;
+        --Cursor->Spilled;
+        Cursor->Block = Queue->Scratch;
+    }
+    else if (Cursor->Block == Queue->Scratch)
+    {
+        Cursor->Block = Queue->Seam->Next;
+    }
+    else
+    {
+        Cursor->Block = Cursor->Block->Next;
+    }
+
+    Cursor->Index = 0;
+
+Bail:
+    return status;
+}
+
+STATUS
+ChunkQueuePeek(
+    ChunkQueue *Queue,
+    void *Elements,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    uint8_t *elements = (uint8_t *) Elements;
+    ChunkQueueCursor cursor;
+    uint64_t take;
+
+    assert(Queue != NULL);
+    assert(Elements != NULL || Count == 0);
+
+    if (Count > Queue->Count)
+    {
+        TagWarnx("Count (%lu) > Queue->Count (%lu)", Count, Queue->Count);
+        BAIL(status = ENV_LENTOOBIG);
+    }
+
+    ChunkQueueBegin(Queue, &cursor);
+
+    while (Count > 0)
+    {
+        if (cursor.Index == cursor.Block->Capacity)
+        {
+            CHECK(status = ChunkQueueAdvance(Queue, &cursor));
+        }
+
+        take = MIN(cursor.Block->Capacity - cursor.Index, Count);
+
+        memcpy(elements,
+               &cursor.Block->Data[cursor.Index * Queue->ElementSize],
+               take * Queue->ElementSize);
+
+        cursor.Index += take;
+        elements += take * Queue->ElementSize;
+        Count -= take;
+    }
+
+Bail:
+    return status;
+}
+
+STATUS
+ChunkQueueDiscard(
+    ChunkQueue *Queue,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueBlock *block;
+    uint64_t take;
+
+    assert(Queue != NULL);
+
+    if (Count > Queue->Count)
+    {
+        TagWarnx("Count (%lu) > Queue->Count (%lu)", Count, Queue->Count);
+        BAIL(status = ENV_LENTOOBIG);
+    }
+
+    while (Count > 0)
+    {
+        take = MIN(Queue->First->Capacity - Queue->FirstIndex, Count);
+
+        Queue->FirstIndex += take;
+        Queue->Count -= take;
+        Count -= take;
+
+        if (Queue->FirstIndex == Queue->First->Capacity &&
+            Queue->First != Queue->Last)
+        {
+            if (Queue->First == Queue->Seam)
+            {
+                //
+                // Only if topping up the head window failed last time.
+                //
+                CHECK(status = ChunkQueueLoad(Queue));
+            }
+
+            block = Queue->First;
+            Queue->First = block->Next;
+            Queue->FirstIndex = 0;
+            --Queue->BlocksInMemory;
+
+            ChunkQueuePutBlock(Queue, block);
+
+            if (Queue->Seam != NULL)
+            {
+                --Queue->HeadBlocks;
+            }
+
+            while (Queue->Seam != NULL && Queue->HeadBlocks < CHUNKQ_SPILL_HEAD_BLOCKS)
+            {
+                CHECK(status = ChunkQueueLoad(Queue));
+            }
+        }
+    }
+
+    if (Queue->Count == 0 && Queue->First != NULL)
+    {
+        //
+        // Everything left is in the one block so start it over.
+        //
+        assert(Queue->First == Queue->Last);
+
+        Queue->FirstIndex = 0;
+        Queue->LastIndex = 0;
+    }
+
+Bail:
+    return status;
+}
+
+STATUS
+ChunkQueuePop(
+    ChunkQueue *Queue,
+    void *Elements,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+
+    CHECK(status = ChunkQueuePeek(Queue, Elements, Count));
+    CHECK(status = ChunkQueueDiscard(Queue, Count));
+
+Bail:
+    return status;
+}
+
+void
+ChunkQueueDump(
+    ChunkQueue *Queue
+    )
+{
+    TagPrint("chunkq: blocks allocated: %lu released: %lu in memory: %lu\n",
+            Queue->BlocksAllocated,
+            Queue->BlocksReleased,
+            Queue->BlocksInMemory);
+
+    if (Queue->Spilling)
+    {
+        TagPrint("chunkq: spilled: %lu blocks (%lu bytes) peak: %lu bytes\n",
+                Queue->Spilled,
+                Queue->WriteOffset - Queue->ReadOffset,
+                Queue->SpillPeakBytes);
+        TagPrint("chunkq: writes: %lu (%lu bytes, %.3fs) reads: %lu (%lu bytes, %.3fs) peeks: %lu\n",
+                Queue->SpillWrites,
+                Queue->SpillBytesWritten,
+                Queue->SpillWriteNs / 1e9,
+                Queue->SpillReads,
+                Queue->SpillBytesRead,
+                Queue->SpillReadNs / 1e9,
+                Queue->SpillPeeks);
+    }
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Util.h"
+
+#define CHUNKQ                  11
+#define CHUNKQ_STATUS(Code)     (MAKE_STATUS(Code, CHUNKQ))
+
+#define CHUNKQ_OK               0
+#define CHUNKQ_IO               (CHUNKQ_STATUS(1))
+
+//
+// Bytes per block, header included. Hugepage blocks are one (x86-64) huge
+// page each.
+//
+#define CHUNKQ_BLOCK_SIZE       (64ULL << 10)
+#define CHUNKQ_HUGE_BLOCK_SIZE  (2ULL << 20)
+
+//
+// How many drained blocks are kept around for reuse. Anything past that goes
+// back to the system so a queue that drains gives its memory back.
+//
+#define CHUNKQ_MAX_FREE_BLOCKS  4
+
+//
+// How many blocks at the head stay in memory while the middle of the queue is
+// spilled. They are read back from the spill file ahead of being popped.
+//
+#define CHUNKQ_SPILL_HEAD_BLOCKS    2
+
+typedef struct _ChunkQueueBlock
+{
+    struct _ChunkQueueBlock *Next;
+    uint64_t Capacity;      // In elements.
+    uint64_t Size;          // In bytes, header included.
+    bool Mapped;            // From mmap rather than malloc.
+    _Alignas(max_align_t) uint8_t Data[];
+} ChunkQueueBlock;
+
+_Static_assert(offsetof(ChunkQueueBlock, Data) % 16 == 0,
+               "ChunkQueueBlock elements have to be aligned");
+
+//
+// A FIFO of fixed-size elements kept in a linked list of fixed-size blocks.
+// Growing only ever links in another block so nothing already queued is
+// copied or moved, and pointers to queued elements stay valid until they are
+// popped. Elements never straddle two blocks.
+//
+typedef struct _ChunkQueue
+{
+    uint32_t ElementSize;
+
+    //
+    // Off by default. When set, blocks allocated from then on are huge pages
+    // if the system has any to spare and transparent huge pages otherwise.
+    //
+    bool HugePages;
+
+    ChunkQueueBlock *First;     // Popped from.
+    ChunkQueueBlock *Last;      // Pushed onto.
+    uint64_t FirstIndex;        // The next element to pop in First.
+    uint64_t LastIndex;         // The next free slot in Last.
+    uint64_t Count;
+
+    ChunkQueueBlock *Free;
+    uint64_t FreeCount;
+
+    uint64_t BlocksInMemory;    // Linked in between First and Last.
+
+    //
+    // Off by default (see ChunkQueueSpill). Once more than MaxBlocks blocks
+    // are queued, the full blocks behind the head are written out to SpillFd
+    // until we are back under. The queue is then First..Seam in memory,
+    // Spilled blocks in the file from ReadOffset to WriteOffset and
+    // Seam->Next..Last in memory again. Seam is NULL when nothing is spilled.
+    //
+    bool Spilling;
+    bool Pinned;            // See ChunkQueuePin.
+    int SpillFd;
+    uint64_t MaxBlocks;
+    ChunkQueueBlock *Seam;
+    uint64_t HeadBlocks;        // First..Seam.
+    uint64_t Spilled;
+    uint64_t ReadOffset;
+    uint64_t WriteOffset;
+
+    //
+    // Where walks and peeks past Seam read spilled blocks into.
+    //
+    ChunkQueueBlock *Scratch;
+
+    //
+    // Statistics.
+    //
+    uint64_t BlocksAllocated;
+    uint64_t BlocksReleased;
+    uint64_t SpillWrites;
+    uint64_t SpillReads;
+    uint64_t SpillPeeks;        // Reads that only looked and didn't load.
+    uint64_t SpillBytesWritten;
+    uint64_t SpillBytesRead;
+    uint64_t SpillPeakBytes;    // The most that was ever in the file at once.
+    uint64_t SpillWriteNs;
+    uint64_t SpillReadNs;
+} ChunkQueue;
+
+//
+// Walks the queue front to back without popping anything. The caller keeps
+// track of how many elements are left. Spilled blocks are read into the
+// queue's Scratch block one at a time, so only one cursor can be out at once
+// while spilling.
+//
+typedef struct _ChunkQueueCursor
+{
+    ChunkQueueBlock *Block;
+    uint64_t Index;
+    uint64_t Spilled;       // Spilled blocks still to read.
+    uint64_t Offset;        // Where the next one starts.
+} ChunkQueueCursor;
+
+STATUS
+ChunkQueueInitialize(
+    ChunkQueue *Queue,
+    uint32_t ElementSize
+    );
+
+void
+ChunkQueueTeardown(
+    ChunkQueue *Queue
+    );
+
+STATUS
+ChunkQueuePush(
+    ChunkQueue *Queue,
+    const void *Elements,
+    uint64_t Count
+    );
+
+STATUS
+ChunkQueuePop(
+    ChunkQueue *Queue,
+    void *Elements,
+    uint64_t Count
+    );
+
+STATUS
+ChunkQueuePeek(
+    ChunkQueue *Queue,
+    void *Elements,
+    uint64_t Count
+    );
+
+//
+// Starts spilling to an unlinked temporary file in Directory once more than
+// MemoryLimit bytes worth of blocks are queued.
+//
+STATUS
+ChunkQueueSpill(
+    ChunkQueue *Queue,
+    const char *Directory,
+    uint64_t MemoryLimit
+    );
+
+//
+// Keeps the spill file just as it is, and sets up the Scratch block, so that
+// the queue as it stands now can still be walked by a child forked off after
+// this while we go on changing it (see TagCheckpoint). Blocks loaded back in
+// the meantime keep their disk space until ChunkQueueUnpin.
+//
+STATUS
+ChunkQueuePin(
+    ChunkQueue *Queue
+    );
+
+void
+ChunkQueueUnpin(
+    ChunkQueue *Queue
+    );
+
+//
+// Moves Cursor onto the next block. Only for ChunkQueueNext.
+//
+STATUS
+ChunkQueueAdvance(
+    ChunkQueue *Queue,
+    ChunkQueueCursor *Cursor
+    );
+
+void
+ChunkQueueDump(
+    ChunkQueue *Queue
+    );
+
+//
+// Like ChunkQueuePop but throws the elements away instead of copying them
+// out.
+//
+STATUS
+ChunkQueueDiscard(
+    ChunkQueue *Queue,
+    uint64_t Count
+    );
+
+static
+inline
+uint64_t
+ChunkQueueCount(
+    const ChunkQueue *Queue
+    )
+{
+    return Queue->Count;
+}
+
+static
+inline
+bool
+ChunkQueueIsEmpty(
+    const ChunkQueue *Queue
+    )
+{
+    return Queue->Count == 0;
+}
+
+//
+// The element at the front, or NULL if there isn't one.
+//
+static
+inline
+void *
+ChunkQueueFront(
+    ChunkQueue *Queue
+    )
+{
+    if (Queue->Count == 0)
+    {
+        return NULL;
+    }
+
+    return &Queue->First->Data[Queue->FirstIndex * Queue->ElementSize];
+}
+
+static
+inline
+void
+ChunkQueueBegin(
+    ChunkQueue *Queue,
+    ChunkQueueCursor *Cursor
+    )
+{
+    Cursor->Block = Queue->First;
+    Cursor->Index = Queue->FirstIndex;
+    Cursor->Spilled = 0;
+    Cursor->Offset = 0;
+}
+
+//
+// Returns the element under the cursor and moves it along. Only valid while
+// the cursor hasn't walked past the last element. NULL means a spilled block
+// couldn't be read back.
+//
+static
+inline
+void *
+ChunkQueueNext(
+    ChunkQueue *Queue,
+    ChunkQueueCursor *Cursor
+    )
+{
+    void *element;
+
+    if (Cursor->Index == Cursor->Block->Capacity &&
+        FAILED(ChunkQueueAdvance(Queue, Cursor)))
+    {
+        return NULL;
+    }
+
+    element = &Cursor->Block->Data[Cursor->Index * Queue->ElementSize];
+    ++Cursor->Index;
+
+    return element;
+}
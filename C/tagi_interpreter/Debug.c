@@ -178,3 +178,33 @@ DebuggerTeardown(
     tommy_hashlin_foreach(&Dbg->SymbolMap, SymbolEntryTeardownComplete);
     tommy_hashlin_done(&Dbg->SymbolMap);
 }
+
+static
+int
+DebuggerCompare(
+    const void *Arg,    /* uint64_t* */
+    const void *Obj     /* SymbolEntry* */
+    )
+{
+    const uint64_t *value = (const uint64_t *) Arg;
+    const SymbolEntry *entry = (const SymbolEntry *) Obj;
+
+    return *value != entry->RawSymbol;
+}
+
+const char *
+DebuggerLookupName(
+    Debugger *Dbg,
+    uint64_t RawSymbol
+    )
+{
+    SymbolEntry *entry;
+
+    entry = (SymbolEntry *) tommy_hashlin_search(
+                        &Dbg->SymbolMap,
+                        DebuggerCompare,
+                        &RawSymbol,
+                        tommy_hash_u64(0, &RawSymbol, sizeof(RawSymbol)));
+
+    return entry != NULL ? entry->Name : NULL;
+}
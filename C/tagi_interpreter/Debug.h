@@ -77,3 +77,12 @@ void
 DebuggerTeardown(
     Debugger *Dbg
     );
+
+//
+// The name RawSymbol was given, or NULL if it doesn't have one.
+//
+const char *
+DebuggerLookupName(
+    Debugger *Dbg,
+    uint64_t RawSymbol
+    );
@@ -9,6 +9,7 @@
 
 #include "IoBuffer.h"
 #include "Util.h"
+#include "TagProbe.h"
 
 #define LAST    8
 #define INITIAL 0
@@ -93,6 +94,9 @@ IoBufferGetBit(
         }
 
         IoBuf->In.Buffer = status & 0xff;
+
+        TagProbe2(byte_in, IoBuf->In.Buffer, IoBuf->BitsIn);
+        TagTraceEvent(TagEvent_ByteIn, 0, IoBuf->In.Buffer, IoBuf->BitsIn);
     }
 
 //#define EXTRACT_BIT(Data, Bit) ((((Data) & (1 << (Bit))) >> (Bit)) & 1)
@@ -104,6 +108,8 @@ IoBufferGetBit(
         memset(&IoBuf->In, 0, sizeof(IoBuf->In));
     }
 
+    ++IoBuf->BitsIn;
+
     status = 0;
 
 Bail:
@@ -124,12 +130,36 @@ IoBufferPutBit(
 
     IoBuf->Out.Buffer |= ((!!Out) & 1) << IoBuf->Out.BitOffset++;
 
+    ++IoBuf->BitsOut;
+
+    if (IoBuf->OutLog != NULL)
+    {
+        if (IoBuf->OutLogBits < IoBuf->OutLogSize)
+        {
+            uint8_t mask = 1 << (IoBuf->OutLogBits % 8);
+
+            if (Out)
+            {
+                IoBuf->OutLog[IoBuf->OutLogBits / 8] |= mask;
+            }
+            else
+            {
+                IoBuf->OutLog[IoBuf->OutLogBits / 8] &= ~mask;
+            }
+        }
+
+        ++IoBuf->OutLogBits;
+    }
+
     //
     // If the output buffer is full then write out a byte.
     //
 
     if (IoBuf->Out.BitOffset == LAST)
     {
+        TagProbe2(byte_out, IoBuf->Out.Buffer, IoBuf->BitsOut);
+        TagTraceEvent(TagEvent_ByteOut, 0, IoBuf->Out.Buffer, IoBuf->BitsOut);
+
         status = IoBuf->Config.PutByte(IoBuf->Out.Buffer, IoBuf->Config.PutContext);
 
         memset(&IoBuf->Out, 0, sizeof(IoBuf->Out));
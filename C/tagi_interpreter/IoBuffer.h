@@ -27,6 +27,21 @@ typedef struct _IoBuffer
     BitBuffer Out;
 
     IoBufferConfig Config;
+
+    //
+    // How many bits have been read and written so far.
+    //
+    uint64_t BitsIn;
+    uint64_t BitsOut;
+
+    //
+    // Optional. When set, every bit written is also packed into OutLog until
+    // OutLogSize bits are used up. OutLogBits keeps counting past that so a
+    // reader can tell the log is incomplete.
+    //
+    uint8_t *OutLog;
+    uint64_t OutLogSize;
+    uint64_t OutLogBits;
 } IoBuffer;
 
 int
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "Util.h"
+#include "IoBuffer.h"
+#include "IoStream.h"
+
+//
+// Writes out the ring from Written up to Published, which may wrap.
+//
+static
+STATUS
+IoStreamWriteOut(
+    IoStream *Stream,
+    uint64_t Written,
+    uint64_t Published
+    )
+{
+    struct iovec iov[2];
+    uint64_t mask = Stream->OutSize - 1;
+    uint64_t first, size;
+    ssize_t n;
+    int count;
+
+    while (Written != Published)
+    {
+        size = Published - Written;
+        first = Stream->OutSize - (Written & mask);
+
+        iov[0].iov_base = &Stream->Out[Written & mask];
+        iov[0].iov_len = MIN(size, first);
+        count = 1;
+
+        if (size > first)
+        {
+            iov[1].iov_base = Stream->Out;
+            iov[1].iov_len = size - first;
+            count = 2;
+        }
+
+        n = writev(Stream->OutFd, iov, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            TagWarn("writev");
+            return IOSTREAM_WRITE;
+        }
+
+        Written += n;
+    }
+
+    return ENV_OK;
+}
+
+static
+void *
+IoStreamWriterMain(
+    void *Context
+    )
+{
+    IoStream *stream = (IoStream *) Context;
+    uint64_t written, published;
+    STATUS error;
+
+    (void) pthread_mutex_lock(&stream->Lock);
+
+    for (;;)
+    {
+        while (stream->Written == stream->Published && !stream->Exit)
+        {
+            (void) pthread_cond_wait(&stream->Work, &stream->Lock);
+        }
+
+        if (stream->Written == stream->Published)
+        {
+            break;
+        }
+
+        written = stream->Written;
+        published = stream->Published;
+        error = stream->Error;
+
+        (void) pthread_mutex_unlock(&stream->Lock);
+
+        //
+        // After an error the rest is thrown away so that nobody waits on it.
+        //
+        if (SUCCEEDED(error))
+        {
+            error = IoStreamWriteOut(stream, written, published);
+        }
+
+        (void) pthread_mutex_lock(&stream->Lock);
+
+        stream->Error = error;
+        stream->Written = published;
+        ++stream->Writes;
+        (void) pthread_cond_broadcast(&stream->Space);
+    }
+
+    (void) pthread_mutex_unlock(&stream->Lock);
+
+    return NULL;
+}
+
+//
+// Maps InFd if it is a regular file, from wherever it has been read up to.
+//
+static
+void
+IoStreamMapInput(
+    IoStream *Stream
+    )
+{
+    struct stat st;
+    off_t offset;
+    void *in;
+
+    if (fstat(Stream->InFd, &st) != 0 ||
+        !S_ISREG(st.st_mode) ||
+        st.st_size == 0)
+    {
+        return;
+    }
+
+    offset = lseek(Stream->InFd, 0, SEEK_CUR);
+    if (offset < 0 || offset > st.st_size)
+    {
+        return;
+    }
+
+    in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, Stream->InFd, 0);
+    if (in == MAP_FAILED)
+    {
+        return;
+    }
+
+    (void) madvise(in, st.st_size, MADV_SEQUENTIAL);
+
+    Stream->In = in;
+    Stream->InSize = st.st_size;
+    Stream->InPosition = offset;
+    Stream->InCapacity = st.st_size;
+    Stream->InMapped = true;
+}
+
+STATUS
+IoStreamInitialize(
+    IoStream *Stream,
+    int InFd,
+    int OutFd
+    )
+{
+    STATUS status = ENV_OK;
+    int error;
+
+    assert(Stream != NULL);
+
+    memset(Stream, 0, sizeof(*Stream));
+
+    (void) pthread_mutex_init(&Stream->Lock, NULL);
+    (void) pthread_cond_init(&Stream->Work, NULL);
+    (void) pthread_cond_init(&Stream->Space, NULL);
+
+    Stream->InFd = InFd;
+    Stream->OutFd = OutFd;
+    Stream->OutSize = IOSTREAM_DEFAULT_RING;
+    Stream->Chunk = IOSTREAM_DEFAULT_CHUNK;
+    Stream->OutPublishAt = Stream->Chunk;
+    Stream->OutLimit = Stream->Chunk;
+
+    assert((Stream->OutSize & (Stream->OutSize - 1)) == 0);
+    assert(Stream->Chunk <= Stream->OutSize);
+
+    IoStreamMapInput(Stream);
+
+    if (!Stream->InMapped)
+    {
+        Stream->InCapacity = IOSTREAM_DEFAULT_BLOCK;
+        Stream->In = malloc(Stream->InCapacity);
+        if (Stream->In == NULL)
+        {
+            TagWarnx("malloc In (%lu)", Stream->InCapacity);
+            BAIL(status = ENV_OOM);
+        }
+    }
+
+    Stream->Out = malloc(Stream->OutSize);
+    if (Stream->Out == NULL)
+    {
+        TagWarnx("malloc Out (%lu)", Stream->OutSize);
+        BAIL(status = ENV_OOM);
+    }
+
+    error = pthread_create(&Stream->Writer, NULL, IoStreamWriterMain, Stream);
+    if (error != 0)
+    {
+        TagWarnx("pthread_create: %s", strerror(error));
+        BAIL(status = IOSTREAM_THREAD);
+    }
+    Stream->Started = true;
+
+Bail:
+    if (FAILED(status))
+    {
+        IoStreamTeardown(Stream);
+    }
+
+    return status;
+}
+
+void
+IoStreamTeardown(
+    IoStream *Stream
+    )
+{
+    if (Stream->Started)
+    {
+        (void) IoStreamFlush(Stream);
+
+        (void) pthread_mutex_lock(&Stream->Lock);
+        Stream->Exit = true;
+        (void) pthread_cond_signal(&Stream->Work);
+        (void) pthread_mutex_unlock(&Stream->Lock);
+
+        (void) pthread_join(Stream->Writer, NULL);
+        Stream->Started = false;
+    }
+
+    if (Stream->InMapped)
+    {
+        (void) munmap(Stream->In, Stream->InCapacity);
+    }
+    else
+    {
+        free(Stream->In);
+    }
+    Stream->In = NULL;
+
+    free(Stream->Out);
+    Stream->Out = NULL;
+
+    (void) pthread_cond_destroy(&Stream->Space);
+    (void) pthread_cond_destroy(&Stream->Work);
+    (void) pthread_mutex_destroy(&Stream->Lock);
+}
+
+void
+IoStreamConfigure(
+    IoStream *Stream,
+    IoBufferConfig *Config
+    )
+{
+    Config->GetByte = IoStreamGetByte;
+    Config->GetContext = Stream;
+    Config->PutByte = IoStreamPutByte;
+    Config->PutContext = Stream;
+}
+
+//
+// Hands the writer everything put so far. Called with Lock held.
+//
+static
+void
+IoStreamPublish(
+    IoStream *Stream
+    )
+{
+    if (Stream->Published != Stream->OutHead)
+    {
+        Stream->Published = Stream->OutHead;
+        (void) pthread_cond_signal(&Stream->Work);
+    }
+
+    Stream->OutPublishAt = Stream->OutHead + Stream->Chunk;
+}
+
+//
+// Works out how far the running thread can put bytes before it next has to
+// come through here. Called with Lock held.
+//
+static
+void
+IoStreamSetLimit(
+    IoStream *Stream
+    )
+{
+    Stream->OutLimit = MIN(Stream->OutPublishAt, Stream->Written + Stream->OutSize);
+}
+
+STATUS
+IoStreamFlush(
+    IoStream *Stream
+    )
+{
+    STATUS status;
+
+    (void) pthread_mutex_lock(&Stream->Lock);
+
+    IoStreamPublish(Stream);
+
+    while (Stream->Written != Stream->Published)
+    {
+        (void) pthread_cond_wait(&Stream->Space, &Stream->Lock);
+    }
+
+    IoStreamSetLimit(Stream);
+    status = Stream->Error;
+
+    (void) pthread_mutex_unlock(&Stream->Lock);
+
+    return status;
+}
+
+//
+// The slow half of IoStreamGetByte, for when In has been used up.
+//
+static
+int
+IoStreamFill(
+    IoStream *Stream
+    )
+{
+    ssize_t n;
+
+    if (Stream->InMapped || Stream->InEof)
+    {
+        return EOF;
+    }
+
+    //
+    // Whatever we wrote may be what whoever is on the other end is waiting
+    // for before they answer.
+    //
+    (void) IoStreamFlush(Stream);
+
+    do
+    {
+        n = read(Stream->InFd, Stream->In, Stream->InCapacity);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+    {
+        if (n < 0)
+        {
+            TagWarn("read");
+        }
+
+        Stream->InEof = true;
+        return EOF;
+    }
+
+    ++Stream->Reads;
+
+    Stream->InSize = n;
+    Stream->InPosition = 1;
+
+    return Stream->In[0];
+}
+
+int
+IoStreamGetByte(
+    void *Context
+    )
+{
+    IoStream *stream = (IoStream *) Context;
+
+    if (stream->InPosition == stream->InSize)
+    {
+        return IoStreamFill(stream);
+    }
+
+    return stream->In[stream->InPosition++];
+}
+
+//
+// The slow half of IoStreamPutByte, for when it is time to wake the writer or
+// the ring is full.
+//
+static
+int
+IoStreamMakeRoom(
+    IoStream *Stream,
+    int Byte
+    )
+{
+    STATUS error;
+
+    (void) pthread_mutex_lock(&Stream->Lock);
+
+    if (Stream->OutHead >= Stream->OutPublishAt)
+    {
+        IoStreamPublish(Stream);
+    }
+
+    while (Stream->OutHead - Stream->Written == Stream->OutSize)
+    {
+        ++Stream->Stalls;
+        IoStreamPublish(Stream);
+        (void) pthread_cond_wait(&Stream->Space, &Stream->Lock);
+    }
+
+    IoStreamSetLimit(Stream);
+    error = Stream->Error;
+
+    (void) pthread_mutex_unlock(&Stream->Lock);
+
+    if (FAILED(error))
+    {
+        return EOF;
+    }
+
+    Stream->Out[Stream->OutHead++ & (Stream->OutSize - 1)] = Byte;
+
+    return Byte & 0xff;
+}
+
+int
+IoStreamPutByte(
+    int Byte,
+    void *Context
+    )
+{
+    IoStream *stream = (IoStream *) Context;
+
+    if (stream->OutHead == stream->OutLimit)
+    {
+        return IoStreamMakeRoom(stream, Byte);
+    }
+
+    stream->Out[stream->OutHead++ & (stream->OutSize - 1)] = Byte;
+
+    return Byte & 0xff;
+}
+
+void
+IoStreamDump(
+    IoStream *Stream
+    )
+{
+    TagPrint("io: %s input, reads: %lu writes: %lu bytes written: %lu stalls: %lu\n",
+            Stream->InMapped ? "mapped" : "read",
+            Stream->Reads,
+            Stream->Writes,
+            Stream->Written,
+            Stream->Stalls);
+}
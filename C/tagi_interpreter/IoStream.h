@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "Util.h"
+#include "IoBuffer.h"
+
+#define IOSTREAM                12
+#define IOSTREAM_STATUS(Code)   (MAKE_STATUS(Code, IOSTREAM))
+
+#define IOSTREAM_OK             0
+#define IOSTREAM_THREAD         (IOSTREAM_STATUS(1))
+#define IOSTREAM_WRITE          (IOSTREAM_STATUS(2))
+
+//
+// Input is read this many bytes at a time when it can't be mapped.
+//
+#define IOSTREAM_DEFAULT_BLOCK  (1 << 16)
+
+//
+// The output ring. Must be a power of two.
+//
+#define IOSTREAM_DEFAULT_RING   (1 << 20)
+
+//
+// The writer is woken every time this much more output is ready.
+//
+#define IOSTREAM_DEFAULT_CHUNK  (1 << 16)
+
+//
+// An IoBufferConfig backend that stays out of stdio. Input comes straight
+// from the file when it can be mapped and otherwise a block at a time. Output
+// is dropped into a ring and a writer thread writes it out in big pieces, so
+// putting a byte is a store and a compare.
+//
+// The running thread is the only one that touches the In* fields and the
+// head of the ring, and it only takes the lock every Chunk bytes or when the
+// ring is full. The output is only guaranteed to be out after IoStreamFlush,
+// which is also done before blocking for more input so that a prompt shows up
+// before it is answered.
+//
+typedef struct _IoStream
+{
+    int InFd;
+    uint8_t *In;
+    uint64_t InSize;            // Bytes of In that are good.
+    uint64_t InPosition;
+    uint64_t InCapacity;
+    bool InMapped;
+    bool InEof;
+
+    int OutFd;
+    uint8_t *Out;
+    uint64_t OutSize;
+    uint64_t Chunk;
+
+    //
+    // Bytes put, and the point at which the writer is next told about them.
+    // Only the running thread uses these.
+    //
+    uint64_t OutHead;
+    uint64_t OutPublishAt;
+    uint64_t OutLimit;          // OutHead can go this far before we need to check for space.
+
+    //
+    // Shared with the writer, under Lock.
+    //
+    pthread_t Writer;
+    bool Started;
+    pthread_mutex_t Lock;
+    pthread_cond_t Work;
+    pthread_cond_t Space;
+    uint64_t Published;
+    uint64_t Written;
+    STATUS Error;
+    bool Exit;
+
+    //
+    // Statistics.
+    //
+    uint64_t Reads;
+    uint64_t Writes;
+    uint64_t Stalls;
+} IoStream;
+
+STATUS
+IoStreamInitialize(
+    IoStream *Stream,
+    int InFd,
+    int OutFd
+    );
+
+//
+// Flushes whatever is left and stops the writer.
+//
+void
+IoStreamTeardown(
+    IoStream *Stream
+    );
+
+//
+// Points Config at Stream.
+//
+void
+IoStreamConfigure(
+    IoStream *Stream,
+    IoBufferConfig *Config
+    );
+
+//
+// Waits for everything put so far to be written. Returns the first error the
+// writer ran into, if any.
+//
+STATUS
+IoStreamFlush(
+    IoStream *Stream
+    );
+
+//
+// GetByteFn and PutByteFn. They return EOF when there is nothing more to
+// read or the output can't be written.
+//
+int
+IoStreamGetByte(
+    void *Context
+    );
+
+int
+IoStreamPutByte(
+    int Byte,
+    void *Context
+    );
+
+void
+IoStreamDump(
+    IoStream *Stream
+    );
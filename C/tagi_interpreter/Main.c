@@ -0,0 +1,781 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "Util.h"
+#include "TagBin.h"
+#include "Tag.h"
+#include "TagJit.h"
+#include "TagMemo.h"
+#include "TagParallel.h"
+#include "TagPipeline.h"
+#include "TagWang.h"
+#include "TagCycle.h"
+#include "TagStats.h"
+#include "TagProfile.h"
+#include "TagProbe.h"
+#include "TagCheckpoint.h"
+#include "TagRule.h"
+#include "IoBuffer.h"
+#include "IoStream.h"
+#include "Debug.h"
+
+//
+// Reads the debug symbols from SymbolsFilename or, without one, from the
+// Names the program carries.
+//
+static
+STATUS
+PrepareDebugger(
+    Debugger *Dbg,
+    char *SymbolsFilename,
+    const char *Names,
+    uint64_t NamesSize,
+    TagSystem *System
+    )
+{
+    STATUS status = ENV_OK;
+    SymbolEntry *entries = NULL;
+    uint64_t count = 0;
+    uint64_t i = 0;
+    FILE *dbg_fp = NULL;
+
+    (void) System;
+
+    if (SymbolsFilename != NULL)
+    {
+        dbg_fp = fopen(SymbolsFilename, "r");
+    }
+    else
+    {
+        dbg_fp = fmemopen((void *) Names, NamesSize, "r");
+    }
+    if (dbg_fp == NULL)
+    {
+        TagWarn("open (dbg_fp)");
+        goto Bail;
+    }
+
+    CHECK(status = ReadSymbolFile(dbg_fp, &entries, &count));
+
+    CHECK(status = DebuggerInitialize(Dbg, entries, count));
+
+Bail:
+    for (i = 0; i < count; ++i)
+    {
+        SymbolEntryTeardown(&entries[i]);
+    }
+    free(entries);
+
+    if (dbg_fp != NULL)
+    {
+        (void) fclose(dbg_fp);
+    }
+
+    return status;
+}
+
+//
+// -r and -F both see the run through TagFire, so neither can be used with
+// anything that takes its steps some other way. Bypassed says whether one of
+// those is on.
+//
+static
+STATUS
+CheckSeesTagFire(
+    const char *Option,
+    bool Bypassed
+    )
+{
+    if (Bypassed)
+    {
+        TagWarnx("%s can't be used with -c, -j, -m, -P, -t or -w", Option);
+        return ENV_BADARG;
+    }
+
+    return ENV_OK;
+}
+
+void
+Usage(
+    void
+    )
+{
+    TagPrint("usage\n");
+
+    exit(1);
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    TagBin binary;
+    TagSystem system;
+    IoBufferConfig io;
+    IoStream stream;
+    Debugger dbg;
+    TagJit jit_state;
+    TagMemo memo;
+    TagParallel parallel;
+    TagPipeline pipeline;
+    TagWang wang;
+    TagCycle cycle;
+    TagStats stats;
+    TagProfile profile;
+    TagEventRing events;
+    TagCheckpointer checkpoint;
+
+    bool binary_initialized;
+    bool system_initialized;
+    bool debugger_initialized;
+    bool jit_initialized;
+    bool memo_initialized;
+    bool parallel_initialized;
+    bool pipeline_initialized;
+    bool wang_initialized;
+    bool cycle_initialized;
+    bool stream_initialized;
+    bool stats_initialized;
+    bool profile_initialized;
+    bool events_initialized;
+    bool checkpoint_initialized;
+    int ch;
+
+    binary_initialized = false;
+    system_initialized = false;
+    debugger_initialized = false;
+    jit_initialized = false;
+    memo_initialized = false;
+    parallel_initialized = false;
+    pipeline_initialized = false;
+    wang_initialized = false;
+    cycle_initialized = false;
+    stream_initialized = false;
+    stats_initialized = false;
+    profile_initialized = false;
+    events_initialized = false;
+    checkpoint_initialized = false;
+
+    char *filename = NULL;
+    int fd = STDIN_FILENO;
+
+    char *debug_file = NULL;
+    char *report_file = NULL;
+    char *profile_file = NULL;
+    char *lines_file = NULL;
+    char *eir_file = NULL;
+    char *events_file = NULL;
+    char *checkpoint_file = NULL;
+    char *restore_file = NULL;
+
+    int print = 0;
+    bool async_io = false;
+    bool jit = false;
+    bool pipelined = false;
+    bool big_counts = false;
+    bool wang_steps = false;
+    bool cycles = false;
+    bool huge_pages = false;
+    bool bypassed;
+
+    uint64_t memo_bytes = 0;
+    uint64_t spill_bytes = 0;
+    char *spill_dir = getenv("TMPDIR");
+    uint64_t memo_segment = TAGMEMO_DEFAULT_SEGMENT;
+    uint64_t threads = 0;
+    uint64_t checkpoint_interval = 0;
+    struct timespec start, end;
+    double seconds;
+
+    uint64_t max_steps = UINT64_MAX;
+    uint64_t steps = 0;
+    uint64_t restored_steps = 0;
+
+    STATUS status = 0;
+
+    while ((ch = getopt(argc, argv, "abcC:d:e:E:f:F:HjK:k:l:m:n:pPr:R:s:S:t:w")) != -1)
+    {
+        switch (ch) {
+        case 'a':
+            //
+            // Do the program's I/O without stdio, with output written out by
+            // a thread of its own.
+            //
+            async_io = true;
+            break;
+
+        case 'b':
+            big_counts = true;
+            break;
+
+        case 'c':
+            cycles = true;
+            break;
+
+        case 'C':
+            //
+            // Where to keep a snapshot of the run, taken every -K steps and
+            // on SIGUSR2. See TagCheckpoint.h.
+            //
+            checkpoint_file = optarg;
+            break;
+
+        case 'd':
+            printf("optarg: %s\n", optarg);
+            debug_file = optarg;
+            break;
+
+        case 'e':
+            //
+            // The .eir file the program was built from, for -F to find the
+            // C functions in.
+            //
+            eir_file = optarg;
+            break;
+
+        case 'E':
+            //
+            // Record events into a ring that is written here on SIGUSR1 and
+            // at exit. See TagProbe.h.
+            //
+            events_file = optarg;
+            break;
+
+        case 'f':
+            filename = optarg;
+            break;
+
+        case 'F':
+            //
+            // Where to write a sampled profile of the run as folded stacks.
+            // See TagProfile.h.
+            //
+            profile_file = optarg;
+            break;
+
+        case 'H':
+            //
+            // Back the queue with huge pages.
+            //
+            huge_pages = true;
+            break;
+
+        case 'j':
+            jit = true;
+            break;
+
+        case 'K':
+            checkpoint_interval = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'k':
+            memo_segment = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'l':
+            //
+            // The line table elvm's wm backend wrote for the program, for -F.
+            //
+            lines_file = optarg;
+            break;
+
+        case 'm':
+            //
+            // The memo table's budget in MiB.
+            //
+            memo_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+
+        case 'n':
+            max_steps = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'p':
+            // XXX make this a log-level (or even subsystem) so we can hook up
+            // a proper logger to print out various info without having to just
+            // comment it out
+            print = 1;
+            break;
+
+        case 'P':
+            pipelined = true;
+            break;
+
+        case 'r':
+            //
+            // Where to write a JSON report of the run. See TagStats.h.
+            //
+            report_file = optarg;
+            break;
+
+        case 'R':
+            //
+            // Pick up from a snapshot taken with -C.
+            //
+            restore_file = optarg;
+            break;
+
+        case 's':
+            //
+            // How much of the queue to keep in memory in MiB before the rest
+            // goes to disk.
+            //
+            spill_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+
+        case 'S':
+            spill_dir = optarg;
+            break;
+
+        case 't':
+            threads = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'w':
+            //
+            // Needs the debug symbols (-d, unless the program carries them)
+            // to find the W-machine's instructions.
+            //
+            wang_steps = true;
+            break;
+
+        default:
+            Usage();
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (filename != NULL)
+    {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            TagWarn("open (fd)");
+            goto Bail;
+        }
+    }
+
+    if (!print)
+    {
+        io.GetByte = (GetByteFn) getc;
+        io.GetContext = stdin;
+        io.PutByte = (PutByteFn) putc;
+        io.PutContext = stdout;
+
+        status = ReadBinaryFile(fd, &binary);
+        if (FAILED(status))
+        {
+            goto Bail;
+        }
+        binary_initialized = true;
+
+        if (async_io)
+        {
+            //
+            // Anything stdio already has for stdout goes first. Input is
+            // picked up from wherever the program left stdin.
+            //
+            (void) fflush(stdout);
+
+            CHECK(status = IoStreamInitialize(&stream, STDIN_FILENO, STDOUT_FILENO));
+            stream_initialized = true;
+            IoStreamConfigure(&stream, &io);
+        }
+
+        status = InstantiateTagSystemFromBinary(&binary, &system, &io);
+        if (FAILED(status))
+        {
+            goto Bail;
+        }
+        system_initialized = true;
+
+        if (events_file != NULL)
+        {
+            CHECK(status = TagEventRingInitialize(
+                                &events,
+                                events_file,
+                                TAG_EVENT_DEFAULT_CAPACITY,
+                                system.SymbolSize));
+            events_initialized = true;
+        }
+
+        system.Tape.BigCounts = big_counts;
+        system.Tape.Queue.HugePages = huge_pages;
+
+        if (spill_bytes > 0)
+        {
+            CHECK(status = ChunkQueueSpill(
+                                &system.Tape.Queue,
+                                spill_dir != NULL ? spill_dir : "/tmp",
+                                spill_bytes));
+        }
+
+        if (debug_file != NULL || binary.NamesSize > 0)
+        {
+            CHECK(status = PrepareDebugger(
+                                &dbg,
+                                debug_file,
+                                binary.Names,
+                                binary.NamesSize,
+                                &system));
+            debugger_initialized = true;
+        }
+
+        hexdump_only("Starting Queue", system.InitialQueue.Data, system.InitialQueue.Size);
+
+        if (jit && (memo_bytes > 0 || threads > 0 || wang_steps || cycles || pipelined))
+        {
+            //
+            // The JIT runs the whole program itself, with none of TagRun's
+            // help.
+            //
+            TagWarnx("-j can't be used with -c, -m, -P, -t or -w");
+            BAIL(status = ENV_BADARG);
+        }
+
+        bypassed = jit || pipelined || memo_bytes > 0 || threads > 0 || wang_steps || cycles;
+
+        if (report_file != NULL)
+        {
+            CHECK(status = CheckSeesTagFire("-r", bypassed));
+        }
+
+        if (profile_file != NULL)
+        {
+            CHECK(status = CheckSeesTagFire("-F", bypassed));
+        }
+
+        if (checkpoint_file != NULL && (jit || pipelined))
+        {
+            //
+            // Snapshots are taken between TagRun's steps.
+            //
+            TagWarnx("-C can't be used with -j or -P");
+            BAIL(status = ENV_BADARG);
+        }
+
+        if (checkpoint_file != NULL || restore_file != NULL)
+        {
+            CHECK(status = TagCheckpointInitialize(
+                                &checkpoint,
+                                &system,
+                                checkpoint_file,
+                                checkpoint_interval));
+            checkpoint_initialized = true;
+
+            if (stream_initialized)
+            {
+                checkpoint.Flush = (CheckpointFlushFn) IoStreamFlush;
+                checkpoint.FlushContext = &stream;
+            }
+            else
+            {
+                checkpoint.Flush = (CheckpointFlushFn) fflush;
+                checkpoint.FlushContext = stdout;
+            }
+
+            if (restore_file != NULL)
+            {
+                CHECK(status = TagRestore(&checkpoint, restore_file));
+
+                //
+                // -n counts the steps taken before the snapshot too.
+                //
+                restored_steps = checkpoint.Clock;
+                max_steps -= MIN(max_steps, restored_steps);
+
+                TagPrint("restored: step %lx, %lu bytes read, %lu bytes written\n",
+                        restored_steps,
+                        (system.Io.BitsIn + 7) / 8,
+                        system.Io.BitsOut / 8);
+            }
+        }
+
+        if (jit)
+        {
+            CHECK(status = TagJitInitialize(&jit_state, &system));
+            jit_initialized = true;
+
+            status = TagJitRun(&jit_state, max_steps, &steps);
+            if (FAILED(status))
+            {
+                TagWarnx("TagJitRun: %x", status);
+            }
+        }
+        else
+        {
+            if (memo_bytes > 0)
+            {
+                CHECK(status = TagMemoInitialize(&memo, &system, memo_segment, memo_bytes));
+                memo_initialized = true;
+                system.Memo = &memo;
+            }
+
+            if (wang_steps)
+            {
+                if (!debugger_initialized)
+                {
+                    TagWarnx("-w needs the debug symbols (-d, or a program that carries them)");
+                    BAIL(status = ENV_BADARG);
+                }
+
+                CHECK(status = TagWangInitialize(&wang, &system, &dbg));
+                wang_initialized = true;
+                system.Wang = &wang;
+            }
+
+            if (cycles)
+            {
+                if (pipelined)
+                {
+                    //
+                    // The pipeline takes most of its steps outside of TagRun
+                    // where the detector can't see them.
+                    //
+                    TagWarnx("-c can't be used with -P");
+                    BAIL(status = ENV_BADARG);
+                }
+
+                CHECK(status = TagCycleInitialize(&cycle, &system));
+                cycle_initialized = true;
+                system.Cycle = &cycle;
+            }
+
+            if (threads > 0)
+            {
+                CHECK(status = TagParallelInitialize(&parallel, &system, threads));
+                parallel_initialized = true;
+                system.Parallel = &parallel;
+            }
+
+            if (report_file != NULL)
+            {
+                CHECK(status = TagStatsInitialize(&stats, &system));
+                stats_initialized = true;
+                system.Stats = &stats;
+            }
+
+            if (checkpoint_file != NULL)
+            {
+                system.Checkpoint = &checkpoint;
+            }
+
+            if (profile_file != NULL)
+            {
+                CHECK(status = TagProfileInitialize(&profile, &system, TAGPROF_DEFAULT_INTERVAL));
+                profile_initialized = true;
+            }
+
+            (void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+            if (pipelined)
+            {
+                CHECK(status = TagPipelineInitialize(&pipeline, &system, TAGPIPE_DEFAULT_DEPTH));
+                pipeline_initialized = true;
+
+                status = TagPipelineRun(&pipeline, max_steps, &steps);
+                if (FAILED(status))
+                {
+                    TagWarnx("TagPipelineRun: %x", status);
+                }
+            }
+            else
+            {
+                status = TagRun(&system, max_steps, &steps);
+                if (FAILED(status))
+                {
+                    TagWarnx("TagRun: %x", status);
+                }
+            }
+
+            if (profile_initialized)
+            {
+                TagProfileStop(&profile);
+            }
+
+            (void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+            if (memo_initialized)
+            {
+                seconds = (end.tv_sec - start.tv_sec) +
+                          (end.tv_nsec - start.tv_nsec) / 1e9;
+
+                TagMemoDump(&memo);
+                TagPrint("memo: %.0f effective steps/sec\n",
+                        seconds > 0 ? steps / seconds : 0.0);
+            }
+
+            if (parallel_initialized)
+            {
+                TagParallelDump(&parallel);
+            }
+
+            if (pipeline_initialized)
+            {
+                TagPipelineDump(&pipeline);
+            }
+
+            if (wang_initialized)
+            {
+                TagWangDump(&wang);
+            }
+
+            if (cycle_initialized)
+            {
+                //
+                // Compare against a run without -c to see what the rolling
+                // hash costs.
+                //
+                seconds = (end.tv_sec - start.tv_sec) +
+                          (end.tv_nsec - start.tv_nsec) / 1e9;
+
+                TagCycleDump(&cycle);
+                TagPrint("cycle: %.0f effective steps/sec\n",
+                        seconds > 0 ? steps / seconds : 0.0);
+            }
+        }
+
+        if (stream_initialized)
+        {
+            //
+            // However the run ended, everything it wrote goes out before we
+            // say how it went.
+            //
+            if (FAILED(IoStreamFlush(&stream)))
+            {
+                TagWarnx("IoStreamFlush: output was lost");
+            }
+
+            IoStreamDump(&stream);
+        }
+
+        if (spill_bytes > 0)
+        {
+            ChunkQueueDump(&system.Tape.Queue);
+        }
+
+        if (stats_initialized)
+        {
+            (void) TagStatsWrite(
+                        &stats,
+                        report_file,
+                        debugger_initialized ? &dbg : NULL,
+                        steps,
+                        status);
+        }
+
+        if (profile_initialized)
+        {
+            TagProfileDump(&profile);
+
+            (void) TagProfileWrite(
+                        &profile,
+                        profile_file,
+                        debugger_initialized ? &dbg : NULL,
+                        lines_file,
+                        eir_file);
+        }
+
+        if (checkpoint_file != NULL)
+        {
+            TagCheckpointDump(&checkpoint);
+        }
+
+        steps += restored_steps;
+
+        TagPrint("steps: %lx\n", steps);
+    }
+    else
+    {
+        binary_initialized = true;
+        (void) ReadBinaryFile(fd, &binary);
+        TagBinDump(&binary);
+    }
+
+Bail:
+    if (fd > 0 && fd != STDIN_FILENO)
+    {
+        (void) close(fd);
+    }
+
+    if (jit_initialized)
+    {
+        TagJitTeardown(&jit_state);
+    }
+    if (memo_initialized)
+    {
+        TagMemoTeardown(&memo);
+    }
+    if (parallel_initialized)
+    {
+        TagParallelTeardown(&parallel);
+    }
+    if (pipeline_initialized)
+    {
+        TagPipelineTeardown(&pipeline);
+    }
+    if (wang_initialized)
+    {
+        TagWangTeardown(&wang);
+    }
+    if (cycle_initialized)
+    {
+        TagCycleTeardown(&cycle);
+    }
+    if (stats_initialized)
+    {
+        TagStatsTeardown(&stats);
+    }
+    if (profile_initialized)
+    {
+        TagProfileTeardown(&profile);
+    }
+    if (events_initialized)
+    {
+        TagEventRingTeardown(&events);
+    }
+    if (binary_initialized)
+    {
+        TagBinTeardown(&binary);
+    }
+    if (system_initialized)
+    {
+        TagTeardown(&system);
+    }
+    if (checkpoint_initialized)
+    {
+        //
+        // After the system, as its queue can point at symbols we hold.
+        //
+        TagCheckpointTeardown(&checkpoint);
+    }
+    if (stream_initialized)
+    {
+        IoStreamTeardown(&stream);
+    }
+    if (debugger_initialized)
+    {
+        DebuggerTeardown(&dbg);
+    }
+
+    return (status < 0);
+}
@@ -94,6 +94,11 @@ RingBufferExpand(
         size = MinimumSize;
     }
 
+    //
+    // A single large push can need more than the usual growth.
+    //
+    size = MAX(size, MinimumSize);
+
     //
     // Allocate a bigger new ring.
     //
@@ -227,6 +232,31 @@ Bail:
     return status;
 }
 
+int
+RingBufferDiscard(
+    RingBuffer *Ring,
+    uint64_t DataSize
+    )
+{
+    int status = 0;
+
+    assert(Ring != NULL);
+    assert(Ring->BufferSize > 0);
+
+    if (DataSize > Ring->ActiveSize)
+    {
+        status = ENV_LENTOOBIG;
+        TagWarnx("DataSize (%lu) > Ring->ActiveSize (%lu)", DataSize, Ring->ActiveSize);
+        goto Bail;
+    }
+
+    Ring->Tail = (Ring->Tail + DataSize) % Ring->BufferSize;
+    Ring->ActiveSize -= DataSize;
+
+Bail:
+    return status;
+}
+
 int
 RingBufferPeek(
     RingBuffer *Ring,
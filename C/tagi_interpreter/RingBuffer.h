@@ -67,6 +67,15 @@ RingBufferPop(
     uint64_t DataSize
     );
 
+//
+// Like RingBufferPop but throws the data away instead of copying it out.
+//
+int
+RingBufferDiscard(
+    RingBuffer *Ring,
+    uint64_t DataSize
+    );
+
 int
 RingBufferPeek(
     RingBuffer *Ring,
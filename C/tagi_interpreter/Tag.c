@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+
 #include "tommyhashlin.h"
 
 #include "Util.h"
@@ -16,12 +18,643 @@
 #include "IoBuffer.h"
 #include "TagRule.h"
 #include "Tag.h"
+#include "TagMemo.h"
+#include "TagParallel.h"
+#include "TagWang.h"
+#include "TagCycle.h"
+#include "TagStats.h"
+#include "TagCheckpoint.h"
+#include "TagProbe.h"
 
 // TODO translate a normal tag system into a cyclic tag system
 
-// XXX everything passed to an instance of tommy_hashtable LOSES ownership.
-// That means the hashtable is responsible for cleaning everything up.
+//
+// Used to find a rule by its symbol while the rules are still being laid out.
+//
+typedef struct _TagRuleKey
+{
+    uint8_t *Symbol;
+    uint32_t SymbolSize;
+    uint64_t Rule;      // Index into the caller's rules.
+} TagRuleKey;
+
+//
+// The generic lookups, for any SymbolSize.
+//
+static
+TagRule *
+TagLookupRuleDense(
+    TagSystem *System,
+    Blob *Symbol
+    )
+{
+    uint64_t value = TagSymbolValue(Symbol->Data, System->SymbolSize);
+
+    if (value >= System->RuleIndexSize)
+    {
+        return NULL;
+    }
+
+    return System->RuleIndex[value];
+}
+
+//
+// One hash and one compare, as whatever is in the slot might be the rule for
+// another symbol.
+//
+static
+TagRule *
+TagLookupRulePerfect(
+    TagSystem *System,
+    Blob *Symbol
+    )
+{
+    uint64_t value = TagSymbolValue(Symbol->Data, System->SymbolSize);
+    TagRule *rule;
+
+    rule = System->HashRules[TagPerfectHashSlot(&System->Image.Hash, value)];
+    if (memcmp(rule->Symbol.Data, Symbol->Data, System->SymbolSize) != 0)
+    {
+        return NULL;
+    }
+
+    return rule;
+}
+
+static
+TagRule *
+TagLookupRuleHashed(
+    TagSystem *System,
+    Blob *Symbol
+    )
+{
+    tommy_hash_t hash = tommy_hash_u64(0, Symbol->Data, System->SymbolSize);
+
+    return (TagRule *) tommy_hashlin_search(
+                        &System->Productions,
+                        TagRuleCompare,
+                        Symbol,
+                        hash);
+}
+
+//
+// And their specializations for a SymbolSize known at compile time. The
+// symbol's value (see TagSymbolValue) is put together without a loop and
+// symbols are compared without memcmp.
+//
+#define TAG_SYMBOL_VALUE_1(S)   ((uint64_t) (S)[0])
+#define TAG_SYMBOL_VALUE_2(S)   (TAG_SYMBOL_VALUE_1(S) | (uint64_t) (S)[1] << 8)
+#define TAG_SYMBOL_VALUE_3(S)   (TAG_SYMBOL_VALUE_2(S) | (uint64_t) (S)[2] << 16)
+#define TAG_SYMBOL_VALUE_4(S)   (TAG_SYMBOL_VALUE_3(S) | (uint64_t) (S)[3] << 24)
+
+#define TAG_DEFINE_DENSE_LOOKUP(Width)                                      \
+static                                                                      \
+TagRule *                                                                   \
+TagLookupRuleDense_##Width(                                                 \
+    TagSystem *System,                                                      \
+    Blob *Symbol                                                            \
+    )                                                                       \
+{                                                                           \
+    uint64_t value = TAG_SYMBOL_VALUE_##Width(Symbol->Data);                \
+                                                                            \
+    assert(System->SymbolSize == Width);                                    \
+                                                                            \
+    if (value >= System->RuleIndexSize)                                     \
+    {                                                                       \
+        return NULL;                                                        \
+    }                                                                       \
+                                                                            \
+    return System->RuleIndex[value];                                        \
+}
+
+#define TAG_DEFINE_HASHED_LOOKUP(Width)                                     \
+static                                                                      \
+int                                                                         \
+TagRuleCompare_##Width(                                                     \
+    const void *Arg,                                                        \
+    const void *Obj                                                         \
+    )                                                                       \
+{                                                                           \
+    const uint8_t *key = ((const Blob *) Arg)->Data;                        \
+    const uint8_t *symbol = ((const TagRule *) Obj)->Symbol.Data;           \
+                                                                            \
+    return !TAGQ_SYMBOL_EQUAL(Width, key, symbol);                          \
+}                                                                           \
+                                                                            \
+static                                                                      \
+TagRule *                                                                   \
+TagLookupRuleHashed_##Width(                                                \
+    TagSystem *System,                                                      \
+    Blob *Symbol                                                            \
+    )                                                                       \
+{                                                                           \
+    tommy_hash_t hash = tommy_hash_u64(0, Symbol->Data, Width);             \
+                                                                            \
+    assert(System->SymbolSize == Width);                                    \
+                                                                            \
+    return (TagRule *) tommy_hashlin_search(                                \
+                        &System->Productions,                               \
+                        TagRuleCompare_##Width,                             \
+                        Symbol,                                             \
+                        hash);                                              \
+}
+
+#define TAG_DEFINE_PERFECT_LOOKUP(Width)                                    \
+static                                                                      \
+TagRule *                                                                   \
+TagLookupRulePerfect_##Width(                                               \
+    TagSystem *System,                                                      \
+    Blob *Symbol                                                            \
+    )                                                                       \
+{                                                                           \
+    uint64_t value = TAG_SYMBOL_VALUE_##Width(Symbol->Data);                \
+    TagRule *rule;                                                          \
+                                                                            \
+    assert(System->SymbolSize == Width);                                    \
+                                                                            \
+    rule = System->HashRules[TagPerfectHashSlot(&System->Image.Hash, value)]; \
+    if (!TAGQ_SYMBOL_EQUAL(Width, rule->Symbol.Data, Symbol->Data))         \
+    {                                                                       \
+        return NULL;                                                        \
+    }                                                                       \
+                                                                            \
+    return rule;                                                            \
+}
+
+TAG_DEFINE_DENSE_LOOKUP(1)
+TAG_DEFINE_DENSE_LOOKUP(2)
+TAG_DEFINE_DENSE_LOOKUP(3)
+TAG_DEFINE_HASHED_LOOKUP(4)
+TAG_DEFINE_PERFECT_LOOKUP(4)
+
+//
+// Picks System->LookupRule. The indexes, if any, have to be in place.
+//
+static
+void
+TagSelectLookup(
+    TagSystem *System
+    )
+{
+    if (System->RuleIndex != NULL)
+    {
+        switch (System->SymbolSize) {
+        case 1:
+            System->LookupRule = TagLookupRuleDense_1;
+            break;
+
+        case 2:
+            System->LookupRule = TagLookupRuleDense_2;
+            break;
 
+        case 3:
+            System->LookupRule = TagLookupRuleDense_3;
+            break;
+
+        default:
+            System->LookupRule = TagLookupRuleDense;
+            break;
+        }
+    }
+    else if (System->HashRules != NULL)
+    {
+        if (System->SymbolSize == 4)
+        {
+            System->LookupRule = TagLookupRulePerfect_4;
+        }
+        else
+        {
+            System->LookupRule = TagLookupRulePerfect;
+        }
+    }
+    else if (System->SymbolSize == 4)
+    {
+        System->LookupRule = TagLookupRuleHashed_4;
+    }
+    else
+    {
+        System->LookupRule = TagLookupRuleHashed;
+    }
+}
+
+//
+// Marks Rule as a chain link if its appendant is a run of one symbol that has
+// a rule of its own. See TagFollowChain.
+//
+static
+void
+TagLinkChain(
+    TagSystem *System,
+    TagRule *Rule
+    )
+{
+    Blob *appendant = &Rule->Pure.Appendant;
+    Blob head;
+    uint64_t i;
+
+    if (Rule->Style != IoSel_Pure || appendant->Size == 0)
+    {
+        return;
+    }
+
+    for (i = System->SymbolSize; i < appendant->Size; i += System->SymbolSize)
+    {
+        if (memcmp(appendant->Data, &appendant->Data[i], System->SymbolSize) != 0)
+        {
+            return;
+        }
+    }
+
+    head.Data = appendant->Data;
+    head.Size = System->SymbolSize;
+    head.MaxSize = System->SymbolSize;
+
+    Rule->ChainNext = TagLookupRule(System, &head);
+    Rule->ChainMultiplier = appendant->Size / System->SymbolSize;
+}
+
+static
+STATUS
+TagAllocateRuleIndex(
+    TagSystem *System,
+    TagRule *Rules,
+    uint64_t RulesCount
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t i, maxValue = 0;
+
+    if (System->Image.Index != NULL)
+    {
+        //
+        // The program came with its own index, so we know exactly how big
+        // this needs to be whatever the width of the symbols.
+        //
+        System->RuleIndexSize = System->Image.IndexSize;
+        goto Allocate;
+    }
+
+    if (System->SymbolSize > TAG_DENSE_INDEX_MAX_SYMBOLSIZE)
+    {
+        //
+        // The symbol space is too large to index directly so go by the
+        // program's perfect hash if it has one and the hash table otherwise.
+        //
+        if (System->Image.Hash.SlotCount > 0)
+        {
+            System->HashRules = calloc(System->Image.Hash.SlotCount, sizeof(*System->HashRules));
+            if (System->HashRules == NULL)
+            {
+                TagWarnx("calloc HashRules (%lu)", System->Image.Hash.SlotCount);
+                BAIL(status = ENV_OOM);
+            }
+        }
+
+        goto Bail;
+    }
+
+    //
+    // Symbols are handed out densely by the assembler so sizing the index by
+    // the largest rule symbol (rather than by the full symbol space) keeps it
+    // small. Anything past the end has no rule.
+    //
+    for (i = 0; i < RulesCount; ++i)
+    {
+        if (Rules[i].Symbol.Size != System->SymbolSize)
+        {
+            //
+            // The main loop will reject this rule.
+            //
+            continue;
+        }
+
+        maxValue = MAX(maxValue, TagSymbolValue(Rules[i].Symbol.Data, System->SymbolSize));
+    }
+
+    System->RuleIndexSize = maxValue + 1;
+
+Allocate:
+    System->RuleIndex = calloc(System->RuleIndexSize, sizeof(*System->RuleIndex));
+    if (System->RuleIndex == NULL)
+    {
+        TagWarnx("calloc RuleIndex (%lu)", System->RuleIndexSize);
+        BAIL(status = ENV_OOM);
+    }
+
+Bail:
+    return status;
+}
+
+
+static
+int
+TagRuleKeyCompare(
+    const void *A,
+    const void *B
+    )
+{
+    const TagRuleKey *a = (const TagRuleKey *) A;
+    const TagRuleKey *b = (const TagRuleKey *) B;
+
+    return memcmp(a->Symbol, b->Symbol, a->SymbolSize);
+}
+
+//
+// Whether the program came with something that finds its rules by symbol, in
+// which case they don't need sorting to be found and can't have duplicates.
+//
+static
+inline
+bool
+TagImageFindsRules(
+    TagSystem *System
+    )
+{
+    return System->Image.Index != NULL || System->Image.Hash.SlotCount > 0;
+}
+
+//
+// The position in Rules of the rule for Symbol, or KeyCount (the number of
+// rules) if there isn't one. Keys are only sorted (and only needed) when the
+// program didn't come with an index or a perfect hash.
+//
+static
+uint64_t
+TagFindRule(
+    TagSystem *System,
+    TagRule *Rules,
+    uint8_t *Symbol,
+    TagRuleKey *Keys,
+    uint64_t KeyCount
+    )
+{
+    TagRuleKey key, *found;
+    uint64_t value, rule;
+
+    if (System->Image.Index != NULL)
+    {
+        value = TagSymbolValue(Symbol, System->SymbolSize);
+        if (value >= System->Image.IndexSize ||
+            System->Image.Index[value] == TAG_IMAGE_NO_RULE)
+        {
+            return KeyCount;
+        }
+
+        return System->Image.Index[value];
+    }
+
+    if (System->Image.Hash.SlotCount > 0)
+    {
+        value = TagSymbolValue(Symbol, System->SymbolSize);
+        rule = System->Image.Hash.Slots[TagPerfectHashSlot(&System->Image.Hash, value)];
+        if (memcmp(Rules[rule].Symbol.Data, Symbol, System->SymbolSize) != 0)
+        {
+            return KeyCount;
+        }
+
+        return rule;
+    }
+
+    key.Symbol = Symbol;
+    key.SymbolSize = System->SymbolSize;
+
+    found = bsearch(&key, Keys, KeyCount, sizeof(*Keys), TagRuleKeyCompare);
+
+    return (found != NULL) ? found->Rule : KeyCount;
+}
+
+//
+// Queues the rules for every symbol of Appendant that we haven't seen yet.
+//
+static
+void
+TagVisitAppendant(
+    TagSystem *System,
+    TagRule *Rules,
+    Blob *Appendant,
+    TagRuleKey *Keys,
+    uint64_t KeyCount,
+    bool *Visited,
+    uint64_t *Order,
+    uint64_t *OrderCount
+    )
+{
+    uint64_t i, found;
+
+    for (i = 0; i + System->SymbolSize <= Appendant->Size; i += System->SymbolSize)
+    {
+        found = TagFindRule(System, Rules, &Appendant->Data[i], Keys, KeyCount);
+        if (found != KeyCount && !Visited[found])
+        {
+            Visited[found] = true;
+            Order[(*OrderCount)++] = found;
+        }
+    }
+}
+
+//
+// Fills Order with the indices of Rules in the order they are laid out in:
+// breadth first through the rule graph, where a rule leads to the rules for
+// the symbols it appends, starting from the rule for the first symbol queued.
+// Rules that can't be reached from there follow in their original order,
+// each bringing along whatever it reaches. A production's successors
+// therefore tend to be its neighbours in memory. Also catches duplicate
+// rules, unless the program's index or perfect hash already ruled them out.
+//
+static
+STATUS
+TagOrderRules(
+    TagSystem *System,
+    TagRule *Rules,
+    uint64_t RulesCount,
+    uint64_t *Order
+    )
+{
+    STATUS status = ENV_OK;
+    TagRuleKey *keys = NULL;
+    bool *visited = NULL;
+    uint64_t i, seed, first, head = 0, count = 0;
+    TagRule *rule;
+
+    visited = calloc(RulesCount, sizeof(*visited));
+    if (visited == NULL)
+    {
+        TagWarnx("calloc visited (%lu)", RulesCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    if (TagImageFindsRules(System))
+    {
+        goto Walk;
+    }
+
+    keys = malloc(RulesCount * sizeof(*keys));
+    if (keys == NULL)
+    {
+        TagWarnx("malloc keys (%lu)", RulesCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    for (i = 0; i < RulesCount; ++i)
+    {
+        keys[i].Symbol = Rules[i].Symbol.Data;
+        keys[i].SymbolSize = System->SymbolSize;
+        keys[i].Rule = i;
+    }
+
+    qsort(keys, RulesCount, sizeof(*keys), TagRuleKeyCompare);
+
+    for (i = 1; i < RulesCount; ++i)
+    {
+        if (TagRuleKeyCompare(&keys[i - 1], &keys[i]) == 0)
+        {
+            status = TAGSS_DUPERULE;
+            TagWarnx("Rule #%lu's already been added", MAX(keys[i - 1].Rule, keys[i].Rule));
+            goto Bail;
+        }
+    }
+
+Walk:
+    first = RulesCount;
+
+    if (System->InitialQueue.Size >= System->SymbolSize)
+    {
+        first = TagFindRule(System, Rules, System->InitialQueue.Data, keys, RulesCount);
+    }
+
+    for (i = 0; i <= RulesCount; ++i)
+    {
+        seed = (i == 0) ? first : i - 1;
+
+        if (seed == RulesCount || visited[seed])
+        {
+            continue;
+        }
+
+        visited[seed] = true;
+        Order[count++] = seed;
+
+        while (head < count)
+        {
+            rule = &Rules[Order[head++]];
+
+            switch (rule->Style) {
+            case IoSel_Pure:
+                TagVisitAppendant(System, Rules, &rule->Pure.Appendant, keys, RulesCount, visited, Order, &count);
+                break;
+
+            case IoSel_Input:
+                TagVisitAppendant(System, Rules, &rule->In.Appendant0, keys, RulesCount, visited, Order, &count);
+                TagVisitAppendant(System, Rules, &rule->In.Appendant1, keys, RulesCount, visited, Order, &count);
+                break;
+
+            case IoSel_Output:
+                TagVisitAppendant(System, Rules, &rule->Out.Appendant, keys, RulesCount, visited, Order, &count);
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    assert(count == RulesCount);
+
+Bail:
+    free(keys);
+    free(visited);
+
+    return status;
+}
+
+//
+// Copies Rules into System->Rules and, unless they point into System->Image,
+// their bytes into System->RulePool. See TagSystem.
+//
+static
+STATUS
+TagLayoutRules(
+    TagSystem *System,
+    TagRule *Rules,
+    uint64_t RulesCount
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t *order = NULL;
+    uint64_t i, size, poolSize = 0;
+    uint8_t *pool;
+
+    for (i = 0; i < RulesCount; ++i)
+    {
+        if (Rules[i].Symbol.Size != System->SymbolSize)
+        {
+            status = ENV_BADLEN;
+            TagWarnx("Rule #%lu's start symbol size (%lu) differs from the stated symbol size of %u", i, Rules[i].Symbol.Size, System->SymbolSize);
+            goto Bail;
+        }
+
+        CHECK(status = TagRuleMeasure(&Rules[i], &size));
+
+        if (__builtin_add_overflow(poolSize, size, &poolSize))
+        {
+            TagWarnx("Rules too large");
+            BAIL(status = ENV_INT_OVERFLOW);
+        }
+    }
+
+    order = malloc(RulesCount * sizeof(*order));
+    if (order == NULL)
+    {
+        TagWarnx("malloc order (%lu)", RulesCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    CHECK(status = TagOrderRules(System, Rules, RulesCount, order));
+
+    System->Rules = calloc(RulesCount, sizeof(*System->Rules));
+    if (System->Rules == NULL)
+    {
+        TagWarnx("calloc Rules (%lu)", RulesCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    if (System->Image.Data != NULL)
+    {
+        //
+        // The bytes are already somewhere that lasts as long as we do.
+        //
+        for (i = 0; i < RulesCount; ++i)
+        {
+            TagRuleCopy(&Rules[order[i]], &System->Rules[i], NULL);
+        }
+    }
+    else
+    {
+        System->RulePool = malloc(MAX(poolSize, 1));
+        if (System->RulePool == NULL)
+        {
+            TagWarnx("malloc RulePool (%lu)", poolSize);
+            BAIL(status = ENV_OOM);
+        }
+        System->RulePoolSize = poolSize;
+
+        pool = System->RulePool;
+
+        for (i = 0; i < RulesCount; ++i)
+        {
+            TagRuleCopy(&Rules[order[i]], &System->Rules[i], &pool);
+        }
+
+        assert(pool == System->RulePool + poolSize);
+    }
+
+    System->RuleCount = RulesCount;
+
+Bail:
+    free(order);
+
+    return status;
+}
 
 STATUS
 TagInitialize(
@@ -30,7 +663,8 @@ TagInitialize(
     uint64_t RulesCount,
     Blob *DefaultQueue,
     uint32_t AbstractDeletionNumber,
-    IoBufferConfig *Io
+    IoBufferConfig *Io,
+    TagImage *Image
     )
 {
     STATUS status = ENV_OK;
@@ -41,6 +675,14 @@ TagInitialize(
 
     memset(System, 0, sizeof(*System));
 
+    //
+    // Ours from here on, whatever happens.
+    //
+    if (Image != NULL)
+    {
+        System->Image = *Image;
+    }
+
     tommy_hashlin_init(&System->Productions);
 
     if (RulesCount < 1)
@@ -71,9 +713,16 @@ TagInitialize(
                 Io));
 
     //
-    // Take ownership of the starting data.
+    // Take ownership of the starting data, unless it's in Image.
     //
-    CHECK(status = BlobCopy(&System->InitialQueue, DefaultQueue));
+    if (System->Image.Data != NULL)
+    {
+        System->InitialQueue = *DefaultQueue;
+    }
+    else
+    {
+        CHECK(status = BlobCopy(&System->InitialQueue, DefaultQueue));
+    }
 
     CHECK(status = TagQueueInitialize(
             &System->Tape,
@@ -84,47 +733,46 @@ TagInitialize(
         &System->InitialQueue,
         1));
 
+    CHECK(status = TagAllocateRuleIndex(System, Rules, RulesCount));
+
 
     //
-    // We now *own* these rules and are members are free to reference these
-    // (read-only). We are the last to teardown and we destroy the rules when
-    // we do.
+    // We now have our own copy of these rules and members are free to
+    // reference it (read-only). We are the last to teardown and we destroy
+    // the rules when we do.
     //
+    CHECK(status = TagLayoutRules(System, Rules, RulesCount));
 
-    for (i = 0; i < RulesCount; ++i)
+    for (i = 0; i < System->RuleCount; ++i)
     {
-        TagRule *rule;
+        TagRule *rule = &System->Rules[i];
+        uint64_t value = TagSymbolValue(rule->Symbol.Data, System->SymbolSize);
         tommy_hash_t hash;
 
-        if (Rules[i].Symbol.Size != System->SymbolSize)
+        if (System->RuleIndex != NULL)
         {
-            status = ENV_BADLEN;
-            TagWarnx("Rule #%lu's start symbol size (%lu) differs from the stated symbol size of %u", i, Rules[i].Symbol.Size, System->SymbolSize);
-            goto Bail;
+            System->RuleIndex[value] = rule;
         }
-
-        status = TagRuleDupe(&Rules[i], &rule);
-        if (FAILED(status))
+        else if (System->HashRules != NULL)
         {
-            goto Bail;
+            System->HashRules[TagPerfectHashSlot(&System->Image.Hash, value)] = rule;
         }
-
-        hash = tommy_hash_u64(0, rule->Symbol.Data, rule->Symbol.Size);
-        if (tommy_hashlin_search(
-                &System->Productions,
-                TagRuleCompare,
-                &rule->Symbol,
-                hash) != NULL)
+        else
         {
-            status = TAGSS_DUPERULE;
-            TagWarnx("Rule #%lu's already been added", i);
-            goto Bail;
+            hash = tommy_hash_u64(0, rule->Symbol.Data, rule->Symbol.Size);
+            tommy_hashlin_insert(
+                    &System->Productions,
+                    &rule->Node,
+                    rule,
+                    hash);
         }
-        tommy_hashlin_insert(
-                &System->Productions,
-                &rule->Node,
-                rule,
-                hash);
+    }
+
+    TagSelectLookup(System);
+
+    for (i = 0; i < System->RuleCount; ++i)
+    {
+        TagLinkChain(System, &System->Rules[i]);
     }
 
 Bail:
@@ -141,97 +789,180 @@ TagTeardown(
     TagSystem *System
     )
 {
-    tommy_hashlin_foreach(
-        &System->Productions,
-        (tommy_foreach_func *) TagRuleTeardownComplete);
-
     tommy_hashlin_done(&System->Productions);
 
+    free(System->Rules);
+    System->Rules = NULL;
+    System->RuleCount = 0;
+
+    free(System->RulePool);
+    System->RulePool = NULL;
+    System->RulePoolSize = 0;
+
+    free(System->RuleIndex);
+    System->RuleIndex = NULL;
+    System->RuleIndexSize = 0;
+
+    free(System->HashRules);
+    System->HashRules = NULL;
+
     TagQueueTeardown(&System->Tape);
 
+    //
+    // Last, as the rules, the initial queue and so the queue all point into
+    // it.
+    //
+    if (System->Image.Data != NULL)
+    {
+        (void) munmap(System->Image.Data, System->Image.Size);
+    }
+    memset(&System->Image, 0, sizeof(System->Image));
+
     // XXX we are using "teardown" inconsistently and in this case it doesn't
     // free everything (i.e., system). Is this ok?
 }
 
-STATUS
-TagStep(
-    TagSystem *System
+//
+// Counts Fires steps of Rule, each popping a run of Repetitions buckets, and
+// marks it as the rule firing.
+//
+static
+inline
+void
+TagCountFires(
+    TagSystem *System,
+    TagRule *Rule,
+    uint64_t Repetitions,
+    uint64_t Fires
     )
 {
-    STATUS status = ENV_OK;
-    TagRule *rule;
-    Blob deleted, appendant;
-    uint64_t reps;
-    bool input;
-    tommy_hash_t hash;
-
-    rule = NULL;
-    memset(&appendant, 0, sizeof(appendant));
+    uint64_t total;
 
-    status = TagQueuePop(
-                &System->Tape,
-                &deleted,
-                &reps);
-    if (FAILED(status))
+    System->Firing = Rule;
+    Rule->Fires += Fires;
+    if (__builtin_mul_overflow(Repetitions, Fires, &total) ||
+        __builtin_add_overflow(Rule->Repetitions, total, &Rule->Repetitions))
     {
-        status = TAGSS_OUTOFTAPE;
-        TagWarnx("TagQueuePop: Queue empty?");
-        goto Bail;
+        Rule->Repetitions = UINT64_MAX;
     }
-    assert(deleted.Size == System->SymbolSize);
-    assert(reps > 0);
+    System->RunLengths[63 - __builtin_clzll(Repetitions)] += Fires;
+}
 
-    // XXX We should implement a shitty debugger.
-    hexdump_only("popped symbol", deleted.Data, System->SymbolSize);
+//
+// If the run we just popped was everything in the queue then pushing a chain
+// link's appendant leaves a single run of ChainNext's symbol, and as long as
+// that is a whole number of buckets it is exactly what the next step pops,
+// again with nothing else queued. Those steps can be done with arithmetic on
+// the repetition count alone. They still count against the budget and are
+// reported through Skipped, and each link is counted as a step of its rule.
+// This returns the rule for the step that is left to actually perform, with
+// Repetitions updated to match.
+//
+// N.B., we only do this when the queue is otherwise empty. With other runs
+// queued the links are interleaved with them one generation at a time and
+// running ours ahead would change the order of their I/O and, with odd-length
+// appendants, which of their symbols get deleted.
+//
+static
+inline
+TagRule *
+TagFollowChain(
+    TagSystem *System,
+    TagRule *Rule,
+    uint64_t *Repetitions,
+    uint64_t Budget,
+    uint64_t *Skipped
+    )
+{
+    uint64_t reps = *Repetitions;
+    uint64_t skipped = 0;
+    uint64_t symbols;
 
-    hash = tommy_hash_u64(0, deleted.Data, System->SymbolSize);
-    rule = (TagRule *) tommy_hashlin_search(
-                        &System->Productions,
-                        TagRuleCompare,
-                        &deleted,
-                        hash);
-    if (rule == NULL)
+    if (!TagQueueIsEmpty(&System->Tape))
     {
-        status = TAGSS_BADRULE;
-        TagWarnx("tommy_hashtable_search: Invalid address");
-        goto Bail;
+        return Rule;
     }
 
-    assert(rule->Style >= IoSel_Min && rule->Style < IoSel_Max);
+    while (Rule->ChainNext != NULL && skipped + 1 < Budget)
+    {
+        if (__builtin_mul_overflow(reps, Rule->ChainMultiplier, &symbols) ||
+            (symbols % System->AbstractDeletionNumber) != 0)
+        {
+            //
+            // Either the count no longer fits or the run doesn't end on a
+            // bucket boundary, in which case the partial bucket would be
+            // popped along with it. Let the queue sort it out.
+            //
+            break;
+        }
+
+        if (Rule->ChainNext == Rule &&
+            symbols / System->AbstractDeletionNumber == reps)
+        {
+            //
+            // This step reproduces itself exactly so the rest of the budget
+            // looks just like it.
+            //
+            TagCountFires(System, Rule, reps, Budget - 1 - skipped);
+            skipped = Budget - 1;
+            break;
+        }
 
-    //TagRuleDump(rule);
+        reps = symbols / System->AbstractDeletionNumber;
+        Rule = Rule->ChainNext;
+        ++skipped;
 
-    switch (rule->Style) {
+        TagCountFires(System, Rule, reps, 1);
+    }
+
+    TagTrace("Chain: %lu steps\n", skipped);
+
+    *Repetitions = reps;
+    *Skipped = skipped;
+
+    return Rule;
+}
+
+//
+// Does the rule's I/O and picks the appendant it leaves us with.
+//
+static
+inline
+STATUS
+TagSelectAppendant(
+    TagSystem *System,
+    TagRule *Rule,
+    Blob **Appendant
+    )
+{
+    STATUS status = ENV_OK;
+    Blob *appendant;
+    bool input;
+
+    assert(Rule->Style >= IoSel_Min && Rule->Style < IoSel_Max);
+
+    switch (Rule->Style) {
     case IoSel_Pure:
-        appendant = rule->Pure.Appendant;
+        appendant = &Rule->Pure.Appendant;
         break;
 
     case IoSel_Input:
-        status = IoBufferGetBit(&System->Io, &input);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
+        CHECK(status = IoBufferGetBit(&System->Io, &input));
 
         if (input)
         {
-            appendant = rule->In.Appendant1;
+            appendant = &Rule->In.Appendant1;
         }
         else
         {
-            appendant = rule->In.Appendant0;
+            appendant = &Rule->In.Appendant0;
         }
         break;
 
     case IoSel_Output:
-        status = IoBufferPutBit(&System->Io, rule->Out.Bit);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
-
-        appendant = rule->Out.Appendant;
+        CHECK(status = IoBufferPutBit(&System->Io, Rule->Out.Bit));
 
+        appendant = &Rule->Out.Appendant;
         break;
 
     case IoSel_Max:
@@ -239,46 +970,328 @@ TagStep(
         assert(false);
 
         status = ENV_FAILURE;
-        warn("TagStep: Malformed rule with invalid enum %x", rule->Style);
+        warn("TagStep: Malformed rule with invalid enum %x", Rule->Style);
         goto Bail;
     }
 
-    if (appendant.Size == 0)
+    if (appendant->Size == 0)
     {
-        status = TAGSS_HALT;
-        goto Bail;
+        BAIL(status = TAGSS_HALT);
     }
 
-    TagPrint("Rep: %lu\n", reps);
-    hexdump_only("pushed appendant", appendant.Data, appendant.Size);
-    TagPrint("\n");
+    *Appendant = appendant;
 
-    status = TagQueuePush(
+Bail:
+    return status;
+}
+
+//
+// TagFire for a run whose length doesn't fit in 64 bits. These only show up
+// with BigCounts on and never take part in chains.
+//
+static
+STATUS
+TagFireBig(
+    TagSystem *System
+    )
+{
+    STATUS status = ENV_OK;
+    TagRule *rule;
+    Blob deleted;
+    Blob *appendant;
+    BigCount *bigReps = NULL;
+    uint64_t reps = 0;
+
+    status = TagQueuePopBig(
                 &System->Tape,
-                &appendant,
-                reps);
+                &deleted,
+                &reps,
+                &bigReps);
     if (FAILED(status))
     {
+        BAIL(status = TAGSS_OUTOFTAPE);
+    }
+
+    rule = TagLookupRule(System, &deleted);
+    if (rule == NULL)
+    {
+        BAIL(status = TAGSS_BADRULE);
+    }
+
+    //
+    // A run too long for 64 bits shows up as UINT64_MAX repetitions, and in
+    // the last of the run lengths.
+    //
+    if (bigReps != NULL)
+    {
+        System->Firing = rule;
+        ++rule->Fires;
+        rule->Repetitions = UINT64_MAX;
+        ++System->RunLengths[TAG_RUN_LENGTH_BUCKETS - 1];
+    }
+    else
+    {
+        TagCountFires(System, rule, reps, 1);
+    }
+
+    TagProbe3(fire, deleted.Data, bigReps != NULL ? UINT64_MAX : reps, rule->Style);
+    TagTraceEvent(TagEvent_Fire,
+            rule->Style,
+            TagSymbolValue(deleted.Data, System->SymbolSize),
+            bigReps != NULL ? UINT64_MAX : reps);
+
+    CHECK(status = TagSelectAppendant(System, rule, &appendant));
+
+    if (bigReps != NULL)
+    {
+        TagTrace("Rep: %lu bits\n", BigCountBits(bigReps));
+
+        status = TagQueuePushBig(
+                    &System->Tape,
+                    appendant,
+                    bigReps);
+    }
+    else
+    {
+        status = TagQueuePush(
+                    &System->Tape,
+                    appendant,
+                    reps);
+    }
+
+Bail:
+    BigCountFree(bigReps);
+
+    return status;
+}
+
+//
+// The body of a single step. TagStep and TagRun's inner loop both come through
+// here so nothing that isn't needed to make progress belongs in it. Up to
+// Budget - 1 steps may be taken arithmetically before it (see TagFollowChain)
+// and those are added to Skipped whether or not this step succeeds.
+//
+static
+inline
+STATUS
+TagFire(
+    TagSystem *System,
+    uint64_t Budget,
+    uint64_t *Skipped
+    )
+{
+    STATUS status = ENV_OK;
+    TagRule *rule;
+    Blob deleted;
+    Blob *appendant;
+    uint64_t reps;
+
+    status = TagQueuePop(
+                &System->Tape,
+                &deleted,
+                &reps);
+    if (status == TAGQ_BIG_RUN)
+    {
+        CHECK(status = TagFireBig(System));
         goto Bail;
     }
+    if (FAILED(status))
+    {
+        BAIL(status = TAGSS_OUTOFTAPE);
+    }
+    assert(deleted.Size == System->SymbolSize);
+    assert(reps > 0);
+
+    TagTraceDump("popped symbol", deleted.Data, System->SymbolSize);
+
+    rule = TagLookupRule(System, &deleted);
+    if (rule == NULL)
+    {
+        BAIL(status = TAGSS_BADRULE);
+    }
+
+    TagCountFires(System, rule, reps, 1);
+
+    TagProbe3(fire, deleted.Data, reps, rule->Style);
+    TagTraceEvent(TagEvent_Fire,
+            rule->Style,
+            TagSymbolValue(deleted.Data, System->SymbolSize),
+            reps);
+
+    if (rule->ChainNext != NULL && Budget > 1)
+    {
+        rule = TagFollowChain(System, rule, &reps, Budget, Skipped);
+    }
+
+    CHECK(status = TagSelectAppendant(System, rule, &appendant));
+
+    TagTrace("Rep: %lu\n", reps);
+    TagTraceDump("pushed appendant", appendant->Data, appendant->Size);
+    TagTrace("\n");
+
+    status = TagQueuePush(
+                &System->Tape,
+                appendant,
+                reps);
 
 Bail:
     return status;
 }
 
 STATUS
-TagRun(
+TagStep(
     TagSystem *System
- /*   Debugger *Dbg */
     )
 {
     STATUS status = ENV_OK;
+    uint64_t skipped = 0;
 
-    (void) System;
+    status = TagFire(System, 1, &skipped);
+    if (status == TAGSS_OUTOFTAPE)
+    {
+        TagWarnx("TagQueuePop: Queue empty?");
+    }
+    else if (status == TAGSS_BADRULE)
+    {
+        TagWarnx("TagLookupRule: Invalid address");
+    }
+
+    return status;
+}
+
+STATUS
+TagRun(
+    TagSystem *System,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t steps;
+    uint64_t cycleMark = 0;
+    uint64_t statsMark = 0;
+    uint64_t checkpointMark = 0;
 
-    goto Bail;
+    assert(System != NULL);
+    assert(StepsTaken != NULL);
+
+    for (steps = 0; steps < MaxSteps; ++steps)
+    {
+        uint64_t skipped = 0;
+
+        if (System->Stats != NULL &&
+            steps - statsMark >= System->Stats->Interval)
+        {
+            TagStatsStep(System->Stats, steps - statsMark);
+            statsMark = steps;
+        }
+
+        if (System->Checkpoint != NULL &&
+            (steps - checkpointMark >= System->Checkpoint->Interval ||
+             System->Checkpoint->Requested))
+        {
+            TagCheckpointStep(System->Checkpoint, steps - checkpointMark);
+            checkpointMark = steps;
+        }
+
+        if (System->Cycle != NULL)
+        {
+            uint64_t taken;
+
+            status = TagCycleStep(System->Cycle, steps - cycleMark, MaxSteps - steps, &taken);
+            cycleMark = steps;
+            if (FAILED(status))
+            {
+                break;
+            }
+
+            if (taken > 0)
+            {
+                cycleMark += taken;
+                steps += taken - 1;
+                continue;
+            }
+        }
+
+        if (System->Parallel != NULL)
+        {
+            uint64_t taken;
+
+            status = TagParallelStep(System->Parallel, MaxSteps - steps, &taken);
+            if (FAILED(status))
+            {
+                break;
+            }
+
+            if (taken > 0)
+            {
+                steps += taken - 1;
+                continue;
+            }
+        }
+
+        if (System->Wang != NULL)
+        {
+            uint64_t taken;
+
+            status = TagWangStep(System->Wang, MaxSteps - steps, &taken);
+            if (FAILED(status))
+            {
+                break;
+            }
+
+            if (taken > 0)
+            {
+                steps += taken - 1;
+                continue;
+            }
+        }
+
+        if (System->Memo != NULL)
+        {
+            uint64_t taken;
+
+            status = TagMemoStep(System->Memo, MaxSteps - steps, &taken);
+            if (FAILED(status))
+            {
+                break;
+            }
+
+            if (taken > 0)
+            {
+                steps += taken - 1;
+                continue;
+            }
+        }
+
+        status = TagFire(System, MaxSteps - steps, &skipped);
+        steps += skipped;
+        if (FAILED(status))
+        {
+            break;
+        }
+    }
+
+    if (System->Cycle != NULL)
+    {
+        //
+        // Let it know about the steps since it last looked.
+        //
+        System->Cycle->Clock += steps - cycleMark;
+    }
+
+    if (System->Stats != NULL)
+    {
+        System->Stats->Clock += steps - statsMark;
+    }
+
+    if (System->Checkpoint != NULL)
+    {
+        System->Checkpoint->Clock += steps - checkpointMark;
+    }
+
+    *StepsTaken = steps;
 
-Bail:
     return status;
 }
 
@@ -16,6 +16,108 @@
 #define TAGSS_HALT              (TAGSS_STATUS(5))
 #define TAGSS_DUPERULE          (TAGSS_STATUS(6))
 
+//
+// Symbols up to this many bytes wide are looked up through a flat array
+// indexed by the symbol's value rather than through the hash table.
+//
+#define TAG_DENSE_INDEX_MAX_SYMBOLSIZE  3
+
+//
+// A minimal perfect hash over the values (see TagSymbolValue) of the rules'
+// symbols, computed by the assembler. Each rule has a slot of its own, found
+// with TagPerfectHashSlot, and Slots[slot] is that rule's position among the
+// rules handed to TagInitialize. Any other value lands on some rule's slot,
+// so whoever looks a symbol up has to check it against the rule found.
+//
+// This is the "hash and displace" scheme: a key's first hash picks a bucket
+// and its second, perturbed by the bucket's displacement, picks the slot.
+// The assembler searches out displacements that leave no two keys sharing a
+// slot. Both hashes only ever look at the value and the seed so any writer
+// can reproduce them.
+//
+typedef struct _TagPerfectHash
+{
+    uint64_t Seed;
+    const uint32_t *Displacements;
+    uint64_t BucketCount;
+    const uint32_t *Slots;
+    uint64_t SlotCount;
+} TagPerfectHash;
+
+#define TAG_PERFECT_HASH_DISPLACE   0x9e3779b97f4a7c15ULL
+
+//
+// MurmurHash3's 64-bit finalizer.
+//
+static
+inline
+uint64_t
+TagHashMix(
+    uint64_t X
+    )
+{
+    X ^= X >> 33;
+    X *= 0xff51afd7ed558ccdULL;
+    X ^= X >> 33;
+    X *= 0xc4ceb9fe1a85ec53ULL;
+    X ^= X >> 33;
+
+    return X;
+}
+
+static
+inline
+uint64_t
+TagPerfectHashSlot(
+    const TagPerfectHash *Hash,
+    uint64_t Value
+    )
+{
+    uint64_t h, bucket;
+
+    //
+    // Both counts are below 2^32 so scaling the top half of a hash by them
+    // picks one without dividing.
+    //
+    h = TagHashMix(Value ^ Hash->Seed);
+    bucket = ((h >> 32) * Hash->BucketCount) >> 32;
+    h = TagHashMix(h + Hash->Displacements[bucket] * TAG_PERFECT_HASH_DISPLACE);
+
+    return ((h >> 32) * Hash->SlotCount) >> 32;
+}
+
+//
+// A program file mapped into memory, along with anything in it we can use as
+// is.
+//
+typedef struct _TagImage
+{
+    uint8_t *Data;
+    uint64_t Size;
+    //
+    // Optional. For every symbol value below IndexSize, the position in the
+    // rules handed to TagInitialize of the rule for that symbol, or
+    // TAG_IMAGE_NO_RULE. It must agree with the rules exactly (ReadBinaryFile
+    // checks this) and stands in for sorting them to find rules by symbol.
+    //
+    const uint32_t *Index;
+    uint64_t IndexSize;
+    //
+    // Optional. SlotCount is 0 when there isn't one. Only used to look rules
+    // up when there is no Index and the symbols are too wide for a dense one
+    // of our own. Again it must agree with the rules exactly.
+    //
+    TagPerfectHash Hash;
+} TagImage;
+
+#define TAG_IMAGE_NO_RULE   UINT32_MAX
+
+//
+// Popped runs are counted by the power of two their length falls under, with
+// one more bucket for runs too long for 64 bits.
+//
+#define TAG_RUN_LENGTH_BUCKETS  65
+
 /*
  * We want to be able to run programs with a TON of productions. This means
  * that using a char to represent the symbols will not suffice. We will instead
@@ -26,29 +128,153 @@
  * that we need to verify appendants are multiples of the symbol size.
  */
 
+struct _TagSystem;
+
+typedef TagRule *(*LookupRuleFn)(struct _TagSystem *, Blob *);
+
 typedef struct _TagSystem
 {
     //
-    // This can be thought of as code.
+    // This can be thought of as code. Every rule lives in the Rules array,
+    // ordered so that a rule sits close to the rules for the symbols it
+    // appends, and every rule's symbol and appendants are packed into
+    // RulePool in the same order. Rules and RulePool are each a single
+    // allocation. RulePool is NULL when the rules point into Image instead.
+    //
+    TagRule *Rules;
+    uint64_t RuleCount;
+    uint8_t *RulePool;
+    uint64_t RulePoolSize;
+    //
+    // Looks rules up by symbol when neither of the indexes below applies.
+    // Empty otherwise.
     //
     tommy_hashlin Productions;
     //
+    // A direct-indexed view of Productions for narrow symbols. The symbol's
+    // (little-endian) value is the index. This is NULL when the symbols are
+    // too wide in which case we fall back to hashing.
+    //
+    TagRule **RuleIndex;
+    uint64_t RuleIndexSize;
+    //
+    // Without RuleIndex, and when the program came with a perfect hash
+    // (Image.Hash), the rule in each of its slots.
+    //
+    TagRule **HashRules;
+    //
+    // Finds the rule for a symbol through whichever of the above applies.
+    // Picked once by TagInitialize, specialized for SymbolSize where we can.
+    //
+    LookupRuleFn LookupRule;
+    //
     // This can be thought of as data.
     //
     TagQueue Tape;
 
     Blob InitialQueue;
 
+    //
+    // Optional. The mapped program file, when the rules and InitialQueue were
+    // handed to us pointing into it. Unmapped at teardown.
+    //
+    TagImage Image;
+
     uint32_t AbstractDeletionNumber;    // The deletion number without taking into account the byte-count of the symbols involved.
     uint32_t SymbolSize;    // The byte-count of the symbols involved.
 
     IoBuffer Io;
 
+    //
+    // Optional. When set, TagRun tries to take whole segments of steps at a
+    // time from here before falling back to single steps. See TagMemo.h.
+    //
+    struct _TagMemo *Memo;
+
+    //
+    // Optional. When set, TagRun hands long spans of pure rules to worker
+    // threads. See TagParallel.h.
+    //
+    struct _TagParallel *Parallel;
+
+    //
+    // Optional. When set, TagRun runs whole W-machine instructions at once
+    // whenever the queue is in their canonical form. See TagWang.h.
+    //
+    struct _TagWang *Wang;
+
+    //
+    // Optional. When set, TagRun checks every configuration it passes through
+    // for one it has been in before. See TagCycle.h.
+    //
+    struct _TagCycle *Cycle;
+
+    //
+    // Optional. When set, TagRun samples the queue for it every so often.
+    // See TagStats.h.
+    //
+    struct _TagStats *Stats;
+
+    //
+    // Optional. When set, TagRun has it take a snapshot of the system every
+    // so often. See TagCheckpoint.h.
+    //
+    struct _TagCheckpointer *Checkpoint;
+
+    //
+    // The rule TagFire last looked up, or the chain link TagFollowChain is
+    // on, for the profiler's signal handler to read (see TagProfile.h).
+    // Storing it is cheaper than deciding whether to.
+    //
+    TagRule *volatile Firing;
+
+    //
+    // Statistics. Always kept, as they are next to free. RunLengths[i] counts
+    // the steps that fired on a run from 2^i up to 2^(i+1) buckets long, chain
+    // links included; the last counts runs too long for 64 bits. The rules
+    // count themselves.
+    //
+    uint64_t RunLengths[TAG_RUN_LENGTH_BUCKETS];
+
     //
     // TODO add some state here such as RUNNING, DEBUGGING, etc
     //
 } TagSystem;
 
+static
+inline
+uint64_t
+TagSymbolValue(
+    uint8_t *Symbol,
+    uint32_t SymbolSize
+    )
+{
+    uint64_t value = 0;
+    uint32_t i;
+
+    //
+    // The assembler serializes each symbol as a little-endian integer
+    // truncated to SymbolSize bytes.
+    //
+    for (i = SymbolSize; i > 0; --i)
+    {
+        value = (value << 8) | Symbol[i - 1];
+    }
+
+    return value;
+}
+
+static
+inline
+TagRule *
+TagLookupRule(
+    TagSystem *System,
+    Blob *Symbol
+    )
+{
+    return System->LookupRule(System, Symbol);
+}
+
 STATUS
 TagInitialize(
     TagSystem *System,
@@ -56,7 +282,8 @@ TagInitialize(
     uint64_t RuleSize,
     Blob *DefaultQueue,
     uint32_t AbstractDeletionNumber,
-    IoBufferConfig *Io
+    IoBufferConfig *Io,
+    TagImage *Image
     );
 
 void
@@ -64,13 +291,23 @@ TagTeardown(
     TagSystem *System
     );
 
-/*
-
+//
+// Runs until the system stops or MaxSteps steps have completed, whichever
+// comes first. StepsTaken receives the number of completed steps. ENV_OK
+// means the budget ran out and another call picks up where this one left off.
+// Anything else is the status of the step that stopped us (TAGSS_HALT,
+// TAGSS_OUTOFTAPE, TAGSS_BADRULE, an IoBuffer error, ...) and that step is not
+// counted.
+//
 STATUS
 TagRun(
-    TagSystem *System
+    TagSystem *System,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
     );
 
+/*
+
 // states include: PAUSE, STOP, RUN
 void
 TagStateChange(
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,10 +9,10 @@
 #include <err.h>
 #include <errno.h>
 #include <unistd.h>
-#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 
 #include "Util.h"
@@ -19,12 +20,6 @@
 #include "Tag.h"
 #include "TagRule.h"
 #include "IoBuffer.h"
-#include "Debug.h"
-
-void
-TagBinTeardown(
-    TagBin *Binary
-    );
 
 STATUS
 TagBinRead(
@@ -58,6 +53,25 @@ TagBinRead(
     return status;
 }
 
+//
+// Reads one of a version 1 rule's 16-bit sizes.
+//
+static
+STATUS
+TagBinReadSize(
+    int fd,
+    uint32_t *Size
+    )
+{
+    STATUS status;
+    uint16_t size;
+
+    status = TagBinRead(fd, &size, sizeof(size));
+    *Size = size;
+
+    return status;
+}
+
 STATUS
 ReadBinaryRules(
     int fd,
@@ -99,9 +113,7 @@ ReadBinaryRules(
 
         switch (rule->Header.Style) {
         case IoSel_Pure:
-            status = TagBinRead(fd,
-                        &rule->Header.Pure,
-                        sizeof(rule->Header.Pure));
+            status = TagBinReadSize(fd, &rule->Header.Pure.AppendantSize);
             if (FAILED(status))
             {
                 TagWarnx("read wrong size for rule property header");
@@ -117,9 +129,11 @@ ReadBinaryRules(
             break;
 
         case IoSel_Input:
-            status = TagBinRead(fd,
-                        &rule->Header.In,
-                        sizeof(rule->Header.In));
+            status = TagBinReadSize(fd, &rule->Header.In.Appendant0Size);
+            if (!FAILED(status))
+            {
+                status = TagBinReadSize(fd, &rule->Header.In.Appendant1Size);
+            }
             if (FAILED(status))
             {
                 TagWarnx("read wrong size for rule property header");
@@ -141,9 +155,7 @@ ReadBinaryRules(
             break;
 
         case IoSel_Output:
-            status = TagBinRead(fd,
-                        &rule->Header.Out,
-                        sizeof(rule->Header.Out));
+            status = TagBinReadSize(fd, &rule->Header.Out.AppendantSize);
             if (FAILED(status))
             {
                 TagWarnx("read wrong size for rule property header");
@@ -293,48 +305,127 @@ Bail:
     return status;
 }
 
-STATUS
-ReadBinaryFile(
-    int fd,
-    TagBin *Binary
+//
+// Hands out the next Size bytes of the image, or NULL if there aren't that
+// many left.
+//
+static
+inline
+uint8_t *
+TagBinTake(
+    TagBin *Binary,
+    uint64_t *Offset,
+    uint64_t Size
     )
 {
-    STATUS status;
+    uint8_t *data;
 
-    status = 0;
+    if (Size > Binary->ImageSize - *Offset)
+    {
+        return NULL;
+    }
 
-    Binary->Rules = NULL;
-    Binary->Queue = NULL;
+    data = &Binary->Image[*Offset];
+    *Offset += Size;
 
-    status = TagBinRead(fd, &Binary->Header, sizeof(Binary->Header));
-    if (FAILED(status))
+    return data;
+}
+
+//
+// Like TagBinTake for one of a version 1 rule's 16-bit sizes.
+//
+static
+bool
+TagBinTakeSize(
+    TagBin *Binary,
+    uint64_t *Offset,
+    uint32_t *Size
+    )
+{
+    uint16_t size;
+    uint8_t *data;
+
+    data = TagBinTake(Binary, Offset, sizeof(size));
+    if (data == NULL)
     {
-        TagWarnx("Read wrong size for header");
-        goto Bail;
+        return false;
     }
 
-    if ((Binary->Header.QueueSize % Binary->Header.SymbolSize) != 0)
+    memcpy(&size, data, sizeof(size));
+    *Size = size;
+
+    return true;
+}
+
+//
+// The checks on the header every version and every way of reading it share.
+//
+static
+STATUS
+TagBinCheckHeader(
+    TagBinHeader *Header
+    )
+{
+    STATUS status = ENV_OK;
+
+    if (Header->SymbolSize == 0 ||
+        (Header->QueueSize % Header->SymbolSize) != 0)
     {
         status = ENV_BADLEN;
         TagWarnx("invalid QueueSize");
         goto Bail;
     }
 
-    if (Binary->Header.DeletionNumber < 2)
+    if (Header->DeletionNumber < 2)
     {
         status = TAGSS_BADDELETIONNUMBER;
-        TagWarnx("invalid deletion number: %u", Binary->Header.DeletionNumber);
+        TagWarnx("invalid deletion number: %u", Header->DeletionNumber);
+        goto Bail;
+    }
+
+Bail:
+    return status;
+}
+
+//
+// The same checks as ReadBinaryFile and ReadBinaryRules make, but on a version
+// 1 image and with everything pointing into it.
+//
+static
+STATUS
+TagBinMap1(
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t offset = 0;
+    uint64_t i;
+    uint32_t appendants = 0;
+    uint8_t *data;
+    bool taken = false;
+
+    data = TagBinTake(Binary, &offset, sizeof(Binary->Header));
+    if (data == NULL)
+    {
+        status = ENV_EOF;
+        TagWarnx("truncated header");
         goto Bail;
     }
+    memcpy(&Binary->Header, data, sizeof(Binary->Header));
+
+    CHECK(status = TagBinCheckHeader(&Binary->Header));
 
     //
-    // N.B., We rely on the fact that calloc zeroes the data before handing it
-    // back to us. This means that if an error occurs we will interpret the
-    // zeroed data as NULL pointers and can safely call free on them. This
-    // simplifies the amount of bookkeeping necessary.
-    // XXX This is not stricly compliant as NULL is *not* guaranteed to have
-    // the representation of all zeroes. Man, C sucks.
+    // Every rule takes up at least its style, its sizes and its symbol, so
+    // anything claiming more rules than that can't be right and we don't
+    // want to allocate for it.
     //
+    if (Binary->Header.RuleCount > Binary->ImageSize / (sizeof(uint8_t) + sizeof(uint16_t) + Binary->Header.SymbolSize))
+    {
+        status = ENV_BADLEN;
+        TagWarnx("RuleCount (%lu) too large for the file", Binary->Header.RuleCount);
+        goto Bail;
+    }
 
     Binary->Rules = calloc(Binary->Header.RuleCount, sizeof(*Binary->Rules));
     if (Binary->Rules == NULL)
@@ -344,546 +435,958 @@ ReadBinaryFile(
         goto Bail;
     }
 
-    Binary->Queue = malloc(Binary->Header.QueueSize);
-    if (Binary->Queue == NULL)
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
     {
-        status = ENV_OOM;
-        TagWarn("malloc Queue");
-        goto Bail;
-    }
+        TagBinRule *rule = &Binary->Rules[i];
 
-    status = ReadBinaryRules(fd, &Binary->Header, Binary->Rules);
-    if (FAILED(status))
-    {
-        goto Bail;
+        data = TagBinTake(Binary, &offset, sizeof(rule->Header.Style));
+        if (data == NULL)
+        {
+            status = ENV_EOF;
+            TagWarnx("truncated rule header #%lu", i);
+            goto Bail;
+        }
+        rule->Header.Style = *data;
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            taken = TagBinTakeSize(Binary, &offset, &rule->Header.Pure.AppendantSize);
+            appendants = rule->Header.Pure.AppendantSize;
+            break;
+
+        case IoSel_Input:
+            taken = TagBinTakeSize(Binary, &offset, &rule->Header.In.Appendant0Size) &&
+                    TagBinTakeSize(Binary, &offset, &rule->Header.In.Appendant1Size);
+            if (taken &&
+                (rule->Header.In.Appendant0Size % Binary->Header.SymbolSize) != 0)
+            {
+                status = ENV_BADLEN;
+                TagWarnx("invalid Appendant0Size for rule symbol #%lu", i);
+                goto Bail;
+            }
+            appendants = rule->Header.In.Appendant1Size;
+            break;
+
+        case IoSel_Output:
+            taken = TagBinTakeSize(Binary, &offset, &rule->Header.Out.AppendantSize);
+            appendants = rule->Header.Out.AppendantSize;
+            break;
+
+        default:
+            status = ENV_BADENUM;
+            TagWarnx("invalid enum for rule #%lu: %x", i, rule->Header.Style);
+            goto Bail;
+        }
+
+        if (!taken)
+        {
+            status = ENV_EOF;
+            TagWarnx("truncated rule property header #%lu", i);
+            goto Bail;
+        }
+
+        if ((appendants % Binary->Header.SymbolSize) != 0)
+        {
+            status = ENV_BADLEN;
+            TagWarnx("invalid AppendantSize for rule symbol #%lu", i);
+            goto Bail;
+        }
+
+        rule->RawSymbol = TagBinTake(Binary, &offset, Binary->Header.SymbolSize);
+        if (rule->RawSymbol == NULL)
+        {
+            status = ENV_EOF;
+            TagWarnx("truncated rule symbol #%lu", i);
+            goto Bail;
+        }
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            rule->Pure.RawAppendant = TagBinTake(Binary, &offset, rule->Header.Pure.AppendantSize);
+            data = rule->Pure.RawAppendant;
+            break;
+
+        case IoSel_Input:
+            rule->In.RawAppendant0 = TagBinTake(Binary, &offset, rule->Header.In.Appendant0Size);
+            rule->In.RawAppendant1 = TagBinTake(Binary, &offset, rule->Header.In.Appendant1Size);
+            data = (rule->In.RawAppendant0 != NULL) ? rule->In.RawAppendant1 : NULL;
+            break;
+
+        case IoSel_Output:
+            rule->Out.RawAppendant = TagBinTake(Binary, &offset, rule->Header.Out.AppendantSize);
+            data = TagBinTake(Binary, &offset, sizeof(rule->Out.Bit));
+            if (rule->Out.RawAppendant == NULL)
+            {
+                data = NULL;
+            }
+            else if (data != NULL)
+            {
+                rule->Out.Bit = *data;
+            }
+            break;
+        }
+
+        if (data == NULL)
+        {
+            status = ENV_EOF;
+            TagWarnx("truncated rule body #%lu", i);
+            goto Bail;
+        }
     }
 
-    status = TagBinRead(fd, Binary->Queue, Binary->Header.QueueSize);
-    if (FAILED(status))
+    Binary->Queue = TagBinTake(Binary, &offset, Binary->Header.QueueSize);
+    if (Binary->Queue == NULL)
     {
-        TagWarnx("read wrong size for queue");
+        status = ENV_EOF;
+        TagWarnx("truncated queue");
         goto Bail;
     }
 
 Bail:
-    if (FAILED(status))
+    return status;
+}
+
+//
+// Size bytes at Offset into a version 2 data section, or NULL if they aren't
+// all there.
+//
+static
+inline
+uint8_t *
+TagBinData(
+    TagBin2Section *Data,
+    uint8_t *Image,
+    uint32_t Offset,
+    uint64_t Size
+    )
+{
+    if (Offset > Data->Size || Size > Data->Size - Offset)
     {
-#if 1 /* XXX this is commented only for dumping! */
-        TagBinTeardown(Binary);
-#endif
+        return NULL;
     }
 
-    return status;
+    return &Image[Data->Offset + Offset];
 }
 
-void
-TagBinTeardown(
+//
+// Makes sure the index and the rules agree on every symbol, which also rules
+// out two rules for the same symbol.
+//
+static
+STATUS
+TagBinCheckIndex(
     TagBin *Binary
     )
 {
-    uint64_t i;
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    uint64_t i, value;
+    uint32_t rule;
 
-    if (Binary->Rules)
+    for (i = 0; i < Binary->IndexSize; ++i)
     {
-        for (i = 0; i < Binary->Header.RuleCount; ++i)
+        rule = Binary->Index[i];
+        if (rule == TAG_IMAGE_NO_RULE)
         {
-            free(Binary->Rules[i].RawSymbol);
+            continue;
+        }
 
-            switch (Binary->Rules[i].Header.Style) {
-            case IoSel_Pure:
-                free(Binary->Rules[i].Pure.RawAppendant);
-                break;
+        if (rule >= Binary->Header.RuleCount ||
+            TagSymbolValue(Binary->Rules[rule].RawSymbol, symbolSize) != i)
+        {
+            status = ENV_BADARG;
+            TagWarnx("index entry %lu doesn't match rule %u", i, rule);
+            goto Bail;
+        }
+    }
 
-            case IoSel_Input:
-                free(Binary->Rules[i].In.RawAppendant0);
-                free(Binary->Rules[i].In.RawAppendant1);
-                break;
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        value = TagSymbolValue(Binary->Rules[i].RawSymbol, symbolSize);
+        if (value >= Binary->IndexSize || Binary->Index[value] != i)
+        {
+            status = TAGSS_DUPERULE;
+            TagWarnx("rule #%lu isn't in the index", i);
+            goto Bail;
+        }
+    }
 
-            case IoSel_Output:
-                free(Binary->Rules[i].Out.RawAppendant);
-                break;
+Bail:
+    return status;
+}
 
-            default:
-                assert(false);
-                break;
-            }
+//
+// Makes sure every rule hashes to the slot that holds it. There are as many
+// slots as rules so that also makes the slots a permutation of the rules and
+// rules out two rules for one symbol.
+//
+static
+STATUS
+TagBinCheckHash(
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    uint64_t slot, value;
+    uint32_t rule;
+
+    for (slot = 0; slot < Binary->Hash.SlotCount; ++slot)
+    {
+        rule = Binary->Hash.Slots[slot];
+        if (rule >= Binary->Header.RuleCount)
+        {
+            status = ENV_BADARG;
+            TagWarnx("hash slot %lu holds rule #%u of %lu", slot, rule, Binary->Header.RuleCount);
+            goto Bail;
+        }
+
+        value = TagSymbolValue(Binary->Rules[rule].RawSymbol, symbolSize);
+        if (TagPerfectHashSlot(&Binary->Hash, value) != slot)
+        {
+            status = TAGSS_DUPERULE;
+            TagWarnx("rule #%u isn't in its hash slot", rule);
+            goto Bail;
         }
-        free(Binary->Rules);
-        Binary->Rules = NULL;
     }
 
-    free(Binary->Queue);
-    Binary->Queue = NULL;
+Bail:
+    return status;
 }
 
-void
-TagBinDump(
+//
+// Checks a version 2 image and points everything into it.
+//
+static
+STATUS
+TagBinMap2(
     TagBin *Binary
     )
 {
-    uint64_t i, level = 0;
+    STATUS status = ENV_OK;
+    TagBin2Section *sections[TagBin2Section_Max] = { NULL };
+    TagBin2Section *section, *data;
+    TagBin2Header *header;
+    TagBin2Rule *raw;
+    uint64_t i;
+    bool found;
 
-    TagPrint("Header:\n");
-    ++level;
+    if (Binary->ImageSize < sizeof(*header))
     {
-        TagPrint("RuleCount: %lu\n", Binary->Header.RuleCount);
-        TagPrint("SymbolSize: %u\n", Binary->Header.SymbolSize);
-        TagPrint("QueueSize: %u\n", Binary->Header.QueueSize);
-        TagPrint("DeletionNumber: %u\n", Binary->Header.DeletionNumber);
+        status = ENV_EOF;
+        TagWarnx("truncated header");
+        goto Bail;
+    }
 
-        TagPrint("\n");
+    //
+    // Images are page aligned and so is everything in them.
+    //
+    header = (TagBin2Header *) Binary->Image;
 
-        TagPrint("Rules:\n");
-        ++level;
-        {
-            for (i = 0; i < Binary->Header.RuleCount; ++i) {
-                TagBinRule *rule = &Binary->Rules[i];
+    if (header->Version != TAGBIN2_VERSION)
+    {
+        status = ENV_BADENUM;
+        TagWarnx("unsupported version %u", header->Version);
+        goto Bail;
+    }
+    Binary->Version = header->Version;
 
-                TagPrint("Rule #%lu Header:\n", i);
-                ++level;
-                {
-                    char *name = "Invalid";
-                    if (rule->Header.Style < IoSel_Max)
-                    {
-                        name = IoSelectorNames[rule->Header.Style];
-                    }
-                    TagPrint("Style: %x (%s)\n", rule->Header.Style, name);
+    if (header->SectionCount > (Binary->ImageSize - sizeof(*header)) / sizeof(*section))
+    {
+        status = ENV_EOF;
+        TagWarnx("truncated section table");
+        goto Bail;
+    }
 
-                    switch (rule->Header.Style) {
-                    case IoSel_Pure:
-                        TagPrint("Appendant Length: %x\n", rule->Header.Pure.AppendantSize);
-                        TagPrint("\n");
-                        break;
-
-                    case IoSel_Input:
-                        TagPrint("Appendant0 Length: %x\n", rule->Header.In.Appendant0Size);
-                        TagPrint("Appendant1 Length: %x\n", rule->Header.In.Appendant1Size);
-                        TagPrint("\n");
-                        break;
-
-                    case IoSel_Output:
-                        TagPrint("Appendant Length: %x\n", rule->Header.Out.AppendantSize);
-                        TagPrint("\n");
-                        break;
-
-                    default:
-                        hexdump_only("Invalid Header", &rule->Header, sizeof(rule->Header));
-                        TagPrint("\n");
-                        break;
-                    }
-                    TagPrint("\n");
-
-                    // XXX we don't validate the shit at all :(
-                    hexdump_only("Raw symbol", rule->RawSymbol, Binary->Header.SymbolSize);
-                    TagPrint("\n");
-
-                    switch (rule->Header.Style) {
-                    case IoSel_Pure:
-                        // XXX we don't validate the shit at all :(
-                        hexdump_only("Appendant", rule->Pure.RawAppendant, rule->Header.Pure.AppendantSize);
-                        break;
-
-                    case IoSel_Input:
-                        // XXX we don't validate the shit at all :(
-                        hexdump_only("False Appendant", rule->In.RawAppendant0, rule->Header.In.Appendant0Size);
-                        hexdump_only("True Appendant", rule->In.RawAppendant1, rule->Header.In.Appendant1Size);
-                        break;
+    for (i = 0; i < header->SectionCount; ++i)
+    {
+        section = &((TagBin2Section *) (header + 1))[i];
 
-                    case IoSel_Output:
-                        // XXX we don't validate the shit at all :(
-                        hexdump_only("Appendant", rule->Out.RawAppendant, rule->Header.Out.AppendantSize);
-                        TagPrint("Bit: %s\n", rule->Out.Bit ? "True" : "False");
-                        break;
+        if ((section->Offset % TAGBIN2_ALIGNMENT) != 0 ||
+            section->Offset > Binary->ImageSize ||
+            section->Size > Binary->ImageSize - section->Offset)
+        {
+            status = ENV_BADLEN;
+            TagWarnx("section #%lu out of bounds", i);
+            goto Bail;
+        }
 
-                    default:
-                        //hexdump_only("Invalid Body", &rule->Header, sizeof(rule->Header));
-                        break;
-                    }
-                    TagPrint("\n");
+        if (section->Kind == 0 || section->Kind >= TagBin2Section_Max)
+        {
+            continue;
+        }
 
-                }
-                --level;
-            }
+        if (sections[section->Kind] != NULL)
+        {
+            status = ENV_BADARG;
+            TagWarnx("section #%lu repeats kind %u", i, section->Kind);
+            goto Bail;
         }
-        --level;
+        sections[section->Kind] = section;
     }
-    --level;
-}
 
-STATUS
-InstantiateTagSystemFromBinary(
-    TagBin *Binary,
-    TagSystem *System,
-    IoBufferConfig *Io
-    )
-{
-    TagRule *rules;
-    Blob *tape;
-    uint64_t i;
-    STATUS status = 0;
+    if (sections[TagBin2Section_Rules] == NULL ||
+        sections[TagBin2Section_Data] == NULL ||
+        sections[TagBin2Section_Queue] == NULL)
+    {
+        status = ENV_BADARG;
+        TagWarnx("missing rules, data or queue");
+        goto Bail;
+    }
 
-    rules = NULL;
-    tape = NULL;
+    if (sections[TagBin2Section_Queue]->Size > UINT32_MAX)
+    {
+        status = ENV_LENTOOBIG;
+        TagWarnx("queue too large (%lu)", sections[TagBin2Section_Queue]->Size);
+        goto Bail;
+    }
 
+    Binary->Header.RuleCount = header->RuleCount;
+    Binary->Header.SymbolSize = header->SymbolSize;
+    Binary->Header.QueueSize = (uint32_t) sections[TagBin2Section_Queue]->Size;
+    Binary->Header.DeletionNumber = header->DeletionNumber;
 
-    //
-    // Allocate space to store the rules. We use the fact that calloc zeroes
-    // this memory.
-    //
+    CHECK(status = TagBinCheckHeader(&Binary->Header));
 
-    rules = calloc(Binary->Header.RuleCount, sizeof(*rules));
-    if (rules == NULL)
+    if (Binary->Header.RuleCount > sections[TagBin2Section_Rules]->Size / sizeof(*raw) ||
+        Binary->Header.RuleCount * sizeof(*raw) != sections[TagBin2Section_Rules]->Size)
     {
-        status = ENV_OOM;
-        TagWarnx("calloc rules");
+        status = ENV_BADLEN;
+        TagWarnx("RuleCount (%lu) doesn't match the rules", Binary->Header.RuleCount);
         goto Bail;
     }
 
-
-    //
-    // Allocate space to store the tape.
-    //
-
-    tape = malloc(sizeof(*tape));
-    if (tape == NULL)
+    Binary->Rules = calloc(Binary->Header.RuleCount, sizeof(*Binary->Rules));
+    if (Binary->Rules == NULL)
     {
         status = ENV_OOM;
-        TagWarnx("malloc tape");
+        TagWarn("calloc Rules");
         goto Bail;
     }
 
-
-    //
-    // Copy over the rules.
-    //
+    raw = (TagBin2Rule *) &Binary->Image[sections[TagBin2Section_Rules]->Offset];
+    data = sections[TagBin2Section_Data];
 
     for (i = 0; i < Binary->Header.RuleCount; ++i)
     {
-        // XXX this should be converted into TagRuleInitialization (1 per tag rule style)
-        TagBinRule *binRule = &Binary->Rules[i];
-        TagRule *rule = &rules[i];
+        TagBinRule *rule = &Binary->Rules[i];
 
-        status = BlobInitialize(
-                    &rule->Symbol,
-                    binRule->RawSymbol,
-                    Binary->Header.SymbolSize);
-        if (FAILED(status))
+        if ((raw[i].Appendant0Size % Binary->Header.SymbolSize) != 0 ||
+            (raw[i].Appendant1Size % Binary->Header.SymbolSize) != 0)
         {
-            TagWarnx("BlobInitialize rule->Symbol");
+            status = ENV_BADLEN;
+            TagWarnx("invalid appendant size for rule symbol #%lu", i);
             goto Bail;
         }
 
-        rule->Style = binRule->Header.Style;
-        switch (rule->Style) {
+        rule->Header.Style = raw[i].Style;
+        rule->RawSymbol = TagBinData(data, Binary->Image, raw[i].Symbol, Binary->Header.SymbolSize);
+
+        switch (rule->Header.Style) {
         case IoSel_Pure:
-            status = BlobInitialize(
-                        &rule->Pure.Appendant,
-                        binRule->Pure.RawAppendant,
-                        binRule->Header.Pure.AppendantSize);
-            if (FAILED(status))
-            {
-                TagWarnx("BlobInitialize rule->Pure.Appendant");
-                goto Bail;
-            }
+            rule->Header.Pure.AppendantSize = raw[i].Appendant0Size;
+            rule->Pure.RawAppendant = TagBinData(data, Binary->Image, raw[i].Appendant0, raw[i].Appendant0Size);
+            found = (rule->Pure.RawAppendant != NULL);
             break;
 
         case IoSel_Input:
-            status = BlobInitialize(
-                        &rule->In.Appendant0,
-                        binRule->In.RawAppendant0,
-                        binRule->Header.In.Appendant0Size);
-            if (FAILED(status))
-            {
-                TagWarnx("BlobInitialize rule->In.Appendant0");
-                goto Bail;
-            }
-
-            status = BlobInitialize(
-                        &rule->In.Appendant1,
-                        binRule->In.RawAppendant1,
-                        binRule->Header.In.Appendant1Size);
-            if (FAILED(status))
-            {
-                TagWarnx("BlobInitialize rule->In.Appendant1");
-                goto Bail;
-            }
-
+            rule->Header.In.Appendant0Size = raw[i].Appendant0Size;
+            rule->Header.In.Appendant1Size = raw[i].Appendant1Size;
+            rule->In.RawAppendant0 = TagBinData(data, Binary->Image, raw[i].Appendant0, raw[i].Appendant0Size);
+            rule->In.RawAppendant1 = TagBinData(data, Binary->Image, raw[i].Appendant1, raw[i].Appendant1Size);
+            found = (rule->In.RawAppendant0 != NULL && rule->In.RawAppendant1 != NULL);
             break;
 
         case IoSel_Output:
-            status = BlobInitialize(
-                        &rule->Out.Appendant,
-                        binRule->Out.RawAppendant,
-                        binRule->Header.Out.AppendantSize);
-            if (FAILED(status))
-            {
-                TagWarnx("BlobInitialize rule->Out.Appendant");
-                goto Bail;
-            }
-
-            rule->Out.Bit = (binRule->Out.Bit != 0);
+            rule->Header.Out.AppendantSize = raw[i].Appendant0Size;
+            rule->Out.RawAppendant = TagBinData(data, Binary->Image, raw[i].Appendant0, raw[i].Appendant0Size);
+            rule->Out.Bit = raw[i].Bit;
+            found = (rule->Out.RawAppendant != NULL);
             break;
 
         default:
             status = ENV_BADENUM;
+            TagWarnx("invalid enum for rule #%lu: %x", i, rule->Header.Style);
+            goto Bail;
+        }
+
+        if (rule->RawSymbol == NULL || !found)
+        {
+            status = ENV_BADLEN;
+            TagWarnx("rule #%lu points outside the data", i);
             goto Bail;
         }
     }
 
+    Binary->Queue = &Binary->Image[sections[TagBin2Section_Queue]->Offset];
 
-    //
-    // Copy the tape.
-    //
+    section = sections[TagBin2Section_Index];
+    if (section != NULL)
+    {
+        //
+        // Symbol values have to fit in a uint64_t to index anything, and rule
+        // numbers in a uint32_t.
+        //
+        if ((section->Size % sizeof(*Binary->Index)) != 0 ||
+            Binary->Header.SymbolSize > sizeof(uint64_t) ||
+            Binary->Header.RuleCount >= TAG_IMAGE_NO_RULE)
+        {
+            status = ENV_BADLEN;
+            TagWarnx("invalid index");
+            goto Bail;
+        }
 
-    status = BlobInitialize(
-                tape,
-                Binary->Queue,
-                Binary->Header.QueueSize);
-    if (FAILED(status))
+        Binary->Index = (const uint32_t *) &Binary->Image[section->Offset];
+        Binary->IndexSize = section->Size / sizeof(*Binary->Index);
+
+        CHECK(status = TagBinCheckIndex(Binary));
+    }
+
+    section = sections[TagBin2Section_Hash];
+    if (section != NULL)
     {
-        TagWarnx("BlobInitialize queue");
-        goto Bail;
+        TagBin2Hash *hash = (TagBin2Hash *) &Binary->Image[section->Offset];
+
+        if (section->Size < sizeof(*hash) ||
+            Binary->Header.SymbolSize > sizeof(uint64_t) ||
+            hash->SlotCount != Binary->Header.RuleCount ||
+            hash->BucketCount == 0 ||
+            section->Size != sizeof(*hash) + ((uint64_t) hash->BucketCount + hash->SlotCount) * sizeof(uint32_t))
+        {
+            status = ENV_BADLEN;
+            TagWarnx("invalid perfect hash");
+            goto Bail;
+        }
+
+        Binary->Hash.Seed = hash->Seed;
+        Binary->Hash.Displacements = (const uint32_t *) (hash + 1);
+        Binary->Hash.BucketCount = hash->BucketCount;
+        Binary->Hash.Slots = Binary->Hash.Displacements + hash->BucketCount;
+        Binary->Hash.SlotCount = hash->SlotCount;
+
+        CHECK(status = TagBinCheckHash(Binary));
     }
 
+    section = sections[TagBin2Section_Names];
+    if (section != NULL)
+    {
+        Binary->Names = (const char *) &Binary->Image[section->Offset];
+        Binary->NamesSize = section->Size;
+    }
 
-    //
-    // Finally, initialize the tag system.
-    //
+Bail:
+    return status;
+}
 
-    status = TagInitialize(
-                System,
-                rules,
-                Binary->Header.RuleCount,
-                tape,
-                Binary->Header.DeletionNumber,
-                Io);
-    if (FAILED(status))
+//
+// Checks Binary->Image, whichever version it is, and points everything into
+// it.
+//
+static
+STATUS
+TagBinMapImage(
+    TagBin *Binary
+    )
+{
+    if (Binary->ImageSize >= sizeof(((TagBin2Header *) NULL)->Magic) &&
+        memcmp(Binary->Image, TAGBIN2_MAGIC, sizeof(((TagBin2Header *) NULL)->Magic)) == 0)
     {
-        TagWarnx("Unable to initialize tag system");
+        return TagBinMap2(Binary);
+    }
+
+    return TagBinMap1(Binary);
+}
+
+static
+STATUS
+TagBinMapFile(
+    int fd,
+    uint64_t Size,
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    void *image;
+
+    image = mmap(NULL, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        status = ENV_FAILURE;
+        TagWarn("mmap (%lu)", Size);
         goto Bail;
     }
 
+    (void) madvise(image, Size, MADV_WILLNEED);
+
+    Binary->Mapped = true;
+    Binary->Image = image;
+    Binary->ImageSize = Size;
+
+    status = TagBinMapImage(Binary);
+
 Bail:
+    return status;
+}
+
+//
+// Reads the rest of fd into an anonymous mapping after the Size bytes at
+// Start that have already been read, so a version 2 file that can't be mapped
+// ends up just like one that can.
+//
+static
+STATUS
+TagBinSlurp(
+    int fd,
+    TagBin *Binary,
+    const void *Start,
+    size_t Size
+    )
+{
+    STATUS status = ENV_OK;
+    size_t capacity = 1 << 20;
+    ssize_t n;
+    void *image;
 
-    if (rules != NULL)
+    image = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED)
     {
-        for (i = 0; i < Binary->Header.RuleCount; ++i)
-        {
-            TagRuleTeardown(&rules[i]);
-        }
-        free(rules);
+        status = ENV_OOM;
+        TagWarn("mmap (%zu)", capacity);
+        goto Bail;
     }
 
-    if (tape != NULL)
+    Binary->Mapped = true;
+    Binary->Image = image;
+    Binary->ImageSize = capacity;
+
+    memcpy(Binary->Image, Start, Size);
+
+    for (;;)
     {
-        if (tape->Data != NULL)
+        if (Size == capacity)
         {
-            BlobTeardown(tape);
+            image = mremap(Binary->Image, capacity, 2 * capacity, MREMAP_MAYMOVE);
+            if (image == MAP_FAILED)
+            {
+                status = ENV_OOM;
+                TagWarn("mremap (%zu)", 2 * capacity);
+                goto Bail;
+            }
+
+            capacity *= 2;
+            Binary->Image = image;
+            Binary->ImageSize = capacity;
         }
 
-        free(tape);
+        n = read(fd, &Binary->Image[Size], capacity - Size);
+        if (n < 0)
+        {
+            status = ENV_FAILURE;
+            TagWarn("read");
+            goto Bail;
+        }
+        else if (n == 0)
+        {
+            break;
+        }
+
+        Size += n;
     }
 
+    //
+    // Shrinking never moves the mapping.
+    //
+    (void) mremap(Binary->Image, capacity, Size, 0);
+    (void) mprotect(Binary->Image, Size, PROT_READ);
+    Binary->ImageSize = Size;
+
+    status = TagBinMapImage(Binary);
+
+Bail:
     return status;
 }
 
-static
 STATUS
-PrepareDebugger(
-    Debugger *Dbg,
-    char *SymbolsFilename,
-    TagSystem *System
+ReadBinaryFile(
+    int fd,
+    TagBin *Binary
     )
 {
-    STATUS status = ENV_OK;
-    SymbolEntry *entries = NULL;
-    uint64_t count = 0;
-    uint64_t i = 0;
-    FILE *dbg_fp = NULL;
+    STATUS status;
+    struct stat st;
+
+    status = 0;
 
-    (void) System;
+    Binary->Rules = NULL;
+    Binary->Queue = NULL;
+    Binary->Version = 1;
+    Binary->Index = NULL;
+    Binary->IndexSize = 0;
+    memset(&Binary->Hash, 0, sizeof(Binary->Hash));
+    Binary->Names = NULL;
+    Binary->NamesSize = 0;
+    Binary->Mapped = false;
+    Binary->Image = NULL;
+    Binary->ImageSize = 0;
 
-    dbg_fp = fopen(SymbolsFilename, "r");
-    if (dbg_fp == NULL)
+    //
+    // A file we are at the start of can be used where it lies.
+    //
+    if (fstat(fd, &st) == 0 &&
+        S_ISREG(st.st_mode) &&
+        st.st_size > 0 &&
+        lseek(fd, 0, SEEK_CUR) == 0)
     {
-        TagWarn("open (dbg_fp)");
+        status = TagBinMapFile(fd, (uint64_t) st.st_size, Binary);
         goto Bail;
     }
 
-    CHECK(status = ReadSymbolFile(dbg_fp, &entries, &count));
+    //
+    // A version 1 file starts with its rule count, which is never anything
+    // like a version 2 file's magic.
+    //
+    status = TagBinRead(fd, &Binary->Header.RuleCount, sizeof(Binary->Header.RuleCount));
+    if (FAILED(status))
+    {
+        TagWarnx("Read wrong size for header");
+        goto Bail;
+    }
 
-    CHECK(status = DebuggerInitialize(Dbg, entries, count));
+    if (memcmp(&Binary->Header.RuleCount, TAGBIN2_MAGIC, sizeof(Binary->Header.RuleCount)) == 0)
+    {
+        status = TagBinSlurp(fd, Binary, &Binary->Header.RuleCount, sizeof(Binary->Header.RuleCount));
+        goto Bail;
+    }
 
-Bail:
-    for (i = 0; i < count; ++i)
+    status = TagBinRead(fd,
+                (uint8_t *) &Binary->Header + sizeof(Binary->Header.RuleCount),
+                sizeof(Binary->Header) - sizeof(Binary->Header.RuleCount));
+    if (FAILED(status))
     {
-        SymbolEntryTeardown(&entries[i]);
+        TagWarnx("Read wrong size for header");
+        goto Bail;
     }
-    free(entries);
 
-    if (dbg_fp != NULL)
+    CHECK(status = TagBinCheckHeader(&Binary->Header));
+
+    //
+    // N.B., We rely on the fact that calloc zeroes the data before handing it
+    // back to us. This means that if an error occurs we will interpret the
+    // zeroed data as NULL pointers and can safely call free on them. This
+    // simplifies the amount of bookkeeping necessary.
+    // XXX This is not stricly compliant as NULL is *not* guaranteed to have
+    // the representation of all zeroes. Man, C sucks.
+    //
+
+    Binary->Rules = calloc(Binary->Header.RuleCount, sizeof(*Binary->Rules));
+    if (Binary->Rules == NULL)
+    {
+        status = ENV_OOM;
+        TagWarn("calloc Rules");
+        goto Bail;
+    }
+
+    Binary->Queue = malloc(Binary->Header.QueueSize);
+    if (Binary->Queue == NULL)
+    {
+        status = ENV_OOM;
+        TagWarn("malloc Queue");
+        goto Bail;
+    }
+
+    status = ReadBinaryRules(fd, &Binary->Header, Binary->Rules);
+    if (FAILED(status))
+    {
+        goto Bail;
+    }
+
+    status = TagBinRead(fd, Binary->Queue, Binary->Header.QueueSize);
+    if (FAILED(status))
+    {
+        TagWarnx("read wrong size for queue");
+        goto Bail;
+    }
+
+Bail:
+    if (FAILED(status))
     {
-        (void) fclose(dbg_fp);
+#if 1 /* XXX this is commented only for dumping! */
+        TagBinTeardown(Binary);
+#endif
     }
 
     return status;
 }
 
 void
-Usage(
-    void
+TagBinTeardown(
+    TagBin *Binary
     )
 {
-    TagPrint("usage\n");
+    uint64_t i;
+
+    if (Binary->Mapped)
+    {
+        free(Binary->Rules);
+        Binary->Rules = NULL;
+        Binary->Queue = NULL;
+        Binary->Index = NULL;
+        memset(&Binary->Hash, 0, sizeof(Binary->Hash));
+        Binary->Names = NULL;
+
+        if (Binary->Image != NULL)
+        {
+            (void) munmap(Binary->Image, Binary->ImageSize);
+            Binary->Image = NULL;
+            Binary->ImageSize = 0;
+        }
+
+        return;
+    }
+
+    if (Binary->Rules)
+    {
+        for (i = 0; i < Binary->Header.RuleCount; ++i)
+        {
+            free(Binary->Rules[i].RawSymbol);
+
+            switch (Binary->Rules[i].Header.Style) {
+            case IoSel_Pure:
+                free(Binary->Rules[i].Pure.RawAppendant);
+                break;
+
+            case IoSel_Input:
+                free(Binary->Rules[i].In.RawAppendant0);
+                free(Binary->Rules[i].In.RawAppendant1);
+                break;
+
+            case IoSel_Output:
+                free(Binary->Rules[i].Out.RawAppendant);
+                break;
 
-    exit(1);
+            default:
+                assert(false);
+                break;
+            }
+        }
+        free(Binary->Rules);
+        Binary->Rules = NULL;
+    }
+
+    free(Binary->Queue);
+    Binary->Queue = NULL;
 }
 
-// XXX Make a real main.c and have this just be a switch to reach something similar to this
-int
-main(
-    int argc,
-    char **argv
+void
+TagBinDump(
+    TagBin *Binary
     )
 {
-    TagBin binary;
-    TagSystem system;
-    IoBufferConfig io;
-    Debugger dbg;
+    uint64_t i, level = 0;
 
-    bool binary_initialized;
-    bool system_initialized;
-    bool debugger_initialized;
-    int ch;
+    TagPrint("Header:\n");
+    ++level;
+    {
+        TagPrint("Version: %u\n", Binary->Version);
+        TagPrint("RuleCount: %lu\n", Binary->Header.RuleCount);
+        TagPrint("SymbolSize: %u\n", Binary->Header.SymbolSize);
+        TagPrint("QueueSize: %u\n", Binary->Header.QueueSize);
+        TagPrint("DeletionNumber: %u\n", Binary->Header.DeletionNumber);
+        TagPrint("IndexSize: %lu\n", Binary->IndexSize);
+        TagPrint("HashBuckets: %lu\n", Binary->Hash.BucketCount);
+        TagPrint("NamesSize: %lu\n", Binary->NamesSize);
 
-    binary_initialized = false;
-    system_initialized = false;
-    debugger_initialized = false;
+        TagPrint("\n");
 
-    char *filename = NULL;
-    int fd = STDIN_FILENO;
+        TagPrint("Rules:\n");
+        ++level;
+        {
+            for (i = 0; i < Binary->Header.RuleCount; ++i) {
+                TagBinRule *rule = &Binary->Rules[i];
 
-    char *debug_file = NULL;
+                TagPrint("Rule #%lu Header:\n", i);
+                ++level;
+                {
+                    char *name = "Invalid";
+                    if (rule->Header.Style < IoSel_Max)
+                    {
+                        name = IoSelectorNames[rule->Header.Style];
+                    }
+                    TagPrint("Style: %x (%s)\n", rule->Header.Style, name);
 
-    int print = 0;
+                    switch (rule->Header.Style) {
+                    case IoSel_Pure:
+                        TagPrint("Appendant Length: %x\n", rule->Header.Pure.AppendantSize);
+                        TagPrint("\n");
+                        break;
 
-    STATUS status = 0;
+                    case IoSel_Input:
+                        TagPrint("Appendant0 Length: %x\n", rule->Header.In.Appendant0Size);
+                        TagPrint("Appendant1 Length: %x\n", rule->Header.In.Appendant1Size);
+                        TagPrint("\n");
+                        break;
 
-    while ((ch = getopt(argc, argv, "d:f:p")) != -1)
-    {
-        switch (ch) {
-        case 'd':
-            printf("optarg: %s\n", optarg);
-            debug_file = optarg;
-            break;
+                    case IoSel_Output:
+                        TagPrint("Appendant Length: %x\n", rule->Header.Out.AppendantSize);
+                        TagPrint("\n");
+                        break;
 
-        case 'f':
-            filename = optarg;
-            break;
+                    default:
+                        hexdump_only("Invalid Header", &rule->Header, sizeof(rule->Header));
+                        TagPrint("\n");
+                        break;
+                    }
+                    TagPrint("\n");
 
-        case 'p':
-            // XXX make this a log-level (or even subsystem) so we can hook up
-            // a proper logger to print out various info without having to just
-            // comment it out
-            print = 1;
-            break;
+                    // XXX we don't validate the shit at all :(
+                    hexdump_only("Raw symbol", rule->RawSymbol, Binary->Header.SymbolSize);
+                    TagPrint("\n");
 
-        // XXX maybe have a "steps" argument so we can run for <x> steps
-        // this is part of the debugger
+                    switch (rule->Header.Style) {
+                    case IoSel_Pure:
+                        // XXX we don't validate the shit at all :(
+                        hexdump_only("Appendant", rule->Pure.RawAppendant, rule->Header.Pure.AppendantSize);
+                        break;
 
-        // TODO implement a jit :)
+                    case IoSel_Input:
+                        // XXX we don't validate the shit at all :(
+                        hexdump_only("False Appendant", rule->In.RawAppendant0, rule->Header.In.Appendant0Size);
+                        hexdump_only("True Appendant", rule->In.RawAppendant1, rule->Header.In.Appendant1Size);
+                        break;
 
-        default:
-            Usage();
-            break;
+                    case IoSel_Output:
+                        // XXX we don't validate the shit at all :(
+                        hexdump_only("Appendant", rule->Out.RawAppendant, rule->Header.Out.AppendantSize);
+                        TagPrint("Bit: %s\n", rule->Out.Bit ? "True" : "False");
+                        break;
+
+                    default:
+                        //hexdump_only("Invalid Body", &rule->Header, sizeof(rule->Header));
+                        break;
+                    }
+                    TagPrint("\n");
+
+                }
+                --level;
+            }
         }
+        --level;
     }
-    argc -= optind;
-    argv += optind;
+    --level;
+}
 
-    if (filename != NULL)
+//
+// Points Obj at Size bytes of Data without copying them.
+//
+static
+void
+TagBinBlob(
+    Blob *Obj,
+    uint8_t *Data,
+    uint64_t Size
+    )
+{
+    Obj->Data = Data;
+    Obj->Size = Size;
+    Obj->MaxSize = Size;
+}
+
+STATUS
+InstantiateTagSystemFromBinary(
+    TagBin *Binary,
+    TagSystem *System,
+    IoBufferConfig *Io
+    )
+{
+    TagRule *rules;
+    TagImage image;
+    Blob tape;
+    uint64_t i;
+    STATUS status = 0;
+
+    //
+    // The rules we hand over only describe where everything is. TagInitialize
+    // makes its own copy, and even then leaves the bytes where they are when
+    // they're mapped.
+    //
+    rules = calloc(Binary->Header.RuleCount, sizeof(*rules));
+    if (rules == NULL)
     {
-        fd = open(filename, O_RDONLY);
-        if (fd < 0)
-        {
-            TagWarn("open (fd)");
-            goto Bail;
-        }
+        status = ENV_OOM;
+        TagWarnx("calloc rules");
+        goto Bail;
     }
 
-    if (!print)
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
     {
-        io.GetByte = (GetByteFn) getc;
-        io.GetContext = stdin;
-        io.PutByte = (PutByteFn) putc;
-        io.PutContext = stdout;
+        TagBinRule *binRule = &Binary->Rules[i];
+        TagRule *rule = &rules[i];
 
-        status = ReadBinaryFile(fd, &binary);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
-        binary_initialized = true;
+        TagBinBlob(&rule->Symbol, binRule->RawSymbol, Binary->Header.SymbolSize);
 
-        status = InstantiateTagSystemFromBinary(&binary, &system, &io);
-        if (FAILED(status))
-        {
+        rule->Style = binRule->Header.Style;
+        switch (rule->Style) {
+        case IoSel_Pure:
+            TagBinBlob(&rule->Pure.Appendant,
+                       binRule->Pure.RawAppendant,
+                       binRule->Header.Pure.AppendantSize);
+            break;
+
+        case IoSel_Input:
+            TagBinBlob(&rule->In.Appendant0,
+                       binRule->In.RawAppendant0,
+                       binRule->Header.In.Appendant0Size);
+            TagBinBlob(&rule->In.Appendant1,
+                       binRule->In.RawAppendant1,
+                       binRule->Header.In.Appendant1Size);
+            break;
+
+        case IoSel_Output:
+            TagBinBlob(&rule->Out.Appendant,
+                       binRule->Out.RawAppendant,
+                       binRule->Header.Out.AppendantSize);
+            rule->Out.Bit = (binRule->Out.Bit != 0);
+            break;
+
+        default:
+            status = ENV_BADENUM;
             goto Bail;
         }
-        system_initialized = true;
+    }
 
-        if (debug_file != NULL)
-        {
-            CHECK(status = PrepareDebugger(&dbg, debug_file, &system));
-            debugger_initialized = true;
-        }
+    TagBinBlob(&tape, Binary->Queue, Binary->Header.QueueSize);
 
-        hexdump_only("Starting Queue", system.InitialQueue.Data, system.InitialQueue.Size);
+    image.Data = Binary->Image;
+    image.Size = Binary->ImageSize;
+    image.Index = Binary->Index;
+    image.IndexSize = Binary->IndexSize;
+    image.Hash = Binary->Hash;
 
-        uint64_t steps;
-        for (steps = 0; ; ++steps)
-        {
-            status = TagStep(&system);
-            if (FAILED(status))
-            {
-                TagWarnx("TagStep: %x", status);
+    //
+    // Finally, initialize the tag system. It takes the mapping (if any) with
+    // it.
+    //
 
-                TagPrint("steps: %lx\n", steps);
+    status = TagInitialize(
+                System,
+                rules,
+                Binary->Header.RuleCount,
+                &tape,
+                Binary->Header.DeletionNumber,
+                Io,
+                &image);
 
-                break;
-            }
+    Binary->Image = NULL;
+    Binary->ImageSize = 0;
 
-            /*
-            TagDump(&system);
-            TagPrint("\n");
-            */
-        }
-    }
-    else
+    if (FAILED(status))
     {
-        binary_initialized = true;
-        (void) ReadBinaryFile(fd, &binary);
-        TagBinDump(&binary);
+        TagWarnx("Unable to initialize tag system");
+        goto Bail;
     }
 
 Bail:
-    if (fd > 0 && fd != STDIN_FILENO)
-    {
-        (void) close(fd);
-    }
+    free(rules);
 
-    if (binary_initialized)
-    {
-        TagBinTeardown(&binary);
-    }
-    if (system_initialized)
-    {
-        TagTeardown(&system);
-    }
-    if (debugger_initialized)
-    {
-        DebuggerTeardown(&dbg);
-    }
-
-    return (status < 0);
+    return status;
 }
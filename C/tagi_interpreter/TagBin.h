@@ -1,21 +1,29 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
+#include "Util.h"
+#include "IoBuffer.h"
+#include "Tag.h"
+
+//
+// Version 1 files store these sizes in 16 bits each, version 2 files in 32.
+//
 typedef struct _TagBinPureRuleHeader
 {
-    uint16_t AppendantSize;   // The length, in bytes, of the data
+    uint32_t AppendantSize;   // The length, in bytes, of the data
 } TagBinPureRuleHeader;
 
 typedef struct _TagBinInputRuleHeader
 {
-    uint16_t Appendant0Size;    // The length, in bytes, of the data corresponding to a 0 bit
-    uint16_t Appendant1Size;    // The length, in bytes, of the data corresponding to a 1 bit
+    uint32_t Appendant0Size;    // The length, in bytes, of the data corresponding to a 0 bit
+    uint32_t Appendant1Size;    // The length, in bytes, of the data corresponding to a 1 bit
 } TagBinInputRuleHeader;
 
 typedef struct _TagBinOutputRuleHeader
 {
-    uint16_t AppendantSize; // The length, in bytes, of the data
+    uint32_t AppendantSize; // The length, in bytes, of the data
 } TagBinOutputRuleHeader;
 
 typedef struct _TagBinRuleHeader
@@ -63,6 +71,11 @@ typedef struct _TagBinRule
 } TagBinRule;
 
 
+//
+// Version 1 files are this header followed by every rule and then the queue,
+// all packed together. Version 2 files are described below but still fill
+// this in when read.
+//
 #pragma pack(push)
 // force alignment to byte boundaries
 #pragma pack(1)
@@ -75,9 +88,129 @@ typedef struct _TagBinHeader
 } TagBinHeader;
 #pragma pack(pop)
 
+//
+// Version 2 files start with a TagBin2Header followed by SectionCount
+// TagBin2Sections saying where everything else is. Everything is little-endian
+// and naturally aligned and every section starts on an 8-byte boundary, so a
+// mapped file can be used where it lies. Sections we don't know are skipped.
+//
+#define TAGBIN2_MAGIC           "\177TAGBIN"
+#define TAGBIN2_VERSION         2
+#define TAGBIN2_ALIGNMENT       8
+
+typedef enum _TagBin2SectionKind
+{
+    TagBin2Section_Rules = 1,   // RuleCount TagBin2Rules.
+    TagBin2Section_Data = 2,    // The symbols and appendants the rules point at.
+    TagBin2Section_Queue = 3,   // The initial queue.
+    TagBin2Section_Index = 4,   // Optional. A uint32_t per symbol value, see TagImage.
+    TagBin2Section_Names = 5,   // Optional. The debug symbols, as in a symbol file.
+    TagBin2Section_Hash = 6,    // Optional. A TagBin2Hash, see TagPerfectHash.
+
+    TagBin2Section_Max,
+} TagBin2SectionKind;
+
+typedef struct _TagBin2Header
+{
+    uint8_t Magic[8];           // TAGBIN2_MAGIC, NUL included.
+    uint32_t Version;           // TAGBIN2_VERSION
+    uint32_t SectionCount;
+    uint64_t RuleCount;
+    uint32_t SymbolSize;
+    uint32_t DeletionNumber;
+} TagBin2Header;
+
+typedef struct _TagBin2Section
+{
+    uint32_t Kind;              // TagBin2SectionKind
+    uint32_t Reserved;
+    uint64_t Offset;            // From the start of the file.
+    uint64_t Size;              // In bytes.
+} TagBin2Section;
+
+//
+// Offsets are into the data section. Pure and output rules only use
+// Appendant0.
+//
+typedef struct _TagBin2Rule
+{
+    uint8_t Style;              // IoSelector
+    uint8_t Bit;                // Output rules only.
+    uint16_t Reserved;
+    uint32_t Symbol;
+    uint32_t Appendant0;
+    uint32_t Appendant0Size;
+    uint32_t Appendant1;
+    uint32_t Appendant1Size;
+} TagBin2Rule;
+
+//
+// A minimal perfect hash over the rules' symbol values. SlotCount is always
+// RuleCount. The header is followed by BucketCount uint32_t displacements and
+// then SlotCount uint32_t rule numbers, one per slot. Symbols have to be at
+// most 8 bytes wide.
+//
+typedef struct _TagBin2Hash
+{
+    uint64_t Seed;
+    uint32_t BucketCount;
+    uint32_t SlotCount;
+} TagBin2Hash;
+
 typedef struct _TagBin
 {
     TagBinHeader Header;
     TagBinRule *Rules;
     uint8_t *Queue;
+
+    uint32_t Version;
+
+    //
+    // Only ever set for version 2 files and pointing into Image, so they last
+    // as long as whoever ends up with Image. NULL if the file doesn't have
+    // them.
+    //
+    const uint32_t *Index;
+    uint64_t IndexSize;         // In entries.
+    TagPerfectHash Hash;        // SlotCount is 0 without one.
+    const char *Names;
+    uint64_t NamesSize;
+
+    //
+    // Set when the file was mapped rather than read, in which case the rules'
+    // Raw pointers and Queue point into Image instead of being allocations of
+    // their own. Image goes to the TagSystem we instantiate, after which it
+    // is NULL here and the Raw pointers last only as long as the system.
+    //
+    bool Mapped;
+    uint8_t *Image;
+    uint64_t ImageSize;
 } TagBin;
+
+//
+// Maps fd when it's a regular file (checking the whole thing in one pass)
+// and reads it piece by piece otherwise. Version 2 files that can't be mapped
+// are read in whole first.
+//
+STATUS
+ReadBinaryFile(
+    int fd,
+    TagBin *Binary
+    );
+
+void
+TagBinTeardown(
+    TagBin *Binary
+    );
+
+void
+TagBinDump(
+    TagBin *Binary
+    );
+
+STATUS
+InstantiateTagSystemFromBinary(
+    TagBin *Binary,
+    TagSystem *System,
+    IoBufferConfig *Io
+    );
@@ -0,0 +1,1086 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "Util.h"
+#include "TagBin.h"
+#include "Tag.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "IoBuffer.h"
+
+//
+// tagc compiles a tag binary into a single C file with no dependencies beyond
+// libc:
+//
+//     tagc -f prog.bin -o prog.c && cc -O2 -o prog prog.c
+//
+// ./prog behaves like `tagi -f prog.bin`: same stdin/stdout bit handling,
+// same "steps: %lx" line on stderr and the same exit code. Every rule becomes
+// a case in one switch with its appendant(s) as static arrays of symbol
+// values, and the run-length queue from TagQueue.c is inlined with the symbol
+// size and deletion number as constants.
+//
+// Symbols are carried as their little-endian integer value (TagSymbolValue)
+// so at most 8 byte symbols are supported.
+//
+#define TAGC_MAX_SYMBOLSIZE     8
+
+//
+// Past this many rules the runner dispatches through a table rather than a
+// switch (see TagCEmitTable) unless the symbols are so sparse that the table
+// would be mostly holes.
+//
+#define TAGC_SWITCH_MAX_RULES   4096
+#define TAGC_TABLE_MAX_SPARSITY 16
+
+//
+// The part of the generated file that doesn't depend on the program. This is
+// a transliteration of TagQueue.c and IoBuffer.c and must stay in step with
+// them; the run boundaries are observable as one I/O per popped run.
+//
+static const char *TagCRuntime[] = {
+    "typedef struct\n",
+    "{\n",
+    "    sym_t Symbol;\n",
+    "    uint64_t Count;\n",
+    "} token_t;\n",
+    "\n",
+    "static token_t *Ring;\n",
+    "static uint64_t RingCapacity, RingHead, RingLength;\n",
+    "\n",
+    "static struct\n",
+    "{\n",
+    "    sym_t Symbol;\n",
+    "    uint64_t SymbolCount;\n",
+    "    bool Dirty;\n",
+    "} Cache;\n",
+    "\n",
+    "static uint8_t InBuffer, InOffset, OutBuffer, OutOffset;\n",
+    "\n",
+    "static void\n",
+    "RingPush(sym_t Symbol, uint64_t Count)\n",
+    "{\n",
+    "    if (RingLength == RingCapacity)\n",
+    "    {\n",
+    "        uint64_t i;\n",
+    "        token_t *ring = malloc(2 * RingCapacity * sizeof(*ring));\n",
+    "        if (ring == NULL)\n",
+    "        {\n",
+    "            fprintf(stderr, \"out of memory\\n\");\n",
+    "            exit(1);\n",
+    "        }\n",
+    "        for (i = 0; i < RingLength; ++i)\n",
+    "        {\n",
+    "            ring[i] = Ring[(RingHead + i) & (RingCapacity - 1)];\n",
+    "        }\n",
+    "        free(Ring);\n",
+    "        Ring = ring;\n",
+    "        RingHead = 0;\n",
+    "        RingCapacity *= 2;\n",
+    "    }\n",
+    "    Ring[(RingHead + RingLength) & (RingCapacity - 1)].Symbol = Symbol;\n",
+    "    Ring[(RingHead + RingLength) & (RingCapacity - 1)].Count = Count;\n",
+    "    ++RingLength;\n",
+    "}\n",
+    "\n",
+    "static void\n",
+    "Flush(void)\n",
+    "{\n",
+    "    RingPush(Cache.Symbol, Cache.SymbolCount / DELETION_NUMBER);\n",
+    "    Cache.SymbolCount %= DELETION_NUMBER;\n",
+    "    Cache.Dirty = (Cache.SymbolCount != 0);\n",
+    "}\n",
+    "\n",
+    "static inline void\n",
+    "PushSymbol(sym_t Symbol, uint64_t SymbolCount)\n",
+    "{\n",
+    "    uint64_t newCount;\n",
+    "    if (Cache.Dirty)\n",
+    "    {\n",
+    "        if (Cache.Symbol == Symbol &&\n",
+    "            !__builtin_add_overflow(Cache.SymbolCount, SymbolCount, &newCount))\n",
+    "        {\n",
+    "            Cache.SymbolCount = newCount;\n",
+    "            return;\n",
+    "        }\n",
+    "        Flush();\n",
+    "    }\n",
+    "    Cache.Dirty = true;\n",
+    "    Cache.Symbol = Symbol;\n",
+    "    Cache.SymbolCount = SymbolCount;\n",
+    "}\n",
+    "\n",
+    "static inline uint64_t\n",
+    "FillBucket(uint64_t Available)\n",
+    "{\n",
+    "    uint64_t residue, fill, newCount;\n",
+    "    for (;;)\n",
+    "    {\n",
+    "        residue = Cache.SymbolCount % DELETION_NUMBER;\n",
+    "        fill = (DELETION_NUMBER - residue) % DELETION_NUMBER;\n",
+    "        fill = (Available < fill) ? Available : fill;\n",
+    "        if (__builtin_add_overflow(Cache.SymbolCount, fill, &newCount))\n",
+    "        {\n",
+    "            Flush();\n",
+    "            continue;\n",
+    "        }\n",
+    "        Cache.SymbolCount = newCount;\n",
+    "        return fill;\n",
+    "    }\n",
+    "}\n",
+    "\n",
+    "static void\n",
+    "PushRun(sym_t Symbol, uint64_t SymbolCount)\n",
+    "{\n",
+    "    const uint64_t maxChunk = UINT64_MAX - (UINT64_MAX % DELETION_NUMBER);\n",
+    "    uint64_t newCount, chunk;\n",
+    "    while (SymbolCount > 0)\n",
+    "    {\n",
+    "        if (Cache.Dirty && Cache.Symbol == Symbol &&\n",
+    "            !__builtin_add_overflow(Cache.SymbolCount, SymbolCount, &newCount))\n",
+    "        {\n",
+    "            Cache.SymbolCount = newCount;\n",
+    "            break;\n",
+    "        }\n",
+    "        if (Cache.Dirty)\n",
+    "        {\n",
+    "            Flush();\n",
+    "        }\n",
+    "        chunk = (SymbolCount < maxChunk) ? SymbolCount : maxChunk;\n",
+    "        Cache.Dirty = true;\n",
+    "        Cache.Symbol = Symbol;\n",
+    "        Cache.SymbolCount = chunk;\n",
+    "        SymbolCount -= chunk;\n",
+    "    }\n",
+    "}\n",
+    "\n",
+    "//\n",
+    "// Stride is gcd(Length, DELETION_NUMBER), worked out by tagc. See\n",
+    "// TagQueueUniformHead.\n",
+    "//\n",
+    "static void\n",
+    "Push(const sym_t *Appendant, uint64_t Length, uint64_t Stride, uint64_t Repetitions)\n",
+    "{\n",
+    "    uint64_t i, fill, start, reps, symbols;\n",
+    "    if (Repetitions > 1)\n",
+    "    {\n",
+    "        fill = (DELETION_NUMBER - Cache.SymbolCount % DELETION_NUMBER) % DELETION_NUMBER;\n",
+    "        start = fill % Stride;\n",
+    "        for (i = start + Stride; i < Length; i += Stride)\n",
+    "        {\n",
+    "            if (Appendant[i] != Appendant[start])\n",
+    "            {\n",
+    "                break;\n",
+    "            }\n",
+    "        }\n",
+    "        if (i >= Length)\n",
+    "        {\n",
+    "            while (Repetitions > 0)\n",
+    "            {\n",
+    "                reps = (Repetitions < UINT64_MAX / Length) ? Repetitions : UINT64_MAX / Length;\n",
+    "                symbols = reps * Length;\n",
+    "                Repetitions -= reps;\n",
+    "                fill = FillBucket(symbols);\n",
+    "                if (symbols > fill)\n",
+    "                {\n",
+    "                    PushRun(Appendant[start], symbols - fill);\n",
+    "                }\n",
+    "            }\n",
+    "            return;\n",
+    "        }\n",
+    "    }\n",
+    "    while (Repetitions--)\n",
+    "    {\n",
+    "        fill = FillBucket(Length);\n",
+    "        for (i = fill; i < Length; i += DELETION_NUMBER)\n",
+    "        {\n",
+    "            PushSymbol(Appendant[i], (Length - i < DELETION_NUMBER) ? Length - i : DELETION_NUMBER);\n",
+    "        }\n",
+    "    }\n",
+    "}\n",
+    "\n",
+    "static inline bool\n",
+    "Pop(sym_t *Symbol, uint64_t *Repetitions)\n",
+    "{\n",
+    "    if (RingLength != 0)\n",
+    "    {\n",
+    "        *Symbol = Ring[RingHead].Symbol;\n",
+    "        *Repetitions = Ring[RingHead].Count;\n",
+    "        RingHead = (RingHead + 1) & (RingCapacity - 1);\n",
+    "        --RingLength;\n",
+    "        return true;\n",
+    "    }\n",
+    "    if (Cache.SymbolCount >= DELETION_NUMBER)\n",
+    "    {\n",
+    "        *Symbol = Cache.Symbol;\n",
+    "        *Repetitions = Cache.SymbolCount / DELETION_NUMBER;\n",
+    "        Cache.SymbolCount %= DELETION_NUMBER;\n",
+    "        Cache.Dirty = (Cache.SymbolCount != 0);\n",
+    "        return true;\n",
+    "    }\n",
+    "    return false;\n",
+    "}\n",
+    "\n",
+    "static inline bool\n",
+    "GetBit(bool *Bit)\n",
+    "{\n",
+    "    int c;\n",
+    "    if (InOffset == 0)\n",
+    "    {\n",
+    "        c = getc(stdin);\n",
+    "        if (c == EOF)\n",
+    "        {\n",
+    "            return false;\n",
+    "        }\n",
+    "        InBuffer = c & 0xff;\n",
+    "    }\n",
+    "    *Bit = (InBuffer >> InOffset++) & 1;\n",
+    "    if (InOffset == 8)\n",
+    "    {\n",
+    "        InBuffer = InOffset = 0;\n",
+    "    }\n",
+    "    return true;\n",
+    "}\n",
+    "\n",
+    "static inline bool\n",
+    "PutBit(int Bit)\n",
+    "{\n",
+    "    int c;\n",
+    "    OutBuffer |= (Bit & 1) << OutOffset++;\n",
+    "    if (OutOffset == 8)\n",
+    "    {\n",
+    "        c = putc(OutBuffer, stdout);\n",
+    "        OutBuffer = OutOffset = 0;\n",
+    "        if (c == EOF)\n",
+    "        {\n",
+    "            return false;\n",
+    "        }\n",
+    "    }\n",
+    "    return true;\n",
+    "}\n",
+    "\n",
+    NULL
+};
+
+//
+// The generated main. This follows Main.c.
+//
+static const char *TagCMain[] = {
+    "int\n",
+    "main(int argc, char **argv)\n",
+    "{\n",
+    "    uint64_t maxSteps = UINT64_MAX, steps = 0;\n",
+    "    int ch, status;\n",
+    "\n",
+    "    while ((ch = getopt(argc, argv, \"n:\")) != -1)\n",
+    "    {\n",
+    "        if (ch != 'n')\n",
+    "        {\n",
+    "            fprintf(stderr, \"usage: %s [-n steps]\\n\", argv[0]);\n",
+    "            return 1;\n",
+    "        }\n",
+    "        maxSteps = strtoull(optarg, NULL, 0);\n",
+    "    }\n",
+    "\n",
+    "    RingCapacity = 64;\n",
+    "    Ring = malloc(RingCapacity * sizeof(*Ring));\n",
+    "    if (Ring == NULL)\n",
+    "    {\n",
+    "        fprintf(stderr, \"out of memory\\n\");\n",
+    "        return 1;\n",
+    "    }\n",
+    "    if (INITIAL_QUEUE_LENGTH != 0)\n",
+    "    {\n",
+    "        Push(InitialQueue, INITIAL_QUEUE_LENGTH, INITIAL_QUEUE_STRIDE, 1);\n",
+    "    }\n",
+    "\n",
+    "    status = Run(maxSteps, &steps);\n",
+    "    if (status != 0)\n",
+    "    {\n",
+    "        fprintf(stderr, \"%s: Run: %x\\n\", argv[0], (unsigned) status);\n",
+    "    }\n",
+    "    fprintf(stderr, \"steps: %lx\\n\", (unsigned long) steps);\n",
+    "\n",
+    "    free(Ring);\n",
+    "\n",
+    "    return (status != 0);\n",
+    "}\n",
+    NULL
+};
+
+static
+uint64_t
+TagCGcd(
+    uint64_t A,
+    uint64_t B
+    )
+{
+    while (B != 0)
+    {
+        uint64_t t = A % B;
+        A = B;
+        B = t;
+    }
+
+    return A;
+}
+
+static
+const char *
+TagCSymbolType(
+    uint32_t SymbolSize
+    )
+{
+    if (SymbolSize <= 1)
+    {
+        return "uint8_t";
+    }
+    else if (SymbolSize <= 2)
+    {
+        return "uint16_t";
+    }
+    else if (SymbolSize <= 4)
+    {
+        return "uint32_t";
+    }
+
+    return "uint64_t";
+}
+
+static
+int
+TagCCompareValues(
+    const void *A,
+    const void *B
+    )
+{
+    uint64_t a = *(const uint64_t *) A;
+    uint64_t b = *(const uint64_t *) B;
+
+    return (a > b) - (a < b);
+}
+
+//
+// Makes sure the binary is something TagInitialize would accept, since the
+// generated code doesn't check any of this at runtime.
+//
+static
+STATUS
+TagCValidate(
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    uint64_t *values = NULL;
+    uint64_t i;
+
+    if (Binary->Header.RuleCount < 1)
+    {
+        TagWarnx("Must have at least 1 rule");
+        BAIL(status = TAGSS_BADRULECOUNT);
+    }
+
+    if (Binary->Header.DeletionNumber < 2)
+    {
+        TagWarnx("Deletion number must be at least 2");
+        BAIL(status = TAGSS_BADDELETIONNUMBER);
+    }
+
+    if (symbolSize < 1 || symbolSize > TAGC_MAX_SYMBOLSIZE)
+    {
+        TagWarnx("Unsupported symbol size %u", symbolSize);
+        BAIL(status = ENV_BADLEN);
+    }
+
+    if (Binary->Header.QueueSize % symbolSize != 0)
+    {
+        TagWarnx("Queue size (%u) isn't a multiple of the symbol size", Binary->Header.QueueSize);
+        BAIL(status = ENV_BADLEN);
+    }
+
+    values = calloc(Binary->Header.RuleCount, sizeof(*values));
+    if (values == NULL)
+    {
+        TagWarnx("calloc values");
+        BAIL(status = ENV_OOM);
+    }
+
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+        bool aligned;
+
+        values[i] = TagSymbolValue(rule->RawSymbol, symbolSize);
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            aligned = (rule->Header.Pure.AppendantSize % symbolSize) == 0;
+            break;
+
+        case IoSel_Input:
+            aligned = (rule->Header.In.Appendant0Size % symbolSize) == 0 &&
+                      (rule->Header.In.Appendant1Size % symbolSize) == 0;
+            break;
+
+        case IoSel_Output:
+            aligned = (rule->Header.Out.AppendantSize % symbolSize) == 0;
+            break;
+
+        default:
+            TagWarnx("invalid enum for rule #%lu: %x", i, rule->Header.Style);
+            BAIL(status = ENV_BADENUM);
+        }
+
+        if (!aligned)
+        {
+            TagWarnx("Rule #%lu has an appendant that isn't a multiple of the symbol size", i);
+            BAIL(status = ENV_BADLEN);
+        }
+    }
+
+    qsort(values, Binary->Header.RuleCount, sizeof(*values), TagCCompareValues);
+    for (i = 1; i < Binary->Header.RuleCount; ++i)
+    {
+        if (values[i] == values[i - 1])
+        {
+            TagWarnx("Symbol %lx has more than one rule", values[i]);
+            BAIL(status = TAGSS_DUPERULE);
+        }
+    }
+
+Bail:
+    free(values);
+
+    return status;
+}
+
+static
+void
+TagCEmitSymbols(
+    FILE *Out,
+    const char *Name,
+    uint8_t *Data,
+    uint64_t Size,
+    uint32_t SymbolSize
+    )
+{
+    uint64_t i;
+
+    if (Size == 0)
+    {
+        //
+        // Empty appendants halt and are never pushed.
+        //
+        return;
+    }
+
+    fprintf(Out, "static const sym_t %s[] = {", Name);
+    for (i = 0; i < Size / SymbolSize; ++i)
+    {
+        if (i % 8 == 0)
+        {
+            fprintf(Out, "\n   ");
+        }
+        fprintf(Out, " 0x%lx,", TagSymbolValue(&Data[i * SymbolSize], SymbolSize));
+    }
+    fprintf(Out, "\n};\n");
+}
+
+//
+// Emits the push (or halt) for one appendant, indented for the switch.
+//
+static
+void
+TagCEmitPush(
+    FILE *Out,
+    const char *Indent,
+    const char *Name,
+    uint64_t Size,
+    TagBin *Binary
+    )
+{
+    uint64_t length = Size / Binary->Header.SymbolSize;
+
+    if (length == 0)
+    {
+        fprintf(Out, "%sstatus = STOP_HALT;\n", Indent);
+        fprintf(Out, "%sgoto Bail;\n", Indent);
+        return;
+    }
+
+    fprintf(Out, "%sPush(%s, %lu, %lu, reps);\n",
+            Indent,
+            Name,
+            length,
+            TagCGcd(length, Binary->Header.DeletionNumber));
+}
+
+static
+void
+TagCEmitLines(
+    FILE *Out,
+    const char **Lines
+    )
+{
+    for (; *Lines != NULL; ++Lines)
+    {
+        fputs(*Lines, Out);
+    }
+}
+
+static
+STATUS
+TagCEmitSwitch(
+    FILE *Out,
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    char name[64];
+    uint64_t i;
+
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            snprintf(name, sizeof(name), "Rule%lu", i);
+            TagCEmitSymbols(Out, name, rule->Pure.RawAppendant, rule->Header.Pure.AppendantSize, symbolSize);
+            break;
+
+        case IoSel_Input:
+            snprintf(name, sizeof(name), "Rule%lu_0", i);
+            TagCEmitSymbols(Out, name, rule->In.RawAppendant0, rule->Header.In.Appendant0Size, symbolSize);
+            snprintf(name, sizeof(name), "Rule%lu_1", i);
+            TagCEmitSymbols(Out, name, rule->In.RawAppendant1, rule->Header.In.Appendant1Size, symbolSize);
+            break;
+
+        case IoSel_Output:
+            snprintf(name, sizeof(name), "Rule%lu", i);
+            TagCEmitSymbols(Out, name, rule->Out.RawAppendant, rule->Header.Out.AppendantSize, symbolSize);
+            break;
+
+        default:
+            assert(false);
+            BAIL(status = ENV_BADENUM);
+        }
+    }
+    fprintf(Out, "\n");
+
+    fprintf(Out, "static int\n");
+    fprintf(Out, "Run(uint64_t MaxSteps, uint64_t *StepsTaken)\n");
+    fprintf(Out, "{\n");
+    fprintf(Out, "    uint64_t steps, reps;\n");
+    fprintf(Out, "    sym_t symbol;\n");
+    fprintf(Out, "    bool bit;\n");
+    fprintf(Out, "    int status = 0;\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "    (void) bit;\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "    for (steps = 0; steps < MaxSteps; ++steps)\n");
+    fprintf(Out, "    {\n");
+    fprintf(Out, "        if (!Pop(&symbol, &reps))\n");
+    fprintf(Out, "        {\n");
+    fprintf(Out, "            status = STOP_OUTOFTAPE;\n");
+    fprintf(Out, "            goto Bail;\n");
+    fprintf(Out, "        }\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "        switch (symbol) {\n");
+
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+
+        fprintf(Out, "        case 0x%lx:\n", TagSymbolValue(rule->RawSymbol, symbolSize));
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            snprintf(name, sizeof(name), "Rule%lu", i);
+            TagCEmitPush(Out, "            ", name, rule->Header.Pure.AppendantSize, Binary);
+            break;
+
+        case IoSel_Input:
+            fprintf(Out, "            if (!GetBit(&bit))\n");
+            fprintf(Out, "            {\n");
+            fprintf(Out, "                status = STOP_EOF;\n");
+            fprintf(Out, "                goto Bail;\n");
+            fprintf(Out, "            }\n");
+            fprintf(Out, "            if (bit)\n");
+            fprintf(Out, "            {\n");
+            snprintf(name, sizeof(name), "Rule%lu_1", i);
+            TagCEmitPush(Out, "                ", name, rule->Header.In.Appendant1Size, Binary);
+            fprintf(Out, "            }\n");
+            fprintf(Out, "            else\n");
+            fprintf(Out, "            {\n");
+            snprintf(name, sizeof(name), "Rule%lu_0", i);
+            TagCEmitPush(Out, "                ", name, rule->Header.In.Appendant0Size, Binary);
+            fprintf(Out, "            }\n");
+            break;
+
+        case IoSel_Output:
+            fprintf(Out, "            if (!PutBit(%d))\n", rule->Out.Bit != 0);
+            fprintf(Out, "            {\n");
+            fprintf(Out, "                status = STOP_EOF;\n");
+            fprintf(Out, "                goto Bail;\n");
+            fprintf(Out, "            }\n");
+            snprintf(name, sizeof(name), "Rule%lu", i);
+            TagCEmitPush(Out, "            ", name, rule->Header.Out.AppendantSize, Binary);
+            break;
+
+        default:
+            assert(false);
+            BAIL(status = ENV_BADENUM);
+        }
+
+        fprintf(Out, "            break;\n");
+        fprintf(Out, "\n");
+    }
+
+    fprintf(Out, "        default:\n");
+    fprintf(Out, "            status = STOP_BADRULE;\n");
+    fprintf(Out, "            goto Bail;\n");
+    fprintf(Out, "        }\n");
+    fprintf(Out, "    }\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "Bail:\n");
+    fprintf(Out, "    *StepsTaken = steps;\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "    return status;\n");
+    fprintf(Out, "}\n");
+    fprintf(Out, "\n");
+
+Bail:
+    return status;
+}
+
+//
+// Emits one entry of the pool and the table fields describing it.
+//
+static
+void
+TagCEmitPoolEntry(
+    FILE *Out,
+    uint8_t *Data,
+    uint64_t Size,
+    uint64_t *Offset,
+    TagBin *Binary
+    )
+{
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    uint64_t i;
+
+    for (i = 0; i < Size / symbolSize; ++i)
+    {
+        fprintf(Out, "%s0x%lx,",
+                ((*Offset + i) % 8 == 0) ? "\n    " : " ",
+                TagSymbolValue(&Data[i * symbolSize], symbolSize));
+    }
+
+    *Offset += Size / symbolSize;
+}
+
+static
+void
+TagCEmitTableEntry(
+    FILE *Out,
+    uint64_t Offset,
+    uint64_t Size,
+    TagBin *Binary
+    )
+{
+    uint64_t length = Size / Binary->Header.SymbolSize;
+
+    fprintf(Out, " { %lu, %lu, %lu },",
+            Offset,
+            length,
+            TagCGcd(length, Binary->Header.DeletionNumber));
+}
+
+//
+// Programs with a huge number of rules take the C compiler far too long as one
+// switch so they get a table indexed by symbol value instead. The appendants
+// all live back to back in one pool.
+//
+static
+STATUS
+TagCEmitTable(
+    FILE *Out,
+    TagBin *Binary
+    )
+{
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+    uint64_t i, offset, maxValue = 0;
+
+    fprintf(Out, "static const sym_t Appendants[] = {\n    0,");
+    offset = 1;
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+
+        maxValue = MAX(maxValue, TagSymbolValue(rule->RawSymbol, symbolSize));
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            TagCEmitPoolEntry(Out, rule->Pure.RawAppendant, rule->Header.Pure.AppendantSize, &offset, Binary);
+            break;
+
+        case IoSel_Input:
+            TagCEmitPoolEntry(Out, rule->In.RawAppendant0, rule->Header.In.Appendant0Size, &offset, Binary);
+            TagCEmitPoolEntry(Out, rule->In.RawAppendant1, rule->Header.In.Appendant1Size, &offset, Binary);
+            break;
+
+        case IoSel_Output:
+            TagCEmitPoolEntry(Out, rule->Out.RawAppendant, rule->Header.Out.AppendantSize, &offset, Binary);
+            break;
+
+        default:
+            assert(false);
+            BAIL(status = ENV_BADENUM);
+        }
+    }
+    fprintf(Out, "\n};\n");
+    fprintf(Out, "\n");
+
+    fprintf(Out, "#define STYLE_NONE 0\n");
+    fprintf(Out, "#define STYLE_PURE 1\n");
+    fprintf(Out, "#define STYLE_INPUT 2\n");
+    fprintf(Out, "#define STYLE_OUTPUT 3\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "typedef struct\n");
+    fprintf(Out, "{\n");
+    fprintf(Out, "    uint8_t Style;\n");
+    fprintf(Out, "    uint8_t Bit;\n");
+    fprintf(Out, "    struct\n");
+    fprintf(Out, "    {\n");
+    fprintf(Out, "        uint64_t Offset;\n");
+    fprintf(Out, "        uint64_t Length;\n");
+    fprintf(Out, "        uint64_t Stride;\n");
+    fprintf(Out, "    } Appendant[2];\n");
+    fprintf(Out, "} rule_t;\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "#define RULE_TABLE_SIZE ((uint64_t) %lu)\n", maxValue + 1);
+    fprintf(Out, "static const rule_t Rules[RULE_TABLE_SIZE] = {\n");
+
+    //
+    // The pool is walked in the same order as above to recover the offsets.
+    //
+    offset = 1;
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+
+        fprintf(Out, "    [0x%lx] = ", TagSymbolValue(rule->RawSymbol, symbolSize));
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            fprintf(Out, "{ STYLE_PURE, 0, {");
+            TagCEmitTableEntry(Out, offset, rule->Header.Pure.AppendantSize, Binary);
+            offset += rule->Header.Pure.AppendantSize / symbolSize;
+            break;
+
+        case IoSel_Input:
+            fprintf(Out, "{ STYLE_INPUT, 0, {");
+            TagCEmitTableEntry(Out, offset, rule->Header.In.Appendant0Size, Binary);
+            offset += rule->Header.In.Appendant0Size / symbolSize;
+            TagCEmitTableEntry(Out, offset, rule->Header.In.Appendant1Size, Binary);
+            offset += rule->Header.In.Appendant1Size / symbolSize;
+            break;
+
+        case IoSel_Output:
+            fprintf(Out, "{ STYLE_OUTPUT, %d, {", rule->Out.Bit != 0);
+            TagCEmitTableEntry(Out, offset, rule->Header.Out.AppendantSize, Binary);
+            offset += rule->Header.Out.AppendantSize / symbolSize;
+            break;
+
+        default:
+            assert(false);
+            BAIL(status = ENV_BADENUM);
+        }
+
+        fprintf(Out, " } },\n");
+    }
+    fprintf(Out, "};\n");
+    fprintf(Out, "\n");
+
+    fprintf(Out, "%s",
+        "static int\n"
+        "Run(uint64_t MaxSteps, uint64_t *StepsTaken)\n"
+        "{\n"
+        "    uint64_t steps, reps;\n"
+        "    sym_t symbol;\n"
+        "    const rule_t *rule;\n"
+        "    bool bit = false;\n"
+        "    int status = 0;\n"
+        "\n"
+        "    for (steps = 0; steps < MaxSteps; ++steps)\n"
+        "    {\n"
+        "        if (!Pop(&symbol, &reps))\n"
+        "        {\n"
+        "            status = STOP_OUTOFTAPE;\n"
+        "            goto Bail;\n"
+        "        }\n"
+        "\n"
+        "        if (symbol >= RULE_TABLE_SIZE || Rules[symbol].Style == STYLE_NONE)\n"
+        "        {\n"
+        "            status = STOP_BADRULE;\n"
+        "            goto Bail;\n"
+        "        }\n"
+        "        rule = &Rules[symbol];\n"
+        "\n"
+        "        bit = false;\n"
+        "        if (rule->Style == STYLE_INPUT && !GetBit(&bit))\n"
+        "        {\n"
+        "            status = STOP_EOF;\n"
+        "            goto Bail;\n"
+        "        }\n"
+        "        if (rule->Style == STYLE_OUTPUT && !PutBit(rule->Bit))\n"
+        "        {\n"
+        "            status = STOP_EOF;\n"
+        "            goto Bail;\n"
+        "        }\n"
+        "\n"
+        "        if (rule->Appendant[bit].Length == 0)\n"
+        "        {\n"
+        "            status = STOP_HALT;\n"
+        "            goto Bail;\n"
+        "        }\n"
+        "\n"
+        "        Push(&Appendants[rule->Appendant[bit].Offset],\n"
+        "            rule->Appendant[bit].Length,\n"
+        "            rule->Appendant[bit].Stride,\n"
+        "            reps);\n"
+        "    }\n"
+        "\n"
+        "Bail:\n"
+        "    *StepsTaken = steps;\n"
+        "\n"
+        "    return status;\n"
+        "}\n"
+        "\n");
+
+Bail:
+    return status;
+}
+
+static
+STATUS
+TagCEmit(
+    FILE *Out,
+    TagBin *Binary,
+    bool Table
+    )
+{
+    STATUS status = ENV_OK;
+    uint32_t symbolSize = Binary->Header.SymbolSize;
+
+    fprintf(Out, "//\n// Generated by tagc. Build with: cc -O2 -o prog prog.c\n//\n");
+    fprintf(Out, "#define _POSIX_C_SOURCE 200809L\n");
+    fprintf(Out, "#include <stdio.h>\n");
+    fprintf(Out, "#include <stdlib.h>\n");
+    fprintf(Out, "#include <stdint.h>\n");
+    fprintf(Out, "#include <stdbool.h>\n");
+    fprintf(Out, "#include <unistd.h>\n");
+    fprintf(Out, "\n");
+    fprintf(Out, "#define SYMBOL_SIZE %u\n", symbolSize);
+    fprintf(Out, "#define DELETION_NUMBER ((uint64_t) %u)\n", Binary->Header.DeletionNumber);
+    fprintf(Out, "typedef %s sym_t;\n", TagCSymbolType(symbolSize));
+    fprintf(Out, "\n");
+
+    //
+    // Report stops with the same codes tagi would.
+    //
+    fprintf(Out, "#define STOP_OUTOFTAPE 0x%x\n", (unsigned) TAGSS_OUTOFTAPE);
+    fprintf(Out, "#define STOP_BADRULE 0x%x\n", (unsigned) TAGSS_BADRULE);
+    fprintf(Out, "#define STOP_HALT 0x%x\n", (unsigned) TAGSS_HALT);
+    fprintf(Out, "#define STOP_EOF 0x%x\n", (unsigned) ENV_EOF);
+    fprintf(Out, "\n");
+
+    TagCEmitLines(Out, TagCRuntime);
+
+    if (Binary->Header.QueueSize == 0)
+    {
+        fprintf(Out, "static const sym_t InitialQueue[] = { 0 };\n");
+    }
+    TagCEmitSymbols(Out, "InitialQueue", Binary->Queue, Binary->Header.QueueSize, symbolSize);
+    fprintf(Out, "#define INITIAL_QUEUE_LENGTH %lu\n", (uint64_t) Binary->Header.QueueSize / symbolSize);
+    fprintf(Out, "#define INITIAL_QUEUE_STRIDE %lu\n",
+            TagCGcd(Binary->Header.QueueSize / symbolSize, Binary->Header.DeletionNumber));
+    fprintf(Out, "\n");
+
+    if (Table)
+    {
+        CHECK(status = TagCEmitTable(Out, Binary));
+    }
+    else
+    {
+        CHECK(status = TagCEmitSwitch(Out, Binary));
+    }
+
+    TagCEmitLines(Out, TagCMain);
+
+    if (ferror(Out))
+    {
+        TagWarnx("Unable to write the output");
+        BAIL(status = ENV_FAILURE);
+    }
+
+Bail:
+    return status;
+}
+
+static
+bool
+TagCPreferTable(
+    TagBin *Binary
+    )
+{
+    uint64_t i, maxValue = 0;
+
+    if (Binary->Header.RuleCount <= TAGC_SWITCH_MAX_RULES)
+    {
+        return false;
+    }
+
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        maxValue = MAX(maxValue, TagSymbolValue(Binary->Rules[i].RawSymbol, Binary->Header.SymbolSize));
+    }
+
+    return (maxValue / Binary->Header.RuleCount) < TAGC_TABLE_MAX_SPARSITY;
+}
+
+static
+void
+Usage(
+    void
+    )
+{
+    TagPrint("usage: tagc [-f prog.bin] [-o prog.c] [-s | -t]\n");
+
+    exit(1);
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    TagBin binary;
+    bool binary_initialized = false;
+    int ch;
+
+    char *filename = NULL;
+    int fd = STDIN_FILENO;
+
+    char *output = NULL;
+    FILE *out = stdout;
+
+    //
+    // -s and -t force a switch or a table. By default it depends on the size
+    // of the program.
+    //
+    int dispatch = 0;
+
+    STATUS status = 0;
+
+    while ((ch = getopt(argc, argv, "f:o:st")) != -1)
+    {
+        switch (ch) {
+        case 'f':
+            filename = optarg;
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 's':
+        case 't':
+            dispatch = ch;
+            break;
+
+        default:
+            Usage();
+            break;
+        }
+    }
+
+    if (filename != NULL)
+    {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            status = ENV_FAILURE;
+            TagWarn("open (fd)");
+            goto Bail;
+        }
+    }
+
+    CHECK(status = ReadBinaryFile(fd, &binary));
+    binary_initialized = true;
+
+    CHECK(status = TagCValidate(&binary));
+
+    if (output != NULL)
+    {
+        out = fopen(output, "w");
+        if (out == NULL)
+        {
+            status = ENV_FAILURE;
+            TagWarn("fopen (%s)", output);
+            goto Bail;
+        }
+    }
+
+    if (dispatch == 0)
+    {
+        dispatch = TagCPreferTable(&binary) ? 't' : 's';
+    }
+
+    CHECK(status = TagCEmit(out, &binary, dispatch == 't'));
+
+Bail:
+    if (out != NULL && out != stdout)
+    {
+        if (fclose(out) != 0 && !FAILED(status))
+        {
+            status = ENV_FAILURE;
+            TagWarn("fclose (%s)", output);
+        }
+
+        if (FAILED(status))
+        {
+            (void) unlink(output);
+        }
+    }
+
+    if (fd > 0 && fd != STDIN_FILENO)
+    {
+        (void) close(fd);
+    }
+
+    if (binary_initialized)
+    {
+        TagBinTeardown(&binary);
+    }
+
+    return (status < 0);
+}
@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tommyhash.h"
+
+#include "Util.h"
+#include "Tag.h"
+#include "TagQueue.h"
+#include "TagCheckpoint.h"
+
+//
+// Who SIGUSR2 asks for a snapshot.
+//
+static TagCheckpointer *TagCheckpointSignalled;
+
+static
+void
+TagCheckpointSignal(
+    int Signal
+    )
+{
+    TagCheckpointer *checkpoint = TagCheckpointSignalled;
+
+    (void) Signal;
+
+    if (checkpoint != NULL)
+    {
+        checkpoint->Requested = 1;
+    }
+}
+
+static
+uint32_t
+TagCheckpointRecordSize(
+    uint32_t SymbolSize
+    )
+{
+    return sizeof(uint64_t) + ((SymbolSize + 7) & ~7U);
+}
+
+static
+void
+TagCheckpointFreeOrphan(
+    void *Element
+    )
+{
+    free(*(uint8_t **) Element);
+}
+
+uint64_t
+TagCheckpointProgramHash(
+    TagSystem *System
+    )
+{
+    uint64_t hash = 0;
+    uint64_t i;
+
+    //
+    // The rules are summed so that laying them out differently still gives
+    // the same program.
+    //
+    for (i = 0; i < System->RuleCount; ++i)
+    {
+        TagRule *rule = &System->Rules[i];
+        uint64_t h;
+
+        h = tommy_hash_u64(rule->Style, rule->Symbol.Data, System->SymbolSize);
+
+        switch (rule->Style)
+        {
+        case IoSel_Input:
+            h = tommy_hash_u64(h, rule->In.Appendant0.Data, rule->In.Appendant0.Size);
+            h = tommy_hash_u64(h, rule->In.Appendant1.Data, rule->In.Appendant1.Size);
+            break;
+
+        case IoSel_Output:
+            h = tommy_hash_u64(h + rule->Out.Bit, rule->Out.Appendant.Data, rule->Out.Appendant.Size);
+            break;
+
+        default:
+            h = tommy_hash_u64(h, rule->Pure.Appendant.Data, rule->Pure.Appendant.Size);
+            break;
+        }
+
+        hash += TagHashMix(h);
+    }
+
+    hash = tommy_hash_u64(hash, System->InitialQueue.Data, System->InitialQueue.Size);
+
+    return TagHashMix(hash ^ ((uint64_t) System->AbstractDeletionNumber << 32) ^ System->SymbolSize);
+}
+
+STATUS
+TagCheckpointInitialize(
+    TagCheckpointer *Checkpoint,
+    TagSystem *System,
+    const char *Filename,
+    uint64_t Interval
+    )
+{
+    STATUS status = ENV_OK;
+    struct sigaction action;
+
+    assert(Checkpoint != NULL);
+    assert(System != NULL);
+
+    memset(Checkpoint, 0, sizeof(*Checkpoint));
+    Checkpoint->System = System;
+    Checkpoint->Filename = Filename;
+    Checkpoint->Interval = Interval > 0 ? Interval : UINT64_MAX;
+    Checkpoint->ProgramHash = TagCheckpointProgramHash(System);
+
+    CHECK(status = VectorInitialize(&Checkpoint->Orphans, NULL, 0, sizeof(uint8_t *), TagCheckpointFreeOrphan));
+
+    if (Filename == NULL)
+    {
+        goto Bail;
+    }
+
+    //
+    // Worked out here as the child that writes to it shouldn't allocate.
+    //
+    if (asprintf(&Checkpoint->TempFilename, "%s.tmp", Filename) < 0)
+    {
+        Checkpoint->TempFilename = NULL;
+        TagWarnx("asprintf");
+        BAIL(status = ENV_OOM);
+    }
+
+    assert(TagCheckpointSignalled == NULL);
+    TagCheckpointSignalled = Checkpoint;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = TagCheckpointSignal;
+    action.sa_flags = SA_RESTART;
+    (void) sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGUSR2, &action, NULL) != 0)
+    {
+        TagWarn("sigaction");
+        BAIL(status = TAGCKP_OPEN);
+    }
+
+Bail:
+    if (FAILED(status))
+    {
+        TagCheckpointTeardown(Checkpoint);
+    }
+
+    return status;
+}
+
+//
+// Collects the child writing the last snapshot if it's done, or waits for it
+// to be when Wait is set.
+//
+static
+void
+TagCheckpointReap(
+    TagCheckpointer *Checkpoint,
+    bool Wait
+    )
+{
+    pid_t pid;
+    int wstatus;
+
+    if (Checkpoint->Writer == 0)
+    {
+        return;
+    }
+
+    do
+    {
+        pid = waitpid(Checkpoint->Writer, &wstatus, Wait ? 0 : WNOHANG);
+    } while (pid < 0 && errno == EINTR);
+
+    if (pid == 0)
+    {
+        return;
+    }
+
+    if (pid > 0 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+    {
+        ++Checkpoint->Taken;
+    }
+    else
+    {
+        TagWarnx("Snapshot for step %lu wasn't written", Checkpoint->LastStep);
+        ++Checkpoint->Failed;
+    }
+
+    Checkpoint->Writer = 0;
+
+    //
+    // Does nothing once the system is torn down, which unpins it anyway.
+    //
+    ChunkQueueUnpin(&Checkpoint->System->Tape.Queue);
+}
+
+void
+TagCheckpointTeardown(
+    TagCheckpointer *Checkpoint
+    )
+{
+    if (TagCheckpointSignalled == Checkpoint)
+    {
+        (void) signal(SIGUSR2, SIG_DFL);
+        TagCheckpointSignalled = NULL;
+    }
+
+    TagCheckpointReap(Checkpoint, true);
+
+    free(Checkpoint->TempFilename);
+    Checkpoint->TempFilename = NULL;
+
+    VectorTeardown(&Checkpoint->Orphans);
+}
+
+static
+STATUS
+TagCheckpointWriteAll(
+    int Fd,
+    const void *Data,
+    uint64_t Size
+    )
+{
+    const uint8_t *p = Data;
+    ssize_t n;
+
+    while (Size > 0)
+    {
+        n = write(Fd, p, Size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            TagWarn("write (snapshot)");
+            return TAGCKP_WRITE;
+        }
+
+        p += n;
+        Size -= n;
+    }
+
+    return ENV_OK;
+}
+
+//
+// Writes the snapshot to TempFilename and renames it over Filename. This is
+// what the child runs, so it sticks to system calls and the stack. A spilled
+// queue is read back into its Scratch block, which TagCheckpoint sets up
+// before forking (see ChunkQueuePin).
+//
+static
+STATUS
+TagCheckpointWrite(
+    TagCheckpointer *Checkpoint
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Checkpoint->System;
+    TagQueue *q = &system->Tape;
+    TagCheckpointHeader header;
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    uint8_t buffer[1 << 16];
+    uint64_t used = 0;
+    uint64_t left;
+    uint32_t recordSize;
+    int fd = -1;
+
+    recordSize = TagCheckpointRecordSize(q->SymbolSize);
+    if (sizeof(header) + recordSize > sizeof(buffer))
+    {
+        TagWarnx("Symbols are too wide to snapshot");
+        BAIL(status = TAGCKP_BIG);
+    }
+
+    fd = open(Checkpoint->TempFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        TagWarn("open %s", Checkpoint->TempFilename);
+        BAIL(status = TAGCKP_OPEN);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, TAG_CHECKPOINT_MAGIC, sizeof(header.Magic));
+    header.ProgramHash = Checkpoint->ProgramHash;
+    header.SymbolSize = q->SymbolSize;
+    header.DeletionNumber = q->DeletionNumber;
+    header.Steps = Checkpoint->Clock;
+    header.BitsIn = system->Io.BitsIn;
+    header.BitsOut = system->Io.BitsOut;
+    header.InBuffer = system->Io.In.Buffer;
+    header.InBitOffset = system->Io.In.BitOffset;
+    header.OutBuffer = system->Io.Out.Buffer;
+    header.OutBitOffset = system->Io.Out.BitOffset;
+    header.CacheDirty = q->Cache.Dirty;
+    header.TokenCount = ChunkQueueCount(&q->Queue);
+    header.RecordSize = recordSize;
+
+    memcpy(buffer, &header, sizeof(header));
+    used = sizeof(header);
+
+    //
+    // The cache's record goes first, whether or not there's anything in it.
+    //
+    memset(&buffer[used], 0, recordSize);
+    if (q->Cache.Dirty)
+    {
+        memcpy(&buffer[used], &q->Cache.SymbolCount, sizeof(uint64_t));
+        memcpy(&buffer[used + sizeof(uint64_t)], q->Cache.Symbol.Data, q->SymbolSize);
+    }
+    used += recordSize;
+
+    ChunkQueueBegin(&q->Queue, &cursor);
+
+    for (left = header.TokenCount; left > 0; --left)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(&q->Queue, &cursor);
+        if (token == NULL)
+        {
+            BAIL(status = CHUNKQ_IO);
+        }
+
+        if (used + recordSize > sizeof(buffer))
+        {
+            CHECK(status = TagCheckpointWriteAll(fd, buffer, used));
+            used = 0;
+        }
+
+        memset(&buffer[used], 0, recordSize);
+        memcpy(&buffer[used], &token->Count, sizeof(uint64_t));
+        memcpy(&buffer[used + sizeof(uint64_t)], token->Symbol, q->SymbolSize);
+        used += recordSize;
+    }
+
+    CHECK(status = TagCheckpointWriteAll(fd, buffer, used));
+
+    if (fsync(fd) != 0)
+    {
+        TagWarn("fsync %s", Checkpoint->TempFilename);
+        BAIL(status = TAGCKP_WRITE);
+    }
+
+    if (close(fd) != 0)
+    {
+        fd = -1;
+        TagWarn("close %s", Checkpoint->TempFilename);
+        BAIL(status = TAGCKP_WRITE);
+    }
+    fd = -1;
+
+    if (rename(Checkpoint->TempFilename, Checkpoint->Filename) != 0)
+    {
+        TagWarn("rename %s", Checkpoint->TempFilename);
+        BAIL(status = TAGCKP_WRITE);
+    }
+
+Bail:
+    if (fd >= 0)
+    {
+        (void) close(fd);
+    }
+
+    if (FAILED(status))
+    {
+        (void) unlink(Checkpoint->TempFilename);
+    }
+
+    return status;
+}
+
+STATUS
+TagCheckpoint(
+    TagCheckpointer *Checkpoint
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Checkpoint->System->Tape;
+    pid_t pid;
+
+    assert(Checkpoint->Filename != NULL);
+
+    TagCheckpointReap(Checkpoint, false);
+    if (Checkpoint->Writer != 0)
+    {
+        BAIL(status = TAGCKP_BUSY);
+    }
+
+    if (q->BigTokens > 0 || q->Cache.Extra != NULL)
+    {
+        //
+        // Runs that long only happen with -b and there's no room for them in
+        // a record.
+        //
+        BAIL(status = TAGCKP_BIG);
+    }
+
+    if (Checkpoint->Flush != NULL && FAILED(Checkpoint->Flush(Checkpoint->FlushContext)))
+    {
+        TagWarnx("Couldn't flush the output before the snapshot");
+    }
+
+    //
+    // The child reads the spilled blocks from the same file we go on loading
+    // from, and can't be left to allocate somewhere to read them into: another
+    // thread may hold the allocator's lock when we fork.
+    //
+    CHECK(status = ChunkQueuePin(&q->Queue));
+
+    Checkpoint->LastStep = Checkpoint->Clock;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        //
+        // Straight out, without running anything the parent set up to happen
+        // at exit or flushing its stdio buffers a second time.
+        //
+        _exit(FAILED(TagCheckpointWrite(Checkpoint)) ? 1 : 0);
+    }
+
+    if (pid < 0)
+    {
+        TagWarn("fork (snapshot); writing it here instead");
+
+        status = TagCheckpointWrite(Checkpoint);
+        ChunkQueueUnpin(&q->Queue);
+        if (FAILED(status))
+        {
+            ++Checkpoint->Failed;
+            goto Bail;
+        }
+
+        ++Checkpoint->Taken;
+        goto Bail;
+    }
+
+    Checkpoint->Writer = pid;
+
+Bail:
+    return status;
+}
+
+void
+TagCheckpointStep(
+    TagCheckpointer *Checkpoint,
+    uint64_t Elapsed
+    )
+{
+    STATUS status;
+
+    Checkpoint->Clock += Elapsed;
+    Checkpoint->Requested = 0;
+
+    status = TagCheckpoint(Checkpoint);
+    if (status == TAGCKP_BUSY)
+    {
+        ++Checkpoint->Skipped;
+    }
+    else if (status == TAGCKP_BIG)
+    {
+        TagWarnx("Snapshot for step %lu skipped: the queue holds runs too long to save",
+                Checkpoint->Clock);
+        ++Checkpoint->Skipped;
+    }
+    else if (FAILED(status))
+    {
+        TagWarnx("TagCheckpoint: %x", status);
+    }
+}
+
+//
+// Finds somewhere that will outlive the queue holding SymbolSize bytes the
+// same as Symbol: the symbol of its rule, or a copy of our own.
+//
+static
+STATUS
+TagCheckpointResolve(
+    TagCheckpointer *Checkpoint,
+    uint8_t *Symbol,
+    uint8_t **Resolved
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Checkpoint->System;
+    uint8_t **orphans;
+    uint8_t *copy;
+    TagRule *rule;
+    Blob blob;
+    size_t i;
+
+    blob.Data = Symbol;
+    blob.Size = system->SymbolSize;
+    blob.MaxSize = system->SymbolSize;
+
+    rule = TagLookupRule(system, &blob);
+    if (rule != NULL)
+    {
+        *Resolved = rule->Symbol.Data;
+        goto Bail;
+    }
+
+    //
+    // A symbol without a rule stops the run when it gets to the front, so
+    // there are hardly ever any of these.
+    //
+    orphans = VectorBuffer(&Checkpoint->Orphans);
+    for (i = 0; i < VectorSize(&Checkpoint->Orphans); ++i)
+    {
+        if (memcmp(orphans[i], Symbol, system->SymbolSize) == 0)
+        {
+            *Resolved = orphans[i];
+            goto Bail;
+        }
+    }
+
+    copy = malloc(system->SymbolSize);
+    if (copy == NULL)
+    {
+        TagWarnx("malloc (orphan)");
+        BAIL(status = ENV_OOM);
+    }
+    memcpy(copy, Symbol, system->SymbolSize);
+
+    status = VectorAppend(&Checkpoint->Orphans, &copy);
+    if (FAILED(status))
+    {
+        free(copy);
+        goto Bail;
+    }
+
+    *Resolved = copy;
+
+Bail:
+    return status;
+}
+
+STATUS
+TagRestore(
+    TagCheckpointer *Checkpoint,
+    const char *Filename
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Checkpoint->System;
+    TagQueue *q = &system->Tape;
+    TagCheckpointHeader *header;
+    TagQueueToken tokens[TAGCKP_BATCH];
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    uint8_t *record;
+    uint64_t size = 0;
+    uint64_t records;
+    uint64_t done;
+    uint64_t count;
+    uint64_t i;
+    int fd;
+
+    fd = open(Filename, O_RDONLY);
+    if (fd < 0)
+    {
+        TagWarn("open %s", Filename);
+        BAIL(status = TAGCKP_OPEN);
+    }
+
+    if (fstat(fd, &st) != 0)
+    {
+        TagWarn("fstat %s", Filename);
+        BAIL(status = TAGCKP_OPEN);
+    }
+    size = st.st_size;
+
+    if (size < sizeof(*header))
+    {
+        TagWarnx("%s is too short to be a snapshot", Filename);
+        BAIL(status = TAGCKP_BADFILE);
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        TagWarn("mmap %s", Filename);
+        BAIL(status = TAGCKP_OPEN);
+    }
+
+    //
+    // It's read once front to back.
+    //
+    (void) madvise(map, size, MADV_SEQUENTIAL);
+
+    header = (TagCheckpointHeader *) map;
+
+    if (memcmp(header->Magic, TAG_CHECKPOINT_MAGIC, sizeof(header->Magic)) != 0)
+    {
+        TagWarnx("%s isn't a snapshot", Filename);
+        BAIL(status = TAGCKP_BADFILE);
+    }
+
+    if (header->ProgramHash != Checkpoint->ProgramHash ||
+        header->SymbolSize != q->SymbolSize ||
+        header->DeletionNumber != q->DeletionNumber)
+    {
+        TagWarnx("%s is a snapshot of another program", Filename);
+        BAIL(status = TAGCKP_WRONGPROGRAM);
+    }
+
+    //
+    // There has to be the cache's record and then one for every token.
+    //
+    records = (size - sizeof(*header)) / TagCheckpointRecordSize(q->SymbolSize);
+
+    if (header->RecordSize != TagCheckpointRecordSize(q->SymbolSize) ||
+        records == 0 ||
+        header->TokenCount > records - 1 ||
+        header->InBitOffset >= 8 ||
+        header->OutBitOffset >= 8)
+    {
+        TagWarnx("%s is damaged", Filename);
+        BAIL(status = TAGCKP_BADFILE);
+    }
+
+    //
+    // Out with the starting queue.
+    //
+    CHECK(status = TagQueueDropTokens(q, TagQueueTokenCount(q)));
+    q->Cache.Symbol.Data = NULL;
+    q->Cache.Symbol.Size = 0;
+    q->Cache.SymbolCount = 0;
+    q->Cache.Dirty = false;
+
+    record = map + sizeof(*header);
+
+    if (header->CacheDirty)
+    {
+        memcpy(&q->Cache.SymbolCount, record, sizeof(uint64_t));
+        CHECK(status = TagCheckpointResolve(Checkpoint, record + sizeof(uint64_t), &q->Cache.Symbol.Data));
+        q->Cache.Symbol.Size = q->SymbolSize;
+        q->Cache.Dirty = true;
+    }
+    record += header->RecordSize;
+
+    for (done = 0; done < header->TokenCount; done += count)
+    {
+        count = header->TokenCount - done;
+        if (count > TAGCKP_BATCH)
+        {
+            count = TAGCKP_BATCH;
+        }
+
+        for (i = 0; i < count; ++i)
+        {
+            memcpy(&tokens[i].Count, record, sizeof(uint64_t));
+            if (tokens[i].Count == 0 || (tokens[i].Count & TAGQ_BIG_COUNT) != 0)
+            {
+                TagWarnx("%s has a bad token at %lu", Filename, done + i);
+                BAIL(status = TAGCKP_BADFILE);
+            }
+
+            CHECK(status = TagCheckpointResolve(Checkpoint, record + sizeof(uint64_t), &tokens[i].Symbol));
+            record += header->RecordSize;
+        }
+
+        CHECK(status = TagQueueAppendTokens(q, tokens, count));
+    }
+
+    system->Io.In.Buffer = header->InBuffer;
+    system->Io.In.BitOffset = header->InBitOffset;
+    system->Io.Out.Buffer = header->OutBuffer;
+    system->Io.Out.BitOffset = header->OutBitOffset;
+    system->Io.BitsIn = header->BitsIn;
+    system->Io.BitsOut = header->BitsOut;
+
+    Checkpoint->Clock = header->Steps;
+    Checkpoint->LastStep = header->Steps;
+
+Bail:
+    if (map != MAP_FAILED)
+    {
+        (void) munmap(map, size);
+    }
+
+    if (fd >= 0)
+    {
+        (void) close(fd);
+    }
+
+    return status;
+}
+
+void
+TagCheckpointDump(
+    TagCheckpointer *Checkpoint
+    )
+{
+    //
+    // A snapshot still being written counts once it's done.
+    //
+    TagCheckpointReap(Checkpoint, true);
+
+    TagPrint("checkpoint: %lu snapshots written, %lu skipped, %lu failed, last at step %lu\n",
+            Checkpoint->Taken,
+            Checkpoint->Skipped,
+            Checkpoint->Failed,
+            Checkpoint->LastStep);
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#include <sys/types.h>
+
+#include "Util.h"
+#include "Vector.h"
+#include "Tag.h"
+
+#define TAGCKP                  16
+#define TAGCKP_STATUS(Code)     (MAKE_STATUS(Code, TAGCKP))
+
+#define TAGCKP_OK               0
+#define TAGCKP_OPEN             (TAGCKP_STATUS(1))
+#define TAGCKP_WRITE            (TAGCKP_STATUS(2))
+#define TAGCKP_BADFILE          (TAGCKP_STATUS(3))
+#define TAGCKP_WRONGPROGRAM     (TAGCKP_STATUS(4))
+#define TAGCKP_BIG              (TAGCKP_STATUS(5))
+#define TAGCKP_BUSY             (TAGCKP_STATUS(6))
+
+//
+// Tokens are restored this many at a time.
+//
+#define TAGCKP_BATCH            1024
+
+typedef int(*CheckpointFlushFn)(void *);
+
+#define TAG_CHECKPOINT_MAGIC    "TAGCKP01"
+
+//
+// A snapshot is this header followed by records of RecordSize bytes: first
+// one for the cache and then one for each token in the queue, front to back.
+// A record is the token's count followed by its symbol's SymbolSize bytes,
+// padded out to a multiple of 8. The cache's count is its SymbolCount, and
+// the record means nothing unless CacheDirty is set.
+//
+// Everything is in the host's byte order. The file only makes sense to the
+// program it was taken from, which ProgramHash stands for (see
+// TagCheckpointProgramHash).
+//
+// Steps is how many steps the run had taken, over all the runs it was
+// restored from. BitsIn and BitsOut say how far into its input and output the
+// program was: on restore the input should pick up from byte (BitsIn + 7) / 8
+// and output past BitsOut / 8 bytes was written after the snapshot.
+//
+typedef struct _TagCheckpointHeader
+{
+    char Magic[8];
+    uint64_t ProgramHash;
+    uint32_t SymbolSize;
+    uint32_t DeletionNumber;
+    uint64_t Steps;
+    uint64_t BitsIn;
+    uint64_t BitsOut;
+    uint8_t InBuffer;
+    uint8_t InBitOffset;
+    uint8_t OutBuffer;
+    uint8_t OutBitOffset;
+    uint32_t CacheDirty;
+    uint64_t TokenCount;
+    uint32_t RecordSize;
+    uint32_t Reserved;
+} TagCheckpointHeader;
+
+//
+// Takes snapshots of a TagSystem as TagRun goes (tagi -C), every Interval
+// steps and whenever SIGUSR2 comes in, and restores them (tagi -R).
+//
+// A snapshot is written by a child forked off for it so the run only stops
+// for as long as the fork takes. The child sees the queue exactly as it was
+// and writes it to Filename.tmp before renaming it over Filename, so Filename
+// always holds a whole snapshot. Only one child is out at a time; a snapshot
+// that comes due while the last is still being written is skipped.
+//
+typedef struct _TagCheckpointer
+{
+    TagSystem *System;
+    const char *Filename;
+    char *TempFilename;
+    uint64_t Interval;      // UINT64_MAX for only on SIGUSR2.
+    uint64_t ProgramHash;
+
+    //
+    // Optional. Pushes out whatever output the program has written so far
+    // before each snapshot, so that BitsOut is what a crash leaves behind.
+    //
+    CheckpointFlushFn Flush;
+    void *FlushContext;
+
+    //
+    // Steps completed, as TagRun tells us about them, starting from wherever
+    // the restored run was.
+    //
+    uint64_t Clock;
+
+    volatile sig_atomic_t Requested;
+    pid_t Writer;           // The child writing a snapshot, or 0.
+
+    //
+    // Copies of restored symbols that have no rule, and so nowhere else for
+    // their tokens to point.
+    //
+    Vector Orphans;
+
+    uint64_t Taken;
+    uint64_t Skipped;
+    uint64_t Failed;
+    uint64_t LastStep;      // The step the last snapshot started at.
+} TagCheckpointer;
+
+//
+// Filename can be NULL when we're only here to restore, in which case nothing
+// is ever written. Otherwise SIGUSR2 asks for a snapshot from then on.
+//
+STATUS
+TagCheckpointInitialize(
+    TagCheckpointer *Checkpoint,
+    TagSystem *System,
+    const char *Filename,
+    uint64_t Interval
+    );
+
+//
+// Waits for any snapshot still being written.
+//
+void
+TagCheckpointTeardown(
+    TagCheckpointer *Checkpoint
+    );
+
+//
+// Called from TagRun, between steps, when a snapshot is due. Elapsed is how
+// many steps were taken since the last call. Never fails the run: a snapshot
+// that can't be taken is warned about and counted.
+//
+void
+TagCheckpointStep(
+    TagCheckpointer *Checkpoint,
+    uint64_t Elapsed
+    );
+
+//
+// Starts writing a snapshot of the system as it is now. When it can't fork it
+// writes the snapshot itself before returning.
+//
+STATUS
+TagCheckpoint(
+    TagCheckpointer *Checkpoint
+    );
+
+//
+// Replaces the system's queue and I/O state with those in the snapshot in
+// Filename and sets Clock to its Steps. Has to come before the system takes
+// any steps, and after whatever is done to how the queue is kept (spilling,
+// huge pages) so that the restored tokens go where they should.
+//
+STATUS
+TagRestore(
+    TagCheckpointer *Checkpoint,
+    const char *Filename
+    );
+
+//
+// A hash of the rules, the starting queue and the deletion number that
+// doesn't depend on the order the rules are kept in.
+//
+uint64_t
+TagCheckpointProgramHash(
+    TagSystem *System
+    );
+
+void
+TagCheckpointDump(
+    TagCheckpointer *Checkpoint
+    );
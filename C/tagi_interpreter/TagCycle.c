@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "IoBuffer.h"
+#include "Tag.h"
+#include "TagCycle.h"
+
+//
+// The most output bits replayed in one go. Orbits that write output can't be
+// skipped all at once when the budget is unlimited so they are skipped in
+// batches with a real trip round the orbit in between.
+//
+#define TAGCYCLE_MAX_REPLAY_BITS    (1ULL << 24)
+
+STATUS
+TagCycleInitialize(
+    TagCycle *Cycle,
+    TagSystem *System
+    )
+{
+    STATUS status = ENV_OK;
+
+    assert(Cycle != NULL);
+    assert(System != NULL);
+
+    memset(Cycle, 0, sizeof(*Cycle));
+
+    Cycle->System = System;
+    Cycle->Power = 1;
+
+    Cycle->OutLog = malloc(TAGCYCLE_DEFAULT_LOG_BITS / 8);
+    if (Cycle->OutLog == NULL)
+    {
+        TagWarnx("malloc OutLog (%llu)", TAGCYCLE_DEFAULT_LOG_BITS / 8);
+        BAIL(status = ENV_OOM);
+    }
+
+    System->Io.OutLog = Cycle->OutLog;
+    System->Io.OutLogSize = TAGCYCLE_DEFAULT_LOG_BITS;
+    System->Io.OutLogBits = 0;
+
+    CHECK(status = TagQueueSetHashing(&System->Tape, true));
+
+Bail:
+    if (FAILED(status))
+    {
+        TagCycleTeardown(Cycle);
+    }
+
+    return status;
+}
+
+void
+TagCycleTeardown(
+    TagCycle *Cycle
+    )
+{
+    if (Cycle->System != NULL)
+    {
+        (void) TagQueueSetHashing(&Cycle->System->Tape, false);
+
+        Cycle->System->Io.OutLog = NULL;
+        Cycle->System->Io.OutLogSize = 0;
+        Cycle->System->Io.OutLogBits = 0;
+    }
+
+    free(Cycle->OutLog);
+    Cycle->OutLog = NULL;
+
+    free(Cycle->SavedTokens);
+    Cycle->SavedTokens = NULL;
+
+    free(Cycle->Tokens);
+    Cycle->Tokens = NULL;
+}
+
+//
+// Makes sure Tokens (and SavedTokens) can hold Count tokens.
+//
+static
+STATUS
+TagCycleReserve(
+    TagCycle *Cycle,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueueToken *tokens;
+    uint64_t capacity;
+
+    if (Count <= Cycle->TokenCapacity)
+    {
+        goto Bail;
+    }
+
+    capacity = MAX(Count, 2 * Cycle->TokenCapacity);
+
+    tokens = realloc(Cycle->Tokens, capacity * sizeof(*tokens));
+    if (tokens == NULL)
+    {
+        TagWarnx("realloc Tokens (%lu)", capacity);
+        BAIL(status = ENV_OOM);
+    }
+    Cycle->Tokens = tokens;
+
+    tokens = realloc(Cycle->SavedTokens, capacity * sizeof(*tokens));
+    if (tokens == NULL)
+    {
+        TagWarnx("realloc SavedTokens (%lu)", capacity);
+        BAIL(status = ENV_OOM);
+    }
+    Cycle->SavedTokens = tokens;
+
+    Cycle->TokenCapacity = capacity;
+
+Bail:
+    return status;
+}
+
+//
+// Makes the current configuration the checkpoint.
+//
+static
+STATUS
+TagCycleSave(
+    TagCycle *Cycle,
+    uint64_t Hash
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Cycle->System->Tape;
+    uint64_t tokenCount = TagQueueTokenCount(q);
+
+    Cycle->Saved = false;
+
+    if (tokenCount > 0)
+    {
+        CHECK(status = TagCycleReserve(Cycle, tokenCount));
+        CHECK(status = TagQueuePeekTokens(q, Cycle->SavedTokens, tokenCount));
+    }
+
+    Cycle->SavedTokenCount = tokenCount;
+    Cycle->SavedCacheSymbol = q->Cache.Symbol.Data;
+    Cycle->SavedCacheCount = q->Cache.SymbolCount;
+    Cycle->SavedCacheDirty = q->Cache.Dirty;
+
+    Cycle->SavedHash = Hash;
+    Cycle->SavedClock = Cycle->Clock;
+    Cycle->SavedBitsIn = Cycle->System->Io.BitsIn;
+    Cycle->System->Io.OutLogBits = 0;
+
+    Cycle->Saved = true;
+    ++Cycle->Checkpoints;
+
+Bail:
+    return status;
+}
+
+//
+// Whether the queue really is the same as the checkpoint and not just a
+// hash collision. Symbols are compared by value as the same symbol can live
+// in more than one place.
+//
+static
+STATUS
+TagCycleSame(
+    TagCycle *Cycle,
+    bool *Same
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Cycle->System->Tape;
+    uint64_t tokenCount = TagQueueTokenCount(q);
+    uint64_t i;
+
+    *Same = false;
+
+    if (tokenCount != Cycle->SavedTokenCount ||
+        q->Cache.Dirty != Cycle->SavedCacheDirty ||
+        q->Cache.SymbolCount != Cycle->SavedCacheCount)
+    {
+        goto Bail;
+    }
+
+    if (q->Cache.Dirty &&
+        memcmp(q->Cache.Symbol.Data, Cycle->SavedCacheSymbol, q->SymbolSize) != 0)
+    {
+        goto Bail;
+    }
+
+    if (tokenCount > 0)
+    {
+        CHECK(status = TagQueuePeekTokens(q, Cycle->Tokens, tokenCount));
+    }
+
+    for (i = 0; i < tokenCount; ++i)
+    {
+        if (Cycle->Tokens[i].Count != Cycle->SavedTokens[i].Count ||
+            memcmp(Cycle->Tokens[i].Symbol, Cycle->SavedTokens[i].Symbol, q->SymbolSize) != 0)
+        {
+            goto Bail;
+        }
+    }
+
+    *Same = true;
+
+Bail:
+    return status;
+}
+
+//
+// Goes round the orbit that just closed as many times as Budget allows,
+// writing out what it wrote each time. Returns the steps that covers.
+//
+static
+STATUS
+TagCycleSkip(
+    TagCycle *Cycle,
+    uint64_t Period,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    IoBuffer *io = &Cycle->System->Io;
+    uint64_t bits = io->OutLogBits;
+    uint64_t orbits, i, j;
+
+    *StepsTaken = 0;
+
+    if (bits > io->OutLogSize)
+    {
+        //
+        // The orbit wrote more than we kept.
+        //
+        goto Bail;
+    }
+
+    orbits = Budget / Period;
+    if (bits > 0)
+    {
+        orbits = MIN(orbits, MAX(1, TAGCYCLE_MAX_REPLAY_BITS / bits));
+    }
+
+    //
+    // The replayed bits aren't part of the next orbit's output.
+    //
+    io->OutLog = NULL;
+
+    for (i = 0; bits > 0 && i < orbits; ++i)
+    {
+        for (j = 0; j < bits; ++j)
+        {
+            status = IoBufferPutBit(io, (Cycle->OutLog[j / 8] >> (j % 8)) & 1);
+            if (FAILED(status))
+            {
+                io->OutLog = Cycle->OutLog;
+                goto Bail;
+            }
+        }
+    }
+
+    io->OutLog = Cycle->OutLog;
+
+    Cycle->ReplayedBits += orbits * bits;
+    *StepsTaken = orbits * Period;
+
+Bail:
+    return status;
+}
+
+STATUS
+TagCycleStep(
+    TagCycle *Cycle,
+    uint64_t Elapsed,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Cycle->System->Tape;
+    uint64_t hash, period, taken = 0;
+    bool same = false;
+
+    *StepsTaken = 0;
+
+    Cycle->Clock += Elapsed;
+
+    if (q->BigTokens > 0 || q->Cache.Extra != NULL)
+    {
+        //
+        // BigCounts aren't saved or compared. A queue that needs them is
+        // still growing anyway.
+        //
+        goto Bail;
+    }
+
+    ++Cycle->Checks;
+
+    if (Cycle->Saved &&
+        Cycle->Lambda < Cycle->Power &&
+        (TagQueueTokenCount(q) != Cycle->SavedTokenCount ||
+         q->Cache.SymbolCount != Cycle->SavedCacheCount))
+    {
+        //
+        // Not even the lengths match and it isn't time for a new checkpoint
+        // so there's no need for the hash.
+        //
+        goto Next;
+    }
+
+    hash = TagQueueHash(q);
+
+    if (Cycle->Saved &&
+        hash == Cycle->SavedHash &&
+        Cycle->Clock > Cycle->SavedClock)
+    {
+        CHECK(status = TagCycleSame(Cycle, &same));
+        if (!same)
+        {
+            ++Cycle->Collisions;
+        }
+    }
+
+    if (same && Cycle->System->Io.BitsIn == Cycle->SavedBitsIn)
+    {
+        period = Cycle->Clock - Cycle->SavedClock;
+
+        if (Cycle->Orbits++ == 0)
+        {
+            Cycle->Period = period;
+            Cycle->FirstSeen = Cycle->SavedClock;
+
+            TagPrint("cycle: configuration at step %lu repeated after %lu steps\n",
+                    Cycle->FirstSeen,
+                    Cycle->Period);
+        }
+
+        CHECK(status = TagCycleSkip(Cycle, period, Budget, &taken));
+
+        Cycle->Clock += taken;
+        Cycle->SkippedSteps += taken;
+
+        //
+        // We are back where the orbit started so it starts again from here.
+        // Power is already at least the orbit's length in iterations, so the
+        // next trip round is caught straight away.
+        //
+        CHECK(status = TagCycleSave(Cycle, hash));
+        Cycle->Lambda = 0;
+    }
+    else if (same || !Cycle->Saved || Cycle->Lambda == Cycle->Power)
+    {
+        CHECK(status = TagCycleSave(Cycle, hash));
+        Cycle->Power *= 2;
+        Cycle->Lambda = 0;
+    }
+
+Next:
+    ++Cycle->Lambda;
+
+    *StepsTaken = taken;
+
+Bail:
+    return status;
+}
+
+void
+TagCycleDump(
+    TagCycle *Cycle
+    )
+{
+    TagPrint("cycle: checks: %lu checkpoints: %lu collisions: %lu orbits: %lu skipped: %lu replayed bits: %lu\n",
+            Cycle->Checks,
+            Cycle->Checkpoints,
+            Cycle->Collisions,
+            Cycle->Orbits,
+            Cycle->SkippedSteps,
+            Cycle->ReplayedBits);
+
+    if (Cycle->Orbits > 0)
+    {
+        TagPrint("cycle: configuration at step %lu repeated after %lu steps\n",
+                Cycle->FirstSeen,
+                Cycle->Period);
+    }
+}
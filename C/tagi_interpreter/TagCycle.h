@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "Tag.h"
+
+#define TAGCYCLE                10
+#define TAGCYCLE_STATUS(Code)   (MAKE_STATUS(Code, TAGCYCLE))
+
+#define TAGCYCLE_OK             0
+
+//
+// How much output an orbit can write and still be replayed, in bits.
+//
+#define TAGCYCLE_DEFAULT_LOG_BITS   (1ULL << 20)
+
+//
+// Notices when a run comes back to a configuration it has already been in.
+//
+// Without input a tag system is deterministic so once its queue repeats it
+// goes round the same orbit for good. Brent's algorithm finds that with a
+// single saved configuration: the queue is saved after 1, 2, 4, 8, ... TagRun
+// iterations and every configuration in between is checked against the saved
+// one. Checking compares TagQueue's rolling hash and, only when that matches,
+// the queue itself.
+//
+// Once an orbit is found the rest of the budget is skipped a whole orbit at a
+// time, replaying whatever output the orbit wrote. An orbit that read input
+// proves nothing so the checkpoint just moves on.
+//
+typedef struct _TagCycle
+{
+    TagSystem *System;
+
+    //
+    // Steps completed since we were set up, as TagRun tells us about them.
+    //
+    uint64_t Clock;
+
+    //
+    // Brent's checkpoint is saved after Power iterations and Lambda counts
+    // the iterations since.
+    //
+    uint64_t Power;
+    uint64_t Lambda;
+
+    bool Saved;
+    uint64_t SavedHash;
+    uint64_t SavedClock;
+    uint64_t SavedBitsIn;
+    uint8_t *SavedCacheSymbol;
+    uint64_t SavedCacheCount;
+    bool SavedCacheDirty;
+    TagQueueToken *SavedTokens;
+    uint64_t SavedTokenCount;
+
+    //
+    // Somewhere to peek the current tokens into when the hashes match.
+    //
+    TagQueueToken *Tokens;
+    uint64_t TokenCapacity;
+
+    //
+    // Handed to the IoBuffer so we know what an orbit wrote.
+    //
+    uint8_t *OutLog;
+
+    //
+    // Statistics. Period and FirstSeen describe the first orbit found.
+    //
+    uint64_t Checks;
+    uint64_t Checkpoints;
+    uint64_t Collisions;
+    uint64_t Orbits;
+    uint64_t Period;
+    uint64_t FirstSeen;
+    uint64_t SkippedSteps;
+    uint64_t ReplayedBits;
+} TagCycle;
+
+//
+// Turns on the Tape's rolling hash and logs the system's output for as long
+// as the detector is around.
+//
+STATUS
+TagCycleInitialize(
+    TagCycle *Cycle,
+    TagSystem *System
+    );
+
+void
+TagCycleTeardown(
+    TagCycle *Cycle
+    );
+
+//
+// Elapsed is how many steps were taken since the last call. StepsTaken is how
+// many steps were skipped by going round a known orbit, or 0 if the caller
+// should carry on as normal.
+//
+STATUS
+TagCycleStep(
+    TagCycle *Cycle,
+    uint64_t Elapsed,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    );
+
+void
+TagCycleDump(
+    TagCycle *Cycle
+    );
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "Util.h"
+#include "Blob.h"
+#include "IoBuffer.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "TagJit.h"
+
+#if defined(__x86_64__)
+
+//
+// Every stub starts on its own cache line. The largest (input) stub is 37
+// bytes.
+//
+#define TAGJIT_STUB_SIZE        64
+
+typedef void (*TagJitEnterFn)(TagJit *, uint8_t *);
+
+//
+// Pops the next run and finds its stub. This is the tail of every helper
+// below, which is what lets the stubs jump directly from one to the next.
+//
+static
+inline
+uint8_t *
+TagJitDispatch(
+    TagJit *Jit
+    )
+{
+    STATUS status;
+    Blob symbol;
+    uint64_t value, taken;
+    uint8_t *stub;
+
+    if (Jit->Steps == Jit->MaxSteps)
+    {
+        Jit->Status = ENV_OK;
+        return Jit->Exit;
+    }
+
+    status = TagQueuePop(
+                &Jit->System->Tape,
+                &symbol,
+                &Jit->Repetitions);
+    while (status == TAGQ_BIG_RUN)
+    {
+        //
+        // The generated code only knows 64-bit counts so big runs are taken
+        // by the interpreter.
+        //
+        status = TagRun(Jit->System, 1, &taken);
+        if (FAILED(status))
+        {
+            Jit->Status = status;
+            return Jit->Exit;
+        }
+
+        if (++Jit->Steps == Jit->MaxSteps)
+        {
+            Jit->Status = ENV_OK;
+            return Jit->Exit;
+        }
+
+        status = TagQueuePop(
+                    &Jit->System->Tape,
+                    &symbol,
+                    &Jit->Repetitions);
+    }
+    if (FAILED(status))
+    {
+        Jit->Status = TAGSS_OUTOFTAPE;
+        return Jit->Exit;
+    }
+
+    TagTraceDump("popped symbol", symbol.Data, Jit->System->SymbolSize);
+
+    value = TagSymbolValue(symbol.Data, Jit->System->SymbolSize);
+    stub = (value < Jit->StubsSize) ? Jit->Stubs[value] : NULL;
+    if (stub == NULL)
+    {
+        Jit->Status = TAGSS_BADRULE;
+        return Jit->Exit;
+    }
+
+    return stub;
+}
+
+static
+inline
+uint8_t *
+TagJitAppend(
+    TagJit *Jit,
+    Blob *Appendant
+    )
+{
+    STATUS status;
+
+    if (Appendant->Size == 0)
+    {
+        Jit->Status = TAGSS_HALT;
+        return Jit->Exit;
+    }
+
+    TagTrace("Rep: %lu\n", Jit->Repetitions);
+    TagTraceDump("pushed appendant", Appendant->Data, Appendant->Size);
+    TagTrace("\n");
+
+    status = TagQueuePush(
+                &Jit->System->Tape,
+                Appendant,
+                Jit->Repetitions);
+    if (FAILED(status))
+    {
+        Jit->Status = status;
+        return Jit->Exit;
+    }
+
+    ++Jit->Steps;
+
+    return TagJitDispatch(Jit);
+}
+
+//
+// The C halves of the three kinds of stub. Each returns the address of the
+// stub to run next.
+//
+
+static
+uint8_t *
+TagJitPure(
+    TagJit *Jit,
+    Blob *Appendant
+    )
+{
+    return TagJitAppend(Jit, Appendant);
+}
+
+static
+uint8_t *
+TagJitInput(
+    TagJit *Jit,
+    Blob *Appendant0,
+    Blob *Appendant1
+    )
+{
+    STATUS status;
+    bool input;
+
+    status = IoBufferGetBit(&Jit->System->Io, &input);
+    if (FAILED(status))
+    {
+        Jit->Status = status;
+        return Jit->Exit;
+    }
+
+    return TagJitAppend(Jit, input ? Appendant1 : Appendant0);
+}
+
+static
+uint8_t *
+TagJitOutput(
+    TagJit *Jit,
+    Blob *Appendant,
+    uint32_t Bit
+    )
+{
+    STATUS status;
+
+    status = IoBufferPutBit(&Jit->System->Io, Bit);
+    if (FAILED(status))
+    {
+        Jit->Status = status;
+        return Jit->Exit;
+    }
+
+    return TagJitAppend(Jit, Appendant);
+}
+
+static
+inline
+void
+TagJitEmit(
+    uint8_t **Cursor,
+    const void *Bytes,
+    size_t Size
+    )
+{
+    memcpy(*Cursor, Bytes, Size);
+    *Cursor += Size;
+}
+
+static
+inline
+void
+TagJitEmitMovImm64(
+    uint8_t **Cursor,
+    uint8_t Register,
+    uint64_t Imm
+    )
+{
+    //
+    // REX.W B8+r io: mov r64, imm64
+    //
+    uint8_t op[] = { 0x48, 0xb8 + Register };
+
+    TagJitEmit(Cursor, op, sizeof(op));
+    TagJitEmit(Cursor, &Imm, sizeof(Imm));
+}
+
+//
+// Register numbers as they appear in the B8+r encoding.
+//
+#define RAX 0
+#define RDX 2
+#define RSI 6
+
+static
+void
+TagJitEmitRule(
+    uint8_t *Stub,
+    TagRule *Rule
+    )
+{
+    //
+    // rbx holds the TagJit for the whole run (see the entry stub) so every
+    // stub passes it through as the helper's first argument.
+    //
+    static const uint8_t movRdiRbx[] = { 0x48, 0x89, 0xdf };
+    static const uint8_t callJmpRax[] = { 0xff, 0xd0, 0xff, 0xe0 };
+    uint8_t *cursor = Stub;
+    uint64_t helper;
+
+    memset(Stub, 0xcc, TAGJIT_STUB_SIZE);
+
+    TagJitEmit(&cursor, movRdiRbx, sizeof(movRdiRbx));
+
+    switch (Rule->Style) {
+    case IoSel_Pure:
+        TagJitEmitMovImm64(&cursor, RSI, (uintptr_t) &Rule->Pure.Appendant);
+        helper = (uintptr_t) TagJitPure;
+        break;
+
+    case IoSel_Input:
+        TagJitEmitMovImm64(&cursor, RSI, (uintptr_t) &Rule->In.Appendant0);
+        TagJitEmitMovImm64(&cursor, RDX, (uintptr_t) &Rule->In.Appendant1);
+        helper = (uintptr_t) TagJitInput;
+        break;
+
+    case IoSel_Output:
+        TagJitEmitMovImm64(&cursor, RSI, (uintptr_t) &Rule->Out.Appendant);
+        TagJitEmitMovImm64(&cursor, RDX, (uint64_t) Rule->Out.Bit);
+        helper = (uintptr_t) TagJitOutput;
+        break;
+
+    case IoSel_Max:
+    default:
+        assert(false);
+        helper = 0;
+        break;
+    }
+
+    //
+    // mov rax, helper; call rax; jmp rax
+    //
+    TagJitEmitMovImm64(&cursor, RAX, helper);
+    TagJitEmit(&cursor, callJmpRax, sizeof(callJmpRax));
+
+    assert(cursor <= Stub + TAGJIT_STUB_SIZE);
+}
+
+STATUS
+TagJitInitialize(
+    TagJit *Jit,
+    TagSystem *System
+    )
+{
+    //
+    // Enter(Jit, Stub): push rbx; mov rbx, rdi; jmp rsi
+    // The push also leaves the stack 16-byte aligned for the helper calls.
+    //
+    static const uint8_t enter[] = { 0x53, 0x48, 0x89, 0xfb, 0xff, 0xe6 };
+    //
+    // Exit: pop rbx; ret
+    //
+    static const uint8_t leave[] = { 0x5b, 0xc3 };
+
+    STATUS status = ENV_OK;
+    uint64_t i, stubCount;
+    uint8_t *stub;
+    void *code;
+
+    assert(Jit != NULL);
+    assert(System != NULL);
+
+    memset(Jit, 0, sizeof(*Jit));
+    Jit->System = System;
+
+    if (System->RuleIndex == NULL)
+    {
+        TagWarnx("Symbols too wide (%u bytes) to JIT", System->SymbolSize);
+        BAIL(status = TAGJIT_UNSUPPORTED);
+    }
+
+    for (i = 0, stubCount = 0; i < System->RuleIndexSize; ++i)
+    {
+        if (System->RuleIndex[i] != NULL)
+        {
+            ++stubCount;
+        }
+    }
+
+    Jit->StubsSize = System->RuleIndexSize;
+    Jit->Stubs = calloc(Jit->StubsSize, sizeof(*Jit->Stubs));
+    if (Jit->Stubs == NULL)
+    {
+        TagWarnx("calloc Stubs (%lu)", Jit->StubsSize);
+        BAIL(status = ENV_OOM);
+    }
+
+    //
+    // The entry and exit stubs share the first slot.
+    //
+    Jit->CodeSize = (stubCount + 1) * TAGJIT_STUB_SIZE;
+    code = mmap(
+            NULL,
+            Jit->CodeSize,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0);
+    if (code == MAP_FAILED)
+    {
+        TagWarn("mmap (%zu)", Jit->CodeSize);
+        BAIL(status = TAGJIT_MMAP);
+    }
+    Jit->Code = code;
+
+    memset(Jit->Code, 0xcc, TAGJIT_STUB_SIZE);
+    Jit->Enter = Jit->Code;
+    memcpy(Jit->Enter, enter, sizeof(enter));
+    Jit->Exit = Jit->Code + TAGJIT_STUB_SIZE / 2;
+    memcpy(Jit->Exit, leave, sizeof(leave));
+
+    stub = Jit->Code + TAGJIT_STUB_SIZE;
+    for (i = 0; i < System->RuleIndexSize; ++i)
+    {
+        if (System->RuleIndex[i] == NULL)
+        {
+            continue;
+        }
+
+        TagJitEmitRule(stub, System->RuleIndex[i]);
+        Jit->Stubs[i] = stub;
+        stub += TAGJIT_STUB_SIZE;
+    }
+
+    if (mprotect(Jit->Code, Jit->CodeSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        TagWarn("mprotect");
+        BAIL(status = TAGJIT_MMAP);
+    }
+
+Bail:
+    if (FAILED(status))
+    {
+        TagJitTeardown(Jit);
+    }
+
+    return status;
+}
+
+void
+TagJitTeardown(
+    TagJit *Jit
+    )
+{
+    if (Jit->Code != NULL)
+    {
+        (void) munmap(Jit->Code, Jit->CodeSize);
+    }
+
+    free(Jit->Stubs);
+
+    memset(Jit, 0, sizeof(*Jit));
+}
+
+STATUS
+TagJitRun(
+    TagJit *Jit,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    )
+{
+    union {
+        uint8_t *Code;
+        TagJitEnterFn Fn;
+    } enter;
+
+    assert(Jit != NULL);
+    assert(Jit->Code != NULL);
+    assert(StepsTaken != NULL);
+
+    Jit->Steps = 0;
+    Jit->MaxSteps = MaxSteps;
+    Jit->Status = ENV_OK;
+
+    enter.Code = Jit->Enter;
+    enter.Fn(Jit, TagJitDispatch(Jit));
+
+    *StepsTaken = Jit->Steps;
+
+    return Jit->Status;
+}
+
+#else
+
+STATUS
+TagJitInitialize(
+    TagJit *Jit,
+    TagSystem *System
+    )
+{
+    (void) System;
+
+    memset(Jit, 0, sizeof(*Jit));
+
+    TagWarnx("The JIT only targets x86-64");
+
+    return TAGJIT_UNSUPPORTED;
+}
+
+void
+TagJitTeardown(
+    TagJit *Jit
+    )
+{
+    (void) Jit;
+}
+
+STATUS
+TagJitRun(
+    TagJit *Jit,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    )
+{
+    (void) Jit;
+    (void) MaxSteps;
+
+    *StepsTaken = 0;
+
+    return TAGJIT_UNSUPPORTED;
+}
+
+#endif
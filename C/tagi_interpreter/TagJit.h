@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Util.h"
+#include "Tag.h"
+
+#define TAGJIT                  5
+#define TAGJIT_STATUS(Code)     (MAKE_STATUS(Code, TAGJIT))
+
+#define TAGJIT_OK               0
+#define TAGJIT_UNSUPPORTED      (TAGJIT_STATUS(1))
+#define TAGJIT_MMAP             (TAGJIT_STATUS(2))
+
+//
+// Each rule gets its own stub of native code. A stub performs the rule's I/O
+// and appends its appendant (by calling back into C for the queue work) and
+// then jumps straight to the stub of whichever rule the next popped symbol
+// selects. There is no central dispatch loop; control only comes back out
+// through the exit stub when the system stops or the step budget runs out.
+//
+// Only x86-64 is supported and only for systems that have a dense RuleIndex
+// (see TAG_DENSE_INDEX_MAX_SYMBOLSIZE) since the stubs are found the same way.
+// Everything else gets TAGJIT_UNSUPPORTED and should use TagRun.
+//
+typedef struct _TagJit
+{
+    TagSystem *System;
+
+    //
+    // The mmap'd stubs. Code is read/execute once TagJitInitialize returns.
+    //
+    uint8_t *Code;
+    size_t CodeSize;
+
+    uint8_t *Enter;
+    uint8_t *Exit;
+
+    //
+    // Stubs[value] is the stub for the rule whose symbol has that value (or
+    // NULL when there is no such rule), mirroring System->RuleIndex.
+    //
+    uint8_t **Stubs;
+    uint64_t StubsSize;
+
+    //
+    // Per-run state the stubs share with the C helpers.
+    //
+    uint64_t Repetitions;
+    uint64_t Steps;
+    uint64_t MaxSteps;
+    STATUS Status;
+} TagJit;
+
+STATUS
+TagJitInitialize(
+    TagJit *Jit,
+    TagSystem *System
+    );
+
+void
+TagJitTeardown(
+    TagJit *Jit
+    );
+
+//
+// Same contract as TagRun.
+//
+STATUS
+TagJitRun(
+    TagJit *Jit,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    );
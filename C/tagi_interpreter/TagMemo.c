@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+
+#include "tommyhashlin.h"
+
+#include "Util.h"
+#include "Blob.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "TagMemo.h"
+
+//
+// Recording runs the segment against a scratch queue whose cache only holds
+// the bucket phase, not the real count. That is only the same as running it
+// for real if none of the count arithmetic on the real queue can overflow, so
+// keep the counts well away from that.
+//
+#define TAGMEMO_MAX_CACHE_COUNT     (1ULL << 62)
+#define TAGMEMO_MAX_REPETITIONS     (1ULL << 32)
+
+typedef struct _TagMemoEntry
+{
+    tommy_node Node;
+
+    //
+    // False when the segment hit an I/O, halting or missing rule. There is
+    // nothing else recorded in that case.
+    //
+    bool Pure;
+
+    //
+    // The state of the scratch cache once the segment was done. CacheCount
+    // is relative to the phase the segment was recorded at.
+    //
+    bool CacheDirty;
+    uint8_t *CacheSymbol;
+    uint64_t CacheCount;
+
+    //
+    // What was flushed into the ring, in order. The first one carries the
+    // real cache's full buckets on top of its count when it is replayed.
+    //
+    uint64_t TokenCount;
+    TagQueueToken *Tokens;
+
+    uint8_t *Key;
+} TagMemoEntry;
+
+static
+int
+TagMemoCompare(
+    const void *Arg,    /* TagMemo* */
+    const void *Obj     /* TagMemoEntry* */
+    )
+{
+    const TagMemo *memo = (const TagMemo *) Arg;
+    const TagMemoEntry *entry = (const TagMemoEntry *) Obj;
+
+    return memcmp(memo->Key, entry->Key, memo->KeySize);
+}
+
+static
+void
+TagMemoEvict(
+    TagMemo *Memo
+    )
+{
+    tommy_hashlin_foreach(&Memo->Entries, free);
+    tommy_hashlin_done(&Memo->Entries);
+    tommy_hashlin_init(&Memo->Entries);
+
+    Memo->UsedBytes = 0;
+}
+
+STATUS
+TagMemoInitialize(
+    TagMemo *Memo,
+    TagSystem *System,
+    uint64_t SegmentTokens,
+    uint64_t BudgetBytes
+    )
+{
+    STATUS status = ENV_OK;
+
+    assert(Memo != NULL);
+    assert(System != NULL);
+
+    memset(Memo, 0, sizeof(*Memo));
+
+    tommy_hashlin_init(&Memo->Entries);
+
+    if (SegmentTokens < 1)
+    {
+        TagWarnx("Segments must be at least 1 token");
+        BAIL(status = ENV_BADARG);
+    }
+
+    Memo->System = System;
+    Memo->SegmentTokens = SegmentTokens;
+    Memo->BudgetBytes = BudgetBytes;
+
+    //
+    // The key is the cache's liveness, symbol and phase followed by each of
+    // the segment's tokens.
+    //
+    Memo->KeySize = 1 + System->SymbolSize + sizeof(uint64_t) +
+                    SegmentTokens * (System->SymbolSize + sizeof(uint64_t));
+
+    Memo->Key = calloc(1, Memo->KeySize);
+    if (Memo->Key == NULL)
+    {
+        TagWarnx("calloc Key (%lu)", Memo->KeySize);
+        BAIL(status = ENV_OOM);
+    }
+
+    Memo->Segment = calloc(SegmentTokens, sizeof(*Memo->Segment));
+    if (Memo->Segment == NULL)
+    {
+        TagWarnx("calloc Segment (%lu)", SegmentTokens);
+        BAIL(status = ENV_OOM);
+    }
+
+    CHECK(status = TagQueueInitialize(
+                &Memo->Scratch,
+                System->AbstractDeletionNumber,
+                System->SymbolSize));
+
+Bail:
+    if (FAILED(status))
+    {
+        TagMemoTeardown(Memo);
+    }
+
+    return status;
+}
+
+void
+TagMemoTeardown(
+    TagMemo *Memo
+    )
+{
+    tommy_hashlin_foreach(&Memo->Entries, free);
+    tommy_hashlin_done(&Memo->Entries);
+
+    TagQueueTeardown(&Memo->Scratch);
+
+    free(Memo->Segment);
+    Memo->Segment = NULL;
+
+    free(Memo->Key);
+    Memo->Key = NULL;
+}
+
+//
+// Fills in Memo->Key from the real queue and Memo->Segment. Returns false if
+// the counts are too large for a recording to be trusted.
+//
+static
+bool
+TagMemoBuildKey(
+    TagMemo *Memo
+    )
+{
+    TagQueue *q = &Memo->System->Tape;
+    uint32_t symbolSize = Memo->System->SymbolSize;
+    uint8_t *key = Memo->Key;
+    uint64_t residue, i;
+
+    if (q->Cache.SymbolCount > TAGMEMO_MAX_CACHE_COUNT ||
+        q->Cache.Extra != NULL)
+    {
+        return false;
+    }
+
+    residue = q->Cache.SymbolCount % q->DeletionNumber;
+
+    *key++ = q->Cache.Dirty;
+    if (q->Cache.Dirty)
+    {
+        memcpy(key, q->Cache.Symbol.Data, symbolSize);
+    }
+    else
+    {
+        memset(key, 0, symbolSize);
+    }
+    key += symbolSize;
+    memcpy(key, &residue, sizeof(residue));
+    key += sizeof(residue);
+
+    for (i = 0; i < Memo->SegmentTokens; ++i)
+    {
+        if (Memo->Segment[i].Count > TAGMEMO_MAX_REPETITIONS)
+        {
+            return false;
+        }
+
+        memcpy(key, Memo->Segment[i].Symbol, symbolSize);
+        key += symbolSize;
+        memcpy(key, &Memo->Segment[i].Count, sizeof(Memo->Segment[i].Count));
+        key += sizeof(Memo->Segment[i].Count);
+    }
+
+    assert(key == Memo->Key + Memo->KeySize);
+
+    return true;
+}
+
+//
+// Runs the segment against the scratch queue and saves the outcome under the
+// current key.
+//
+static
+STATUS
+TagMemoRecord(
+    TagMemo *Memo,
+    tommy_hash_t Hash,
+    TagMemoEntry **Entry
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Memo->System->Tape;
+    TagQueue *scratch = &Memo->Scratch;
+    TagMemoEntry *entry = NULL;
+    TagRule *rule;
+    Blob symbol;
+    uint64_t i, tokenCount, size;
+    bool pure = true;
+
+    assert(TagQueueTokenCount(scratch) == 0);
+
+    scratch->Cache.Symbol = q->Cache.Symbol;
+    scratch->Cache.SymbolCount = q->Cache.SymbolCount % q->DeletionNumber;
+    scratch->Cache.Dirty = q->Cache.Dirty;
+
+    for (i = 0; i < Memo->SegmentTokens; ++i)
+    {
+        symbol.Data = Memo->Segment[i].Symbol;
+        symbol.Size = Memo->System->SymbolSize;
+        symbol.MaxSize = Memo->System->SymbolSize;
+
+        rule = TagLookupRule(Memo->System, &symbol);
+        if (rule == NULL ||
+            rule->Style != IoSel_Pure ||
+            rule->Pure.Appendant.Size == 0)
+        {
+            pure = false;
+            break;
+        }
+
+        CHECK(status = TagQueuePush(
+                    scratch,
+                    &rule->Pure.Appendant,
+                    Memo->Segment[i].Count));
+    }
+
+    tokenCount = pure ? TagQueueTokenCount(scratch) : 0;
+
+    size = sizeof(*entry) +
+           tokenCount * sizeof(*entry->Tokens) +
+           Memo->KeySize;
+
+    if (Memo->UsedBytes + size > Memo->BudgetBytes)
+    {
+        TagMemoEvict(Memo);
+        ++Memo->Evictions;
+    }
+
+    entry = malloc(size);
+    if (entry == NULL)
+    {
+        TagWarnx("malloc entry (%lu)", size);
+        BAIL(status = ENV_OOM);
+    }
+    memset(entry, 0, sizeof(*entry));
+
+    entry->Pure = pure;
+    entry->TokenCount = tokenCount;
+    entry->Tokens = (TagQueueToken *) (entry + 1);
+    entry->Key = (uint8_t *) (entry->Tokens + tokenCount);
+    memcpy(entry->Key, Memo->Key, Memo->KeySize);
+
+    if (pure)
+    {
+        CHECK(status = TagQueuePeekTokens(scratch, entry->Tokens, tokenCount));
+
+        entry->CacheDirty = scratch->Cache.Dirty;
+        entry->CacheSymbol = scratch->Cache.Symbol.Data;
+        entry->CacheCount = scratch->Cache.SymbolCount;
+    }
+
+    tommy_hashlin_insert(&Memo->Entries, &entry->Node, entry, Hash);
+    Memo->UsedBytes += size;
+
+    *Entry = entry;
+    entry = NULL;
+
+Bail:
+    free(entry);
+
+    //
+    // Leave the scratch queue empty for next time.
+    //
+    (void) TagQueueDropTokens(scratch, TagQueueTokenCount(scratch));
+    scratch->Cache.Symbol.Data = NULL;
+    scratch->Cache.SymbolCount = 0;
+    scratch->Cache.Dirty = false;
+
+    return status;
+}
+
+//
+// Replays a recorded segment on the real queue.
+//
+static
+STATUS
+TagMemoApply(
+    TagMemo *Memo,
+    TagMemoEntry *Entry
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Memo->System->Tape;
+    TagQueueToken first;
+    uint64_t buckets;
+
+    //
+    // Everything but the phase of the real cache was left out of the
+    // recording. Those full buckets belong to whatever the cache flushes
+    // first or, if it never did, are still sitting in it.
+    //
+    buckets = (q->Cache.SymbolCount / q->DeletionNumber) * q->DeletionNumber;
+
+    CHECK(status = TagQueueDropTokens(q, Memo->SegmentTokens));
+
+    if (Entry->TokenCount > 0)
+    {
+        first = Entry->Tokens[0];
+        first.Count += buckets / q->DeletionNumber;
+
+        CHECK(status = TagQueueAppendTokens(q, &first, 1));
+        CHECK(status = TagQueueAppendTokens(q, &Entry->Tokens[1], Entry->TokenCount - 1));
+
+        buckets = 0;
+    }
+
+    q->Cache.Symbol.Data = Entry->CacheSymbol;
+    q->Cache.Symbol.Size = q->SymbolSize;
+    q->Cache.SymbolCount = buckets + Entry->CacheCount;
+    q->Cache.Dirty = Entry->CacheDirty;
+
+Bail:
+    return status;
+}
+
+STATUS
+TagMemoStep(
+    TagMemo *Memo,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    TagMemoEntry *entry;
+    tommy_hash_t hash;
+
+    *StepsTaken = 0;
+
+    if (Budget < Memo->SegmentTokens ||
+        TagQueueTokenCount(&Memo->System->Tape) < Memo->SegmentTokens)
+    {
+        goto Bail;
+    }
+
+    CHECK(status = TagQueuePeekTokens(
+                &Memo->System->Tape,
+                Memo->Segment,
+                Memo->SegmentTokens));
+
+    if (!TagMemoBuildKey(Memo))
+    {
+        goto Bail;
+    }
+
+    hash = tommy_hash_u64(0, Memo->Key, Memo->KeySize);
+    entry = (TagMemoEntry *) tommy_hashlin_search(
+                &Memo->Entries,
+                TagMemoCompare,
+                Memo,
+                hash);
+    if (entry != NULL)
+    {
+        ++Memo->Hits;
+    }
+    else
+    {
+        CHECK(status = TagMemoRecord(Memo, hash, &entry));
+        ++Memo->Misses;
+    }
+
+    if (!entry->Pure)
+    {
+        ++Memo->Declined;
+        goto Bail;
+    }
+
+    CHECK(status = TagMemoApply(Memo, entry));
+
+    *StepsTaken = Memo->SegmentTokens;
+
+Bail:
+    return status;
+}
+
+void
+TagMemoDump(
+    TagMemo *Memo
+    )
+{
+    uint64_t lookups = Memo->Hits + Memo->Misses;
+
+    TagPrint("memo: hits: %lu misses: %lu (%.1f%% hit rate) declined: %lu evictions: %lu bytes: %lu\n",
+            Memo->Hits,
+            Memo->Misses,
+            lookups ? (100.0 * Memo->Hits) / lookups : 0.0,
+            Memo->Declined,
+            Memo->Evictions,
+            Memo->UsedBytes);
+}
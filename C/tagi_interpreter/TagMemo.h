@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tommyhashlin.h"
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "Tag.h"
+
+#define TAGMEMO                 6
+#define TAGMEMO_STATUS(Code)    (MAKE_STATUS(Code, TAGMEMO))
+
+#define TAGMEMO_OK              0
+
+//
+// How many tokens make up a segment unless told otherwise.
+//
+#define TAGMEMO_DEFAULT_SEGMENT 8
+
+//
+// The memoizer remembers what processing a segment, the first SegmentTokens
+// runs at the front of the queue, appends to the back. A segment is keyed on
+// its tokens together with the state of the back of the queue that matters:
+// the cached symbol, whether it is live and the bucket phase (the cache's
+// count modulo the deletion number). The next time the same segment comes up
+// against the same phase the recorded tokens are spliced in directly instead
+// of looking up and pushing each rule.
+//
+// Only segments made entirely of pure, non-halting rules are remembered. The
+// rest are noted as such and TagRun steps through them one rule at a time.
+//
+// Entries are thrown away wholesale once they take up more than the budget.
+//
+typedef struct _TagMemo
+{
+    TagSystem *System;
+
+    uint64_t SegmentTokens;
+    uint64_t BudgetBytes;
+    uint64_t UsedBytes;
+
+    tommy_hashlin Entries;
+
+    //
+    // Scratch space reused for every lookup and recording.
+    //
+    TagQueue Scratch;
+    TagQueueToken *Segment;
+    uint8_t *Key;
+    uint64_t KeySize;
+
+    //
+    // Statistics.
+    //
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Declined;
+    uint64_t Evictions;
+} TagMemo;
+
+STATUS
+TagMemoInitialize(
+    TagMemo *Memo,
+    TagSystem *System,
+    uint64_t SegmentTokens,
+    uint64_t BudgetBytes
+    );
+
+void
+TagMemoTeardown(
+    TagMemo *Memo
+    );
+
+//
+// Tries to take a whole segment's worth of steps at once. StepsTaken is either
+// SegmentTokens or 0 if the caller should take a normal step instead (the
+// queue is too short, the budget is too small or the segment isn't pure).
+//
+STATUS
+TagMemoStep(
+    TagMemo *Memo,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    );
+
+void
+TagMemoDump(
+    TagMemo *Memo
+    );
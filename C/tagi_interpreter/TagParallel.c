@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+#include <pthread.h>
+
+#include "Util.h"
+#include "Blob.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "TagParallel.h"
+
+//
+// The chunks are expanded against queues that only know the bucket phase, not
+// how full the real cache is. That is the same as expanding onto the real
+// queue only as long as none of the counts come anywhere near overflowing, so
+// spans stay well clear of that.
+//
+#define TAGPAR_MAX_CACHE_COUNT  (1ULL << 62)
+#define TAGPAR_MAX_LENGTH       (1ULL << 56)
+
+//
+// Walks up to Count tokens from the front of the queue, where they sit, and
+// looks up each one's rule. Span is left at the first token that has to be run
+// in order (or whose length doesn't fit), and only the tokens before it are
+// copied out.
+//
+static
+STATUS
+TagParallelMeasure(
+    TagParallel *Parallel,
+    uint64_t Count,
+    uint64_t *Span
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Parallel->System;
+    ChunkQueue *queue = &system->Tape.Queue;
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    TagRule *rule;
+    Blob symbol;
+    uint64_t i, symbols, length, total;
+
+    symbol.Size = system->SymbolSize;
+    symbol.MaxSize = system->SymbolSize;
+
+    total = 0;
+    ChunkQueueBegin(queue, &cursor);
+
+    for (i = 0; i < Count; ++i)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(queue, &cursor);
+        if (token == NULL)
+        {
+            BAIL(status = CHUNKQ_IO);
+        }
+
+        symbol.Data = token->Symbol;
+
+        rule = TagLookupRule(system, &symbol);
+        if (rule == NULL ||
+            rule->Style != IoSel_Pure ||
+            rule->Pure.Appendant.Size == 0)
+        {
+            break;
+        }
+
+        symbols = rule->Pure.Appendant.Size / system->SymbolSize;
+        if (__builtin_mul_overflow(symbols, token->Count, &length) ||
+            length > TAGPAR_MAX_LENGTH - total)
+        {
+            break;
+        }
+
+        Parallel->Tokens[i] = *token;
+        Parallel->Rules[i] = rule;
+        total += length;
+    }
+
+Bail:
+    *Span = i;
+
+    return status;
+}
+
+//
+// Expands the worker's chunk into its own queue, starting from the chunk's
+// phase, and keeps the heads of the buckets it ends up with.
+//
+static
+STATUS
+TagParallelExpand(
+    TagParallelWorker *Worker
+    )
+{
+    STATUS status = ENV_OK;
+    TagParallel *par = Worker->Parallel;
+    TagQueue *scratch = &Worker->Scratch;
+    TagQueueToken *runs;
+    uint64_t i, tokenCount;
+
+    Worker->RunCount = 0;
+
+    //
+    // The symbols that close off the bucket open before this chunk are
+    // headed by someone else. A clean cache sitting part way into a bucket
+    // swallows them without producing a head.
+    //
+    scratch->Cache.Symbol.Data = NULL;
+    scratch->Cache.SymbolCount = Worker->Phase;
+    scratch->Cache.Dirty = false;
+
+    for (i = Worker->First; i < Worker->First + Worker->Count; ++i)
+    {
+        CHECK(status = TagQueuePush(
+                    scratch,
+                    &par->Rules[i]->Pure.Appendant,
+                    par->Tokens[i].Count));
+    }
+
+    tokenCount = TagQueueTokenCount(scratch);
+    if (tokenCount + 1 > Worker->RunCapacity)
+    {
+        runs = realloc(Worker->Runs, (tokenCount + 1) * sizeof(*runs));
+        if (runs == NULL)
+        {
+            TagWarnx("realloc Runs (%lu)", tokenCount + 1);
+            BAIL(status = ENV_OOM);
+        }
+        Worker->Runs = runs;
+        Worker->RunCapacity = tokenCount + 1;
+    }
+
+    CHECK(status = TagQueuePeekTokens(scratch, Worker->Runs, tokenCount));
+    Worker->RunCount = tokenCount;
+
+    //
+    // The cache's last bucket may still be open. It is headed all the same.
+    //
+    if (scratch->Cache.Dirty)
+    {
+        Worker->Runs[Worker->RunCount].Symbol = scratch->Cache.Symbol.Data;
+        Worker->Runs[Worker->RunCount].Count =
+            (scratch->Cache.SymbolCount + scratch->DeletionNumber - 1) / scratch->DeletionNumber;
+        ++Worker->RunCount;
+    }
+
+Bail:
+    (void) TagQueueDropTokens(scratch, TagQueueTokenCount(scratch));
+    scratch->Cache.Symbol.Data = NULL;
+    scratch->Cache.SymbolCount = 0;
+    scratch->Cache.Dirty = false;
+
+    return status;
+}
+
+static
+void *
+TagParallelWorkerMain(
+    void *Arg
+    )
+{
+    TagParallelWorker *worker = (TagParallelWorker *) Arg;
+    TagParallel *par = worker->Parallel;
+    TagParallel_t round;
+    uint64_t seen = 0;
+
+    for (;;)
+    {
+        (void) pthread_mutex_lock(&par->Lock);
+        while (par->Generation == seen)
+        {
+            (void) pthread_cond_wait(&par->Start, &par->Lock);
+        }
+        seen = par->Generation;
+        round = par->Round;
+        (void) pthread_mutex_unlock(&par->Lock);
+
+        if (round == TagParallel_Exit)
+        {
+            break;
+        }
+
+        worker->Status = TagParallelExpand(worker);
+
+        (void) pthread_mutex_lock(&par->Lock);
+        if (--par->Pending == 0)
+        {
+            (void) pthread_cond_signal(&par->Done);
+        }
+        (void) pthread_mutex_unlock(&par->Lock);
+    }
+
+    return NULL;
+}
+
+//
+// Runs one round on every worker and waits for all of them to finish.
+//
+static
+STATUS
+TagParallelRound(
+    TagParallel *Parallel,
+    TagParallel_t Round
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t i;
+
+    (void) pthread_mutex_lock(&Parallel->Lock);
+    Parallel->Round = Round;
+    Parallel->Pending = Parallel->WorkerCount;
+    ++Parallel->Generation;
+    (void) pthread_cond_broadcast(&Parallel->Start);
+    while (Parallel->Pending > 0)
+    {
+        (void) pthread_cond_wait(&Parallel->Done, &Parallel->Lock);
+    }
+    Parallel->Round = TagParallel_Idle;
+    (void) pthread_mutex_unlock(&Parallel->Lock);
+
+    for (i = 0; i < Parallel->WorkerCount; ++i)
+    {
+        if (FAILED(Parallel->Workers[i].Status))
+        {
+            status = Parallel->Workers[i].Status;
+        }
+    }
+
+    return status;
+}
+
+STATUS
+TagParallelInitialize(
+    TagParallel *Parallel,
+    TagSystem *System,
+    uint64_t WorkerCount
+    )
+{
+    STATUS status = ENV_OK;
+    TagParallelWorker *worker;
+    uint64_t i;
+    int error;
+
+    assert(Parallel != NULL);
+    assert(System != NULL);
+
+    memset(Parallel, 0, sizeof(*Parallel));
+
+    (void) pthread_mutex_init(&Parallel->Lock, NULL);
+    (void) pthread_cond_init(&Parallel->Start, NULL);
+    (void) pthread_cond_init(&Parallel->Done, NULL);
+
+    if (WorkerCount < 1)
+    {
+        TagWarnx("Need at least 1 worker");
+        BAIL(status = ENV_BADARG);
+    }
+
+    Parallel->System = System;
+    Parallel->MinimumSpan = TAGPAR_DEFAULT_MINIMUM_SPAN;
+    Parallel->MaximumSpan = TAGPAR_DEFAULT_MAXIMUM_SPAN;
+
+    Parallel->Tokens = calloc(Parallel->MaximumSpan, sizeof(*Parallel->Tokens));
+    if (Parallel->Tokens == NULL)
+    {
+        TagWarnx("calloc Tokens (%lu)", Parallel->MaximumSpan);
+        BAIL(status = ENV_OOM);
+    }
+
+    Parallel->Rules = calloc(Parallel->MaximumSpan, sizeof(*Parallel->Rules));
+    if (Parallel->Rules == NULL)
+    {
+        TagWarnx("calloc Rules (%lu)", Parallel->MaximumSpan);
+        BAIL(status = ENV_OOM);
+    }
+
+    Parallel->Workers = calloc(WorkerCount, sizeof(*Parallel->Workers));
+    if (Parallel->Workers == NULL)
+    {
+        TagWarnx("calloc Workers (%lu)", WorkerCount);
+        BAIL(status = ENV_OOM);
+    }
+    Parallel->WorkerCount = WorkerCount;
+
+    for (i = 0; i < WorkerCount; ++i)
+    {
+        worker = &Parallel->Workers[i];
+        worker->Parallel = Parallel;
+
+        CHECK(status = TagQueueInitialize(
+                    &worker->Scratch,
+                    System->AbstractDeletionNumber,
+                    System->SymbolSize));
+
+        error = pthread_create(&worker->Thread, NULL, TagParallelWorkerMain, worker);
+        if (error != 0)
+        {
+            TagWarnx("pthread_create: %s", strerror(error));
+            BAIL(status = TAGPAR_THREAD);
+        }
+        worker->Started = true;
+    }
+
+Bail:
+    if (FAILED(status))
+    {
+        TagParallelTeardown(Parallel);
+    }
+
+    return status;
+}
+
+void
+TagParallelTeardown(
+    TagParallel *Parallel
+    )
+{
+    TagParallelWorker *worker;
+    uint64_t i;
+
+    (void) pthread_mutex_lock(&Parallel->Lock);
+    Parallel->Round = TagParallel_Exit;
+    ++Parallel->Generation;
+    (void) pthread_cond_broadcast(&Parallel->Start);
+    (void) pthread_mutex_unlock(&Parallel->Lock);
+
+    for (i = 0; i < Parallel->WorkerCount; ++i)
+    {
+        worker = &Parallel->Workers[i];
+
+        if (worker->Started)
+        {
+            (void) pthread_join(worker->Thread, NULL);
+        }
+
+        TagQueueTeardown(&worker->Scratch);
+        free(worker->Runs);
+    }
+
+    free(Parallel->Workers);
+    free(Parallel->Rules);
+    free(Parallel->Tokens);
+
+    (void) pthread_cond_destroy(&Parallel->Done);
+    (void) pthread_cond_destroy(&Parallel->Start);
+    (void) pthread_mutex_destroy(&Parallel->Lock);
+
+    memset(Parallel, 0, sizeof(*Parallel));
+}
+
+STATUS
+TagParallelStep(
+    TagParallel *Parallel,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueue *q = &Parallel->System->Tape;
+    TagParallelWorker *worker;
+    uint64_t i, j, n, chunk, span, phase;
+
+    *StepsTaken = 0;
+
+    if (Parallel->Backoff > 0)
+    {
+        --Parallel->Backoff;
+        goto Bail;
+    }
+
+    n = MIN(TagQueueTokenCount(q), MIN(Parallel->MaximumSpan, Budget));
+    if (n < Parallel->MinimumSpan ||
+        q->Cache.SymbolCount > TAGPAR_MAX_CACHE_COUNT)
+    {
+        goto Bail;
+    }
+
+    CHECK(status = TagParallelMeasure(Parallel, n, &span));
+
+    if (span < Parallel->MinimumSpan)
+    {
+        //
+        // The span ends at the first token that has to be run in order, and
+        // nothing before that will be any different next time. Let TagRun get
+        // past it before looking again.
+        //
+        Parallel->Backoff = span + 1;
+        ++Parallel->Misses;
+        goto Bail;
+    }
+
+    chunk = (span + Parallel->WorkerCount - 1) / Parallel->WorkerCount;
+    for (i = 0; i < Parallel->WorkerCount; ++i)
+    {
+        worker = &Parallel->Workers[i];
+        worker->First = MIN(i * chunk, span);
+        worker->Count = MIN(chunk, span - worker->First);
+        worker->Length = 0;
+
+        for (j = worker->First; j < worker->First + worker->Count; ++j)
+        {
+            worker->Length += Parallel->Tokens[j].Count *
+                (Parallel->Rules[j]->Pure.Appendant.Size / q->SymbolSize);
+        }
+    }
+
+    //
+    // Each chunk starts where the symbols before it leave off.
+    //
+    phase = q->Cache.SymbolCount % q->DeletionNumber;
+    for (i = 0; i < Parallel->WorkerCount; ++i)
+    {
+        worker = &Parallel->Workers[i];
+        worker->Phase = phase;
+        phase = (phase + worker->Length % q->DeletionNumber) % q->DeletionNumber;
+    }
+
+    CHECK(status = TagParallelRound(Parallel, TagParallel_Expand));
+
+    CHECK(status = TagQueueDropTokens(q, span));
+    for (i = 0; i < Parallel->WorkerCount; ++i)
+    {
+        worker = &Parallel->Workers[i];
+
+        CHECK(status = TagQueueAppendRuns(
+                    q,
+                    worker->Runs,
+                    worker->RunCount,
+                    worker->Length));
+    }
+
+    ++Parallel->Spans;
+    Parallel->Steps += span;
+
+    *StepsTaken = span;
+
+Bail:
+    return status;
+}
+
+void
+TagParallelDump(
+    TagParallel *Parallel
+    )
+{
+    TagPrint("parallel: workers: %lu spans: %lu steps: %lu misses: %lu\n",
+            Parallel->WorkerCount,
+            Parallel->Spans,
+            Parallel->Steps,
+            Parallel->Misses);
+}
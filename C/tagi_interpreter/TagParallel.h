@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+
+#define TAGPAR                  7
+#define TAGPAR_STATUS(Code)     (MAKE_STATUS(Code, TAGPAR))
+
+#define TAGPAR_OK               0
+#define TAGPAR_THREAD           (TAGPAR_STATUS(1))
+
+//
+// Spans shorter than this many tokens aren't worth waking the workers for.
+//
+#define TAGPAR_DEFAULT_MINIMUM_SPAN (1 << 14)
+
+//
+// The most tokens handed out in one go. This bounds the scratch memory.
+//
+#define TAGPAR_DEFAULT_MAXIMUM_SPAN (1 << 20)
+
+typedef enum {
+    TagParallel_Idle = 0,
+    TagParallel_Expand,
+    TagParallel_Exit,
+    TagParallel_Max
+} TagParallel_t;
+
+typedef struct _TagParallelWorker
+{
+    struct _TagParallel *Parallel;
+    pthread_t Thread;
+    bool Started;
+
+    //
+    // This worker's chunk of the span, as indexes into Parallel->Tokens.
+    //
+    uint64_t First;
+    uint64_t Count;
+
+    //
+    // How many symbols the chunk appends.
+    //
+    uint64_t Length;
+
+    //
+    // Expand: the bucket phase the chunk starts on and the heads of the
+    // buckets it produces.
+    //
+    uint64_t Phase;
+    TagQueue Scratch;
+    TagQueueToken *Runs;
+    uint64_t RunCount;
+    uint64_t RunCapacity;
+
+    STATUS Status;
+} TagParallelWorker;
+
+//
+// Expands whole spans of the queue across several threads. Every token sitting
+// in the ring was produced before any of them is popped, and a pure rule's
+// appendant depends on nothing but its symbol, so a span of pure tokens can be
+// expanded in any order. The only thing tying the chunks together is where
+// their symbols fall relative to the bucket boundaries, and that only depends
+// on how many symbols came before, i.e. a prefix sum of the chunk lengths
+// modulo the deletion number.
+//
+// Each step starts with the calling thread walking the front of the queue in
+// place, looking up every token's rule, up to the first that isn't a pure,
+// non-halting rule. Only a span that turns out long enough is handed to the
+// workers, which expand a chunk of it each into their own queue, starting from
+// its phase, and keep the heads of the buckets. The calling thread then
+// splices those onto the real queue in order.
+//
+// A span stops at the first I/O (or halting) rule so that I/O happens in the
+// same order it would otherwise. TagRun steps past it normally, and nothing is
+// looked at again until it has.
+//
+typedef struct _TagParallel
+{
+    TagSystem *System;
+
+    uint64_t WorkerCount;
+    TagParallelWorker *Workers;
+
+    uint64_t MinimumSpan;
+    uint64_t MaximumSpan;
+
+    //
+    // The span being worked on.
+    //
+    TagQueueToken *Tokens;
+    TagRule **Rules;
+
+    //
+    // How many more calls to sit out after a span came up too short: enough
+    // for TagRun to get past the token that cut it off.
+    //
+    uint64_t Backoff;
+
+    pthread_mutex_t Lock;
+    pthread_cond_t Start;
+    pthread_cond_t Done;
+    TagParallel_t Round;
+    uint64_t Generation;
+    uint64_t Pending;
+
+    //
+    // Statistics.
+    //
+    uint64_t Spans;
+    uint64_t Steps;
+    uint64_t Misses;        // Spans that came up too short.
+} TagParallel;
+
+STATUS
+TagParallelInitialize(
+    TagParallel *Parallel,
+    TagSystem *System,
+    uint64_t WorkerCount
+    );
+
+void
+TagParallelTeardown(
+    TagParallel *Parallel
+    );
+
+//
+// Tries to expand a span of the queue in parallel. StepsTaken is the number of
+// tokens expanded, or 0 if the caller should take a normal step instead.
+//
+STATUS
+TagParallelStep(
+    TagParallel *Parallel,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    );
+
+void
+TagParallelDump(
+    TagParallel *Parallel
+    );
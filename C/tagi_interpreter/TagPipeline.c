@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include <err.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "Util.h"
+#include "Blob.h"
+#include "IoBuffer.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "TagPipeline.h"
+
+static
+inline
+void
+TagPipelineSend(
+    TagPipeline *Pipe,
+    Blob *Appendant,
+    uint64_t Count,
+    STATUS Status
+    )
+{
+    uint64_t produced = atomic_load_explicit(&Pipe->Produced, memory_order_relaxed);
+    TagPipeMessage *slot;
+
+    while (produced - atomic_load_explicit(&Pipe->Consumed, memory_order_acquire) == Pipe->Depth)
+    {
+        (void) sched_yield();
+    }
+
+    slot = &Pipe->Channel[produced & (Pipe->Depth - 1)];
+    slot->Appendant = Appendant;
+    slot->Count = Count;
+    slot->Status = Status;
+
+    atomic_store_explicit(&Pipe->Produced, produced + 1, memory_order_release);
+}
+
+static
+inline
+void
+TagPipelineReceive(
+    TagPipeline *Pipe,
+    TagPipeMessage *Message
+    )
+{
+    uint64_t consumed = atomic_load_explicit(&Pipe->Consumed, memory_order_relaxed);
+
+    while (consumed == atomic_load_explicit(&Pipe->Produced, memory_order_acquire))
+    {
+        (void) sched_yield();
+    }
+
+    *Message = Pipe->Channel[consumed & (Pipe->Depth - 1)];
+
+    atomic_store_explicit(&Pipe->Consumed, consumed + 1, memory_order_release);
+}
+
+//
+// The head stage's half of every step in the window. This mirrors TagFire up
+// to the push.
+//
+static
+void
+TagPipelineHeadWindow(
+    TagPipeline *Pipe
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Pipe->System;
+    TagRule *rule;
+    Blob symbol;
+    Blob *appendant;
+    uint64_t i;
+    bool input;
+
+    symbol.Size = system->SymbolSize;
+    symbol.MaxSize = system->SymbolSize;
+
+    for (i = 0; i < Pipe->WindowSize; ++i)
+    {
+        if (TagQueueTokenIsBig(&Pipe->Window[i]))
+        {
+            //
+            // Leave it to the tail, which owns the count.
+            //
+            break;
+        }
+
+        symbol.Data = Pipe->Window[i].Symbol;
+
+        rule = TagLookupRule(system, &symbol);
+        if (rule == NULL)
+        {
+            BAIL(status = TAGSS_BADRULE);
+        }
+
+        switch (rule->Style) {
+        case IoSel_Pure:
+            appendant = &rule->Pure.Appendant;
+            break;
+
+        case IoSel_Input:
+            CHECK(status = IoBufferGetBit(&system->Io, &input));
+
+            appendant = input ? &rule->In.Appendant1 : &rule->In.Appendant0;
+            break;
+
+        case IoSel_Output:
+            CHECK(status = IoBufferPutBit(&system->Io, rule->Out.Bit));
+
+            appendant = &rule->Out.Appendant;
+            break;
+
+        case IoSel_Max:
+        default:
+            assert(false);
+            BAIL(status = ENV_FAILURE);
+        }
+
+        if (appendant->Size == 0)
+        {
+            BAIL(status = TAGSS_HALT);
+        }
+
+        TagPipelineSend(Pipe, appendant, Pipe->Window[i].Count, ENV_OK);
+    }
+
+Bail:
+    //
+    // A step that failed still used up its token.
+    //
+    TagPipelineSend(Pipe, NULL, FAILED(status) ? i + 1 : i, status);
+}
+
+static
+void *
+TagPipelineHead(
+    void *Arg
+    )
+{
+    TagPipeline *pipe = (TagPipeline *) Arg;
+    uint64_t seen = 0;
+    bool exit;
+
+    for (;;)
+    {
+        (void) pthread_mutex_lock(&pipe->Lock);
+        while (pipe->Generation == seen && !pipe->Exit)
+        {
+            (void) pthread_cond_wait(&pipe->Start, &pipe->Lock);
+        }
+        seen = pipe->Generation;
+        exit = pipe->Exit;
+        (void) pthread_mutex_unlock(&pipe->Lock);
+
+        if (exit)
+        {
+            break;
+        }
+
+        TagPipelineHeadWindow(pipe);
+    }
+
+    return NULL;
+}
+
+STATUS
+TagPipelineInitialize(
+    TagPipeline *Pipe,
+    TagSystem *System,
+    uint64_t Depth
+    )
+{
+    STATUS status = ENV_OK;
+    int error;
+
+    assert(Pipe != NULL);
+    assert(System != NULL);
+
+    memset(Pipe, 0, sizeof(*Pipe));
+
+    atomic_init(&Pipe->Produced, 0);
+    atomic_init(&Pipe->Consumed, 0);
+    (void) pthread_mutex_init(&Pipe->Lock, NULL);
+    (void) pthread_cond_init(&Pipe->Start, NULL);
+
+    if (Depth < 1 || (Depth & (Depth - 1)) != 0)
+    {
+        TagWarnx("Depth (%lu) must be a power of two", Depth);
+        BAIL(status = ENV_BADARG);
+    }
+
+    Pipe->System = System;
+    Pipe->Depth = Depth;
+
+    Pipe->Channel = calloc(Depth, sizeof(*Pipe->Channel));
+    if (Pipe->Channel == NULL)
+    {
+        TagWarnx("calloc Channel (%lu)", Depth);
+        BAIL(status = ENV_OOM);
+    }
+
+    Pipe->Window = calloc(TAGPIPE_MAX_WINDOW, sizeof(*Pipe->Window));
+    if (Pipe->Window == NULL)
+    {
+        TagWarnx("calloc Window (%u)", TAGPIPE_MAX_WINDOW);
+        BAIL(status = ENV_OOM);
+    }
+
+    error = pthread_create(&Pipe->Thread, NULL, TagPipelineHead, Pipe);
+    if (error != 0)
+    {
+        TagWarnx("pthread_create: %s", strerror(error));
+        BAIL(status = TAGPIPE_THREAD);
+    }
+    Pipe->Started = true;
+
+Bail:
+    if (FAILED(status))
+    {
+        TagPipelineTeardown(Pipe);
+    }
+
+    return status;
+}
+
+void
+TagPipelineTeardown(
+    TagPipeline *Pipe
+    )
+{
+    if (Pipe->Started)
+    {
+        (void) pthread_mutex_lock(&Pipe->Lock);
+        Pipe->Exit = true;
+        (void) pthread_cond_signal(&Pipe->Start);
+        (void) pthread_mutex_unlock(&Pipe->Lock);
+
+        (void) pthread_join(Pipe->Thread, NULL);
+    }
+
+    free(Pipe->Window);
+    free(Pipe->Channel);
+
+    (void) pthread_cond_destroy(&Pipe->Start);
+    (void) pthread_mutex_destroy(&Pipe->Lock);
+
+    memset(Pipe, 0, sizeof(*Pipe));
+}
+
+STATUS
+TagPipelineRun(
+    TagPipeline *Pipe,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    STATUS pushStatus;
+    TagQueue *q = &Pipe->System->Tape;
+    TagPipeMessage message;
+    uint64_t steps, taken, tokens;
+
+    assert(Pipe != NULL);
+    assert(Pipe->Started);
+    assert(StepsTaken != NULL);
+
+    steps = 0;
+
+    while (steps < MaxSteps)
+    {
+        tokens = TagQueueTokenCount(q);
+        if (tokens < Pipe->Depth)
+        {
+            //
+            // Too close to the back of the queue to keep both stages busy.
+            //
+            status = TagRun(Pipe->System, MIN(Pipe->Depth, MaxSteps - steps), &taken);
+            steps += taken;
+            Pipe->SerialSteps += taken;
+            if (FAILED(status))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        Pipe->WindowSize = MIN(tokens, MIN(MaxSteps - steps, TAGPIPE_MAX_WINDOW));
+        CHECK(status = TagQueuePeekTokens(q, Pipe->Window, Pipe->WindowSize));
+
+        (void) pthread_mutex_lock(&Pipe->Lock);
+        ++Pipe->Generation;
+        (void) pthread_cond_signal(&Pipe->Start);
+        (void) pthread_mutex_unlock(&Pipe->Lock);
+
+        ++Pipe->Windows;
+
+        //
+        // Keep draining even if a push fails so the head gets to the end of
+        // its window.
+        //
+        pushStatus = ENV_OK;
+        for (;;)
+        {
+            TagPipelineReceive(Pipe, &message);
+            if (message.Appendant == NULL)
+            {
+                break;
+            }
+
+            if (FAILED(pushStatus))
+            {
+                continue;
+            }
+
+            pushStatus = TagQueuePush(q, message.Appendant, message.Count);
+            if (!FAILED(pushStatus))
+            {
+                ++steps;
+                ++Pipe->PipelinedSteps;
+            }
+        }
+
+        CHECK(status = pushStatus);
+        CHECK(status = TagQueueDropTokens(q, message.Count));
+        CHECK(status = message.Status);
+
+        if (message.Count < Pipe->WindowSize)
+        {
+            //
+            // The head stopped short at a big run.
+            //
+            status = TagRun(Pipe->System, 1, &taken);
+            steps += taken;
+            Pipe->SerialSteps += taken;
+            if (FAILED(status))
+            {
+                break;
+            }
+        }
+    }
+
+Bail:
+    *StepsTaken = steps;
+
+    return status;
+}
+
+void
+TagPipelineDump(
+    TagPipeline *Pipe
+    )
+{
+    TagPrint("pipeline: windows: %lu pipelined steps: %lu serial steps: %lu\n",
+            Pipe->Windows,
+            Pipe->PipelinedSteps,
+            Pipe->SerialSteps);
+}
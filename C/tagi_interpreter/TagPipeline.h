@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "Util.h"
+#include "Blob.h"
+#include "TagQueue.h"
+#include "Tag.h"
+
+#define TAGPIPE                 8
+#define TAGPIPE_STATUS(Code)    (MAKE_STATUS(Code, TAGPIPE))
+
+#define TAGPIPE_OK              0
+#define TAGPIPE_THREAD          (TAGPIPE_STATUS(1))
+
+//
+// How many steps can be in flight between the two stages. Must be a power of
+// two.
+//
+#define TAGPIPE_DEFAULT_DEPTH   1024
+
+//
+// The most tokens handed to the head stage in one go.
+//
+#define TAGPIPE_MAX_WINDOW      (1 << 16)
+
+//
+// What the head stage hands the tail stage for every step. A NULL Appendant
+// ends the window: Count is then how many of the window's tokens were used
+// up (including one that failed) and Status says why it ended.
+//
+typedef struct _TagPipeMessage
+{
+    Blob *Appendant;
+    uint64_t Count;
+    STATUS Status;
+} TagPipeMessage;
+
+//
+// Splits each step in two and runs the halves on different threads. The head
+// stage pops a symbol, looks up its rule and does any I/O, which leaves it
+// knowing which appendant to push and how many times. The tail stage does the
+// pushing. They are joined by a lock-free single-producer single-consumer ring
+// of TagPipeMessages.
+//
+// The two ends of the queue only meet when it is short. So the calling thread,
+// which owns the queue and acts as the tail, hands the head a window of tokens
+// that are already in the ring and that nothing it pushes can disturb; the
+// window is only dropped from the ring once the head is done with it. When
+// there are fewer tokens than the pipeline is deep the run carries on one step
+// at a time through TagRun instead.
+//
+typedef struct _TagPipeline
+{
+    TagSystem *System;
+
+    uint64_t Depth;
+    TagPipeMessage *Channel;
+
+    //
+    // Written only by the head and tail respectively. Kept on separate cache
+    // lines so the stages don't fight over them.
+    //
+    _Alignas(64) _Atomic uint64_t Produced;
+    _Alignas(64) _Atomic uint64_t Consumed;
+
+    _Alignas(64) TagQueueToken *Window;
+    uint64_t WindowSize;
+
+    pthread_t Thread;
+    bool Started;
+    pthread_mutex_t Lock;
+    pthread_cond_t Start;
+    uint64_t Generation;
+    bool Exit;
+
+    //
+    // Statistics.
+    //
+    uint64_t Windows;
+    uint64_t PipelinedSteps;
+    uint64_t SerialSteps;
+} TagPipeline;
+
+STATUS
+TagPipelineInitialize(
+    TagPipeline *Pipe,
+    TagSystem *System,
+    uint64_t Depth
+    );
+
+void
+TagPipelineTeardown(
+    TagPipeline *Pipe
+    );
+
+//
+// Same contract as TagRun.
+//
+STATUS
+TagPipelineRun(
+    TagPipeline *Pipe,
+    uint64_t MaxSteps,
+    uint64_t *StepsTaken
+    );
+
+void
+TagPipelineDump(
+    TagPipeline *Pipe
+    );
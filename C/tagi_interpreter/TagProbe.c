@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "Util.h"
+#include "TagProbe.h"
+
+TagEventRing *TagEvents;
+
+void
+TagEventRecord(
+    TagEventRing *Ring,
+    TagEventKind Kind,
+    uint32_t Aux,
+    uint64_t A,
+    uint64_t B
+    )
+{
+    uint64_t sequence;
+    TagEvent *event;
+
+    sequence = __atomic_fetch_add(&Ring->Head, 1, __ATOMIC_RELAXED);
+    event = &Ring->Events[sequence & (Ring->Capacity - 1)];
+
+    //
+    // Clear Sequence first so that a dump in the middle of this can't take
+    // the slot's old Sequence for the new fields.
+    //
+    __atomic_store_n(&event->Sequence, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    event->Kind = Kind;
+    event->Aux = Aux;
+    event->A = A;
+    event->B = B;
+
+    __atomic_store_n(&event->Sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+static
+STATUS
+TagEventRingWrite(
+    int Fd,
+    const void *Data,
+    uint64_t Size
+    )
+{
+    const uint8_t *p = Data;
+    ssize_t n;
+
+    while (Size > 0)
+    {
+        n = write(Fd, p, Size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return TAGPROBE_WRITE;
+        }
+
+        p += n;
+        Size -= n;
+    }
+
+    return ENV_OK;
+}
+
+STATUS
+TagEventRingDump(
+    TagEventRing *Ring
+    )
+{
+    STATUS status = ENV_OK;
+    TagEventHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, TAG_EVENT_MAGIC, sizeof(header.Magic));
+    header.EventSize = sizeof(TagEvent);
+    header.SymbolSize = Ring->SymbolSize;
+    header.Capacity = Ring->Capacity;
+    header.Recorded = __atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE);
+
+    CHECK(status = TagEventRingWrite(Ring->Fd, &header, sizeof(header)));
+    CHECK(status = TagEventRingWrite(Ring->Fd, Ring->Events, Ring->Capacity * sizeof(TagEvent)));
+
+Bail:
+    return status;
+}
+
+static
+void
+TagEventRingSignal(
+    int Signal
+    )
+{
+    TagEventRing *ring = TagEvents;
+    int saved = errno;
+
+    (void) Signal;
+
+    if (ring != NULL)
+    {
+        (void) TagEventRingDump(ring);
+    }
+
+    errno = saved;
+}
+
+STATUS
+TagEventRingInitialize(
+    TagEventRing *Ring,
+    const char *Filename,
+    uint64_t Capacity,
+    uint32_t SymbolSize
+    )
+{
+    STATUS status = ENV_OK;
+    struct sigaction action;
+
+    assert(Ring != NULL);
+    assert(TagEvents == NULL);
+
+    memset(Ring, 0, sizeof(*Ring));
+    Ring->Fd = -1;
+    Ring->SymbolSize = SymbolSize;
+
+    if (Capacity == 0 || Capacity > (1ULL << 32))
+    {
+        TagWarnx("Bad event ring capacity %lu", Capacity);
+        BAIL(status = ENV_BADARG);
+    }
+
+    Ring->Capacity = 1;
+    while (Ring->Capacity < Capacity)
+    {
+        Ring->Capacity *= 2;
+    }
+
+    Ring->Events = calloc(Ring->Capacity, sizeof(*Ring->Events));
+    if (Ring->Events == NULL)
+    {
+        TagWarnx("calloc Events (%lu)", Ring->Capacity);
+        BAIL(status = ENV_OOM);
+    }
+
+    Ring->Fd = open(Filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (Ring->Fd < 0)
+    {
+        TagWarn("open %s", Filename);
+        BAIL(status = TAGPROBE_OPEN);
+    }
+
+    TagEvents = Ring;
+
+    //
+    // SA_RESTART for the same reason as the profiler's SIGPROF (see
+    // TagProfileInitialize).
+    //
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = TagEventRingSignal;
+    action.sa_flags = SA_RESTART;
+    (void) sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGUSR1, &action, NULL) != 0)
+    {
+        TagWarn("sigaction");
+        BAIL(status = TAGPROBE_OPEN);
+    }
+
+Bail:
+    if (FAILED(status))
+    {
+        TagEventRingTeardown(Ring);
+    }
+
+    return status;
+}
+
+void
+TagEventRingTeardown(
+    TagEventRing *Ring
+    )
+{
+    if (TagEvents == Ring)
+    {
+        (void) signal(SIGUSR1, SIG_DFL);
+        TagEvents = NULL;
+
+        if (FAILED(TagEventRingDump(Ring)))
+        {
+            TagWarn("write (events)");
+        }
+    }
+
+    if (Ring->Fd >= 0)
+    {
+        (void) close(Ring->Fd);
+        Ring->Fd = -1;
+    }
+
+    free(Ring->Events);
+    Ring->Events = NULL;
+}
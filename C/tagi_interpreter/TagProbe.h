@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Util.h"
+
+#define TAGPROBE                15
+#define TAGPROBE_STATUS(Code)   (MAKE_STATUS(Code, TAGPROBE))
+
+#define TAGPROBE_OK             0
+#define TAGPROBE_OPEN           (TAGPROBE_STATUS(1))
+#define TAGPROBE_WRITE          (TAGPROBE_STATUS(2))
+
+//
+// Static tracepoints (USDT) in the hot paths, under the "tagi" provider, for
+// perf probe, bpftrace and the like:
+//
+//  fire            symbol (pointer to SymbolSize bytes), repetitions, style
+//  push            appendant size in bytes, repetitions
+//  flush           cached symbol (pointer), symbols in the cache
+//  block_alloc     block size in bytes, blocks allocated so far
+//  block_free      block size in bytes, blocks given back so far
+//  byte_in         byte, bits read so far
+//  byte_out        byte, bits written so far
+//
+// A disabled probe is a nop with its arguments left where they already are,
+// which is why none of them are worked out just for the probe. They are only
+// there when <sys/sdt.h> is (systemtap-sdt-dev) and TAG_NO_PROBES isn't
+// defined; otherwise they compile away.
+//
+#if !defined(TAG_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TAG_PROBES  1
+#endif
+#endif
+
+#ifdef TAG_PROBES
+#define TagProbe2(Name, A, B)       STAP_PROBE2(tagi, Name, A, B)
+#define TagProbe3(Name, A, B, C)    STAP_PROBE3(tagi, Name, A, B, C)
+#else
+#define TagProbe2(Name, A, B)       ((void) 0)
+#define TagProbe3(Name, A, B, C)    ((void) 0)
+#endif
+
+//
+// The same points can also be recorded into an in-process ring of events
+// (tagi -E), for when there's nothing attached from outside. Recording only
+// happens while TagEvents is set, so turned off it costs a load and a branch
+// that is never taken.
+//
+typedef enum _TagEventKind
+{
+    TagEvent_None = 0,
+    TagEvent_Fire,          // A: symbol value, B: repetitions, Aux: style
+    TagEvent_Push,          // A: appendant size in bytes, B: repetitions
+    TagEvent_Flush,         // A: symbols in the cache, B: buckets flushed
+    TagEvent_BlockAlloc,    // A: block size in bytes, B: blocks allocated
+    TagEvent_BlockFree,     // A: block size in bytes, B: blocks given back
+    TagEvent_ByteIn,        // A: byte, B: bits read so far
+    TagEvent_ByteOut,       // A: byte, B: bits written so far
+    TagEvent_Max,
+} TagEventKind;
+
+//
+// An event as it sits in the ring and in the file. Sequence is one more than
+// the event's position in the stream of all events recorded, and is written
+// last: a slot whose Sequence is 0, or doesn't fit where the slot is, was
+// caught half written.
+//
+typedef struct _TagEvent
+{
+    uint64_t Sequence;
+    uint32_t Kind;
+    uint32_t Aux;
+    uint64_t A;
+    uint64_t B;
+} TagEvent;
+
+#define TAG_EVENT_MAGIC     "TAGEVT01"
+
+//
+// Every dump appends a header and then the whole ring, Capacity events, to
+// the file. The oldest event is at (Recorded % Capacity) once the ring has
+// wrapped.
+//
+typedef struct _TagEventHeader
+{
+    char Magic[8];
+    uint32_t EventSize;
+    uint32_t SymbolSize;
+    uint64_t Capacity;
+    uint64_t Recorded;
+} TagEventHeader;
+
+//
+// Many threads can record at once: each takes a slot with an atomic add and
+// fills it in. Nothing waits. A full ring overwrites its oldest events.
+//
+typedef struct _TagEventRing
+{
+    TagEvent *Events;
+    uint64_t Capacity;      // A power of two.
+    uint64_t Head;          // Events recorded, taken atomically.
+    uint32_t SymbolSize;
+    int Fd;
+} TagEventRing;
+
+#define TAG_EVENT_DEFAULT_CAPACITY  (1 << 16)
+
+extern TagEventRing *TagEvents;
+
+void
+TagEventRecord(
+    TagEventRing *Ring,
+    TagEventKind Kind,
+    uint32_t Aux,
+    uint64_t A,
+    uint64_t B
+    );
+
+//
+// A and B are only evaluated when the ring is on.
+//
+#define TagTraceEvent(Kind, Aux, A, B)                      \
+do {                                                        \
+    if (__builtin_expect(TagEvents != NULL, 0))             \
+    {                                                       \
+        TagEventRecord(TagEvents, (Kind), (Aux), (A), (B)); \
+    }                                                       \
+} while (0)
+
+//
+// Sets up a ring of Capacity events (rounded up to a power of two) that dumps
+// to Filename, starts recording into it and dumps it whenever SIGUSR1 comes
+// in. SymbolSize is only recorded in the header for whoever reads the file.
+//
+STATUS
+TagEventRingInitialize(
+    TagEventRing *Ring,
+    const char *Filename,
+    uint64_t Capacity,
+    uint32_t SymbolSize
+    );
+
+//
+// Stops recording and dumps the ring one last time.
+//
+void
+TagEventRingTeardown(
+    TagEventRing *Ring
+    );
+
+//
+// Appends the ring to its file. Only uses write(2) so it is safe from a
+// signal handler.
+//
+STATUS
+TagEventRingDump(
+    TagEventRing *Ring
+    );
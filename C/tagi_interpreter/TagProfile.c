@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <ctype.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "Util.h"
+#include "Vector.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "Debug.h"
+#include "TagProfile.h"
+
+//
+// A row of the line table. See elvm/target/wm.c.
+//
+typedef struct _TagProfileLine
+{
+    uint64_t Insn;
+    int64_t Pc;             // -1 for glue.
+    int64_t EirLine;
+    char What[32];          // The op, or what the glue is.
+} TagProfileLine;
+
+//
+// Where the EIR from EirLine on came from. Function and File point into the
+// strings read out of the .eir file and either can be NULL.
+//
+typedef struct _TagProfileSource
+{
+    uint64_t EirLine;
+    const char *Function;
+    const char *File;
+    uint64_t Line;
+} TagProfileSource;
+
+typedef struct _TagProfileFile
+{
+    uint64_t Number;
+    const char *Name;
+} TagProfileFile;
+
+//
+// The profile the signal handler counts into.
+//
+static TagProfile *volatile TagProfileActive;
+
+static
+void
+TagProfileTick(
+    int Signal
+    )
+{
+    TagProfile *profile = TagProfileActive;
+    TagSystem *system;
+    TagRule *rule;
+
+    (void) Signal;
+
+    if (profile == NULL)
+    {
+        return;
+    }
+
+    system = profile->System;
+    rule = system->Firing;
+
+    ++profile->Ticks;
+
+    if (rule == NULL || (uint64_t) (rule - system->Rules) >= system->RuleCount)
+    {
+        ++profile->Unattributed;
+        return;
+    }
+
+    ++profile->Samples[rule - system->Rules];
+}
+
+STATUS
+TagProfileInitialize(
+    TagProfile *Profile,
+    TagSystem *System,
+    uint64_t Interval
+    )
+{
+    STATUS status = ENV_OK;
+    struct sigaction action;
+    struct itimerval timer;
+
+    assert(Profile != NULL);
+    assert(System != NULL);
+    assert(TagProfileActive == NULL);
+
+    memset(Profile, 0, sizeof(*Profile));
+
+    if (Interval == 0)
+    {
+        TagWarnx("The sampling interval must be nonzero");
+        BAIL(status = ENV_BADARG);
+    }
+
+    Profile->System = System;
+    Profile->Interval = Interval;
+
+    Profile->Samples = calloc(MAX(System->RuleCount, 1), sizeof(*Profile->Samples));
+    if (Profile->Samples == NULL)
+    {
+        TagWarnx("calloc Samples (%lu)", System->RuleCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    TagProfileActive = Profile;
+
+    //
+    // SA_RESTART so that the program's reads and writes carry on across a
+    // sample.
+    //
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = TagProfileTick;
+    action.sa_flags = SA_RESTART;
+    (void) sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, &Profile->Previous) != 0)
+    {
+        TagWarn("sigaction");
+        BAIL(status = TAGPROF_TIMER);
+    }
+    Profile->Armed = true;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_sec = Interval / 1000000;
+    timer.it_interval.tv_usec = Interval % 1000000;
+    timer.it_value = timer.it_interval;
+
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    {
+        TagWarn("setitimer");
+        BAIL(status = TAGPROF_TIMER);
+    }
+
+Bail:
+    if (FAILED(status))
+    {
+        TagProfileTeardown(Profile);
+    }
+
+    return status;
+}
+
+void
+TagProfileStop(
+    TagProfile *Profile
+    )
+{
+    struct itimerval timer;
+
+    if (!Profile->Armed)
+    {
+        return;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    (void) setitimer(ITIMER_PROF, &timer, NULL);
+    (void) sigaction(SIGPROF, &Profile->Previous, NULL);
+
+    TagProfileActive = NULL;
+    Profile->Armed = false;
+}
+
+void
+TagProfileTeardown(
+    TagProfile *Profile
+    )
+{
+    TagProfileStop(Profile);
+
+    if (TagProfileActive == Profile)
+    {
+        TagProfileActive = NULL;
+    }
+
+    free(Profile->Samples);
+    Profile->Samples = NULL;
+}
+
+static
+void
+TagProfileFreeString(
+    void *Element
+    )
+{
+    free(*(char **) Element);
+}
+
+//
+// Keeps a copy of Length bytes of Text in Strings.
+//
+static
+STATUS
+TagProfileSaveString(
+    Vector *Strings,
+    const char *Text,
+    size_t Length,
+    const char **Saved
+    )
+{
+    STATUS status = ENV_OK;
+    char *copy;
+
+    copy = strndup(Text, Length);
+    if (copy == NULL)
+    {
+        TagWarnx("strndup");
+        BAIL(status = ENV_OOM);
+    }
+
+    status = VectorAppend(Strings, &copy);
+    if (FAILED(status))
+    {
+        free(copy);
+        goto Bail;
+    }
+
+    *Saved = copy;
+
+Bail:
+    return status;
+}
+
+static
+STATUS
+TagProfileReadLines(
+    const char *Filename,
+    Vector *Lines
+    )
+{
+    STATUS status = ENV_OK;
+    TagProfileLine row;
+    uint64_t lineno = 0;
+    uint64_t last = 0;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp = NULL;
+
+    fp = fopen(Filename, "r");
+    if (fp == NULL)
+    {
+        TagWarn("fopen %s", Filename);
+        BAIL(status = TAGPROF_BADLINES);
+    }
+
+    while (getline(&line, &len, fp) > 0)
+    {
+        ++lineno;
+
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+
+        memset(&row, 0, sizeof(row));
+        if (sscanf(line, "%lu %ld %ld %31s", &row.Insn, &row.Pc, &row.EirLine, row.What) != 4 ||
+            row.Insn < last)
+        {
+            TagWarnx("%s:%lu: malformed line table", Filename, lineno);
+            BAIL(status = TAGPROF_BADLINES);
+        }
+        last = row.Insn;
+
+        CHECK(status = VectorAppend(Lines, &row));
+    }
+
+Bail:
+    free(line);
+
+    if (fp != NULL)
+    {
+        (void) fclose(fp);
+    }
+
+    return status;
+}
+
+//
+// Goes through the .eir file noting each function label (a label at the
+// start of a line in .text) and .loc directive, the way 8cc writes them.
+//
+static
+STATUS
+TagProfileReadEir(
+    const char *Filename,
+    Vector *Sources,
+    Vector *Files,
+    Vector *Strings
+    )
+{
+    STATUS status = ENV_OK;
+    TagProfileSource source;
+    TagProfileFile file;
+    TagProfileFile *files;
+    uint64_t eirLine = 0;
+    uint64_t number, cline, i;
+    bool inText = true;
+    char *line = NULL;
+    char *s, *name, *end;
+    size_t len = 0;
+    FILE *fp = NULL;
+
+    memset(&source, 0, sizeof(source));
+
+    fp = fopen(Filename, "r");
+    if (fp == NULL)
+    {
+        TagWarn("fopen %s", Filename);
+        BAIL(status = TAGPROF_BADLINES);
+    }
+
+    while (getline(&line, &len, fp) > 0)
+    {
+        ++eirLine;
+
+        for (s = line; *s == ' ' || *s == '\t'; ++s)
+        {
+        }
+
+        if (strncmp(s, ".text", 5) == 0)
+        {
+            inText = true;
+        }
+        else if (strncmp(s, ".data", 5) == 0)
+        {
+            inText = false;
+        }
+        else if (sscanf(s, ".file %lu", &number) == 1)
+        {
+            name = strchr(s, '"');
+            end = name != NULL ? strrchr(name + 1, '"') : NULL;
+            if (end != NULL)
+            {
+                file.Number = number;
+                CHECK(status = TagProfileSaveString(Strings, name + 1, end - name - 1, &file.Name));
+                CHECK(status = VectorAppend(Files, &file));
+            }
+        }
+        else if (sscanf(s, ".loc %lu %lu", &number, &cline) == 2)
+        {
+            files = VectorBuffer(Files);
+
+            source.File = NULL;
+            for (i = 0; i < VectorSize(Files); ++i)
+            {
+                if (files[i].Number == number)
+                {
+                    source.File = files[i].Name;
+                }
+            }
+
+            source.EirLine = eirLine;
+            source.Line = cline;
+            CHECK(status = VectorAppend(Sources, &source));
+        }
+        else if (s == line && inText && (isalpha((unsigned char) *s) || *s == '_'))
+        {
+            for (end = s; isalnum((unsigned char) *end) || *end == '_'; ++end)
+            {
+            }
+
+            if (*end == ':')
+            {
+                source.EirLine = eirLine;
+                source.File = NULL;
+                source.Line = 0;
+                CHECK(status = TagProfileSaveString(Strings, s, end - s, &source.Function));
+                CHECK(status = VectorAppend(Sources, &source));
+            }
+        }
+    }
+
+Bail:
+    free(line);
+
+    if (fp != NULL)
+    {
+        (void) fclose(fp);
+    }
+
+    return status;
+}
+
+//
+// The row of the line table that Insn falls under, or NULL.
+//
+static
+TagProfileLine *
+TagProfileFindLine(
+    Vector *Lines,
+    uint64_t Insn
+    )
+{
+    TagProfileLine *lines = VectorBuffer(Lines);
+    uint64_t low = 0;
+    uint64_t high = VectorSize(Lines);
+    uint64_t middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (lines[middle].Insn <= Insn)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low > 0 ? &lines[low - 1] : NULL;
+}
+
+static
+TagProfileSource *
+TagProfileFindSource(
+    Vector *Sources,
+    uint64_t EirLine
+    )
+{
+    TagProfileSource *sources = VectorBuffer(Sources);
+    uint64_t low = 0;
+    uint64_t high = VectorSize(Sources);
+    uint64_t middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (sources[middle].EirLine <= EirLine)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low > 0 ? &sources[low - 1] : NULL;
+}
+
+//
+// The W-machine instruction the symbol called Name belongs to: Name ends in
+// _N for instruction N.
+//
+static
+bool
+TagProfileInsnIndex(
+    const char *Name,
+    uint64_t *Insn
+    )
+{
+    const char *digits = strrchr(Name, '_');
+    char *end;
+
+    if (digits == NULL || !isdigit((unsigned char) digits[1]))
+    {
+        return false;
+    }
+
+    errno = 0;
+    *Insn = strtoull(digits + 1, &end, 10);
+
+    return *end == '\0' && errno == 0;
+}
+
+//
+// Writes a frame of a folded stack. The format splits frames on ';' and the
+// count off on the last ' ' so neither can be in one.
+//
+static
+void
+TagProfilePutFrame(
+    FILE *Fp,
+    bool *First,
+    const char *Fmt,
+    ...
+    )
+{
+    char frame[512];
+    char *c;
+    va_list args;
+
+    va_start(args, Fmt);
+    (void) vsnprintf(frame, sizeof(frame), Fmt, args);
+    va_end(args);
+
+    for (c = frame; *c != '\0'; ++c)
+    {
+        if (*c == ';' || isspace((unsigned char) *c))
+        {
+            *c = '_';
+        }
+    }
+
+    fprintf(Fp, "%s%s", *First ? "" : ";", frame);
+    *First = false;
+}
+
+static
+void
+TagProfilePutStack(
+    TagProfile *Profile,
+    FILE *Fp,
+    TagRule *Rule,
+    Debugger *Dbg,
+    Vector *Lines,
+    Vector *Sources
+    )
+{
+    TagSystem *system = Profile->System;
+    TagProfileLine *row = NULL;
+    TagProfileSource *source = NULL;
+    const char *name = NULL;
+    uint64_t value, insn;
+    bool haveInsn = false;
+    bool first = true;
+
+    value = TagSymbolValue(Rule->Symbol.Data, system->SymbolSize);
+
+    if (Dbg != NULL)
+    {
+        name = DebuggerLookupName(Dbg, value);
+    }
+
+    if (name != NULL)
+    {
+        haveInsn = TagProfileInsnIndex(name, &insn);
+    }
+
+    if (haveInsn)
+    {
+        row = TagProfileFindLine(Lines, insn);
+    }
+
+    if (row != NULL && row->Pc >= 0)
+    {
+        source = TagProfileFindSource(Sources, row->EirLine);
+    }
+
+    if (source != NULL)
+    {
+        if (source->Function != NULL)
+        {
+            TagProfilePutFrame(Fp, &first, "%s", source->Function);
+        }
+
+        if (source->Line > 0)
+        {
+            TagProfilePutFrame(Fp, &first, "%s:%lu",
+                    source->File != NULL ? source->File : "?",
+                    source->Line);
+        }
+    }
+
+    if (row != NULL)
+    {
+        if (row->Pc >= 0)
+        {
+            TagProfilePutFrame(Fp, &first, "pc_%ld", row->Pc);
+            TagProfilePutFrame(Fp, &first, "%s@eir:%ld", row->What, row->EirLine);
+        }
+        else
+        {
+            TagProfilePutFrame(Fp, &first, "[%s]", row->What);
+        }
+    }
+
+    if (haveInsn)
+    {
+        TagProfilePutFrame(Fp, &first, "w_%lu", insn);
+    }
+
+    if (name != NULL)
+    {
+        TagProfilePutFrame(Fp, &first, "%s", name);
+    }
+    else
+    {
+        TagProfilePutFrame(Fp, &first, "0x%lx", value);
+    }
+
+    fprintf(Fp, " %lu\n", Profile->Samples[Rule - system->Rules]);
+}
+
+STATUS
+TagProfileWrite(
+    TagProfile *Profile,
+    const char *Filename,
+    Debugger *Dbg,
+    const char *LinesFilename,
+    const char *EirFilename
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Profile->System;
+    Vector lines, sources, files, strings;
+    FILE *fp = NULL;
+    uint64_t i;
+
+    memset(&lines, 0, sizeof(lines));
+    memset(&sources, 0, sizeof(sources));
+    memset(&files, 0, sizeof(files));
+    memset(&strings, 0, sizeof(strings));
+
+    CHECK(status = VectorInitialize(&lines, NULL, 0, sizeof(TagProfileLine), NULL));
+    CHECK(status = VectorInitialize(&sources, NULL, 0, sizeof(TagProfileSource), NULL));
+    CHECK(status = VectorInitialize(&files, NULL, 0, sizeof(TagProfileFile), NULL));
+    CHECK(status = VectorInitialize(&strings, NULL, 0, sizeof(char *), TagProfileFreeString));
+
+    if (LinesFilename != NULL)
+    {
+        CHECK(status = TagProfileReadLines(LinesFilename, &lines));
+    }
+
+    if (EirFilename != NULL)
+    {
+        CHECK(status = TagProfileReadEir(EirFilename, &sources, &files, &strings));
+    }
+
+    fp = fopen(Filename, "w");
+    if (fp == NULL)
+    {
+        TagWarn("fopen %s", Filename);
+        BAIL(status = TAGPROF_WRITE);
+    }
+
+    if (Profile->Unattributed > 0)
+    {
+        fprintf(fp, "[tagi] %lu\n", Profile->Unattributed);
+    }
+
+    for (i = 0; i < system->RuleCount; ++i)
+    {
+        if (Profile->Samples[i] > 0)
+        {
+            TagProfilePutStack(Profile, fp, &system->Rules[i], Dbg, &lines, &sources);
+        }
+    }
+
+    if (ferror(fp))
+    {
+        TagWarnx("write %s", Filename);
+        BAIL(status = TAGPROF_WRITE);
+    }
+
+Bail:
+    if (fp != NULL && fclose(fp) != 0 && SUCCEEDED(status))
+    {
+        TagWarn("fclose %s", Filename);
+        status = TAGPROF_WRITE;
+    }
+
+    VectorTeardown(&strings);
+    VectorTeardown(&files);
+    VectorTeardown(&sources);
+    VectorTeardown(&lines);
+
+    return status;
+}
+
+void
+TagProfileDump(
+    TagProfile *Profile
+    )
+{
+    TagPrint("profile: %lu samples every %lu us, %lu before the first rule fired\n",
+            Profile->Ticks,
+            Profile->Interval,
+            Profile->Unattributed);
+}
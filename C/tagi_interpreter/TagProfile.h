@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <signal.h>
+
+#include "Util.h"
+#include "Tag.h"
+#include "Debug.h"
+
+#define TAGPROF                 14
+#define TAGPROF_STATUS(Code)    (MAKE_STATUS(Code, TAGPROF))
+
+#define TAGPROF_OK              0
+#define TAGPROF_TIMER           (TAGPROF_STATUS(1))
+#define TAGPROF_WRITE           (TAGPROF_STATUS(2))
+#define TAGPROF_BADLINES        (TAGPROF_STATUS(3))
+
+//
+// How often the run is sampled, in microseconds of CPU time.
+//
+#define TAGPROF_DEFAULT_INTERVAL    1000
+
+//
+// A sampling profiler (tagi -F). A SIGPROF timer goes off every Interval of
+// CPU time and the handler counts a sample against whichever rule is firing
+// (TagSystem.Firing), chain links included. That is all it does; working out
+// what the samples mean waits until TagProfileWrite.
+//
+// The samples are written in the folded format flamegraph tools take, one
+// line per rule, with the rule's stack made from every layer we can find out
+// about:
+//
+//  - The rule's name (from the debug symbols). The W-machine assembler names
+//    the symbols for instruction N with an _N suffix, which gives the
+//    W-machine instruction.
+//  - The line table elvm's wm backend writes (WM_LINE_TABLE), which gives the
+//    EIR instruction (its pc, op and line in the .eir file) that the
+//    W-machine instruction was emitted for.
+//  - The .eir file itself, whose labels and .loc directives give the C
+//    function and line the EIR came from.
+//
+// Any layer that is missing is left out of the stacks.
+//
+typedef struct _TagProfile
+{
+    TagSystem *System;
+
+    uint64_t Interval;
+    bool Armed;
+    struct sigaction Previous;
+
+    //
+    // Written by the signal handler. Samples is indexed like System->Rules.
+    // Unattributed counts the samples taken before the first rule fired.
+    //
+    uint64_t *Samples;
+    uint64_t Unattributed;
+    uint64_t Ticks;
+} TagProfile;
+
+//
+// Sets up and starts the timer. Only one profile can be running at a time.
+//
+STATUS
+TagProfileInitialize(
+    TagProfile *Profile,
+    TagSystem *System,
+    uint64_t Interval
+    );
+
+//
+// Stops the timer. The samples are kept.
+//
+void
+TagProfileStop(
+    TagProfile *Profile
+    );
+
+void
+TagProfileTeardown(
+    TagProfile *Profile
+    );
+
+//
+// Writes the folded stacks to Filename. Dbg, LinesFilename (the line table)
+// and EirFilename are each optional.
+//
+STATUS
+TagProfileWrite(
+    TagProfile *Profile,
+    const char *Filename,
+    Debugger *Dbg,
+    const char *LinesFilename,
+    const char *EirFilename
+    );
+
+void
+TagProfileDump(
+    TagProfile *Profile
+    );
@@ -10,14 +10,16 @@
 
 #include "TagQueue.h"
 #include "Blob.h"
-#include "RingBuffer.h"
+#include "ChunkQueue.h"
 #include "Util.h"
+#include "TagProbe.h"
 
-typedef struct _TokenSymbol
-{
-    Blob Value;
-    uint64_t Count;
-} TokenSymbol;
+//
+// The base of the rolling hash and its inverse modulo 2^64. Any odd base has
+// one, which is what lets a pop shift every other token down a position.
+//
+#define TAGQ_HASH_BASE          0x9e3779b97f4a7c15ULL
+#define TAGQ_HASH_BASE_INVERSE  0xf1de83e19937733dULL
 
 
 static
@@ -35,6 +37,13 @@ TagQueuePushAppendant(
     Blob *Appendant
     );
 
+static
+PushFn
+TagQueueSelectKernel(
+    uint32_t DeletionNumber,
+    uint32_t SymbolSize
+    );
+
 STATUS
 TagQueueInitialize(
         TagQueue *Q,
@@ -52,15 +61,17 @@ TagQueueInitialize(
 
     Q->DeletionNumber = DeletionNumber;
     Q->SymbolSize = SymbolSize;
+    Q->Push = TagQueueSelectKernel(DeletionNumber, SymbolSize);
+
+    Q->HeadPower = 1;
+    Q->HeadInverse = 1;
+    Q->TailPower = 1;
 
     Q->Cache.Symbol.Data = NULL;
     Q->Cache.Symbol.Size = 0;
     Q->Cache.Symbol.MaxSize = SymbolSize;
 
-    status = RingBufferInitialize(
-                &Q->Queue,
-                sizeof(TokenSymbol*),
-                RingBuffer_Expandable);
+    status = ChunkQueueInitialize(&Q->Queue, sizeof(TagQueueToken));
     if (FAILED(status))
     {
         goto Bail;
@@ -82,54 +93,196 @@ TagQueueTeardown(
     TagQueue *Q
     )
 {
-    if (RingBufferIsInitialized(&Q->Queue))
-    {
-        TokenSymbol *symbol;
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    uint64_t left;
+
+    //
+    // The tokens live inside the queue's blocks and own nothing unless they
+    // carry a BigCount, in which case we have to walk them.
+    //
+    ChunkQueueBegin(&Q->Queue, &cursor);
 
-        // XXX this is sloppy and error-prone. Is there a better way (including
-        // modifying RingBuffer)?
-        while (SUCCEEDED(RingBufferPop(&Q->Queue,
-                        &symbol,
-                        sizeof(TokenSymbol*))))
+    for (left = ChunkQueueCount(&Q->Queue); Q->BigTokens > 0 && left > 0; --left)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(&Q->Queue, &cursor);
+        if (token == NULL)
+        {
+            //
+            // Couldn't read a spilled block back. Its counts are lost.
+            //
+            break;
+        }
+        if (TagQueueTokenIsBig(token))
         {
-            free(symbol);
+            BigCountFree(TagQueueTokenBigCount(token));
+            --Q->BigTokens;
         }
+    }
+
+    ChunkQueueTeardown(&Q->Queue);
 
-        RingBufferTeardown(&Q->Queue);
+    BigCountFree(Q->Cache.Extra);
+    Q->Cache.Extra = NULL;
+}
+
+static
+inline
+uint64_t
+TagQueueTokenHash(
+    TagQueue *Q,
+    const TagQueueToken *Token
+    )
+{
+    uint64_t hash = Token->Count;
+    uint32_t i;
+
+    for (i = 0; i < Q->SymbolSize; ++i)
+    {
+        hash = (hash ^ Token->Symbol[i]) * 0x100000001b3ULL;
     }
+
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash;
 }
 
+static
+inline
+void
+TagQueueHashPush(
+    TagQueue *Q,
+    const TagQueueToken *Token
+    )
+{
+    Q->Hash += TagQueueTokenHash(Q, Token) * Q->TailPower;
+    Q->TailPower *= TAGQ_HASH_BASE;
+}
+
+static
+inline
+void
+TagQueueHashPop(
+    TagQueue *Q,
+    const TagQueueToken *Token
+    )
+{
+    Q->Hash -= TagQueueTokenHash(Q, Token) * Q->HeadPower;
+    Q->HeadPower *= TAGQ_HASH_BASE;
+    Q->HeadInverse *= TAGQ_HASH_BASE_INVERSE;
+}
+
+//
+// Turns Count into a token count, taking ownership of it. Anything that fits
+// becomes an ordinary count again.
+//
+static
+inline
+void
+TagQueueSetTokenCount(
+    TagQueue *Q,
+    TagQueueToken *Token,
+    BigCount **Count
+    )
+{
+    uint64_t value;
+
+    if (BigCountToU64(*Count, &value) && value < TAGQ_BIG_COUNT)
+    {
+        Token->Count = value;
+        BigCountFree(*Count);
+    }
+    else
+    {
+        Token->Count = TAGQ_BIG_COUNT | (uintptr_t) *Count;
+        ++Q->BigTokens;
+    }
+
+    *Count = NULL;
+}
+
+//
+// Moves the full buckets of the cache's count into Extra to make room.
+//
 static
 STATUS
-TagQueueFlush(
+TagQueueSpill(
     TagQueue *Q
     )
 {
     STATUS status = ENV_OK;
+    uint64_t full;
+
+    full = Q->Cache.SymbolCount - (Q->Cache.SymbolCount % Q->DeletionNumber);
 
-    TokenSymbol *symbol = malloc(sizeof(*symbol));
-    if (symbol == NULL)
+    if (Q->Cache.Extra == NULL)
     {
-        TagWarnx("malloc: TokenSymbol");
-        BAIL(status = ENV_OOM);
+        CHECK(status = BigCountFromU64(&Q->Cache.Extra, full));
     }
+    else
+    {
+        CHECK(status = BigCountAddU64(&Q->Cache.Extra, full));
+    }
+
+    Q->Cache.SymbolCount -= full;
+
+Bail:
+    return status;
+}
+
+static
+STATUS
+TagQueueFlush(
+    TagQueue *Q
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueueToken symbol;
+    BigCount *count = NULL;
 
     //
-    // Copy the blob. The pointers are all to owned memory and we
-    // aren't modifying them so it's ok.
+    // Reference the cached symbol. The pointer is to owned memory and we
+    // aren't modifying it so it's ok.
     //
-    symbol->Value = Q->Cache.Symbol;
-    symbol->Count = Q->Cache.SymbolCount / Q->DeletionNumber;
-    status = RingBufferPush(
-                &Q->Queue,
-                &symbol,
-                sizeof(TokenSymbol*));
+    symbol.Symbol = Q->Cache.Symbol.Data;
+    symbol.Count = Q->Cache.SymbolCount / Q->DeletionNumber;
+
+    TagProbe2(flush, Q->Cache.Symbol.Data, Q->Cache.SymbolCount);
+    TagTraceEvent(TagEvent_Flush, 0, Q->Cache.SymbolCount, symbol.Count);
+
+    if (Q->Cache.Extra != NULL)
+    {
+        //
+        // Extra is a whole number of buckets so this is exact.
+        //
+        count = Q->Cache.Extra;
+        Q->Cache.Extra = NULL;
+
+        (void) BigCountDivU32(count, Q->DeletionNumber);
+        CHECK(status = BigCountAddU64(&count, symbol.Count));
+        TagQueueSetTokenCount(Q, &symbol, &count);
+    }
+
+    status = ChunkQueuePush(&Q->Queue, &symbol, 1);
     if (FAILED(status))
     {
-        free(symbol);
+        if (TagQueueTokenIsBig(&symbol))
+        {
+            BigCountFree(TagQueueTokenBigCount(&symbol));
+            --Q->BigTokens;
+        }
         goto Bail;
     }
 
+    if (Q->Hashing)
+    {
+        TagQueueHashPush(Q, &symbol);
+    }
+
     if ((Q->Cache.SymbolCount % Q->DeletionNumber) != 0)
     {
         //
@@ -149,6 +302,8 @@ TagQueueFlush(
     }
 
 Bail:
+    BigCountFree(count);
+
     return status;
 }
 
@@ -170,9 +325,18 @@ TagQueuePushSymbol(
     if (Q->Cache.Dirty)
     {
         uint64_t newCount;
-        if (memcmp(Q->Cache.Symbol.Data,
+        bool same = (memcmp(Q->Cache.Symbol.Data,
                     AppendantSymbol,
-                    Q->SymbolSize) == 0 &&
+                    Q->SymbolSize) == 0);
+
+        if (same &&
+            Q->BigCounts &&
+            __builtin_add_overflow(Q->Cache.SymbolCount, SymbolCount, &newCount))
+        {
+            CHECK(status = TagQueueSpill(Q));
+        }
+
+        if (same &&
 			!__builtin_add_overflow(Q->Cache.SymbolCount,
 				SymbolCount,
 				&newCount))
@@ -223,17 +387,15 @@ Bail:
 }
 
 static
-inline
 STATUS
-TagQueuePushAppendant(
+TagQueueFillBucket(
     TagQueue *Q,
-    Blob *Appendant
+    uint64_t Available,
+    uint64_t *Fill
     )
 {
     STATUS status = ENV_OK;
-    uint64_t i, residue, appendantCount, fill;
-
-    assert((Appendant->Size % Q->SymbolSize) == 0);
+    uint64_t residue, fill, newCount;
 
     for (;;)
     {
@@ -242,20 +404,26 @@ TagQueuePushAppendant(
         //
         residue = Q->Cache.SymbolCount % Q->DeletionNumber;
 
-        appendantCount = Appendant->Size / Q->SymbolSize;
         //
         // How many symbols do we need to fill the bucket?
         //
-        fill = MIN(appendantCount, (Q->DeletionNumber - residue) % Q->DeletionNumber);
+        fill = MIN(Available, (Q->DeletionNumber - residue) % Q->DeletionNumber);
 
-        uint64_t newCount;
         if (__builtin_add_overflow(Q->Cache.SymbolCount, fill, &newCount))
         {
             //
-            // We have to flush the cache! Then retry with updated values.
+            // We have to flush (or spill) the cache! Then retry with updated
+            // values.
             //
 
-            CHECK(status = TagQueueFlush(Q));
+            if (Q->BigCounts)
+            {
+                CHECK(status = TagQueueSpill(Q));
+            }
+            else
+            {
+                CHECK(status = TagQueueFlush(Q));
+            }
 
             continue;
         }
@@ -274,6 +442,191 @@ TagQueuePushAppendant(
         break;
     }
 
+    *Fill = fill;
+
+Bail:
+    return status;
+}
+
+static
+STATUS
+TagQueuePushRun(
+    TagQueue *Q,
+    void *Symbol,
+    uint64_t SymbolCount
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t newCount, chunk;
+
+    //
+    // The largest amount of symbols a single token can soak up while keeping
+    // the cache on a bucket boundary.
+    //
+    const uint64_t maxChunk = UINT64_MAX - (UINT64_MAX % Q->DeletionNumber);
+
+    assert((Q->Cache.SymbolCount % Q->DeletionNumber) == 0);
+
+    while (SymbolCount > 0)
+    {
+        if (Q->BigCounts &&
+            Q->Cache.Dirty &&
+            memcmp(Q->Cache.Symbol.Data, Symbol, Q->SymbolSize) == 0 &&
+            __builtin_add_overflow(Q->Cache.SymbolCount, SymbolCount, &newCount))
+        {
+            CHECK(status = TagQueueSpill(Q));
+        }
+
+        if (Q->Cache.Dirty &&
+            memcmp(Q->Cache.Symbol.Data, Symbol, Q->SymbolSize) == 0 &&
+            !__builtin_add_overflow(Q->Cache.SymbolCount, SymbolCount, &newCount))
+        {
+            //
+            // Same symbol and it fits. This is the common case.
+            //
+            Q->Cache.SymbolCount = newCount;
+            break;
+        }
+
+        if (Q->Cache.Dirty)
+        {
+            //
+            // We are on a boundary so this empties the cache.
+            //
+            CHECK(status = TagQueueFlush(Q));
+        }
+
+        chunk = MIN(SymbolCount, maxChunk);
+
+        Q->Cache.Dirty = true;
+        Q->Cache.Symbol.Data = Symbol;
+        Q->Cache.Symbol.Size = Q->SymbolSize;
+        Q->Cache.SymbolCount = chunk;
+
+        SymbolCount -= chunk;
+    }
+
+Bail:
+    return status;
+}
+
+static
+uint64_t
+Gcd(
+    uint64_t A,
+    uint64_t B
+    )
+{
+    while (B != 0)
+    {
+        uint64_t t = A % B;
+        A = B;
+        B = t;
+    }
+
+    return A;
+}
+
+//
+// Pushing an appendant n times concatenates n copies of it and the only
+// symbols that survive are the ones landing on a bucket boundary. Those sit at
+// offsets f, f + d, f + 2d, ... into the concatenation, where d is the
+// deletion number and f is however much it takes to fill the current bucket.
+// Taken modulo the appendant's length L, these offsets visit exactly the
+// residue class of f modulo gcd(L, d), no matter how many repetitions came
+// before. If every symbol in that class is the same, each bucket we are
+// about to produce starts with that symbol and the whole push collapses into
+// one run. This returns that symbol, or NULL if the buckets would differ.
+//
+static
+uint8_t *
+TagQueueUniformHead(
+    TagQueue *Q,
+    Blob *Appendant
+    )
+{
+    uint64_t appendantCount, residue, fill, stride, i;
+    uint8_t *head;
+
+    appendantCount = Appendant->Size / Q->SymbolSize;
+    if (appendantCount == 0)
+    {
+        return NULL;
+    }
+
+    residue = Q->Cache.SymbolCount % Q->DeletionNumber;
+    fill = (Q->DeletionNumber - residue) % Q->DeletionNumber;
+    stride = Gcd(appendantCount, Q->DeletionNumber);
+
+    head = &Appendant->Data[(fill % stride) * Q->SymbolSize];
+    for (i = (fill % stride) + stride; i < appendantCount; i += stride)
+    {
+        if (memcmp(head, &Appendant->Data[i * Q->SymbolSize], Q->SymbolSize) != 0)
+        {
+            return NULL;
+        }
+    }
+
+    return head;
+}
+
+static
+STATUS
+TagQueuePushUniform(
+    TagQueue *Q,
+    Blob *Appendant,
+    uint8_t *Head,
+    uint64_t Repetitions
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t appendantCount, reps, symbols, fill;
+
+    appendantCount = Appendant->Size / Q->SymbolSize;
+
+    while (Repetitions > 0)
+    {
+        //
+        // Only take as many repetitions as we can count symbols for.
+        //
+        reps = MIN(Repetitions, UINT64_MAX / appendantCount);
+        symbols = reps * appendantCount;
+        Repetitions -= reps;
+
+        //
+        // Whatever fills the partially filled bucket is deleted along with
+        // it. Everything after starts on a boundary and every bucket is
+        // headed by the same symbol.
+        //
+        CHECK(status = TagQueueFillBucket(Q, symbols, &fill));
+
+        if (symbols > fill)
+        {
+            CHECK(status = TagQueuePushRun(Q, Head, symbols - fill));
+        }
+    }
+
+Bail:
+    return status;
+}
+
+static
+inline
+STATUS
+TagQueuePushAppendant(
+    TagQueue *Q,
+    Blob *Appendant
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t i, appendantCount, fill;
+
+    assert((Appendant->Size % Q->SymbolSize) == 0);
+
+    appendantCount = Appendant->Size / Q->SymbolSize;
+
+    CHECK(status = TagQueueFillBucket(Q, appendantCount, &fill));
+
     for (i = fill; i < appendantCount; i += Q->DeletionNumber)
     {
         //
@@ -297,24 +650,187 @@ Bail:
     return status;
 }
 
+static
 STATUS
-TagQueuePush(
+TagQueuePushGeneric(
     TagQueue *Q,
     Blob *Appendant,
     uint64_t Repetitions
     )
 {
     STATUS status = ENV_OK;
+    uint8_t *head;
+
+    if (Repetitions > 1)
+    {
+        //
+        // See if every bucket this push produces begins with the same symbol.
+        // If so we can do the whole thing with arithmetic instead of walking
+        // each repetition.
+        //
+        head = TagQueueUniformHead(Q, Appendant);
+        if (head != NULL)
+        {
+            CHECK(status = TagQueuePushUniform(Q, Appendant, head, Repetitions));
+            goto Bail;
+        }
+    }
+
+    //
+    // The buckets vary so there is no getting around producing each of them.
+    //
+    while (Repetitions--)
+    {
+        CHECK(status = TagQueuePushAppendant(Q, Appendant));
+    }
+
+Bail:
+    return status;
+}
+
+//
+// The specialized kernels. Almost every program is 2-tag with symbols a few
+// bytes wide so that is mostly what we stamp out. Anything else is pushed by
+// TagQueuePushGeneric.
+//
+#define TAGQ_KERNEL_WIDTH       1
+#define TAGQ_KERNEL_DELETION    2
+#include "TagQueueKernel.h"
+
+#define TAGQ_KERNEL_WIDTH       2
+#define TAGQ_KERNEL_DELETION    2
+#include "TagQueueKernel.h"
+
+#define TAGQ_KERNEL_WIDTH       3
+#define TAGQ_KERNEL_DELETION    2
+#include "TagQueueKernel.h"
+
+#define TAGQ_KERNEL_WIDTH       4
+#define TAGQ_KERNEL_DELETION    2
+#include "TagQueueKernel.h"
+
+#define TAGQ_KERNEL_WIDTH       1
+#define TAGQ_KERNEL_DELETION    3
+#include "TagQueueKernel.h"
+
+#define TAGQ_KERNEL_WIDTH       2
+#define TAGQ_KERNEL_DELETION    3
+#include "TagQueueKernel.h"
 
+static const struct
+{
+    uint32_t SymbolSize;
+    uint32_t DeletionNumber;
+    PushFn Push;
+} TagQueueKernels[] = {
+    { 1, 2, TagQueuePush_1x2 },
+    { 2, 2, TagQueuePush_2x2 },
+    { 3, 2, TagQueuePush_3x2 },
+    { 4, 2, TagQueuePush_4x2 },
+    { 1, 3, TagQueuePush_1x3 },
+    { 2, 3, TagQueuePush_2x3 },
+};
+
+static
+PushFn
+TagQueueSelectKernel(
+    uint32_t DeletionNumber,
+    uint32_t SymbolSize
+    )
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(TagQueueKernels); ++i)
+    {
+        if (TagQueueKernels[i].SymbolSize == SymbolSize &&
+            TagQueueKernels[i].DeletionNumber == DeletionNumber)
+        {
+            return TagQueueKernels[i].Push;
+        }
+    }
+
+    return TagQueuePushGeneric;
+}
+
+STATUS
+TagQueuePush(
+    TagQueue *Q,
+    Blob *Appendant,
+    uint64_t Repetitions
+    )
+{
     assert(Q != NULL);
     assert(Appendant != NULL || Repetitions == 0);
     assert(Repetitions > 0 && Appendant->Data != NULL);
     assert(Repetitions > 0 && (Appendant->Size % Q->SymbolSize) == 0);
 
-    // XXX this might be a good optimization opportunity
-    while (Repetitions--)
+    TagProbe2(push, Appendant->Size, Repetitions);
+    TagTraceEvent(TagEvent_Push, 0, Appendant->Size, Repetitions);
+
+    return Q->Push(Q, Appendant, Repetitions);
+}
+
+STATUS
+TagQueueAppendRuns(
+    TagQueue *Q,
+    TagQueueToken *Runs,
+    uint64_t RunCount,
+    uint64_t Length
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t i, fill, symbols, buckets, partial;
+
+    assert(Q != NULL);
+    assert(Runs != NULL || RunCount == 0);
+
+    //
+    // Whatever tops off the open bucket goes under the head already there.
+    //
+    CHECK(status = TagQueueFillBucket(Q, Length, &fill));
+    Length -= fill;
+
+    if (RunCount == 0)
     {
-        CHECK(status = TagQueuePushAppendant(Q, Appendant));
+        assert(Length == 0);
+        goto Bail;
+    }
+
+    if (RunCount > 1)
+    {
+        //
+        // The first run may carry on from our cache. Everything between it
+        // and the last run is already in final form so it goes straight into
+        // Queue.
+        //
+        symbols = Runs[0].Count * Q->DeletionNumber;
+        CHECK(status = TagQueuePushRun(Q, Runs[0].Symbol, symbols));
+        Length -= symbols;
+
+        if (RunCount > 2)
+        {
+            CHECK(status = TagQueueFlush(Q));
+            CHECK(status = TagQueueAppendTokens(Q, &Runs[1], RunCount - 2));
+
+            for (i = 1, buckets = 0; i < RunCount - 1; ++i)
+            {
+                buckets += Runs[i].Count;
+            }
+            Length -= buckets * Q->DeletionNumber;
+        }
+    }
+
+    //
+    // Only the very last bucket can come up short.
+    //
+    partial = Length % Q->DeletionNumber;
+    if (Length > partial)
+    {
+        CHECK(status = TagQueuePushRun(Q, Runs[RunCount - 1].Symbol, Length - partial));
+    }
+    if (partial > 0)
+    {
+        CHECK(status = TagQueuePushSymbol(Q, Runs[RunCount - 1].Symbol, partial));
     }
 
 Bail:
@@ -336,22 +852,35 @@ TagQueuePop(
     assert(Symbol != NULL);
     assert(Repetitions != NULL);
 
-    if (!RingBufferIsEmpty(&Q->Queue))
+    if (!ChunkQueueIsEmpty(&Q->Queue))
     {
         //
         // The queue has data! Just use it as normal.
         //
 
-        TokenSymbol *symbol;
+        TagQueueToken symbol;
+
+        if (Q->BigTokens > 0 &&
+            TagQueueTokenIsBig((TagQueueToken *) ChunkQueueFront(&Q->Queue)))
+        {
+            BAIL(status = TAGQ_BIG_RUN);
+        }
 
-        CHECK(status = RingBufferPop(&Q->Queue,
-                &symbol,
-                sizeof(TokenSymbol*)));
+        CHECK(status = ChunkQueuePop(&Q->Queue, &symbol, 1));
 
-        *Symbol = symbol->Value;
-        *Repetitions = symbol->Count;
+        if (Q->Hashing)
+        {
+            TagQueueHashPop(Q, &symbol);
+        }
 
-        free(symbol);
+        Symbol->Data = symbol.Symbol;
+        Symbol->Size = Q->SymbolSize;
+        Symbol->MaxSize = Q->SymbolSize;
+        *Repetitions = symbol.Count;
+    }
+    else if (Q->Cache.Extra != NULL)
+    {
+        BAIL(status = TAGQ_BIG_RUN);
     }
     else if (Q->Cache.SymbolCount >= Q->DeletionNumber)
     {
@@ -384,6 +913,338 @@ Bail:
     return status;
 }
 
+STATUS
+TagQueuePopBig(
+    TagQueue *Q,
+    Blob *Symbol,
+    uint64_t *Repetitions,
+    BigCount **BigRepetitions
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueueToken symbol;
+    BigCount *count = NULL;
+    uint64_t value;
+
+    assert(Q != NULL);
+    assert(Symbol != NULL);
+    assert(Repetitions != NULL);
+    assert(BigRepetitions != NULL);
+
+    *BigRepetitions = NULL;
+
+    if (!ChunkQueueIsEmpty(&Q->Queue))
+    {
+        CHECK(status = ChunkQueuePop(&Q->Queue, &symbol, 1));
+
+        if (Q->Hashing)
+        {
+            TagQueueHashPop(Q, &symbol);
+        }
+
+        Symbol->Data = symbol.Symbol;
+        Symbol->Size = Q->SymbolSize;
+        Symbol->MaxSize = Q->SymbolSize;
+
+        if (!TagQueueTokenIsBig(&symbol))
+        {
+            *Repetitions = symbol.Count;
+            goto Bail;
+        }
+
+        --Q->BigTokens;
+        count = TagQueueTokenBigCount(&symbol);
+    }
+    else if (Q->Cache.Extra != NULL)
+    {
+        //
+        // Extra is a whole number of buckets and the rest of the cache's
+        // count is handled the same way TagQueuePop would.
+        //
+        count = Q->Cache.Extra;
+        Q->Cache.Extra = NULL;
+
+        (void) BigCountDivU32(count, Q->DeletionNumber);
+        status = BigCountAddU64(&count, Q->Cache.SymbolCount / Q->DeletionNumber);
+        if (FAILED(status))
+        {
+            (void) BigCountMulU32(&count, Q->DeletionNumber);
+            Q->Cache.Extra = count;
+            count = NULL;
+            goto Bail;
+        }
+
+        *Symbol = Q->Cache.Symbol;
+
+        Q->Cache.SymbolCount %= Q->DeletionNumber;
+        Q->Cache.Dirty = (Q->Cache.SymbolCount != 0);
+        if (!Q->Cache.Dirty)
+        {
+            Q->Cache.Symbol.Data = NULL;
+        }
+    }
+    else
+    {
+        CHECK(status = TagQueuePop(Q, Symbol, Repetitions));
+        goto Bail;
+    }
+
+    if (BigCountToU64(count, &value))
+    {
+        *Repetitions = value;
+    }
+    else
+    {
+        *BigRepetitions = count;
+        count = NULL;
+    }
+
+Bail:
+    BigCountFree(count);
+
+    return status;
+}
+
+STATUS
+TagQueuePushBig(
+    TagQueue *Q,
+    Blob *Appendant,
+    const BigCount *Repetitions
+    )
+{
+    STATUS status = ENV_OK;
+    BigCount *symbols = NULL;
+    uint64_t appendantCount, fill, partial;
+    uint8_t *head;
+
+    assert(Q != NULL);
+    assert(Appendant != NULL && Appendant->Data != NULL);
+    assert((Appendant->Size % Q->SymbolSize) == 0);
+    assert(Repetitions != NULL);
+
+    appendantCount = Appendant->Size / Q->SymbolSize;
+
+    //
+    // There is no walking this many repetitions one by one so every bucket
+    // has to start with the same symbol.
+    //
+    head = TagQueueUniformHead(Q, Appendant);
+    if (head == NULL || appendantCount > UINT32_MAX)
+    {
+        TagWarnx("Can't push a %lu symbol appendant %lu bits worth of times",
+                appendantCount,
+                BigCountBits(Repetitions));
+        BAIL(status = ENV_INT_OVERFLOW);
+    }
+
+    CHECK(status = BigCountCopy(&symbols, Repetitions));
+    CHECK(status = BigCountMulU32(&symbols, (uint32_t) appendantCount));
+
+    //
+    // Repetitions is too big for a uint64_t so there is always enough to fill
+    // the open bucket.
+    //
+    CHECK(status = TagQueueFillBucket(Q, UINT64_MAX, &fill));
+    BigCountSubU64(symbols, fill);
+
+    partial = BigCountModU32(symbols, Q->DeletionNumber);
+    BigCountSubU64(symbols, partial);
+
+    if (Q->Cache.Dirty &&
+        memcmp(Q->Cache.Symbol.Data, head, Q->SymbolSize) == 0)
+    {
+        if (Q->Cache.Extra == NULL)
+        {
+            Q->Cache.Extra = symbols;
+            symbols = NULL;
+        }
+        else
+        {
+            CHECK(status = BigCountAdd(&Q->Cache.Extra, symbols));
+        }
+    }
+    else
+    {
+        if (Q->Cache.Dirty)
+        {
+            CHECK(status = TagQueueFlush(Q));
+        }
+
+        Q->Cache.Dirty = true;
+        Q->Cache.Symbol.Data = head;
+        Q->Cache.Symbol.Size = Q->SymbolSize;
+        Q->Cache.SymbolCount = 0;
+        Q->Cache.Extra = symbols;
+        symbols = NULL;
+    }
+
+    if (partial > 0)
+    {
+        CHECK(status = TagQueuePushSymbol(Q, head, partial));
+    }
+
+Bail:
+    BigCountFree(symbols);
+
+    return status;
+}
+
+uint64_t
+TagQueueTokenCount(
+    TagQueue *Q
+    )
+{
+    return ChunkQueueCount(&Q->Queue);
+}
+
+STATUS
+TagQueuePeekTokens(
+    TagQueue *Q,
+    TagQueueToken *Tokens,
+    uint64_t Count
+    )
+{
+    return ChunkQueuePeek(&Q->Queue, Tokens, Count);
+}
+
+STATUS
+TagQueueDropTokens(
+    TagQueue *Q,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    uint64_t i;
+
+    //
+    // Big tokens own their counts and hashed tokens have to be taken back out
+    // of the hash so both have to be looked at on the way out.
+    //
+    ChunkQueueBegin(&Q->Queue, &cursor);
+
+    for (i = 0;
+         (Q->BigTokens > 0 || Q->Hashing) &&
+         i < Count && i < ChunkQueueCount(&Q->Queue);
+         ++i)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(&Q->Queue, &cursor);
+        if (token == NULL)
+        {
+            BAIL(status = CHUNKQ_IO);
+        }
+        if (Q->Hashing)
+        {
+            TagQueueHashPop(Q, token);
+        }
+        if (TagQueueTokenIsBig(token))
+        {
+            BigCountFree(TagQueueTokenBigCount(token));
+            --Q->BigTokens;
+        }
+    }
+
+    CHECK(status = ChunkQueueDiscard(&Q->Queue, Count));
+
+Bail:
+    return status;
+}
+
+STATUS
+TagQueueAppendTokens(
+    TagQueue *Q,
+    TagQueueToken *Tokens,
+    uint64_t Count
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t i;
+
+    CHECK(status = ChunkQueuePush(&Q->Queue, Tokens, Count));
+
+    for (i = 0; Q->Hashing && i < Count; ++i)
+    {
+        TagQueueHashPush(Q, &Tokens[i]);
+    }
+
+Bail:
+    return status;
+}
+
+bool
+TagQueueIsEmpty(
+    TagQueue *Q
+    )
+{
+    return ChunkQueueIsEmpty(&Q->Queue) &&
+           Q->Cache.SymbolCount == 0 &&
+           Q->Cache.Extra == NULL;
+}
+
+STATUS
+TagQueueSetHashing(
+    TagQueue *Q,
+    bool Hashing
+    )
+{
+    STATUS status = ENV_OK;
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    uint64_t left;
+
+    Q->Hashing = Hashing;
+    Q->Hash = 0;
+    Q->HeadPower = 1;
+    Q->HeadInverse = 1;
+    Q->TailPower = 1;
+
+    ChunkQueueBegin(&Q->Queue, &cursor);
+
+    for (left = ChunkQueueCount(&Q->Queue); Hashing && left > 0; --left)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(&Q->Queue, &cursor);
+        if (token == NULL)
+        {
+            Q->Hashing = false;
+            BAIL(status = CHUNKQ_IO);
+        }
+        TagQueueHashPush(Q, token);
+    }
+
+Bail:
+    return status;
+}
+
+uint64_t
+TagQueueHash(
+    TagQueue *Q
+    )
+{
+    TagQueueToken cache;
+    uint64_t hash;
+
+    assert(Q->Hashing);
+
+    //
+    // Shifting everything down to the first token makes the hash independent
+    // of how many tokens came and went before. The cache hashes as one more
+    // token after Queue. Cache.Extra is left out: a queue holding one is
+    // never going to be seen again anyway.
+    //
+    hash = Q->Hash * Q->HeadInverse;
+
+    if (Q->Cache.Dirty)
+    {
+        cache.Symbol = Q->Cache.Symbol.Data;
+        cache.Count = Q->Cache.SymbolCount;
+
+        hash += TagQueueTokenHash(Q, &cache) * (Q->TailPower * Q->HeadInverse);
+    }
+
+    return hash;
+}
+
 void
 TagQueueDump(
     TagQueue *Q
@@ -3,29 +3,117 @@
 #include <stdbool.h>
 
 #include "Blob.h"
-#include "RingBuffer.h"
+#include "ChunkQueue.h"
+#include "BigCount.h"
 
-#define TAGQ                    2
+#define TAGQ                    4
 #define TAGQ_STATUS(Code)       (MAKE_STATUS(Code, TAGQ))
 
 #define TAGQ_OK                 0
-#define TAGQ_QUEUE_TOO_SMALL    1
+#define TAGQ_QUEUE_TOO_SMALL    (TAGQ_STATUS(1))
+#define TAGQ_BIG_RUN            (TAGQ_STATUS(2))
 
+//
+// A token whose Count has this bit set holds a run too long for 63 bits. The
+// rest of Count is then a pointer to a BigCount owned by the token. Ordinary
+// counts never get this far: a flush divides by the deletion number.
+//
+#define TAGQ_BIG_COUNT          (1ULL << 63)
+
+//
+// Whether two symbols are the same when their width is known at compile
+// time. Width must be a literal from 1 to 4. For the specialized kernels.
+//
+#define TAGQ_SYMBOL_EQUAL_1(A, B)   ((A)[0] == (B)[0])
+#define TAGQ_SYMBOL_EQUAL_2(A, B)   (TAGQ_SYMBOL_EQUAL_1(A, B) && (A)[1] == (B)[1])
+#define TAGQ_SYMBOL_EQUAL_3(A, B)   (TAGQ_SYMBOL_EQUAL_2(A, B) && (A)[2] == (B)[2])
+#define TAGQ_SYMBOL_EQUAL_4(A, B)   (TAGQ_SYMBOL_EQUAL_3(A, B) && (A)[3] == (B)[3])
+#define TAGQ_SYMBOL_EQUAL_PASTE(Width, A, B)    TAGQ_SYMBOL_EQUAL_##Width(A, B)
+#define TAGQ_SYMBOL_EQUAL(Width, A, B)  TAGQ_SYMBOL_EQUAL_PASTE(Width, A, B)
+
+//
+// A run of Count buckets all headed by Symbol. Tokens are stored by value in
+// Queue's blocks so pushing and popping a run only touches the heap when a
+// block fills up or drains. Symbol points at SymbolSize bytes owned by either
+// a rule's appendant or the TagSystem's initial queue, both of which outlive
+// us.
+//
+typedef struct _TagQueueToken
+{
+    uint8_t *Symbol;
+    uint64_t Count;
+} TagQueueToken;
+
+struct _TagQueue;
+
+typedef STATUS(*PushFn)(struct _TagQueue *, Blob *, uint64_t);
 
 typedef struct _TagQueue
 {
     uint32_t DeletionNumber;
     uint32_t SymbolSize;
 
-    RingBuffer Queue;
+    //
+    // What TagQueuePush does the work with. Picked once by
+    // TagQueueInitialize: either a kernel specialized for this SymbolSize and
+    // DeletionNumber (see TagQueueKernel.h) or the generic routine.
+    //
+    PushFn Push;
+
+    ChunkQueue Queue;
 
     struct {
         Blob Symbol;
         uint64_t SymbolCount;  // XXX think of a better name capturing "total amount of symbols in the cache"
         bool Dirty;
+        //
+        // Whatever part of the count no longer fit in SymbolCount. Always a
+        // multiple of the deletion number so the bucket phase can still be
+        // read off SymbolCount alone. NULL almost always.
+        //
+        BigCount *Extra;
     } Cache;
+
+    //
+    // Off by default. When set, counts that would overflow grow into
+    // BigCounts instead of being split across several tokens.
+    //
+    bool BigCounts;
+    uint64_t BigTokens;     // How many tokens in Queue carry a BigCount.
+
+    //
+    // Off by default (see TagQueueSetHashing). When set, Hash is kept equal
+    // to the sum of h(token) * B^position over the tokens in Queue, where
+    // positions count every token ever pushed. The powers of B at either end
+    // are kept alongside so pushes and pops each cost one multiply-add.
+    //
+    bool Hashing;
+    uint64_t Hash;
+    uint64_t HeadPower;
+    uint64_t HeadInverse;   // 1 / HeadPower modulo 2^64.
+    uint64_t TailPower;
 } TagQueue;
 
+static
+inline
+bool
+TagQueueTokenIsBig(
+    const TagQueueToken *Token
+    )
+{
+    return (Token->Count & TAGQ_BIG_COUNT) != 0;
+}
+
+static
+inline
+BigCount *
+TagQueueTokenBigCount(
+    const TagQueueToken *Token
+    )
+{
+    return (BigCount *) (uintptr_t) (Token->Count & ~TAGQ_BIG_COUNT);
+}
+
 STATUS
 TagQueueInitialize(
         TagQueue *Q,
@@ -45,9 +133,110 @@ TagQueuePush(
     uint64_t Repetitions
     );
 
+//
+// Appends Length symbols that were expanded somewhere else (another queue,
+// another thread) starting from this queue's current bucket phase. Runs lists
+// the heads of the buckets that start within those symbols, in order, with
+// Count being the number of buckets each heads. The symbols that close off
+// the currently open bucket don't get a head of their own.
+//
+STATUS
+TagQueueAppendRuns(
+    TagQueue *Q,
+    TagQueueToken *Runs,
+    uint64_t RunCount,
+    uint64_t Length
+    );
+
+//
+// Fails with TAGQ_BIG_RUN, without popping anything, when the next run is
+// too long for Repetitions. Use TagQueuePopBig for those.
+//
 STATUS
 TagQueuePop(
     TagQueue *Q,
     Blob *Symbol,
     uint64_t *Repetitions
     );
+
+//
+// Pops the next run whatever its length. If it doesn't fit in Repetitions
+// then BigRepetitions is set instead and the caller owns it.
+//
+STATUS
+TagQueuePopBig(
+    TagQueue *Q,
+    Blob *Symbol,
+    uint64_t *Repetitions,
+    BigCount **BigRepetitions
+    );
+
+//
+// Pushes Appendant an arbitrarily large number of times. This is only possible
+// when every bucket produced starts with the same symbol; anything else fails
+// with ENV_INT_OVERFLOW.
+//
+STATUS
+TagQueuePushBig(
+    TagQueue *Q,
+    Blob *Appendant,
+    const BigCount *Repetitions
+    );
+
+//
+// True when nothing at all is queued, not even a partial bucket.
+//
+bool
+TagQueueIsEmpty(
+    TagQueue *Q
+    );
+
+//
+// Turns the rolling hash on or off. Turning it on hashes whatever is already
+// in Queue, which fails only if a spilled part of it can't be read back.
+//
+STATUS
+TagQueueSetHashing(
+    TagQueue *Q,
+    bool Hashing
+    );
+
+//
+// A hash of the whole queue, cache included, that only depends on what is
+// queued and not on how it got there. Only meaningful with hashing on.
+//
+uint64_t
+TagQueueHash(
+    TagQueue *Q
+    );
+
+//
+// Direct access to the tokens sitting in Queue (i.e., not the cache) for
+// the memoizer and the parallel expander. Peek copies the first Count tokens
+// out, Drop discards them and Append adds already formed tokens at the back of
+// Queue without touching the cache.
+//
+uint64_t
+TagQueueTokenCount(
+    TagQueue *Q
+    );
+
+STATUS
+TagQueuePeekTokens(
+    TagQueue *Q,
+    TagQueueToken *Tokens,
+    uint64_t Count
+    );
+
+STATUS
+TagQueueDropTokens(
+    TagQueue *Q,
+    uint64_t Count
+    );
+
+STATUS
+TagQueueAppendTokens(
+    TagQueue *Q,
+    TagQueueToken *Tokens,
+    uint64_t Count
+    );
@@ -0,0 +1,215 @@
+//
+// A template, not an ordinary header. TagQueue.c includes it once per
+// specialized kernel with TAGQ_KERNEL_WIDTH and TAGQ_KERNEL_DELETION defined
+// to the SymbolSize and DeletionNumber it is for, and it defines that
+// kernel's TagQueuePush. With both known at compile time the offset math
+// comes down to constant strides, the bucket residue to a constant modulus
+// and symbol comparisons to a couple of byte compares.
+//
+// Only the common case lives here. Anything that needs to grow a count
+// (overflow, BigCounts) goes back to the generic routines, which the kernel
+// leaves the queue in a fit state for.
+//
+// N.B., no #pragma once.
+//
+
+#if !defined(TAGQ_KERNEL_WIDTH) || !defined(TAGQ_KERNEL_DELETION)
+#error "Define TAGQ_KERNEL_WIDTH and TAGQ_KERNEL_DELETION before including TagQueueKernel.h"
+#endif
+
+//
+// TagQueuePush becomes TagQueuePush_2x2 and so on.
+//
+#define TAGQ_KERNEL_PASTE(Name, Width, Deletion)    Name##_##Width##x##Deletion
+#define TAGQ_KERNEL_EXPAND(Name, Width, Deletion)   TAGQ_KERNEL_PASTE(Name, Width, Deletion)
+#define TAGQ_KERNEL_NAME(Name)  TAGQ_KERNEL_EXPAND(Name, TAGQ_KERNEL_WIDTH, TAGQ_KERNEL_DELETION)
+
+static
+inline
+STATUS
+TAGQ_KERNEL_NAME(TagQueuePushSymbol)(
+    TagQueue *Q,
+    uint8_t *AppendantSymbol,
+    uint64_t SymbolCount
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t newCount;
+
+    assert((Q->Cache.SymbolCount % TAGQ_KERNEL_DELETION) == 0);
+
+    if (Q->Cache.Dirty)
+    {
+        if (TAGQ_SYMBOL_EQUAL(TAGQ_KERNEL_WIDTH, Q->Cache.Symbol.Data, AppendantSymbol))
+        {
+            if (__builtin_add_overflow(Q->Cache.SymbolCount, SymbolCount, &newCount))
+            {
+                //
+                // Spill or flush; the generic code knows which.
+                //
+                return TagQueuePushSymbol(Q, AppendantSymbol, SymbolCount);
+            }
+
+            Q->Cache.SymbolCount = newCount;
+            goto Bail;
+        }
+
+        CHECK(status = TagQueueFlush(Q));
+    }
+
+    Q->Cache.Dirty = true;
+    Q->Cache.Symbol.Data = AppendantSymbol;
+    Q->Cache.Symbol.Size = TAGQ_KERNEL_WIDTH;
+    Q->Cache.SymbolCount = SymbolCount;
+
+Bail:
+    return status;
+}
+
+static
+inline
+STATUS
+TAGQ_KERNEL_NAME(TagQueueFillBucket)(
+    TagQueue *Q,
+    uint64_t Available,
+    uint64_t *Fill
+    )
+{
+    uint64_t residue, fill, newCount;
+
+    residue = Q->Cache.SymbolCount % TAGQ_KERNEL_DELETION;
+    fill = MIN(Available, (TAGQ_KERNEL_DELETION - residue) % TAGQ_KERNEL_DELETION);
+
+    if (__builtin_add_overflow(Q->Cache.SymbolCount, fill, &newCount))
+    {
+        //
+        // The generic code makes room first.
+        //
+        return TagQueueFillBucket(Q, Available, Fill);
+    }
+
+    Q->Cache.SymbolCount = newCount;
+    *Fill = fill;
+
+    return ENV_OK;
+}
+
+static
+inline
+STATUS
+TAGQ_KERNEL_NAME(TagQueuePushRun)(
+    TagQueue *Q,
+    uint8_t *Symbol,
+    uint64_t SymbolCount
+    )
+{
+    uint64_t newCount;
+
+    if (Q->Cache.Dirty &&
+        TAGQ_SYMBOL_EQUAL(TAGQ_KERNEL_WIDTH, Q->Cache.Symbol.Data, Symbol) &&
+        !__builtin_add_overflow(Q->Cache.SymbolCount, SymbolCount, &newCount))
+    {
+        Q->Cache.SymbolCount = newCount;
+        return ENV_OK;
+    }
+
+    return TagQueuePushRun(Q, Symbol, SymbolCount);
+}
+
+//
+// See TagQueueUniformHead.
+//
+static
+inline
+uint8_t *
+TAGQ_KERNEL_NAME(TagQueueUniformHead)(
+    TagQueue *Q,
+    Blob *Appendant
+    )
+{
+    uint64_t appendantCount, residue, fill, stride, i;
+    uint8_t *head;
+
+    appendantCount = Appendant->Size / TAGQ_KERNEL_WIDTH;
+    if (appendantCount == 0)
+    {
+        return NULL;
+    }
+
+    residue = Q->Cache.SymbolCount % TAGQ_KERNEL_DELETION;
+    fill = (TAGQ_KERNEL_DELETION - residue) % TAGQ_KERNEL_DELETION;
+    stride = Gcd(TAGQ_KERNEL_DELETION, appendantCount % TAGQ_KERNEL_DELETION);
+
+    head = &Appendant->Data[(fill % stride) * TAGQ_KERNEL_WIDTH];
+    for (i = (fill % stride) + stride; i < appendantCount; i += stride)
+    {
+        if (!TAGQ_SYMBOL_EQUAL(TAGQ_KERNEL_WIDTH, head, &Appendant->Data[i * TAGQ_KERNEL_WIDTH]))
+        {
+            return NULL;
+        }
+    }
+
+    return head;
+}
+
+static
+STATUS
+TAGQ_KERNEL_NAME(TagQueuePush)(
+    TagQueue *Q,
+    Blob *Appendant,
+    uint64_t Repetitions
+    )
+{
+    STATUS status = ENV_OK;
+    uint64_t appendantCount, reps, symbols, fill, i;
+    uint8_t *head = NULL;
+
+    assert(Q->SymbolSize == TAGQ_KERNEL_WIDTH);
+    assert(Q->DeletionNumber == TAGQ_KERNEL_DELETION);
+
+    appendantCount = Appendant->Size / TAGQ_KERNEL_WIDTH;
+
+    if (Repetitions > 1)
+    {
+        head = TAGQ_KERNEL_NAME(TagQueueUniformHead)(Q, Appendant);
+    }
+
+    while (head != NULL && Repetitions > 0)
+    {
+        //
+        // As TagQueuePushUniform.
+        //
+        reps = MIN(Repetitions, UINT64_MAX / appendantCount);
+        symbols = reps * appendantCount;
+        Repetitions -= reps;
+
+        CHECK(status = TAGQ_KERNEL_NAME(TagQueueFillBucket)(Q, symbols, &fill));
+
+        if (symbols > fill)
+        {
+            CHECK(status = TAGQ_KERNEL_NAME(TagQueuePushRun)(Q, head, symbols - fill));
+        }
+    }
+
+    for (; Repetitions > 0; --Repetitions)
+    {
+        CHECK(status = TAGQ_KERNEL_NAME(TagQueueFillBucket)(Q, appendantCount, &fill));
+
+        for (i = fill; i < appendantCount; i += TAGQ_KERNEL_DELETION)
+        {
+            CHECK(status = TAGQ_KERNEL_NAME(TagQueuePushSymbol)(
+                        Q,
+                        &Appendant->Data[i * TAGQ_KERNEL_WIDTH],
+                        MIN(appendantCount - i, TAGQ_KERNEL_DELETION)));
+        }
+    }
+
+Bail:
+    return status;
+}
+
+#undef TAGQ_KERNEL_NAME
+#undef TAGQ_KERNEL_EXPAND
+#undef TAGQ_KERNEL_PASTE
+#undef TAGQ_KERNEL_WIDTH
+#undef TAGQ_KERNEL_DELETION
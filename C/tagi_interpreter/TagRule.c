@@ -51,155 +51,141 @@ TagRuleTeardown(
 }
 
 //
-// For *TeardownComplete, we will free the pointer to the object itself.
+// The bytes TagRuleCopy needs for Rule's symbol and appendants, once they've
+// been checked to be whole symbols.
 //
-void
-TagRuleTeardownComplete(
-    TagRule *Obj
-    )
-{
-    TagRuleTeardown(Obj);
-
-    free(Obj);
-}
-
 STATUS
-TagRuleDupe(
-    TagRule *Source,
-    TagRule **Destination
+TagRuleMeasure(
+    TagRule *Rule,
+    uint64_t *Size
     )
 {
     STATUS status = ENV_OK;
-    TagRule *obj;
-
-    obj = NULL;
-
-    if (Source == NULL)
-    {
-        status = ENV_BADPTR; // invalid arguments
-        TagWarnx("NULL Source");
-        goto Bail;
-    }
-    else if (Destination == NULL)
-    {
-        status = ENV_BADPTR; // invalid arguments
-        TagWarnx("NULL Destination");
-        goto Bail;
-    }
-
-    obj = malloc(sizeof(*obj));
-    if (obj == NULL)
-    {
-        status = ENV_OOM;
-        TagWarnx("malloc obj");
-        goto Bail;
-    }
-    memset(obj, 0, sizeof(*obj));
+    uint64_t size;
 
     //
     // Since we have no way of knowing what the proper size of a symbol is, the
     // caller must have verified this before invoking us.
     //
-    status = BlobInitialize(
-                &obj->Symbol,
-                Source->Symbol.Data,
-                Source->Symbol.Size);
-    if (FAILED(status))
-    {
-        goto Bail;
-    }
+    size = Rule->Symbol.Size;
 
-    switch (Source->Style) {
+    switch (Rule->Style) {
     case IoSel_Pure:
-        if ((Source->Pure.Appendant.Size % Source->Symbol.Size) != 0)
+        if ((Rule->Pure.Appendant.Size % Rule->Symbol.Size) != 0)
         {
             status = ENV_BADLEN;
             TagWarnx("invalid Appendant size for pure rule symbol");
             goto Bail;
         }
 
-        status = BlobInitialize(
-                    &obj->Pure.Appendant,
-                    Source->Pure.Appendant.Data,
-                    Source->Pure.Appendant.Size);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
+        size += Rule->Pure.Appendant.Size;
         break;
 
     case IoSel_Input:
-        if ((Source->In.Appendant0.Size % Source->Symbol.Size) != 0)
+        if ((Rule->In.Appendant0.Size % Rule->Symbol.Size) != 0)
         {
             status = ENV_BADLEN;
             TagWarnx("invalid Appendant0 size for in rule symbol");
             goto Bail;
         }
-        if ((Source->In.Appendant1.Size % Source->Symbol.Size) != 0)
+        if ((Rule->In.Appendant1.Size % Rule->Symbol.Size) != 0)
         {
             status = ENV_BADLEN;
             TagWarnx("invalid Appendant1 size for in rule symbol");
             goto Bail;
         }
 
-        status = BlobInitialize(
-                    &obj->In.Appendant0,
-                    Source->In.Appendant0.Data,
-                    Source->In.Appendant0.Size);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
-
-        status = BlobInitialize(
-                    &obj->In.Appendant1,
-                    Source->In.Appendant1.Data,
-                    Source->In.Appendant1.Size);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
+        size += Rule->In.Appendant0.Size + Rule->In.Appendant1.Size;
         break;
 
     case IoSel_Output:
-        if ((Source->Out.Appendant.Size % Source->Symbol.Size) != 0)
+        if ((Rule->Out.Appendant.Size % Rule->Symbol.Size) != 0)
         {
             status = ENV_BADLEN;
             TagWarnx("invalid Appendant size for out rule symbol");
             goto Bail;
         }
 
-        status = BlobInitialize(
-                    &obj->Out.Appendant,
-                    Source->Out.Appendant.Data,
-                    Source->Out.Appendant.Size);
-        if (FAILED(status))
-        {
-            goto Bail;
-        }
-
-        obj->Out.Bit = Source->Out.Bit;
+        size += Rule->Out.Appendant.Size;
         break;
 
     default:
         status = ENV_BADENUM;
-        TagWarnx("Enum %x not valid", Source->Style);
+        TagWarnx("Enum %x not valid", Rule->Style);
         goto Bail;
     }
-    obj->Style = Source->Style;
 
-    *Destination = obj;
-    obj = NULL;
+    *Size = size;
 
 Bail:
-    if (obj != NULL)
+    return status;
+}
+
+//
+// Points Blob at Size bytes copied to *Pool and moves *Pool past them. With
+// no Pool it points at Source's bytes instead.
+//
+static
+void
+TagRuleCopyBlob(
+    Blob *Destination,
+    Blob *Source,
+    uint8_t **Pool
+    )
+{
+    Destination->Size = Source->Size;
+    Destination->MaxSize = Source->Size;
+
+    if (Pool == NULL)
     {
-        TagRuleTeardown(obj);
+        Destination->Data = Source->Data;
+        return;
+    }
+
+    Destination->Data = *Pool;
 
-        free(obj);
+    if (Source->Size > 0)
+    {
+        memcpy(*Pool, Source->Data, Source->Size);
     }
 
-    return status;
+    *Pool += Source->Size;
+}
+
+void
+TagRuleCopy(
+    TagRule *Source,
+    TagRule *Destination,
+    uint8_t **Pool
+    )
+{
+    memset(Destination, 0, sizeof(*Destination));
+
+    TagRuleCopyBlob(&Destination->Symbol, &Source->Symbol, Pool);
+
+    switch (Source->Style) {
+    case IoSel_Pure:
+        TagRuleCopyBlob(&Destination->Pure.Appendant, &Source->Pure.Appendant, Pool);
+        break;
+
+    case IoSel_Input:
+        TagRuleCopyBlob(&Destination->In.Appendant0, &Source->In.Appendant0, Pool);
+        TagRuleCopyBlob(&Destination->In.Appendant1, &Source->In.Appendant1, Pool);
+        break;
+
+    case IoSel_Output:
+        TagRuleCopyBlob(&Destination->Out.Appendant, &Source->Out.Appendant, Pool);
+        Destination->Out.Bit = Source->Out.Bit;
+        break;
+
+    default:
+        //
+        // TagRuleMeasure turned these away.
+        //
+        break;
+    }
+
+    Destination->Style = Source->Style;
 }
 
 int
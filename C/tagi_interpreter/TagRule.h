@@ -78,6 +78,24 @@ typedef struct _TagRule
         OutputRule Out;
     };
 
+    //
+    // Filled in by the TagSystem when this is a pure rule whose appendant is
+    // ChainMultiplier copies of a single symbol and that symbol has a rule
+    // (ChainNext). Those are the translation/expansion/contraction links that
+    // W-machine compilation strings together.
+    //
+    struct _TagRule *ChainNext;
+    uint64_t ChainMultiplier;
+
+    //
+    // Statistics, kept here so that counting costs no more than the rule
+    // lookup already did. Fires counts the steps that popped this rule's
+    // symbol one at a time (see TagFire) and Repetitions the buckets those
+    // steps handled between them, stopping at UINT64_MAX.
+    //
+    uint64_t Fires;
+    uint64_t Repetitions;
+
     // XXX HOW DO
     //DebugData X;
 
@@ -90,15 +108,23 @@ TagRuleTeardown(
     TagRule *Obj
     );
 
-void
-TagRuleTeardownComplete(
-    TagRule *Obj
+//
+// Rules owned by a TagSystem don't own their bytes. Measure checks Rule and
+// says how many bytes its symbol and appendants take up and Copy makes
+// Destination a copy of Source whose bytes are packed at *Pool, moving *Pool
+// past them. A NULL Pool shares Source's bytes instead.
+//
+STATUS
+TagRuleMeasure(
+    TagRule *Rule,
+    uint64_t *Size
     );
 
-STATUS
-TagRuleDupe(
+void
+TagRuleCopy(
     TagRule *Source,
-    TagRule **Destination
+    TagRule *Destination,
+    uint8_t **Pool
     );
 
 int
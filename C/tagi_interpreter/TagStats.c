@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+
+#include <err.h>
+#include <sys/resource.h>
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "Debug.h"
+#include "TagStats.h"
+
+STATUS
+TagStatsInitialize(
+    TagStats *Stats,
+    TagSystem *System
+    )
+{
+    STATUS status = ENV_OK;
+
+    assert(Stats != NULL);
+    assert(System != NULL);
+
+    memset(Stats, 0, sizeof(*Stats));
+
+    Stats->System = System;
+    Stats->Interval = TAGSTATS_DEFAULT_INTERVAL;
+    Stats->MaxSamples = TAGSTATS_DEFAULT_SAMPLES;
+
+    Stats->Samples = malloc(Stats->MaxSamples * sizeof(*Stats->Samples));
+    if (Stats->Samples == NULL)
+    {
+        TagWarnx("malloc Samples (%lu)", Stats->MaxSamples);
+        BAIL(status = ENV_OOM);
+    }
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &Stats->Start);
+
+Bail:
+    if (FAILED(status))
+    {
+        TagStatsTeardown(Stats);
+    }
+
+    return status;
+}
+
+void
+TagStatsTeardown(
+    TagStats *Stats
+    )
+{
+    free(Stats->Samples);
+    Stats->Samples = NULL;
+}
+
+static
+double
+TagStatsSeconds(
+    TagStats *Stats
+    )
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - Stats->Start.tv_sec) +
+           (now.tv_nsec - Stats->Start.tv_nsec) / 1e9;
+}
+
+//
+// Walks the queue adding up its symbols, or gives UINT64_MAX if there are
+// too many to count (or a spilled block can't be read back).
+//
+static
+uint64_t
+TagStatsCountSymbols(
+    TagQueue *Q
+    )
+{
+    ChunkQueueCursor cursor;
+    TagQueueToken *token;
+    uint64_t left, symbols, run;
+
+    if (Q->BigTokens > 0 || Q->Cache.Extra != NULL)
+    {
+        return UINT64_MAX;
+    }
+
+    symbols = Q->Cache.SymbolCount;
+
+    ChunkQueueBegin(&Q->Queue, &cursor);
+
+    for (left = ChunkQueueCount(&Q->Queue); left > 0; --left)
+    {
+        token = (TagQueueToken *) ChunkQueueNext(&Q->Queue, &cursor);
+        if (token == NULL ||
+            __builtin_mul_overflow(token->Count, Q->DeletionNumber, &run) ||
+            __builtin_add_overflow(symbols, run, &symbols))
+        {
+            return UINT64_MAX;
+        }
+    }
+
+    return symbols;
+}
+
+//
+// Records where the queue is now. Since is how many steps it has been since
+// the last sample.
+//
+static
+void
+TagStatsTake(
+    TagStats *Stats,
+    uint64_t Since
+    )
+{
+    TagQueue *q = &Stats->System->Tape;
+    TagStatsSample *sample;
+    uint64_t i;
+
+    if (Stats->SampleCount == Stats->MaxSamples)
+    {
+        for (i = 0; 2 * i < Stats->SampleCount; ++i)
+        {
+            Stats->Samples[i] = Stats->Samples[2 * i];
+        }
+
+        Stats->SampleCount = i;
+        Stats->Interval *= 2;
+    }
+
+    sample = &Stats->Samples[Stats->SampleCount++];
+
+    sample->Step = Stats->Clock;
+    sample->Seconds = TagStatsSeconds(Stats);
+    sample->Tokens = TagQueueTokenCount(q);
+    sample->Blocks = q->Queue.BlocksInMemory;
+    sample->Symbols = UINT64_MAX;
+
+    if (sample->Tokens <= Since / TAGSTATS_WALK_RATIO)
+    {
+        sample->Symbols = TagStatsCountSymbols(q);
+    }
+
+    Stats->PeakTokens = MAX(Stats->PeakTokens, sample->Tokens);
+    Stats->PeakBlocks = MAX(Stats->PeakBlocks, sample->Blocks);
+}
+
+void
+TagStatsStep(
+    TagStats *Stats,
+    uint64_t Elapsed
+    )
+{
+    Stats->Clock += Elapsed;
+
+    TagStatsTake(Stats, Elapsed);
+}
+
+//
+// Writes Text as a JSON string.
+//
+static
+void
+TagStatsPutString(
+    FILE *Fp,
+    const char *Text
+    )
+{
+    const unsigned char *c;
+
+    fputc('"', Fp);
+
+    for (c = (const unsigned char *) Text; *c != '\0'; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(Fp, "\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(Fp, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, Fp);
+        }
+    }
+
+    fputc('"', Fp);
+}
+
+static
+void
+TagStatsPutRules(
+    TagStats *Stats,
+    FILE *Fp,
+    Debugger *Dbg
+    )
+{
+    static const char *styles[IoSel_Max] = {
+        [IoSel_Output] = "output",
+        [IoSel_Input] = "input",
+        [IoSel_Pure] = "pure",
+    };
+    TagSystem *system = Stats->System;
+    TagRule *rule;
+    const char *name;
+    uint64_t value, i;
+
+    fprintf(Fp, "  \"rules\": [");
+
+    for (i = 0; i < system->RuleCount; ++i)
+    {
+        rule = &system->Rules[i];
+        value = TagSymbolValue(rule->Symbol.Data, system->SymbolSize);
+        name = Dbg != NULL ? DebuggerLookupName(Dbg, value) : NULL;
+
+        fprintf(Fp, "%s\n    {\"symbol\": %lu, \"name\": ", i > 0 ? "," : "", value);
+        if (name != NULL)
+        {
+            TagStatsPutString(Fp, name);
+        }
+        else
+        {
+            fprintf(Fp, "null");
+        }
+        fprintf(Fp, ", \"style\": \"%s\", \"fires\": %lu, \"repetitions\": %lu}",
+                rule->Style < IoSel_Max ? styles[rule->Style] : "invalid",
+                rule->Fires,
+                rule->Repetitions);
+    }
+
+    fprintf(Fp, "\n  ],\n");
+}
+
+static
+void
+TagStatsPutRunLengths(
+    TagStats *Stats,
+    FILE *Fp
+    )
+{
+    TagSystem *system = Stats->System;
+    bool first = true;
+    uint64_t i;
+
+    //
+    // Only the buckets that were hit. The last has no upper end.
+    //
+    fprintf(Fp, "  \"run_lengths\": [");
+
+    for (i = 0; i < TAG_RUN_LENGTH_BUCKETS; ++i)
+    {
+        if (system->RunLengths[i] == 0)
+        {
+            continue;
+        }
+
+        if (i < 64)
+        {
+            fprintf(Fp, "%s\n    {\"from\": %lu, \"count\": %lu}",
+                    first ? "" : ",",
+                    (uint64_t) 1 << i,
+                    system->RunLengths[i]);
+        }
+        else
+        {
+            fprintf(Fp, "%s\n    {\"from\": \"2^64\", \"count\": %lu}",
+                    first ? "" : ",",
+                    system->RunLengths[i]);
+        }
+        first = false;
+    }
+
+    fprintf(Fp, "\n  ],\n");
+}
+
+static
+void
+TagStatsPutSamples(
+    TagStats *Stats,
+    FILE *Fp
+    )
+{
+    TagStatsSample *sample;
+    uint64_t i;
+
+    fprintf(Fp, "  \"samples\": [");
+
+    for (i = 0; i < Stats->SampleCount; ++i)
+    {
+        sample = &Stats->Samples[i];
+
+        fprintf(Fp, "%s\n    {\"step\": %lu, \"seconds\": %.6f, \"tokens\": %lu, \"symbols\": ",
+                i > 0 ? "," : "",
+                sample->Step,
+                sample->Seconds,
+                sample->Tokens);
+        if (sample->Symbols != UINT64_MAX)
+        {
+            fprintf(Fp, "%lu", sample->Symbols);
+        }
+        else
+        {
+            fprintf(Fp, "null");
+        }
+        fprintf(Fp, ", \"blocks\": %lu}", sample->Blocks);
+    }
+
+    fprintf(Fp, "\n  ],\n");
+}
+
+STATUS
+TagStatsWrite(
+    TagStats *Stats,
+    const char *Filename,
+    Debugger *Dbg,
+    uint64_t Steps,
+    STATUS RunStatus
+    )
+{
+    STATUS status = ENV_OK;
+    TagSystem *system = Stats->System;
+    ChunkQueue *queue = &system->Tape.Queue;
+    struct rusage usage;
+    double seconds;
+    FILE *fp = NULL;
+
+    //
+    // One last look at where the run ended up.
+    //
+    TagStatsTake(Stats, UINT64_MAX);
+    seconds = Stats->Samples[Stats->SampleCount - 1].Seconds;
+
+    memset(&usage, 0, sizeof(usage));
+    (void) getrusage(RUSAGE_SELF, &usage);
+
+    fp = fopen(Filename, "w");
+    if (fp == NULL)
+    {
+        TagWarn("fopen %s", Filename);
+        BAIL(status = TAGSTATS_WRITE);
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"steps\": %lu,\n", Steps);
+    fprintf(fp, "  \"status\": \"%x\",\n", RunStatus);
+    fprintf(fp, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(fp, "  \"steps_per_second\": %.0f,\n", seconds > 0 ? Steps / seconds : 0.0);
+    fprintf(fp, "  \"peak_rss_kib\": %ld,\n", usage.ru_maxrss);
+    fprintf(fp, "  \"symbol_size\": %u,\n", system->SymbolSize);
+    fprintf(fp, "  \"deletion_number\": %u,\n", system->AbstractDeletionNumber);
+    fprintf(fp, "  \"queue\": {\"peak_tokens\": %lu, \"peak_blocks\": %lu, "
+                "\"blocks_allocated\": %lu, \"blocks_released\": %lu, \"blocks_spilled\": %lu},\n",
+            Stats->PeakTokens,
+            Stats->PeakBlocks,
+            queue->BlocksAllocated,
+            queue->BlocksReleased,
+            queue->Spilled);
+
+    TagStatsPutRunLengths(Stats, fp);
+    TagStatsPutSamples(Stats, fp);
+    TagStatsPutRules(Stats, fp, Dbg);
+
+    fprintf(fp, "  \"sample_interval\": %lu\n", Stats->Interval);
+    fprintf(fp, "}\n");
+
+    if (ferror(fp))
+    {
+        TagWarnx("write %s", Filename);
+        BAIL(status = TAGSTATS_WRITE);
+    }
+
+Bail:
+    if (fp != NULL && fclose(fp) != 0 && SUCCEEDED(status))
+    {
+        TagWarn("fclose %s", Filename);
+        status = TAGSTATS_WRITE;
+    }
+
+    return status;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "Tag.h"
+#include "Debug.h"
+
+#define TAGSTATS                13
+#define TAGSTATS_STATUS(Code)   (MAKE_STATUS(Code, TAGSTATS))
+
+#define TAGSTATS_OK             0
+#define TAGSTATS_WRITE          (TAGSTATS_STATUS(1))
+
+//
+// How many samples of the queue are kept, and how many steps apart the first
+// ones are.
+//
+#define TAGSTATS_DEFAULT_SAMPLES    1024
+#define TAGSTATS_DEFAULT_INTERVAL   (1 << 12)
+
+//
+// Counting the symbols in the queue means walking it, so it is only done
+// when the queue has no more than one token for every this many steps since
+// the last sample.
+//
+#define TAGSTATS_WALK_RATIO     16
+
+typedef struct _TagStatsSample
+{
+    uint64_t Step;
+    double Seconds;
+    uint64_t Tokens;
+    uint64_t Symbols;       // UINT64_MAX when they weren't counted.
+    uint64_t Blocks;        // The queue's blocks in memory.
+} TagStatsSample;
+
+//
+// Collects what goes into a run report (tagi -r). The rules and the TagSystem
+// keep their own counters all the time; this adds samples of the queue taken
+// as TagRun goes, which are what cost anything.
+//
+// Samples start out Interval steps apart. Whenever there is no room for
+// another, every other one is dropped and Interval doubles, so the samples
+// always cover the whole run evenly however long it gets.
+//
+typedef struct _TagStats
+{
+    TagSystem *System;
+
+    //
+    // Steps completed since we were set up, as TagRun tells us about them.
+    //
+    uint64_t Clock;
+    uint64_t Interval;
+    struct timespec Start;
+
+    TagStatsSample *Samples;
+    uint64_t SampleCount;
+    uint64_t MaxSamples;
+
+    uint64_t PeakTokens;
+    uint64_t PeakBlocks;
+} TagStats;
+
+STATUS
+TagStatsInitialize(
+    TagStats *Stats,
+    TagSystem *System
+    );
+
+void
+TagStatsTeardown(
+    TagStats *Stats
+    );
+
+//
+// Elapsed is how many steps were taken since the last call.
+//
+void
+TagStatsStep(
+    TagStats *Stats,
+    uint64_t Elapsed
+    );
+
+//
+// Writes the report for a run that took Steps steps and stopped with
+// RunStatus to Filename as JSON. Rules are named through Dbg when there is
+// one.
+//
+STATUS
+TagStatsWrite(
+    TagStats *Stats,
+    const char *Filename,
+    Debugger *Dbg,
+    uint64_t Steps,
+    STATUS RunStatus
+    );
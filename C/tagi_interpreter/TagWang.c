@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <err.h>
+
+#include "tommyhashlin.h"
+
+#include "Util.h"
+#include "Blob.h"
+#include "TagQueue.h"
+#include "TagRule.h"
+#include "Tag.h"
+#include "Debug.h"
+#include "TagWang.h"
+
+//
+// Learning tries every m and n in [0, TAGWANG_SAMPLES) of the case's classes
+// and gives up on it if it isn't back in canonical form within
+// TAGWANG_MAX_LEARN_STEPS steps. The constructions in wmach take at most
+// about a dozen.
+//
+#define TAGWANG_SAMPLES             8
+#define TAGWANG_MAX_LEARN_STEPS     64
+
+//
+// Keeps the rebuilt queue's counts, and its length in symbols, well clear of
+// overflowing.
+//
+#define TAGWANG_MAX_COUNT           (1ULL << 60)
+
+typedef struct _TagWangScan
+{
+    TagWang *Wang;
+    STATUS Status;
+} TagWangScan;
+
+static const char *TagWangPrefixes[TagWang_Kinds] = {
+    [TagWang_X] = "x_",
+    [TagWang_S0] = "s0_",
+    [TagWang_S1] = "s1_",
+    [TagWang_Y] = "y_",
+};
+
+static
+int
+TagWangCompare(
+    const void *Arg,    /* uint64_t* */
+    const void *Obj     /* TagWangSymbol* */
+    )
+{
+    const uint64_t *value = (const uint64_t *) Arg;
+    const TagWangSymbol *symbol = (const TagWangSymbol *) Obj;
+
+    return *value != symbol->Value;
+}
+
+static
+inline
+TagWangSymbol *
+TagWangLookup(
+    TagWang *Wang,
+    uint8_t *Symbol
+    )
+{
+    uint64_t value = TagSymbolValue(Symbol, Wang->System->SymbolSize);
+
+    return (TagWangSymbol *) tommy_hashlin_search(
+                        &Wang->Symbols,
+                        TagWangCompare,
+                        &value,
+                        tommy_hash_u64(0, &value, sizeof(value)));
+}
+
+//
+// Picks out the debug symbols that name canonical symbols, i.e. a prefix
+// followed by nothing but the instruction's index.
+//
+static
+void
+TagWangAddSymbol(
+    void *Arg,  /* TagWangScan* */
+    void *Obj   /* SymbolEntry* */
+    )
+{
+    TagWangScan *scan = (TagWangScan *) Arg;
+    SymbolEntry *entry = (SymbolEntry *) Obj;
+    TagWangSymbol *symbol;
+    const char *digits;
+    char *end;
+    uint64_t index;
+    int kind;
+
+    if (FAILED(scan->Status))
+    {
+        return;
+    }
+
+    for (kind = 0; kind < TagWang_Kinds; ++kind)
+    {
+        size_t length = strlen(TagWangPrefixes[kind]);
+
+        if (strncmp(entry->Name, TagWangPrefixes[kind], length) == 0)
+        {
+            break;
+        }
+    }
+    if (kind == TagWang_Kinds)
+    {
+        return;
+    }
+
+    digits = entry->Name + strlen(TagWangPrefixes[kind]);
+    if (*digits < '0' || *digits > '9')
+    {
+        return;
+    }
+
+    index = strtoull(digits, &end, 10);
+    if (*end != '\0' || index >= UINT32_MAX)
+    {
+        return;
+    }
+
+    symbol = malloc(sizeof(*symbol));
+    if (symbol == NULL)
+    {
+        TagWarnx("malloc symbol");
+        scan->Status = ENV_OOM;
+        return;
+    }
+
+    symbol->Value = entry->RawSymbol;
+    symbol->Kind = (TagWangKind) kind;
+    symbol->Index = index;
+
+    tommy_hashlin_insert(
+            &scan->Wang->Symbols,
+            &symbol->Node,
+            symbol,
+            tommy_hash_u64(0, &symbol->Value, sizeof(symbol->Value)));
+
+    scan->Wang->InsnCount = MAX(scan->Wang->InsnCount, index + 1);
+}
+
+static
+void
+TagWangNoteSymbols(
+    TagWang *Wang,
+    Blob *Symbols
+    )
+{
+    TagWangSymbol *symbol;
+    uint8_t **slot;
+    uint64_t i;
+
+    for (i = 0; i < Symbols->Size; i += Wang->System->SymbolSize)
+    {
+        symbol = TagWangLookup(Wang, &Symbols->Data[i]);
+        if (symbol == NULL)
+        {
+            continue;
+        }
+
+        slot = &Wang->Insns[symbol->Index].Symbols[symbol->Kind];
+        if (*slot == NULL)
+        {
+            *slot = &Symbols->Data[i];
+        }
+    }
+}
+
+//
+// Finds a copy of every canonical symbol that the TagSystem owns so the
+// rebuilt queue can point at it.
+//
+static
+void
+TagWangNoteRule(
+    TagWang *Wang,
+    TagRule *Rule
+    )
+{
+    TagWangNoteSymbols(Wang, &Rule->Symbol);
+
+    switch (Rule->Style) {
+    case IoSel_Pure:
+        TagWangNoteSymbols(Wang, &Rule->Pure.Appendant);
+        break;
+
+    case IoSel_Input:
+        TagWangNoteSymbols(Wang, &Rule->In.Appendant0);
+        TagWangNoteSymbols(Wang, &Rule->In.Appendant1);
+        break;
+
+    case IoSel_Output:
+        TagWangNoteSymbols(Wang, &Rule->Out.Appendant);
+        break;
+
+    case IoSel_Max:
+    default:
+        break;
+    }
+}
+
+STATUS
+TagWangInitialize(
+    TagWang *Wang,
+    TagSystem *System,
+    Debugger *Dbg
+    )
+{
+    STATUS status = ENV_OK;
+    TagWangScan scan;
+    uint64_t i;
+
+    assert(Wang != NULL);
+    assert(System != NULL);
+    assert(Dbg != NULL);
+
+    memset(Wang, 0, sizeof(*Wang));
+
+    tommy_hashlin_init(&Wang->Symbols);
+
+    if (System->AbstractDeletionNumber != 2)
+    {
+        TagWarnx("W-machines are 2-tag systems, not %u-tag systems",
+                System->AbstractDeletionNumber);
+        BAIL(status = ENV_BADARG);
+    }
+
+    Wang->System = System;
+
+    scan.Wang = Wang;
+    scan.Status = ENV_OK;
+    tommy_hashlin_foreach_arg(&Dbg->SymbolMap, TagWangAddSymbol, &scan);
+    CHECK(status = scan.Status);
+
+    if (Wang->InsnCount == 0)
+    {
+        TagWarnx("No W-machine symbols in the debug symbols");
+        BAIL(status = ENV_BADARG);
+    }
+
+    Wang->Insns = calloc(Wang->InsnCount, sizeof(*Wang->Insns));
+    if (Wang->Insns == NULL)
+    {
+        TagWarnx("calloc Insns (%lu)", Wang->InsnCount);
+        BAIL(status = ENV_OOM);
+    }
+
+    for (i = 0; i < System->RuleCount; ++i)
+    {
+        TagWangNoteRule(Wang, &System->Rules[i]);
+    }
+
+    CHECK(status = TagQueueInitialize(
+                &Wang->Scratch,
+                System->AbstractDeletionNumber,
+                System->SymbolSize));
+
+Bail:
+    if (FAILED(status))
+    {
+        TagWangTeardown(Wang);
+    }
+
+    return status;
+}
+
+void
+TagWangTeardown(
+    TagWang *Wang
+    )
+{
+    tommy_hashlin_foreach(&Wang->Symbols, free);
+    tommy_hashlin_done(&Wang->Symbols);
+
+    TagQueueTeardown(&Wang->Scratch);
+
+    free(Wang->Insns);
+    Wang->Insns = NULL;
+}
+
+//
+// Checks whether Q holds exactly (x_i x_i)^M s_i s_i (y_i y_i)^N, with one
+// token per run.
+//
+static
+bool
+TagWangMatch(
+    TagWang *Wang,
+    TagQueue *Q,
+    uint64_t *Index,
+    uint64_t *M,
+    bool *S,
+    uint64_t *N
+    )
+{
+    TagQueueToken runs[4];
+    TagWangSymbol *symbol;
+    uint64_t tokenCount, runCount, i, counts[TagWang_Kinds] = { 0 };
+    int expect = TagWang_X;
+    bool head = false;
+
+    tokenCount = TagQueueTokenCount(Q);
+    if (tokenCount > 3 ||
+        Q->Cache.Extra != NULL ||
+        (Q->Cache.SymbolCount % Q->DeletionNumber) != 0)
+    {
+        return false;
+    }
+
+    if (FAILED(TagQueuePeekTokens(Q, runs, tokenCount)))
+    {
+        return false;
+    }
+    runCount = tokenCount;
+
+    if (Q->Cache.Dirty)
+    {
+        runs[runCount].Symbol = Q->Cache.Symbol.Data;
+        runs[runCount].Count = Q->Cache.SymbolCount / Q->DeletionNumber;
+        ++runCount;
+    }
+    else if (Q->Cache.SymbolCount != 0)
+    {
+        return false;
+    }
+
+    for (i = 0; i < runCount; ++i)
+    {
+        if (TagQueueTokenIsBig(&runs[i]))
+        {
+            return false;
+        }
+
+        symbol = TagWangLookup(Wang, runs[i].Symbol);
+        if (symbol == NULL ||
+            (int) symbol->Kind < expect ||
+            (i > 0 && symbol->Index != *Index))
+        {
+            return false;
+        }
+
+        *Index = symbol->Index;
+        counts[symbol->Kind] = runs[i].Count;
+
+        switch (symbol->Kind) {
+        case TagWang_X:
+            expect = TagWang_S0;
+            break;
+
+        case TagWang_S0:
+        case TagWang_S1:
+            if (runs[i].Count != 1)
+            {
+                return false;
+            }
+
+            *S = (symbol->Kind == TagWang_S1);
+            head = true;
+            expect = TagWang_Y;
+            break;
+
+        case TagWang_Y:
+            if (!head)
+            {
+                return false;
+            }
+
+            expect = TagWang_Kinds;
+            break;
+
+        case TagWang_Kinds:
+        default:
+            return false;
+        }
+    }
+
+    if (!head)
+    {
+        return false;
+    }
+
+    if (counts[TagWang_X] > TAGWANG_MAX_COUNT ||
+        counts[TagWang_Y] > TAGWANG_MAX_COUNT)
+    {
+        return false;
+    }
+
+    *M = counts[TagWang_X];
+    *N = counts[TagWang_Y];
+
+    return true;
+}
+
+static
+inline
+TagWangClass
+TagWangClassify(
+    uint64_t Count
+    )
+{
+    if (Count == 0)
+    {
+        return TagWangClass_Zero;
+    }
+
+    return (Count & 1) ? TagWangClass_Odd : TagWangClass_Even;
+}
+
+//
+// Replaces the contents of Q with the canonical form of Insn.
+//
+static
+STATUS
+TagWangBuild(
+    TagWang *Wang,
+    TagQueue *Q,
+    TagWangInsn *Insn,
+    uint64_t M,
+    bool S,
+    uint64_t N
+    )
+{
+    STATUS status = ENV_OK;
+    TagQueueToken runs[3];
+    uint64_t runCount = 0;
+
+    assert(M <= TAGWANG_MAX_COUNT && N <= TAGWANG_MAX_COUNT);
+    (void) Wang;
+
+    if (M > 0)
+    {
+        runs[runCount].Symbol = Insn->Symbols[TagWang_X];
+        runs[runCount++].Count = M;
+    }
+
+    runs[runCount].Symbol = Insn->Symbols[S ? TagWang_S1 : TagWang_S0];
+    runs[runCount++].Count = 1;
+
+    if (N > 0)
+    {
+        runs[runCount].Symbol = Insn->Symbols[TagWang_Y];
+        runs[runCount++].Count = N;
+    }
+
+    CHECK(status = TagQueueDropTokens(Q, TagQueueTokenCount(Q)));
+    Q->Cache.Symbol.Data = NULL;
+    Q->Cache.SymbolCount = 0;
+    Q->Cache.Dirty = false;
+
+    CHECK(status = TagQueueAppendRuns(
+                Q,
+                runs,
+                runCount,
+                (M + 1 + N) * Q->DeletionNumber));
+
+Bail:
+    return status;
+}
+
+//
+// Whether the symbols needed to build this configuration of Insn exist.
+//
+static
+inline
+bool
+TagWangCanBuild(
+    TagWangInsn *Insn,
+    uint64_t M,
+    bool S,
+    uint64_t N
+    )
+{
+    return (M == 0 || Insn->Symbols[TagWang_X] != NULL) &&
+           Insn->Symbols[S ? TagWang_S1 : TagWang_S0] != NULL &&
+           (N == 0 || Insn->Symbols[TagWang_Y] != NULL);
+}
+
+//
+// Where Effect takes (M, S, N). False if the result would be too large.
+//
+static
+bool
+TagWangApply(
+    TagWangEffect Effect,
+    uint64_t *M,
+    bool *S,
+    uint64_t *N
+    )
+{
+    bool s = *S;
+
+    switch (Effect) {
+    case TagWangEffect_Keep:
+        break;
+
+    case TagWangEffect_Set:
+        *S = true;
+        break;
+
+    case TagWangEffect_Unset:
+        *S = false;
+        break;
+
+    case TagWangEffect_Right:
+        if (*M >= TAGWANG_MAX_COUNT / 2)
+        {
+            return false;
+        }
+
+        *M = 2 * *M + s;
+        *S = (*N & 1) != 0;
+        *N /= 2;
+        break;
+
+    case TagWangEffect_Left:
+        if (*N >= TAGWANG_MAX_COUNT / 2)
+        {
+            return false;
+        }
+
+        *N = 2 * *N + s;
+        *S = (*M & 1) != 0;
+        *M /= 2;
+        break;
+
+    case TagWangEffect_Unknown:
+    case TagWangEffect_Declined:
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Runs one sample of Insn on the scratch queue until it is back in canonical
+// form. Returns false if it never gets there using only pure rules.
+//
+static
+bool
+TagWangSample(
+    TagWang *Wang,
+    TagWangInsn *Insn,
+    uint64_t *M,
+    bool *S,
+    uint64_t *N,
+    uint64_t *Target,
+    uint64_t *Steps
+    )
+{
+    TagQueue *scratch = &Wang->Scratch;
+    TagRule *rule;
+    Blob symbol;
+    uint64_t reps, steps;
+    bool matched = false;
+
+    if (FAILED(TagWangBuild(Wang, scratch, Insn, *M, *S, *N)))
+    {
+        goto Bail;
+    }
+
+    for (steps = 1; steps <= TAGWANG_MAX_LEARN_STEPS; ++steps)
+    {
+        if (TagQueueIsEmpty(scratch) ||
+            FAILED(TagQueuePop(scratch, &symbol, &reps)))
+        {
+            break;
+        }
+
+        rule = TagLookupRule(Wang->System, &symbol);
+        if (rule == NULL ||
+            rule->Style != IoSel_Pure ||
+            rule->Pure.Appendant.Size == 0)
+        {
+            break;
+        }
+
+        if (FAILED(TagQueuePush(scratch, &rule->Pure.Appendant, reps)))
+        {
+            break;
+        }
+
+        if (TagWangMatch(Wang, scratch, Target, M, S, N))
+        {
+            *Steps = steps;
+            matched = true;
+            break;
+        }
+    }
+
+Bail:
+    //
+    // Leave the scratch queue empty for next time.
+    //
+    (void) TagQueueDropTokens(scratch, TagQueueTokenCount(scratch));
+    scratch->Cache.Symbol.Data = NULL;
+    scratch->Cache.SymbolCount = 0;
+    scratch->Cache.Dirty = false;
+
+    return matched;
+}
+
+//
+// Works out what Insn does to the m and n in the given classes when the head
+// reads S by trying it on all of the samples in them. Every sample has to
+// agree on the target, the number of steps and at least one effect.
+//
+static
+void
+TagWangLearn(
+    TagWang *Wang,
+    TagWangInsn *Insn,
+    bool S,
+    TagWangClass MClass,
+    TagWangClass NClass
+    )
+{
+    static const TagWangEffect effects[] = {
+        TagWangEffect_Keep,
+        TagWangEffect_Set,
+        TagWangEffect_Unset,
+        TagWangEffect_Right,
+        TagWangEffect_Left,
+    };
+    TagWangCase *wcase = &Insn->Cases[S][MClass][NClass];
+    uint64_t m, n, i, m1, n1, m2, n2, target, steps;
+    bool s1, s2, possible[ARRAY_SIZE(effects)];
+    bool first = true;
+
+    ++Wang->Learned;
+
+    wcase->Effect = TagWangEffect_Declined;
+
+    for (i = 0; i < ARRAY_SIZE(effects); ++i)
+    {
+        possible[i] = true;
+    }
+
+    for (m = 0; m < TAGWANG_SAMPLES; ++m)
+    {
+        for (n = 0; n < TAGWANG_SAMPLES; ++n)
+        {
+            if (TagWangClassify(m) != MClass || TagWangClassify(n) != NClass)
+            {
+                continue;
+            }
+
+            m1 = m;
+            s1 = S;
+            n1 = n;
+            if (!TagWangCanBuild(Insn, m, S, n) ||
+                !TagWangSample(Wang, Insn, &m1, &s1, &n1, &target, &steps))
+            {
+                return;
+            }
+
+            if (first)
+            {
+                wcase->Target = target;
+                wcase->Steps = steps;
+                first = false;
+            }
+            else if (target != wcase->Target || steps != wcase->Steps)
+            {
+                return;
+            }
+
+            for (i = 0; i < ARRAY_SIZE(effects); ++i)
+            {
+                m2 = m;
+                s2 = S;
+                n2 = n;
+                possible[i] = possible[i] &&
+                              TagWangApply(effects[i], &m2, &s2, &n2) &&
+                              m2 == m1 && s2 == s1 && n2 == n1;
+            }
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(effects); ++i)
+    {
+        if (possible[i])
+        {
+            wcase->Effect = effects[i];
+            break;
+        }
+    }
+}
+
+STATUS
+TagWangStep(
+    TagWang *Wang,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    )
+{
+    STATUS status = ENV_OK;
+    TagWangCase *wcase;
+    uint64_t index, m, n;
+    bool s;
+
+    *StepsTaken = 0;
+
+    if (!TagWangMatch(Wang, &Wang->System->Tape, &index, &m, &s, &n))
+    {
+        goto Bail;
+    }
+
+    wcase = &Wang->Insns[index].Cases[s][TagWangClassify(m)][TagWangClassify(n)];
+
+    if (wcase->Effect == TagWangEffect_Unknown)
+    {
+        TagWangLearn(Wang, &Wang->Insns[index], s, TagWangClassify(m), TagWangClassify(n));
+    }
+
+    if (wcase->Effect == TagWangEffect_Declined ||
+        wcase->Steps > Budget ||
+        !TagWangApply(wcase->Effect, &m, &s, &n) ||
+        !TagWangCanBuild(&Wang->Insns[wcase->Target], m, s, n))
+    {
+        ++Wang->Declined;
+        goto Bail;
+    }
+
+    CHECK(status = TagWangBuild(
+                Wang,
+                &Wang->System->Tape,
+                &Wang->Insns[wcase->Target],
+                m,
+                s,
+                n));
+
+    ++Wang->Instructions;
+    Wang->Steps += wcase->Steps;
+
+    *StepsTaken = wcase->Steps;
+
+Bail:
+    return status;
+}
+
+void
+TagWangDump(
+    TagWang *Wang
+    )
+{
+    TagPrint("wang: instructions: %lu steps: %lu learned: %lu declined: %lu\n",
+            Wang->Instructions,
+            Wang->Steps,
+            Wang->Learned,
+            Wang->Declined);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tommyhashlin.h"
+
+#include "Util.h"
+#include "TagQueue.h"
+#include "Tag.h"
+#include "Debug.h"
+
+#define TAGWANG                 9
+#define TAGWANG_STATUS(Code)    (MAKE_STATUS(Code, TAGWANG))
+
+#define TAGWANG_OK              0
+
+//
+// The four symbols a W-machine instruction's canonical configuration is made
+// of (see W_Machine.c). They are named x_i, s0_i, s1_i and y_i by wmach.
+//
+typedef enum _TagWangKind
+{
+    TagWang_X = 0,
+    TagWang_S0 = 1,
+    TagWang_S1 = 2,
+    TagWang_Y = 3,
+
+    TagWang_Kinds,
+} TagWangKind;
+
+//
+// What an instruction does to the tape (m, s, n), where m and n are the
+// counts of the x and y pairs and s the bit under the head.
+//
+typedef enum _TagWangEffect
+{
+    TagWangEffect_Unknown = 0,
+    TagWangEffect_Declined,
+
+    TagWangEffect_Keep,     // Jumps, debug.
+    TagWangEffect_Set,
+    TagWangEffect_Unset,
+    TagWangEffect_Right,    // (2m + s, n & 1, n / 2)
+    TagWangEffect_Left,     // (m / 2, m & 1, 2n + s)
+} TagWangEffect;
+
+//
+// Which of these m (or n) is decides how the construction behaves, as the
+// runs' lengths only matter through their parity, and a side that is empty
+// leaves out a run altogether.
+//
+typedef enum _TagWangClass
+{
+    TagWangClass_Zero = 0,
+    TagWangClass_Odd = 1,
+    TagWangClass_Even = 2,
+
+    TagWangClasses,
+} TagWangClass;
+
+//
+// What an instruction was seen to do for one value of s and one class each
+// of m and n.
+//
+typedef struct _TagWangCase
+{
+    TagWangEffect Effect;
+    uint64_t Target;
+    uint64_t Steps;     // How many steps TagStep takes to get there.
+} TagWangCase;
+
+typedef struct _TagWangInsn
+{
+    //
+    // Point into memory owned by the TagSystem. NULL if the program never
+    // mentions the symbol.
+    //
+    uint8_t *Symbols[TagWang_Kinds];
+
+    TagWangCase Cases[2][TagWangClasses][TagWangClasses];
+} TagWangInsn;
+
+typedef struct _TagWangSymbol
+{
+    tommy_node Node;
+
+    uint64_t Value;
+    TagWangKind Kind;
+    uint64_t Index;
+} TagWangSymbol;
+
+//
+// Runs tag systems compiled from W-machines an instruction at a time instead
+// of a step at a time.
+//
+// Whenever the queue is in the canonical form (x_i x_i)^m s_i s_i (y_i y_i)^n
+// for some instruction i the whole instruction is applied to m, s and n
+// directly and the queue is rebuilt in the canonical form of the next one.
+// Which symbols are which comes from the debug symbols.
+//
+// Nothing is assumed about what each instruction does. The first time an
+// instruction comes up with a given s and classes of m and n it is run step
+// by step against a scratch queue for the small m and n in those classes and
+// the results are matched against the effects above. Cases that don't match
+// any of them, do I/O, halt or don't always take the same number of steps are
+// left to TagStep.
+//
+typedef struct _TagWang
+{
+    TagSystem *System;
+
+    tommy_hashlin Symbols;
+
+    TagWangInsn *Insns;
+    uint64_t InsnCount;
+
+    TagQueue Scratch;
+
+    //
+    // Statistics.
+    //
+    uint64_t Instructions;
+    uint64_t Steps;
+    uint64_t Learned;
+    uint64_t Declined;
+} TagWang;
+
+STATUS
+TagWangInitialize(
+    TagWang *Wang,
+    TagSystem *System,
+    Debugger *Dbg
+    );
+
+void
+TagWangTeardown(
+    TagWang *Wang
+    );
+
+//
+// Tries to run a whole instruction. StepsTaken is how many steps that was
+// worth, or 0 if the caller should take a normal step instead.
+//
+STATUS
+TagWangStep(
+    TagWang *Wang,
+    uint64_t Budget,
+    uint64_t *StepsTaken
+    );
+
+void
+TagWangDump(
+    TagWang *Wang
+    );
@@ -82,6 +82,18 @@ typedef int32_t     STATUS;
 #define TagWarn(fmt, ...)       warn ("%s: " fmt, __FUNCTION__, ##__VA_ARGS__)
 #define TagWarnx(fmt, ...)      warnx("%s: " fmt, __FUNCTION__, ##__VA_ARGS__)
 
+//
+// Per-step tracing. This is far too slow to leave in the step loop so it only
+// exists in builds with TAG_TRACE defined (make TRACE=1).
+//
+#ifdef TAG_TRACE
+#define TagTrace(fmt, ...)              TagPrint(fmt, ##__VA_ARGS__)
+#define TagTraceDump(Desc, Addr, Len)   hexdump_only(Desc, Addr, Len)
+#else
+#define TagTrace(fmt, ...)              ((void) 0)
+#define TagTraceDump(Desc, Addr, Len)   ((void) 0)
+#endif
+
 #pragma clang diagnostic pop
 
 void
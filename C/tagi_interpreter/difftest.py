@@ -0,0 +1,557 @@
+#!/usr/bin/env python3
+#
+# Differential tests for tagi. Generates small random tag systems and checks
+#
+#  - a plain run against a naive model that pushes every repetition one at a
+#    time (what TagQueuePush does arithmetically has to give the same queue),
+#  - every accelerator flag, and everything else that has to behave like a
+#    plain run, against a plain run (see CHECKS), and
+#  - runs of programs built for a particular feature against plain runs of
+#    the same programs (see SUITES),
+#
+# comparing output, exit status and the step count tagi reports.
+#
+# usage: difftest.py [-p programs] [-s seed] [-n steps] [tagi]
+#
+# Exits non-zero if anything differed. make check runs it against ./tagi.
+#
+
+import argparse
+import json
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+import tagbin
+import wmachine
+
+#
+# How tagi is run for each accelerator that only has to give the same run.
+#
+FLAGS = [
+    ['-c'],
+    ['-m', '16'],
+    ['-t', '2'],
+    ['-t', '1'],
+    ['-P'],
+    ['-a'],
+    ['-H'],
+    ['-s', '1'],
+    ['-j'],
+]
+
+#
+# The flags that take their steps some other way than TagFire, which -r and
+# -F have to refuse.
+#
+BYPASSING = [
+    ['-c'],
+    ['-m', '16'],
+    ['-t', '2'],
+    ['-P'],
+    ['-w'],
+    ['-j'],
+]
+
+#
+# The model gives up past this many symbols pushed in one step, and the
+# comparison stops at the step before.
+#
+MODEL_MAX_PUSH = 1 << 16
+
+#
+# check(test, path, data, plain) is called for every random program with the
+# result of its plain run, and compares whatever runs it makes against it.
+#
+CHECKS = []
+
+#
+# suite(test) is called once, and makes up its own programs.
+#
+SUITES = []
+
+
+def check(function):
+    CHECKS.append(function)
+    return function
+
+
+def suite(function):
+    SUITES.append(function)
+    return function
+
+
+def generate(rng):
+    """A random program: (deletion number, rules, queue). Rules map a symbol
+    to ('pure', appendant), ('out', bit, appendant) or ('in', appendant0,
+    appendant1). Some symbols are left without rules and some appendants are
+    empty, both of which stop the run."""
+    d = rng.randint(2, 4)
+    n = rng.choice([2, 3, 5, 8, 8, 12, 300])
+    syms = list(range(n))
+    rules = {}
+
+    for s in syms:
+        r = rng.random()
+        if r < 0.35:
+            #
+            # Every bucket the same: what TagQueuePushUniform takes.
+            #
+            m = rng.choice([1, 2, d, 2 * d, d + 1, 2 * d + 1, 4])
+            rules[s] = ('pure', [rng.choice(syms)] * m)
+        elif r < 0.75:
+            rules[s] = ('pure', [rng.choice(syms) for _ in range(rng.randint(d - 1, 2 * d + 1))])
+        elif r < 0.85:
+            rules[s] = ('out', rng.randint(0, 1), [rng.choice(syms) for _ in range(rng.randint(1, 2 * d))])
+        elif r < 0.93:
+            rules[s] = ('in',
+                        [rng.choice(syms)] * rng.randint(1, d + 1),
+                        [rng.choice(syms) for _ in range(rng.randint(1, d + 1))])
+        elif r < 0.97:
+            rules[s] = ('pure', [])
+        # else no rule at all
+
+    if not rules:
+        rules[0] = ('pure', [0] * d)
+
+    if rng.random() < 0.5:
+        queue = [rng.choice(syms)] * rng.randint(1, 2 * d)
+    else:
+        queue = [rng.choice(syms) for _ in range(rng.randint(d, 8 * d))]
+
+    return d, rules, queue
+
+
+def interesting(rng, generate):
+    """A program from generate(rng), and input for it. Most random programs
+    stop within a few steps, which shows nothing, so keep going until one
+    doesn't. Returns (program, data, what the model made of it)."""
+    data = bytes(rng.randrange(256) for _ in range(64))
+    for _ in range(100):
+        program = generate(rng)
+        result = model(program, data, 3000)
+        if result is None or result[0] >= 50:
+            break
+
+    return program, data, result
+
+
+def assemble(program, path, names=None, width=None, values=None):
+    """Writes program out as a v1 binary, and its symbol names as path.dbg.
+    Symbol s is written as values[s] if given, and is called names[s] (s%d by
+    default)."""
+    d, rules, queue = program
+    count = max(max(rules), max(queue)) + 1
+    for rule in rules.values():
+        for part in rule[1:]:
+            if isinstance(part, list) and part:
+                count = max(count, max(part) + 1)
+
+    if names is None:
+        names = ['s%d' % s for s in range(count)]
+    if values is None:
+        values = list(range(count))
+    if width is None:
+        width = max(1, (max(values).bit_length() + 7) // 8)
+
+    def pack(symbols):
+        return b''.join(struct.pack('<Q', values[s])[:width] for s in symbols)
+
+    out = bytearray(struct.pack('<QIII', len(rules), width, len(queue) * width, d))
+    for s, rule in sorted(rules.items()):
+        if rule[0] == 'pure':
+            out += struct.pack('<BH', 2, len(rule[1]) * width) + pack([s]) + pack(rule[1])
+        elif rule[0] == 'in':
+            out += struct.pack('<BHH', 1, len(rule[1]) * width, len(rule[2]) * width)
+            out += pack([s]) + pack(rule[1]) + pack(rule[2])
+        else:
+            out += struct.pack('<BH', 0, len(rule[2]) * width) + pack([s]) + pack(rule[2])
+            out += bytes([rule[1]])
+    out += pack(queue)
+
+    with open(path, 'wb') as f:
+        f.write(out)
+    with open(path + '.dbg', 'w') as f:
+        for s in range(count):
+            f.write('%s %x\n' % (names[s], values[s]))
+
+
+def model(program, data, steps):
+    """Runs program the slow way. Returns (steps taken, output, whether it
+    stopped by itself) or None when a step would push too much to follow."""
+    d, rules, queue = program
+
+    #
+    # The same runs as TagQueue keeps: tokens of (head, buckets) and a cache
+    # that soaks up whatever shares the last head, partial bucket included.
+    #
+    tokens = []
+    cache = [None, 0]
+    front = 0
+
+    def flush():
+        tokens.append((cache[0], cache[1] // d))
+        cache[0] = None
+        cache[1] = 0
+
+    def push(appendant):
+        n = len(appendant)
+        fill = min(n, (d - cache[1] % d) % d)
+        cache[1] += fill
+        for i in range(fill, n, d):
+            size = min(n - i, d)
+            if cache[0] is not None and cache[0] == appendant[i]:
+                cache[1] += size
+                continue
+            if cache[0] is not None:
+                flush()
+            cache[0] = appendant[i]
+            cache[1] = size
+
+    push(queue)
+
+    out = bytearray()
+    bits_out = []
+    bits_in = [(byte >> i) & 1 for byte in data for i in range(8)]
+    taken = 0
+
+    while taken < steps:
+        if front < len(tokens):
+            head, reps = tokens[front]
+            front += 1
+        elif cache[1] >= d:
+            head, reps = cache[0], cache[1] // d
+            cache[1] %= d
+            if cache[1] == 0:
+                cache[0] = None
+        else:
+            return taken, bytes(out), True
+
+        rule = rules.get(head)
+        if rule is None:
+            return taken, bytes(out), True
+
+        if reps * max(len(part) for part in rule[1:] if isinstance(part, list)) > MODEL_MAX_PUSH:
+            return None if taken == 0 else (taken, bytes(out), False)
+
+        if rule[0] == 'pure':
+            appendant = rule[1]
+        elif rule[0] == 'in':
+            if not bits_in:
+                return taken, bytes(out), True
+            appendant = rule[2] if bits_in.pop(0) else rule[1]
+        else:
+            bits_out.append(rule[1])
+            if len(bits_out) == 8:
+                out.append(sum(b << i for i, b in enumerate(bits_out)))
+                bits_out = []
+            appendant = rule[2]
+
+        if not appendant:
+            return taken, bytes(out), True
+
+        for _ in range(reps):
+            push(appendant)
+
+        taken += 1
+
+    return taken, bytes(out), False
+
+
+def reported(stderr):
+    """The step count from the "steps:" line a run leaves on stderr."""
+    for line in stderr.decode(errors='replace').splitlines():
+        if line.startswith('steps: '):
+            return int(line.split()[1], 16)
+    return None
+
+
+class Test:
+    """What the checks share: where tagi and the scratch directory are, and
+    the tally."""
+
+    def __init__(self, tagi, work, first, programs, steps):
+        self.tagi = tagi
+        self.tagc = os.path.join(os.path.dirname(tagi), 'tagc')
+        self.work = work
+        self.first = first
+        self.programs = programs
+        self.steps = steps
+        self.seed = None
+        self.checks = 0
+        self.failures = 0
+
+    def path(self, name):
+        return os.path.join(self.work, name)
+
+    def run(self, flags, program, data, steps=None, stdin=None):
+        """Returns (exit status, output, steps tagi reported)."""
+        p = self.execute([self.tagi] + flags + ['-n', str(self.steps if steps is None else steps), '-f', program],
+                         data if stdin is None else stdin)
+        return p.returncode, p.stdout, reported(p.stderr)
+
+    def execute(self, command, data):
+        return subprocess.run(command, input=data,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                              timeout=60)
+
+    def compare(self, what, expected, got):
+        self.checks += 1
+        if got != expected:
+            self.fail(what, 'expected (status %s, %d bytes, steps %s) got (status %s, %d bytes, steps %s)' %
+                      (expected[0], len(expected[1]), expected[2], got[0], len(got[1]), got[2]))
+
+    def fail(self, what, why):
+        self.failures += 1
+        print('DIFF seed %s %s: %s' % (self.seed, what, why))
+
+
+@check
+def check_flags(test, path, data, plain):
+    for flag in FLAGS:
+        test.compare(' '.join(flag), plain, test.run(flag, path, data))
+
+
+@check
+def check_tagc(test, path, data, plain):
+    """The runner tagc compiles has to match tagi, dispatching through a
+    switch or a table."""
+    runner = test.path('runner')
+    for dispatch in ['-s', '-t']:
+        source = runner + '.c'
+        p = test.execute([test.tagc, dispatch, '-f', path, '-o', source], b'')
+        if p.returncode != 0:
+            test.fail('tagc ' + dispatch, p.stderr.decode(errors='replace').strip())
+            continue
+
+        p = test.execute([os.environ.get('CC', 'cc'), '-O0', '-w', '-o', runner, source], b'')
+        if p.returncode != 0:
+            test.fail('tagc ' + dispatch, p.stderr.decode(errors='replace').strip())
+            continue
+
+        p = test.execute([runner, '-n', str(test.steps)], data)
+        test.compare('tagc ' + dispatch, plain, (p.returncode, p.stdout, reported(p.stderr)))
+
+
+@check
+def check_bignum(test, path, data, plain):
+    """-b only differs from a plain run once a run outgrows 64 bits: without
+    it the run is split and each part fires, and does its I/O, by itself.
+    That is what -b is there to change."""
+    report = test.path('report.json')
+    test.run(['-r', report], path, data)
+    with open(report) as f:
+        saturated = any(bucket['from'] >= 1 << 60 for bucket in json.load(f)['run_lengths'])
+
+    got = test.run(['-b'], path, data)
+    if saturated:
+        got = (got[0], plain[1], got[2])
+    test.compare('-b', plain, got)
+
+
+@check
+def check_v2(test, path, data, plain):
+    """The same program as a v2 binary, with the rule index and without it
+    and the rules shuffled."""
+    v2 = test.path('v2.bin')
+    tagbin.convert(path, v2, names=path + '.dbg')
+    test.compare('v2', plain, test.run([], v2, data))
+
+    tagbin.convert(path, v2, index=False, shuffle=test.seed)
+    test.compare('v2 -I -S', plain, test.run([], v2, data))
+
+
+@check
+def check_profile(test, path, data, plain):
+    """-F only watches, and has to leave a profile behind."""
+    profile = test.path('profile.folded')
+    if os.path.exists(profile):
+        os.unlink(profile)
+
+    test.compare('-F', plain, test.run(['-F', profile], path, data))
+    if not os.path.exists(profile):
+        test.fail('-F', 'no profile written')
+
+
+@check
+def check_events(test, path, data, plain):
+    """-E only watches. The ring it dumps at exit has to parse, and when
+    nothing was overwritten its ByteOut events have to spell out the
+    output."""
+    events = test.path('events')
+    if os.path.exists(events):
+        os.unlink(events)
+
+    test.compare('-E', plain, test.run(['-E', events], path, data))
+
+    with open(events, 'rb') as f:
+        dump = f.read()
+
+    header = struct.Struct('<8sIIQQ')
+    event = struct.Struct('<QIIQQ')
+    test.checks += 1
+
+    if len(dump) < header.size:
+        test.fail('-E', 'short dump')
+        return
+
+    magic, size, _, capacity, recorded = header.unpack_from(dump, 0)
+    if magic != b'TAGEVT01' or size != event.size or capacity & (capacity - 1) or \
+       len(dump) != header.size + capacity * size:
+        test.fail('-E', 'bad header %r' % ((magic, size, capacity, recorded, len(dump)),))
+        return
+
+    written = []
+    for i in range(capacity):
+        sequence, kind, _, a, _ = event.unpack_from(dump, header.size + i * size)
+        if sequence == 0:
+            continue
+        if sequence > recorded or (sequence - 1) % capacity != i or kind == 0 or kind >= 8:
+            test.fail('-E', 'bad event %d in slot %d' % (sequence, i))
+            return
+        if kind == 7:
+            written.append((sequence, a))
+
+    if recorded <= capacity and bytes(a for _, a in sorted(written)) != plain[1]:
+        test.fail('-E', 'ByteOut events don\'t match the output')
+
+
+@check
+def check_snapshot(test, path, data, plain):
+    """Stopped part way and picked up from the last snapshot. Output past the
+    snapshot is thrown away and input picks up where it had got to, as
+    someone recovering a run would do."""
+    snap = test.path('snap')
+    if os.path.exists(snap):
+        os.unlink(snap)
+
+    first = test.run(['-C', snap, '-K', '50'], path, data, 300)
+    if not os.path.exists(snap):
+        return
+
+    with open(snap, 'rb') as f:
+        #
+        # BitsIn and BitsOut. See TagCheckpoint.h.
+        #
+        bits_in, bits_out = struct.unpack_from('<QQ', f.read(48), 32)
+
+    rest = test.run(['-R', snap], path, data, stdin=data[(bits_in + 7) // 8:])
+    test.compare('-C/-R', plain, (rest[0], first[1][:bits_out // 8] + rest[1], rest[2]))
+
+
+@suite
+def suite_wang(test):
+    """W-machine programs run symbolically (-w) against the same programs
+    run a tag step at a time, and -w going by the names a v2 binary carries
+    instead of -d."""
+    for seed in range(test.first, test.first + test.programs):
+        test.seed = seed
+        rng = random.Random(seed)
+        data = bytes(rng.randrange(256) for _ in range(64))
+        program, names = wmachine.compile(*wmachine.generate(rng))
+        path = test.path('w%d.bin' % seed)
+        assemble(program, path, names)
+
+        #
+        # -d is passed to both, as it echoes its argument to stdout.
+        #
+        symbols = ['-d', path + '.dbg']
+        test.compare('-w', test.run(symbols, path, data), test.run(['-w'] + symbols, path, data))
+
+        v2 = test.path('w%d.v2' % seed)
+        tagbin.convert(path, v2, names=path + '.dbg')
+        test.compare('-w v2', test.run([], v2, data), test.run(['-w'], v2, data))
+
+
+@suite
+def suite_hash(test):
+    """Programs with 4 and 5 byte symbols, which are too wide for tagi to
+    index by itself. With the symbols numbered densely, the perfect hash has
+    to find the same rules as the rule index. With them spread over the whole
+    width, it has to find the same ones as tagi's own lookup."""
+    for seed in range(test.first, test.first + test.programs):
+        test.seed = seed
+        rng = random.Random(seed)
+        program, data, _ = interesting(rng, generate)
+        width = rng.choice([4, 5])
+        path = test.path('h%d.bin' % seed)
+        v2 = test.path('h%d.v2' % seed)
+
+        assemble(program, path, width=width)
+        tagbin.convert(path, v2)
+        indexed = test.run([], v2, data)
+        tagbin.convert(path, v2, hash=True, shuffle=seed)
+        test.compare('hash, dense', indexed, test.run([], v2, data))
+
+        values = rng.sample(range(1 << (8 * width)), 1000)
+        assemble(program, path, width=width, values=values)
+        plain = test.run([], path, data)
+        tagbin.convert(path, v2, hash=True)
+        test.compare('hash, sparse', plain, test.run([], v2, data))
+
+
+@suite
+def suite_refusals(test):
+    """-r and -F see the run through TagFire, and have to refuse whatever
+    takes its steps some other way rather than report on part of it."""
+    test.seed = None
+    path = test.path('refuse.bin')
+    assemble((2, {0: ('pure', [0, 0, 0])}, [0, 0]), path)
+    for option in [['-r', test.path('refused.json')], ['-F', test.path('refused.folded')]]:
+        for flag in BYPASSING:
+            p = test.execute([test.tagi] + option + flag + ['-n', '10', '-f', path], b'')
+            test.checks += 1
+            if p.returncode == 0 or b"can't be used" not in p.stderr:
+                test.fail(' '.join(option[:1] + flag), 'not refused (status %d)' % p.returncode)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-p', '--programs', type=int, default=60)
+    parser.add_argument('-s', '--seed', type=int, default=1)
+    parser.add_argument('-n', '--steps', type=int, default=200000)
+    parser.add_argument('tagi', nargs='?', default='./tagi')
+    args = parser.parse_args()
+
+    if os.uname().machine != 'x86_64':
+        FLAGS.remove(['-j'])
+        BYPASSING.remove(['-j'])
+
+    test = Test(os.path.abspath(args.tagi), tempfile.mkdtemp(prefix='difftest.'),
+                args.seed, args.programs, args.steps)
+
+    try:
+        for seed in range(test.first, test.first + test.programs):
+            test.seed = seed
+            program, data, result = interesting(random.Random(seed), generate)
+            path = test.path('p%d.bin' % seed)
+            assemble(program, path)
+
+            #
+            # Against the model, for as far as it can follow.
+            #
+            if result is not None:
+                taken, out, stopped = result
+                got = test.run([], path, data, taken if not stopped else 3000)
+                test.compare('model', (1 if stopped else 0, out, taken), got)
+
+            plain = test.run([], path, data)
+            for function in CHECKS:
+                function(test, path, data, plain)
+
+        for function in SUITES:
+            function(test)
+    finally:
+        shutil.rmtree(test.work)
+
+    print('%d checks, %d differences' % (test.checks, test.failures))
+
+    return 1 if test.failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+#
+# Converts version 1 tag binaries to version 2 (see TagBin.h), for trying the
+# v2 loader on programs from any assembler that writes v1.
+#
+# usage: tagbin.py [-d names.dbg] [-I] [-S seed] [-H] in.bin out.bin
+#
+#  -d  carry the debug symbols along in a names section
+#  -I  leave out the rule index
+#  -S  write the rules out in a random order
+#  -H  look rules up through a perfect hash instead of the rule index
+#
+
+import argparse
+import random
+import struct
+import sys
+
+TAGBIN2_MAGIC = b'\x7fTAGBIN\x00'
+TAGBIN2_VERSION = 2
+
+SECTION_RULES = 1
+SECTION_DATA = 2
+SECTION_QUEUE = 3
+SECTION_INDEX = 4
+SECTION_NAMES = 5
+SECTION_HASH = 6
+
+NO_RULE = 0xffffffff
+
+#
+# Symbols spread out further than this get no index, as it would be almost all
+# holes.
+#
+MAX_INDEX = 1 << 24
+
+#
+# Keys per bucket of the perfect hash, on average.
+#
+HASH_BUCKET_SIZE = 4
+
+HASH_DISPLACE = 0x9e3779b97f4a7c15
+MASK64 = (1 << 64) - 1
+
+
+def read_v1(image):
+    """(deletion number, symbol size, rules, queue) from a v1 binary. Rules
+    are (style, bit, symbol, appendant 0, appendant 1), all as bytes."""
+    count, width, queue_size, deletion = struct.unpack_from('<QIII', image, 0)
+    offset = struct.calcsize('<QIII')
+    rules = []
+
+    for _ in range(count):
+        style = image[offset]
+        if style == 1:
+            size0, size1 = struct.unpack_from('<HH', image, offset + 1)
+            offset += 5
+        else:
+            size0, = struct.unpack_from('<H', image, offset + 1)
+            size1 = 0
+            offset += 3
+
+        symbol = image[offset:offset + width]
+        offset += width
+        appendant0 = image[offset:offset + size0]
+        offset += size0
+        appendant1 = image[offset:offset + size1]
+        offset += size1
+
+        bit = 0
+        if style == 0:
+            bit = image[offset]
+            offset += 1
+
+        rules.append((style, bit, symbol, appendant0, appendant1))
+
+    return deletion, width, rules, image[offset:offset + queue_size]
+
+
+def mix(x):
+    """MurmurHash3's 64-bit finalizer, as TagHashMix."""
+    x ^= x >> 33
+    x = (x * 0xff51afd7ed558ccd) & MASK64
+    x ^= x >> 33
+    x = (x * 0xc4ceb9fe1a85ec53) & MASK64
+    x ^= x >> 33
+    return x
+
+
+def perfect_hash(values):
+    """(seed, displacements, slots) such that TagPerfectHashSlot puts value i
+    in a slot of its own, and slots[slot] is i. Buckets are placed biggest
+    first, trying displacements until all of a bucket's keys land in free
+    slots, and a seed that leaves some bucket with nowhere to go is given
+    up for the next."""
+    n = len(values)
+    buckets = max(1, (n + HASH_BUCKET_SIZE - 1) // HASH_BUCKET_SIZE)
+
+    for attempt in range(1, 100):
+        seed = mix(attempt)
+        hashes = [mix(value ^ seed) for value in values]
+        members = [[] for _ in range(buckets)]
+        for i, h in enumerate(hashes):
+            members[((h >> 32) * buckets) >> 32].append(i)
+
+        displacements = [0] * buckets
+        slots = [None] * n
+
+        for bucket in sorted(range(buckets), key=lambda b: -len(members[b])):
+            keys = members[bucket]
+            for displacement in range(1 << 16):
+                chosen = [((mix((hashes[k] + displacement * HASH_DISPLACE) & MASK64) >> 32) * n) >> 32
+                          for k in keys]
+                if len(set(chosen)) == len(chosen) and all(slots[slot] is None for slot in chosen):
+                    break
+            else:
+                break
+
+            displacements[bucket] = displacement
+            for k, slot in zip(keys, chosen):
+                slots[slot] = k
+        else:
+            return seed, displacements, slots
+
+    raise ValueError('no perfect hash for %d values' % n)
+
+
+def write_v2(path, deletion, width, rules, queue, index=True, names=None, hash=False):
+    """Writes a v2 binary. The sections are 8 byte aligned, as the loader
+    wants them. A hash takes the place of the index."""
+    data = bytearray()
+    records = bytearray()
+
+    def put(chunk):
+        data.extend(chunk)
+        return len(data) - len(chunk)
+
+    for style, bit, symbol, appendant0, appendant1 in rules:
+        records += struct.pack('<BBHIIIII', style, bit, 0, put(symbol),
+                               put(appendant0), len(appendant0),
+                               put(appendant1), len(appendant1))
+
+    sections = [(SECTION_RULES, bytes(records)), (SECTION_DATA, bytes(data)), (SECTION_QUEUE, bytes(queue))]
+
+    values = [int.from_bytes(rule[2], 'little') for rule in rules]
+    if hash:
+        seed, displacements, slots = perfect_hash(values)
+        sections.append((SECTION_HASH,
+                         struct.pack('<QII', seed, len(displacements), len(slots)) +
+                         struct.pack('<%dI' % len(displacements), *displacements) +
+                         struct.pack('<%dI' % len(slots), *slots)))
+    elif index and values and max(values) < MAX_INDEX:
+        table = [NO_RULE] * (max(values) + 1)
+        for i, value in enumerate(values):
+            table[value] = i
+        sections.append((SECTION_INDEX, struct.pack('<%dI' % len(table), *table)))
+
+    if names is not None:
+        sections.append((SECTION_NAMES, names))
+
+    header = TAGBIN2_MAGIC + struct.pack('<IIQII', TAGBIN2_VERSION, len(sections), len(rules), width, deletion)
+    offset = len(header) + struct.calcsize('<IIQQ') * len(sections)
+    table = bytearray()
+    body = bytearray()
+
+    for kind, section in sections:
+        aligned = (offset + 7) & ~7
+        body += bytes(aligned - offset)
+        table += struct.pack('<IIQQ', kind, 0, aligned, len(section))
+        body += section
+        offset = aligned + len(section)
+
+    with open(path, 'wb') as f:
+        f.write(header + table + body)
+
+
+def convert(source, destination, names=None, index=True, shuffle=None, hash=False):
+    with open(source, 'rb') as f:
+        deletion, width, rules, queue = read_v1(f.read())
+
+    if shuffle is not None:
+        random.Random(shuffle).shuffle(rules)
+
+    if names is not None:
+        with open(names, 'rb') as f:
+            names = f.read()
+
+    write_v2(destination, deletion, width, rules, queue, index=index, names=names, hash=hash)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-d', '--names')
+    parser.add_argument('-I', '--no-index', action='store_true')
+    parser.add_argument('-S', '--shuffle', type=int)
+    parser.add_argument('-H', '--hash', action='store_true')
+    parser.add_argument('source')
+    parser.add_argument('destination')
+    args = parser.parse_args()
+
+    convert(args.source, args.destination, names=args.names,
+            index=not args.no_index, shuffle=args.shuffle, hash=args.hash)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
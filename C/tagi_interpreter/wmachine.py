@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# Compiles W-machine programs into tag systems the way wmach does, naming the
+# symbols the way tagi -w expects (x_i, s0_i, s1_i and y_i for instruction i,
+# and helpers named after them), and generates random ones for difftest.py.
+#
+# Instructions are tuples: ('+',) and ('-',) set and clear the bit under the
+# head, ('>',) and ('<',) move it, ('j', t) jumps to t when the bit is set and
+# ('j', t, f) goes to f otherwise, ('o',) writes the bit and ('i',) reads one.
+# Running off the end, or jumping there, halts.
+#
+# usage: wmachine.py [-s seed] out.bin
+#
+# writes a random program as a v1 binary and its symbol names as out.bin.dbg.
+#
+
+import argparse
+import sys
+
+
+def name(i, what):
+    return '%s_%d' % (what, i)
+
+
+def write(i, bit):
+    to = name(i + 1, 's1' if bit else 's0')
+    return {
+        name(i, 'x'): [name(i + 1, 'x')] * 2,
+        name(i, 'y'): [name(i + 1, 'y')] * 2,
+        name(i, 's0'): [to, to],
+        name(i, 's1'): [to, to],
+    }
+
+
+def seek(i, right):
+    n = lambda what: name(i, what)
+    rules = {
+        n('net'): [n('odd_net'), n('even_net')],
+        n('test'): [n('s1b'), n('s0b')],
+        n('ya'): [n('yb')] * 2,
+        n('xb'): [n('xc')] * 2,
+        n('s0b'): [n('s0c')] * 2,
+        n('s1b'): [n('s1c')] * 2,
+        n('odd_net'): [],
+        n('even_net'): [n('pad')],
+        n('yb'): [n('yc')] * 2,
+        n('xc'): [name(i + 1, 'x')] * 2,
+        n('s0c'): [name(i + 1, 's0')] * 2,
+        n('s1c'): [name(i + 1, 's1')] * 2,
+        n('yc'): [name(i + 1, 'y')] * 2,
+        n('s0'): [n('net'), n('_'), n('test')],
+    }
+
+    if right:
+        rules[n('x')] = [n('xa')] * 4
+        rules[n('s1')] = [n('xa'), n('xa'), n('net'), n('_'), n('test')]
+        rules[n('y')] = [n('ya')]
+        rules[n('xa')] = [n('xb')] * 2
+    else:
+        rules[n('x')] = [n('xa')] * 2
+        rules[n('s1')] = [n('net'), n('_'), n('test'), n('ya'), n('ya')]
+        rules[n('y')] = [n('ya')] * 4
+        rules[n('xa')] = [n('xb')]
+
+    return rules
+
+
+def jump(i, true, false):
+    n = lambda what: name(i, what)
+    return {
+        n('x'): [n('xa')] * 2,
+        n('s0'): [n('net'), n('_'), n('shift')],
+        n('s1'): [n('s1a_t')] * 2,
+        n('y'): [n('ya_t'), n('ya_f')],
+        n('xa'): [n('xb_t'), n('xb_f')],
+        n('s1a_t'): [n('s1b_t')] * 2,
+        n('ya_t'): [n('yb_t')] * 2,
+        n('net'): [n('_')],
+        n('shift'): [n('s0b_f')] * 2,
+        n('ya_f'): [n('yb_f')] * 2,
+        n('xb_t'): [name(true, 'x')] * 2,
+        n('s1b_t'): [name(true, 's1')] * 2,
+        n('yb_t'): [name(true, 'y')] * 2,
+        n('xb_f'): [name(false, 'x')] * 2,
+        n('s0b_f'): [name(false, 's0')] * 2,
+        n('yb_f'): [name(false, 'y')] * 2,
+    }
+
+
+def io(i, out):
+    zero = [name(i + 1, 's0')] * 2
+    one = [name(i + 1, 's1')] * 2
+    rules = {
+        name(i, 'x'): [name(i + 1, 'x')] * 2,
+        name(i, 'y'): [name(i + 1, 'y')] * 2,
+    }
+
+    if out:
+        rules[name(i, 's0')] = ('out', 0, zero)
+        rules[name(i, 's1')] = ('out', 1, one)
+    else:
+        rules[name(i, 's0')] = ('in', zero, one)
+        rules[name(i, 's1')] = ('in', zero, one)
+
+    return rules
+
+
+def compile(instructions, m, bit, n):
+    """The tag system for instructions started on the tape (m, bit, n), as a
+    program for difftest.py (deletion number, rules, queue) and the symbols'
+    names, indexed by symbol."""
+    rules = {}
+    for i, instruction in enumerate(instructions):
+        kind = instruction[0]
+        if kind in '+-':
+            rules.update(write(i, kind == '+'))
+        elif kind in '><':
+            rules.update(seek(i, kind == '>'))
+        elif kind == 'j':
+            rules.update(jump(i, instruction[1], instruction[2] if len(instruction) > 2 else i + 1))
+        elif kind in 'oi':
+            rules.update(io(i, kind == 'o'))
+
+    queue = [name(0, 'x')] * (2 * m) + [name(0, 's%d' % bit)] * 2 + [name(0, 'y')] * (2 * n)
+
+    names = []
+    symbols = {}
+
+    def symbol(s):
+        if s not in symbols:
+            symbols[s] = len(names)
+            names.append(s)
+        return symbols[s]
+
+    program = {}
+    for s, rule in rules.items():
+        if isinstance(rule, list):
+            rule = ('pure', rule)
+        program[symbol(s)] = tuple([part if not isinstance(part, list) else [symbol(t) for t in part]
+                                    for part in rule])
+
+    return (2, program, [symbol(s) for s in queue]), names
+
+
+def generate(rng):
+    """A random program and the tape it starts on: (instructions, m, bit, n)."""
+    count = rng.randint(2, 9)
+    instructions = []
+    for _ in range(count):
+        kind = rng.choice('+-><><jjoi')
+        if kind != 'j':
+            instructions.append((kind,))
+        elif rng.random() < 0.5:
+            instructions.append(('j', rng.randint(0, count), rng.randint(0, count)))
+        else:
+            instructions.append(('j', rng.randint(0, count)))
+
+    return instructions, rng.randint(0, 5), rng.randint(0, 1), rng.randint(0, 5)
+
+
+def main():
+    import random
+    import difftest
+
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-s', '--seed', type=int, default=1)
+    parser.add_argument('output')
+    args = parser.parse_args()
+
+    program, names = compile(*generate(random.Random(args.seed)))
+    difftest.assemble(program, args.output, names)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
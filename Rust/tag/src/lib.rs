@@ -573,9 +573,311 @@ impl Program {
         ((highest_bit + bits_in_byte - 1) / bits_in_byte)
     }
 
+    //
+    // Writes the current (version 2) binary format with the debug symbols
+    // included. See assemble_v2.
+    //
+    pub fn assemble(&self) -> Result<(HashMap<Symbol, BinSymbol>, Vec<u8>), failure::Error> {
+        self.assemble_v2(true)
+    }
+
+    //
+    // Version 2 of the binary format (see C/tagi_interpreter/TagBin.h) is a
+    // header, a table of sections and the sections themselves, each 8-byte
+    // aligned and all little-endian. Rules are fixed-size records pointing
+    // into a data section, and an index maps every symbol value to its rule so
+    // the interpreter can check it instead of building its own. Symbols too
+    // wide for an index get a minimal perfect hash over their values instead
+    // (or nothing, should we fail to find one). With names,
+    // the debug symbols come along in the same "name value" lines as the
+    // separate symbol file.
+    //
+    pub fn assemble_v2(&self, with_names: bool) -> Result<(HashMap<Symbol, BinSymbol>, Vec<u8>), failure::Error> {
+        const MAGIC: &[u8; 8] = b"\x7fTAGBIN\0";
+        const VERSION: u32 = 2;
+        const ALIGNMENT: usize = 8;
+        const HEADER_SIZE: usize = 32;
+        const SECTION_SIZE: usize = 24;
+        const NO_RULE: u32 = u32::max_value();
+
+        const SECTION_RULES: u32 = 1;
+        const SECTION_DATA: u32 = 2;
+        const SECTION_QUEUE: u32 = 3;
+        const SECTION_INDEX: u32 = 4;
+        const SECTION_NAMES: u32 = 5;
+        const SECTION_HASH: u32 = 6;
+
+        //
+        // Wider symbols than this get a perfect hash instead of an index,
+        // which would need an entry for every value they can take. Matches
+        // TAG_DENSE_INDEX_MAX_SYMBOLSIZE.
+        //
+        const INDEX_MAX_BOUNDARY: usize = 3;
+
+        let trans = self.make_symbol_map();
+        let boundary = Program::calculate_byte_boundary(trans.len());
+
+        if boundary == 0 {
+            Err(Err::EmptyProgram)?;
+        }
+        if boundary > 8 {
+            Err(Err::TooManySymbols {
+                boundary: boundary,
+            })?;
+        }
+
+        fn length(bytes: usize) -> Result<u32, Err> {
+            if bytes > u32::max_value() as usize {
+                Err(Err::GeneralError {
+                    message: format!("{} bytes is more than the format can describe", bytes)
+                })
+            } else {
+                Ok(bytes as u32)
+            }
+        }
+
+        fn put_u32(bin: &mut Vec<u8>, value: u32) {
+            bin.extend_from_slice(&value.to_le_bytes());
+        }
+
+        fn put_u64(bin: &mut Vec<u8>, value: u64) {
+            bin.extend_from_slice(&value.to_le_bytes());
+        }
+
+        //
+        // Appends series to data and says where it went and how long it is.
+        //
+        fn put_series(data: &mut Vec<u8>,
+                      series: &[Symbol],
+                      boundary: usize,
+                      trans: &HashMap<Symbol, BinSymbol>)
+                      -> Result<(u32, u32), Err>
+        {
+            let offset = length(data.len())?;
+            for symbol in series {
+                data.extend_from_slice(&trans[symbol].to_le_bytes()[..boundary]);
+            }
+            Ok((offset, length(series.len() * boundary)?))
+        }
+
+        //
+        // The same hashes as Tag.h's TagHashMix and TagPerfectHashSlot.
+        //
+        const DISPLACE: u64 = 0x9e3779b97f4a7c15;
+        const KEYS_PER_BUCKET: usize = 4;
+        const MAX_DISPLACEMENT: u32 = 1 << 20;
+        const MAX_SEEDS: u64 = 100;
+
+        fn mix(mut x: u64) -> u64 {
+            x ^= x >> 33;
+            x = x.wrapping_mul(0xff51afd7ed558ccd);
+            x ^= x >> 33;
+            x = x.wrapping_mul(0xc4ceb9fe1a85ec53);
+            x ^= x >> 33;
+            x
+        }
+
+        fn scale(h: u64, count: usize) -> usize {
+            (((h >> 32) * count as u64) >> 32) as usize
+        }
+
+        //
+        // Hash and displace: hash every value into a bucket, then take the
+        // buckets biggest first and find each one the smallest displacement
+        // that moves all its values into slots nobody has yet. Gives the
+        // seed, the displacements and which value went in each slot, or None
+        // if no seed we tried worked out.
+        //
+        fn perfect_hash(values: &[u64]) -> Option<(u64, Vec<u32>, Vec<u32>)> {
+            let count = values.len();
+            let bucket_count = std::cmp::max(1, (count + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET);
+
+            'seeds: for attempt in 0..MAX_SEEDS {
+                let seed = mix(attempt + 1);
+                let hashes = values.iter().map(|value| mix(value ^ seed)).collect::<Vec<_>>();
+
+                let mut buckets = vec![Vec::new(); bucket_count];
+                for (i, hash) in hashes.iter().enumerate() {
+                    buckets[scale(*hash, bucket_count)].push(i);
+                }
+
+                let mut order = (0..bucket_count).collect::<Vec<_>>();
+                order.sort_by_key(|bucket| std::cmp::Reverse(buckets[*bucket].len()));
+
+                let mut slots = vec![None; count];
+                let mut displacements = vec![0u32; bucket_count];
+                let mut candidate = Vec::new();
+
+                for bucket in order {
+                    let keys = &buckets[bucket];
+                    if keys.is_empty() {
+                        break;
+                    }
+
+                    let mut found = false;
+                    for displacement in 0..MAX_DISPLACEMENT {
+                        candidate.clear();
+                        for key in keys {
+                            let slot = scale(mix(hashes[*key].wrapping_add(
+                                (displacement as u64).wrapping_mul(DISPLACE))), count);
+                            if slots[slot].is_some() || candidate.contains(&slot) {
+                                break;
+                            }
+                            candidate.push(slot);
+                        }
+
+                        if candidate.len() == keys.len() {
+                            for (key, slot) in keys.iter().zip(&candidate) {
+                                slots[*slot] = Some(*key as u32);
+                            }
+                            displacements[bucket] = displacement;
+                            found = true;
+                            break;
+                        }
+                    }
+
+                    if !found {
+                        continue 'seeds;
+                    }
+                }
+
+                return Some((seed, displacements, slots.into_iter().map(|slot| slot.unwrap()).collect()));
+            }
+
+            None
+        }
+
+        if self.rules.len() >= NO_RULE as usize {
+            Err(Err::GeneralError {
+                message: format!("{} rules is more than the format can describe", self.rules.len())
+            })?;
+        }
+
+        //
+        // Rules go out in symbol order so the same program always assembles
+        // the same way.
+        //
+        let mut start_symbols = self.rules.keys().collect::<Vec<_>>();
+        start_symbols.sort_by_key(|symbol| trans[*symbol]);
+
+        let mut records = Vec::new();
+        let mut data = Vec::new();
+        let mut values = Vec::with_capacity(start_symbols.len());
+
+        for start_symbol in &start_symbols {
+            let (symbol, _) = put_series(&mut data, &[start_symbol.to_string()], boundary, &trans)?;
+
+            let (style, bit, appendant0, appendant1) = match &self.rules[*start_symbol] {
+                RuleStyle::Pure(appendant) =>
+                    (BinRuleStyle::Pure, false, appendant, None),
+                RuleStyle::Input(appendant0, appendant1) =>
+                    (BinRuleStyle::Input, false, appendant0, Some(appendant1)),
+                RuleStyle::Output(appendant, bit) =>
+                    (BinRuleStyle::Output, *bit, appendant, None),
+            };
+
+            let (offset0, size0) = put_series(&mut data, appendant0, boundary, &trans)?;
+            let (offset1, size1) = match appendant1 {
+                Some(appendant1) => put_series(&mut data, appendant1, boundary, &trans)?,
+                None => (0, 0),
+            };
+
+            records.push(style as u8);
+            records.push(bit as u8);
+            records.extend_from_slice(&0u16.to_le_bytes());
+            put_u32(&mut records, symbol);
+            put_u32(&mut records, offset0);
+            put_u32(&mut records, size0);
+            put_u32(&mut records, offset1);
+            put_u32(&mut records, size1);
+
+            values.push(trans[*start_symbol]);
+        }
+
+        let mut queue = Vec::new();
+        put_series(&mut queue, &self.queue, boundary, &trans)?;
+
+        let mut sections = vec![
+            (SECTION_RULES, records),
+            (SECTION_DATA, data),
+            (SECTION_QUEUE, queue),
+        ];
+
+        //
+        // Either way the rule numbers are positions in records, which is the
+        // order values is in.
+        //
+        if boundary <= INDEX_MAX_BOUNDARY {
+            let mut index = vec![NO_RULE; trans.len()];
+            for (i, value) in values.iter().enumerate() {
+                index[*value as usize] = i as u32;
+            }
+
+            let mut index_bytes = Vec::with_capacity(index.len() * 4);
+            for rule in index {
+                put_u32(&mut index_bytes, rule);
+            }
+            sections.push((SECTION_INDEX, index_bytes));
+        } else if let Some((seed, displacements, slots)) = perfect_hash(&values) {
+            let mut hash_bytes = Vec::with_capacity(16 + (displacements.len() + slots.len()) * 4);
+            put_u64(&mut hash_bytes, seed);
+            put_u32(&mut hash_bytes, displacements.len() as u32);
+            put_u32(&mut hash_bytes, slots.len() as u32);
+            for displacement in displacements {
+                put_u32(&mut hash_bytes, displacement);
+            }
+            for rule in slots {
+                put_u32(&mut hash_bytes, rule);
+            }
+            sections.push((SECTION_HASH, hash_bytes));
+        }
+
+        if with_names {
+            let mut names = trans.iter().collect::<Vec<_>>();
+            names.sort_by_key(|&(_, value)| *value);
+
+            let mut text = String::new();
+            for (name, value) in names {
+                text.push_str(&format!("{} {:x}\n", name, value));
+            }
+            sections.push((SECTION_NAMES, text.into_bytes()));
+        }
+
+        let mut bin = Vec::new();
+        bin.extend_from_slice(MAGIC);
+        put_u32(&mut bin, VERSION);
+        put_u32(&mut bin, sections.len() as u32);
+        put_u64(&mut bin, self.rules.len() as u64);
+        put_u32(&mut bin, boundary as u32);
+        put_u32(&mut bin, self.deletion_number);
+
+        let mut offset = HEADER_SIZE + SECTION_SIZE * sections.len();
+        for (kind, section) in &sections {
+            offset = (offset + ALIGNMENT - 1) & !(ALIGNMENT - 1);
+            put_u32(&mut bin, *kind);
+            put_u32(&mut bin, 0);
+            put_u64(&mut bin, offset as u64);
+            put_u64(&mut bin, section.len() as u64);
+            offset += section.len();
+        }
+
+        for (_, section) in &sections {
+            while bin.len() % ALIGNMENT != 0 {
+                bin.push(0);
+            }
+            bin.extend_from_slice(section);
+        }
+
+        Ok((trans, bin))
+    }
+
+    //
+    // The original binary format, for interpreters that predate version 2.
+    // Appendants are limited to 64KiB.
+    //
     // XXX we should probably be a bit stricter with checking for int overflows
     // This should probably only fail if we run out of memory, yolo
-    pub fn assemble(&self) -> Result<(HashMap<Symbol, BinSymbol>, Vec<u8>), failure::Error> {
+    pub fn assemble_v1(&self) -> Result<(HashMap<Symbol, BinSymbol>, Vec<u8>), failure::Error> {
         let trans = self.make_symbol_map();
         let boundary = Program::calculate_byte_boundary(trans.len());
         // XXX check for overflow?
@@ -397,6 +397,103 @@ EmitFmt(
     va_end(args);
 }
 
+//
+// Every W-machine instruction we emit is counted. The assembler numbers them
+// the same way (every statement but a label is one) and names the tag symbols
+// it makes for instruction N with an _N suffix, so a count taken here is how
+// the tag interpreter's profiler finds its way back to us.
+//
+static uint64_t EmittedInsns;
+
+//
+// Optional. The line table, written to wherever WM_LINE_TABLE says. Each line
+// is "insn pc lineno op": the W-machine instructions from insn up to the next
+// line's were emitted for the EIR instruction at pc, from line lineno of the
+// .eir file. The glue between instructions (dispatch tables and the like) has
+// a pc and lineno of -1 and says what it is instead of an op.
+//
+static FILE *LineTable;
+
+static const char *OpNames[LAST_OP] = {
+    [MOV] = "mov", [ADD] = "add", [SUB] = "sub",
+    [LOAD] = "load", [STORE] = "store",
+    [PUTC] = "putc", [GETC] = "getc", [EXIT] = "exit",
+    [JEQ] = "jeq", [JNE] = "jne", [JLT] = "jlt", [JGT] = "jgt",
+    [JLE] = "jle", [JGE] = "jge", [JMP] = "jmp",
+    [EQ] = "eq", [NE] = "ne", [LT] = "lt", [GT] = "gt",
+    [LE] = "le", [GE] = "ge", [DUMP] = "dump",
+};
+
+static
+void
+LineTableOpen(
+    void
+    )
+{
+    const char *path = getenv("WM_LINE_TABLE");
+
+    EmittedInsns = 0;
+
+    if (path == NULL)
+    {
+        return;
+    }
+
+    LineTable = fopen(path, "w");
+    if (LineTable == NULL)
+    {
+        error("Can't open the line table %s", path);
+    }
+
+    fprintf(LineTable, "# insn pc lineno op\n");
+}
+
+static
+void
+LineTableClose(
+    void
+    )
+{
+    if (LineTable != NULL && fclose(LineTable) != 0)
+    {
+        error("Can't write the line table");
+    }
+
+    LineTable = NULL;
+}
+
+//
+// Marks where the code for Insn starts or, without one, the glue called What.
+//
+static
+void
+EmitLine(
+    const Inst *Insn,
+    const char *What
+    )
+{
+    const char *op;
+
+    if (LineTable == NULL)
+    {
+        return;
+    }
+
+    if (Insn == NULL)
+    {
+        fprintf(LineTable, "%lu -1 -1 %s\n", EmittedInsns, What);
+        return;
+    }
+
+    op = (Insn->op >= 0 && Insn->op < LAST_OP) ? OpNames[Insn->op] : NULL;
+
+    fprintf(LineTable, "%lu %d %d %s\n",
+            EmittedInsns,
+            Insn->pc,
+            Insn->lineno,
+            op != NULL ? op : "?");
+}
+
 
 //
 // ALU functions
@@ -1306,6 +1403,7 @@ EmitBranch(
     )
 {
     EmitFmt("jmp %s", TrueLabel);
+    ++EmittedInsns;
 
     if (FalseLabel != NULL)
     {
@@ -1555,6 +1653,8 @@ WmachProduceGotoTable(
     reg_t trueAddr = REG_ADDR(Flags) + TrueFlag;
     Tape readyHead, inHead, outHead;
 
+    EmitLine(NULL, "goto_table");
+
     INIT_LABEL(State, fix);
     INIT_LABEL(State, ready);
     INIT_LABEL(State, successful);
@@ -1802,6 +1902,7 @@ EmitSimple(
     }
 
     emit_1(raw);
+    ++EmittedInsns;
 }
 
 
@@ -1841,6 +1942,9 @@ WmachInitialize(
     emit_reset();
     emit_start();
 
+    LineTableOpen();
+    EmitLine(NULL, "prologue");
+
     for (Inst *inst = State->Current;
         inst != NULL;
         inst = inst->next)
@@ -2127,6 +2231,8 @@ WmachProduceMemTable(
     reg_t memBase  = REG_ADDR(MemoryBase);
     Tape context;
 
+    EmitLine(NULL, "mem_table");
+
     //
     // N.B., This is necessary because we can be invoked at arbitrary times.
     // All useres should not call us directly but should instead use
@@ -2354,6 +2460,7 @@ target_wm(
 
 #ifdef DEBUG
 DbgMain(&state);
+LineTableClose();
 return;
 #endif
 WmachProduceGotoTable(NULL); // XXX shut the compiler up. Make sure to remove
@@ -2386,6 +2493,8 @@ TapePreserve(NULL); // XXX shut the compiler up. Make sure to remove
 
             previousPc = state.Current->pc;
 
+            EmitLine(NULL, "bb_entry");
+
             //
             // We just emitted the last instruction in a basic block. It is
             // likely that this is a jmp, which takes care of itself and cleans
@@ -2421,6 +2530,7 @@ TapePreserve(NULL); // XXX shut the compiler up. Make sure to remove
             EmitFmt("\n");
         }
 
+        EmitLine(state.Current, NULL);
         WmachProduceInst(&state);
     }
     EmitFmt("\n");
@@ -2432,4 +2542,6 @@ TapePreserve(NULL); // XXX shut the compiler up. Make sure to remove
     // interpreter.
     //
     EmitLabel(FIN_LABEL);
+
+    LineTableClose();
 }
@@ -50,6 +50,24 @@ TagBinRead(
     return status;
 }
 
+//
+// Reads one of a version 1 rule's 16-bit sizes.
+//
+int
+TagBinReadSize(
+    int fd,
+    uint32_t *Size
+    )
+{
+    int status;
+    uint16_t size;
+
+    status = TagBinRead(fd, &size, sizeof(size));
+    *Size = size;
+
+    return status;
+}
+
 int
 ReadBinaryRules(
     int fd,
@@ -89,21 +107,19 @@ ReadBinaryRules(
 
         switch (rule->Header.Style) {
         case IoSel_Pure:
-            status = TagBinRead(fd,
-                        &rule->Header.Pure,
-                        sizeof(rule->Header.Pure));
+            status = TagBinReadSize(fd, &rule->Header.Pure.AppendantSize);
             break;
 
         case IoSel_Input:
-            status = TagBinRead(fd,
-                        &rule->Header.In,
-                        sizeof(rule->Header.In));
+            status = TagBinReadSize(fd, &rule->Header.In.Appendant0Size);
+            if (!FAILED(status))
+            {
+                status = TagBinReadSize(fd, &rule->Header.In.Appendant1Size);
+            }
             break;
 
         case IoSel_Output:
-            status = TagBinRead(fd,
-                        &rule->Header.Out,
-                        sizeof(rule->Header.Out));
+            status = TagBinReadSize(fd, &rule->Header.Out.AppendantSize);
             break;
 
         default:
@@ -287,6 +303,220 @@ Bail:
     return status;
 }
 
+//
+// A copy of Size bytes at Offset into Section, or NULL if they aren't all
+// there (or there's no memory). Zero bytes are still a valid allocation.
+//
+void *
+TagBinCopy2(
+    uint8_t *Image,
+    TagBin2Section *Section,
+    uint64_t Offset,
+    uint64_t Size
+    )
+{
+    void *copy;
+
+    if (Offset > Section->Size || Size > Section->Size - Offset)
+    {
+        return NULL;
+    }
+
+    copy = malloc(Size > 0 ? Size : 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, &Image[Section->Offset + Offset], Size);
+    }
+
+    return copy;
+}
+
+//
+// Reads the rest of a version 2 file, whose magic has already been read, and
+// copies everything out of it just like a version 1 file would be read.
+//
+int
+ReadBinaryFile2(
+    int fd,
+    TagBin *Binary
+    )
+{
+    int status = 0;
+    TagBin2Section *sections[TagBin2Section_Max] = { NULL };
+    TagBin2Section *section;
+    TagBin2Header *header;
+    TagBin2Rule *raw;
+    uint8_t *image = NULL, *grown;
+    size_t size = sizeof(Binary->Header.RuleCount), capacity = 1 << 20;
+    ssize_t n;
+    uint64_t i;
+
+    image = malloc(capacity);
+    if (image == NULL)
+    {
+        status = ENV_OOM;
+        warn("ReadBinaryFile2: malloc image");
+        goto Bail;
+    }
+    memcpy(image, &Binary->Header.RuleCount, size);
+
+    while ((n = read(fd, &image[size], capacity - size)) > 0)
+    {
+        size += n;
+        if (size == capacity)
+        {
+            grown = realloc(image, 2 * capacity);
+            if (grown == NULL)
+            {
+                status = ENV_OOM;
+                warn("ReadBinaryFile2: realloc image");
+                goto Bail;
+            }
+            image = grown;
+            capacity *= 2;
+        }
+    }
+
+    header = (TagBin2Header *) image;
+    if (n < 0 ||
+        size < sizeof(*header) ||
+        header->SectionCount > (size - sizeof(*header)) / sizeof(*section))
+    {
+        status = ENV_FAILURE;
+        warnx("ReadBinaryFile2: truncated header");
+        goto Bail;
+    }
+
+    Binary->Version = header->Version;
+    if (Binary->Version != TAGBIN2_VERSION)
+    {
+        status = ENV_BADENUM;
+        warnx("ReadBinaryFile2: unsupported version %u", Binary->Version);
+        goto Bail;
+    }
+
+    for (i = 0; i < header->SectionCount; ++i)
+    {
+        section = &((TagBin2Section *) (header + 1))[i];
+
+        if (section->Offset > size || section->Size > size - section->Offset)
+        {
+            status = ENV_BADLEN;
+            warnx("ReadBinaryFile2: section #%lu out of bounds", i);
+            goto Bail;
+        }
+
+        if (section->Kind > 0 && section->Kind < TagBin2Section_Max)
+        {
+            sections[section->Kind] = section;
+        }
+    }
+
+    if (sections[TagBin2Section_Rules] == NULL ||
+        sections[TagBin2Section_Data] == NULL ||
+        sections[TagBin2Section_Queue] == NULL ||
+        header->SymbolSize == 0 ||
+        header->RuleCount > sections[TagBin2Section_Rules]->Size / sizeof(*raw))
+    {
+        status = ENV_BADLEN;
+        warnx("ReadBinaryFile2: missing or short sections");
+        goto Bail;
+    }
+
+    Binary->Header.RuleCount = header->RuleCount;
+    Binary->Header.SymbolSize = header->SymbolSize;
+    Binary->Header.QueueSize = sections[TagBin2Section_Queue]->Size;
+    Binary->Header.DeletionNumber = header->DeletionNumber;
+
+    Binary->Rules = calloc(Binary->Header.RuleCount, sizeof(*Binary->Rules));
+    Binary->Queue = TagBinCopy2(image, sections[TagBin2Section_Queue], 0, Binary->Header.QueueSize);
+    if (Binary->Rules == NULL || Binary->Queue == NULL)
+    {
+        status = ENV_OOM;
+        warn("ReadBinaryFile2: calloc Rules");
+        goto Bail;
+    }
+
+    raw = (TagBin2Rule *) &image[sections[TagBin2Section_Rules]->Offset];
+    section = sections[TagBin2Section_Data];
+
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
+    {
+        TagBinRule *rule = &Binary->Rules[i];
+        bool copied = false;
+
+        rule->Header.Style = raw[i].Style;
+        rule->RawSymbol = TagBinCopy2(image, section, raw[i].Symbol, Binary->Header.SymbolSize);
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            rule->Header.Pure.AppendantSize = raw[i].Appendant0Size;
+            rule->Pure.RawAppendant = TagBinCopy2(image, section, raw[i].Appendant0, raw[i].Appendant0Size);
+            copied = (rule->Pure.RawAppendant != NULL);
+            break;
+
+        case IoSel_Input:
+            rule->Header.In.Appendant0Size = raw[i].Appendant0Size;
+            rule->Header.In.Appendant1Size = raw[i].Appendant1Size;
+            rule->In.RawAppendant0 = TagBinCopy2(image, section, raw[i].Appendant0, raw[i].Appendant0Size);
+            rule->In.RawAppendant1 = TagBinCopy2(image, section, raw[i].Appendant1, raw[i].Appendant1Size);
+            copied = (rule->In.RawAppendant0 != NULL && rule->In.RawAppendant1 != NULL);
+            break;
+
+        case IoSel_Output:
+            rule->Header.Out.AppendantSize = raw[i].Appendant0Size;
+            rule->Out.RawAppendant = TagBinCopy2(image, section, raw[i].Appendant0, raw[i].Appendant0Size);
+            rule->Out.Bit = raw[i].Bit;
+            copied = (rule->Out.RawAppendant != NULL);
+            break;
+
+        default:
+            //
+            // Leave it for the dump to show.
+            //
+            copied = true;
+            break;
+        }
+
+        if (rule->RawSymbol == NULL || !copied)
+        {
+            status = ENV_BADLEN;
+            warnx("ReadBinaryFile2: rule #%lu points outside the data", i);
+            goto Bail;
+        }
+    }
+
+    section = sections[TagBin2Section_Index];
+    if (section != NULL)
+    {
+        Binary->IndexSize = section->Size / sizeof(*Binary->Index);
+        Binary->Index = TagBinCopy2(image, section, 0, Binary->IndexSize * sizeof(*Binary->Index));
+    }
+
+    section = sections[TagBin2Section_Names];
+    if (section != NULL)
+    {
+        Binary->NamesSize = section->Size;
+        Binary->Names = TagBinCopy2(image, section, 0, Binary->NamesSize);
+    }
+
+    section = sections[TagBin2Section_Hash];
+    if (section != NULL && section->Size >= sizeof(Binary->HashHeader))
+    {
+        memcpy(&Binary->HashHeader, &image[section->Offset], sizeof(Binary->HashHeader));
+        Binary->Hash = TagBinCopy2(
+                image,
+                section,
+                sizeof(Binary->HashHeader),
+                ((uint64_t) Binary->HashHeader.BucketCount + Binary->HashHeader.SlotCount) * sizeof(*Binary->Hash));
+    }
+
+Bail:
+    free(image);
+
+    return status;
+}
+
 int
 ReadBinaryFile(
     int fd,
@@ -299,15 +529,42 @@ ReadBinaryFile(
 
     Binary->Rules = NULL;
     Binary->Queue = NULL;
+    Binary->Version = 1;
+    Binary->Index = NULL;
+    Binary->IndexSize = 0;
+    Binary->Names = NULL;
+    Binary->NamesSize = 0;
+    memset(&Binary->HashHeader, 0, sizeof(Binary->HashHeader));
+    Binary->Hash = NULL;
 
-    status = TagBinRead(fd, &Binary->Header, sizeof(Binary->Header));
+    //
+    // A version 1 file starts with its rule count, which is never anything
+    // like a version 2 file's magic.
+    //
+    status = TagBinRead(fd, &Binary->Header.RuleCount, sizeof(Binary->Header.RuleCount));
+    if (FAILED(status))
+    {
+        warnx("ReadBinaryFile: Read wrong size for header");
+        goto Bail;
+    }
+
+    if (memcmp(&Binary->Header.RuleCount, TAGBIN2_MAGIC, sizeof(Binary->Header.RuleCount)) == 0)
+    {
+        status = ReadBinaryFile2(fd, Binary);
+        goto Bail;
+    }
+
+    status = TagBinRead(fd,
+                (uint8_t *) &Binary->Header + sizeof(Binary->Header.RuleCount),
+                sizeof(Binary->Header) - sizeof(Binary->Header.RuleCount));
     if (FAILED(status))
     {
         warnx("ReadBinaryFile: Read wrong size for header");
         goto Bail;
     }
 
-    if ((Binary->Header.QueueSize % Binary->Header.SymbolSize) != 0)
+    if (Binary->Header.SymbolSize == 0 ||
+        (Binary->Header.QueueSize % Binary->Header.SymbolSize) != 0)
     {
         status = ENV_BADLEN;
         warnx("ReadBinaryFile: invalid QueueSize");
@@ -402,55 +659,126 @@ TagBinTeardown(
 
     free(Binary->Queue);
     Binary->Queue = NULL;
+
+    free(Binary->Index);
+    Binary->Index = NULL;
+
+    free(Binary->Names);
+    Binary->Names = NULL;
+
+    free(Binary->Hash);
+    Binary->Hash = NULL;
 }
 
 
 void
-TagBinTeardown(
+TagBinDumpBytes(
+    const char *Name,
+    uint8_t *Data,
+    uint64_t Size
+    )
+{
+    uint64_t i;
+
+    printf("%s:", Name);
+    for (i = 0; i < Size; ++i)
+    {
+        printf(" %02x", Data[i]);
+    }
+    printf("\n");
+}
+
+void
+TagBinDump(
     TagBin *Binary
     )
 {
-    uint64_t i, level = 0;
+    char *Names[] = {
+        "Output",
+        "Input",
+        "Pure"
+    };
+    uint64_t i;
 
     printf("Header:\n");
+    printf("Version: %u\n", Binary->Version);
+    printf("RuleCount: %lu\n", Binary->Header.RuleCount);
+    printf("SymbolSize: %u\n", Binary->Header.SymbolSize);
+    printf("QueueSize: %u\n", Binary->Header.QueueSize);
+    printf("DeletionNumber: %u\n", Binary->Header.DeletionNumber);
+    printf("\n");
+
+    printf("Rules:\n");
+    for (i = 0; i < Binary->Header.RuleCount; ++i)
     {
-        ++level;
-        printf("RuleCount: %lu\n", Binary->Header.RuleCount);
-        printf("SymbolSize: %u\n", Binary->Header.SymbolSize);
-        printf("QueueSize: %u\n", Binary->Header.QueueSize);
-        printf("DeletionNumber: %u\n", Binary->Header.DeletionNumber);
+        TagBinRule *rule = &Binary->Rules[i];
+        char *name = "Invalid";
+
+        if (rule->Header.Style < ARRAY_SIZE(Names))
+        {
+            name = Names[rule->Header.Style];
+        }
 
+        printf("Rule #%lu:\n", i);
+        printf("Style: %x (%s)\n", rule->Header.Style, name);
+        TagBinDumpBytes("Symbol", rule->RawSymbol, Binary->Header.SymbolSize);
+
+        switch (rule->Header.Style) {
+        case IoSel_Pure:
+            TagBinDumpBytes("Appendant", rule->Pure.RawAppendant, rule->Header.Pure.AppendantSize);
+            break;
+
+        case IoSel_Input:
+            TagBinDumpBytes("False Appendant", rule->In.RawAppendant0, rule->Header.In.Appendant0Size);
+            TagBinDumpBytes("True Appendant", rule->In.RawAppendant1, rule->Header.In.Appendant1Size);
+            break;
+
+        case IoSel_Output:
+            TagBinDumpBytes("Appendant", rule->Out.RawAppendant, rule->Header.Out.AppendantSize);
+            printf("Bit: %s\n", rule->Out.Bit ? "True" : "False");
+            break;
+
+        default:
+            break;
+        }
         printf("\n");
+    }
 
-        printf("Rules:\n");
-        {
-            ++level;
-            for (i = 0; i < Binary->Header.RuleCount; ++i) {
-                TagBinRule *rule = &Binary->Rules[i];
+    TagBinDumpBytes("Queue", Binary->Queue, Binary->Header.QueueSize);
 
-                printf("Rule #%lu Header:\n");
-                ++level;
-                {
-                    char *Names[] = {
-                        "Output",
-                        "Input",
-                        "Pure"
-                    };
-                    char *name = "Invalid";
-                    /*
-                    if (rule->Header.Style < IoSel_Max)
-                    {
-                        name = 
-                    }
-                    */
-                    if (rule->Header.Style < ARRAY_SIZE(Names))
-                    {
-                        name = 
-                    }
-                    printf("Style: %x (%s)\n", 
-                }
-                --level;
+    if (Binary->Index != NULL)
+    {
+        printf("\nIndex:\n");
+        for (i = 0; i < Binary->IndexSize; ++i)
+        {
+            if (Binary->Index[i] != UINT32_MAX)
+            {
+                printf("%lx -> Rule #%u\n", i, Binary->Index[i]);
             }
+        }
+    }
+
+    if (Binary->Hash != NULL)
+    {
+        printf("\nHash:\n");
+        printf("Seed: %lx\n", Binary->HashHeader.Seed);
+        printf("Displacements:");
+        for (i = 0; i < Binary->HashHeader.BucketCount; ++i)
+        {
+            printf(" %u", Binary->Hash[i]);
+        }
+        printf("\n");
+        for (i = 0; i < Binary->HashHeader.SlotCount; ++i)
+        {
+            printf("Slot %lu -> Rule #%u\n", i, Binary->Hash[Binary->HashHeader.BucketCount + i]);
+        }
+    }
+
+    if (Binary->Names != NULL)
+    {
+        printf("\nNames:\n");
+        fwrite(Binary->Names, 1, Binary->NamesSize, stdout);
+    }
 }
 
 int
@@ -459,18 +787,15 @@ main(
     )
 {
     TagBin binary;
-    int binary_initialized;
     int status;
 
-    binary_initialized = 0;
-
     status = ReadBinaryFile(STDIN_FILENO, &binary);
+    if (!FAILED(status))
+    {
+        TagBinDump(&binary);
+    }
 
-    TagBinDump(&binary);
-
-
-Bail:
     TagBinTeardown(&binary);
 
-    return (status < 0);
+    return FAILED(status);
 }
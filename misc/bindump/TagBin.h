@@ -2,20 +2,23 @@
 
 #include <stdint.h>
 
+//
+// Version 1 files store these sizes in 16 bits each, version 2 files in 32.
+//
 typedef struct _TagBinPureRuleHeader
 {
-    uint16_t AppendantSize;   // The length, in bytes, of the data
+    uint32_t AppendantSize;   // The length, in bytes, of the data
 } TagBinPureRuleHeader;
 
 typedef struct _TagBinInputRuleHeader
 {
-    uint16_t Appendant0Size;    // The length, in bytes, of the data corresponding to a 0 bit
-    uint16_t Appendant1Size;    // The length, in bytes, of the data corresponding to a 1 bit
+    uint32_t Appendant0Size;    // The length, in bytes, of the data corresponding to a 0 bit
+    uint32_t Appendant1Size;    // The length, in bytes, of the data corresponding to a 1 bit
 } TagBinInputRuleHeader;
 
 typedef struct _TagBinOutputRuleHeader
 {
-    uint16_t AppendantSize; // The length, in bytes, of the data
+    uint32_t AppendantSize; // The length, in bytes, of the data
 } TagBinOutputRuleHeader;
 
 typedef struct _TagBinRuleHeader
@@ -75,9 +78,81 @@ typedef struct _TagBinHeader
 } TagBinHeader;
 #pragma pack(pop)
 
+//
+// Version 2 files. See C/tagi_interpreter/TagBin.h, which this has to match.
+//
+#define TAGBIN2_MAGIC           "\177TAGBIN"
+#define TAGBIN2_VERSION         2
+#define TAGBIN2_ALIGNMENT       8
+
+typedef enum _TagBin2SectionKind
+{
+    TagBin2Section_Rules = 1,
+    TagBin2Section_Data = 2,
+    TagBin2Section_Queue = 3,
+    TagBin2Section_Index = 4,
+    TagBin2Section_Names = 5,
+    TagBin2Section_Hash = 6,
+
+    TagBin2Section_Max,
+} TagBin2SectionKind;
+
+typedef struct _TagBin2Header
+{
+    uint8_t Magic[8];
+    uint32_t Version;
+    uint32_t SectionCount;
+    uint64_t RuleCount;
+    uint32_t SymbolSize;
+    uint32_t DeletionNumber;
+} TagBin2Header;
+
+typedef struct _TagBin2Section
+{
+    uint32_t Kind;
+    uint32_t Reserved;
+    uint64_t Offset;
+    uint64_t Size;
+} TagBin2Section;
+
+typedef struct _TagBin2Rule
+{
+    uint8_t Style;
+    uint8_t Bit;
+    uint16_t Reserved;
+    uint32_t Symbol;
+    uint32_t Appendant0;
+    uint32_t Appendant0Size;
+    uint32_t Appendant1;
+    uint32_t Appendant1Size;
+} TagBin2Rule;
+
+//
+// Followed by BucketCount uint32_t displacements and then SlotCount uint32_t
+// rule numbers.
+//
+typedef struct _TagBin2Hash
+{
+    uint64_t Seed;
+    uint32_t BucketCount;
+    uint32_t SlotCount;
+} TagBin2Hash;
+
 typedef struct _TagBin
 {
     TagBinHeader Header;
     TagBinRule *Rules;
     uint8_t *Queue;
+
+    uint32_t Version;
+
+    //
+    // Version 2 only. NULL if the file doesn't have them.
+    //
+    uint32_t *Index;
+    uint64_t IndexSize;         // In entries.
+    char *Names;
+    uint64_t NamesSize;
+    TagBin2Hash HashHeader;
+    uint32_t *Hash;             // Displacements then slots.
 } TagBin;